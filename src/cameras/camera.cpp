@@ -6,3 +6,8 @@ Camera::Camera(const Matrix4x4 &cameraToWorld_, const Film &film_)
     aspect = (double) (film.getWidth()) / (double) (film.getHeight());
 }
 
+void Camera::setCameraToWorld(const Matrix4x4 &cameraToWorld_)
+{
+    cameraToWorld = cameraToWorld_;
+}
+
@@ -5,7 +5,15 @@ PerspectiveCamera::PerspectiveCamera(const Matrix4x4 &cameraToWorld_, const doub
                 const Film &film_ )
     : Camera(cameraToWorld_, film_),
       fov(fov_)
-{ }
+{
+    cameraToWorld.inverse(worldToCamera);
+}
+
+void PerspectiveCamera::setCameraToWorld(const Matrix4x4 &cameraToWorld_)
+{
+    cameraToWorld = cameraToWorld_;
+    cameraToWorld.inverse(worldToCamera);
+}
 
 Vector3D PerspectiveCamera::ndcToCameraSpace(const double u, const double v) const
 {
@@ -25,6 +33,46 @@ Vector3D PerspectiveCamera::ndcToCameraSpace(const double u, const double v) con
                       1);
 }
 
+bool PerspectiveCamera::worldToRaster(const Vector3D &p, double &x, double &y) const
+{
+    Vector3D q = worldToCamera.transformPoint(p);
+    if (q.z <= 0.0)
+        return false;
+
+    // Inverse of ndcToCameraSpace() on the image plane z = 1
+    double size = 2.0 * std::tan(fov/2);
+    double u = (q.x / q.z / aspect + size * 0.5) / size;
+    double v = (size * 0.5 - q.y / q.z) / size;
+    x = u * film.getWidth();
+    y = v * film.getHeight();
+    return u >= 0.0 && u < 1.0 && v >= 0.0 && v < 1.0;
+}
+
+double PerspectiveCamera::directionPdf(const Vector3D &w) const
+{
+    Vector3D q = worldToCamera.transformVector(w).normalized();
+    double x, y;
+    if (q.z <= 0.0 || !worldToRaster(getPosition() + w, x, y))
+        return 0.0;
+    return 1.0 / (imagePlaneArea() * q.z * q.z * q.z);
+}
+
+double PerspectiveCamera::imagePlaneArea() const
+{
+    double size = 2.0 * std::tan(fov/2);
+    return size * size * aspect;
+}
+
+Vector3D PerspectiveCamera::getPosition() const
+{
+    return cameraToWorld.transformPoint(Vector3D(0, 0, 0));
+}
+
+Vector3D PerspectiveCamera::getForward() const
+{
+    return cameraToWorld.transformVector(Vector3D(0, 0, 1)).normalized();
+}
+
 Ray PerspectiveCamera::generateRay(const double u, const double v) const
 {
     // Convert the sample to camera coordinates
@@ -14,9 +14,25 @@ public:
     // Member functions
     virtual Ray generateRay(const double u, const double v) const;
     virtual Vector3D ndcToCameraSpace(const double u, const double v) const;
+    virtual void setCameraToWorld(const Matrix4x4 &cameraToWorld_);
+
+    // Position on the film, in pixels from its top left corner, of the
+    // world point p (inverse of generateRay()). False when p is behind
+    // the camera or outside the field of view
+    bool worldToRaster(const Vector3D &p, double &x, double &y) const;
+
+    // Density per unit solid angle of the camera rays with world
+    // direction w, for raster positions uniform over the whole film
+    // (1 / (A cos^3), A being the image plane area at distance 1)
+    double directionPdf(const Vector3D &w) const;
+    double imagePlaneArea() const;
+
+    Vector3D getPosition() const;
+    Vector3D getForward() const; // Unit viewing direction
 
     /* Perspective Camera Data */
     double fov; // Radians
+    Matrix4x4 worldToCamera;
 };
 
 #endif // PERSPECTIVE_H
@@ -0,0 +1,213 @@
+#include "animation.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "../cameras/camera.h"
+#include "../shapes/aggregate.h"
+
+// Rotation matrix (upper 3x3) of the unit quaternion q, and back (Shoemake)
+static void quaternionToMatrix(const double q[4], double r[3][3])
+{
+    double x = q[0], y = q[1], z = q[2], w = q[3];
+    r[0][0] = 1.0 - 2.0 * (y * y + z * z);
+    r[0][1] = 2.0 * (x * y - w * z);
+    r[0][2] = 2.0 * (x * z + w * y);
+    r[1][0] = 2.0 * (x * y + w * z);
+    r[1][1] = 1.0 - 2.0 * (x * x + z * z);
+    r[1][2] = 2.0 * (y * z - w * x);
+    r[2][0] = 2.0 * (x * z - w * y);
+    r[2][1] = 2.0 * (y * z + w * x);
+    r[2][2] = 1.0 - 2.0 * (x * x + y * y);
+}
+
+static void matrixToQuaternion(const double r[3][3], double q[4])
+{
+    double trace = r[0][0] + r[1][1] + r[2][2];
+    if (trace > 0.0)
+    {
+        double s = 2.0 * std::sqrt(trace + 1.0);
+        q[0] = (r[2][1] - r[1][2]) / s;
+        q[1] = (r[0][2] - r[2][0]) / s;
+        q[2] = (r[1][0] - r[0][1]) / s;
+        q[3] = 0.25 * s;
+    }
+    else if (r[0][0] > r[1][1] && r[0][0] > r[2][2])
+    {
+        double s = 2.0 * std::sqrt(1.0 + r[0][0] - r[1][1] - r[2][2]);
+        q[0] = 0.25 * s;
+        q[1] = (r[0][1] + r[1][0]) / s;
+        q[2] = (r[0][2] + r[2][0]) / s;
+        q[3] = (r[2][1] - r[1][2]) / s;
+    }
+    else if (r[1][1] > r[2][2])
+    {
+        double s = 2.0 * std::sqrt(1.0 + r[1][1] - r[0][0] - r[2][2]);
+        q[0] = (r[0][1] + r[1][0]) / s;
+        q[1] = 0.25 * s;
+        q[2] = (r[1][2] + r[2][1]) / s;
+        q[3] = (r[0][2] - r[2][0]) / s;
+    }
+    else
+    {
+        double s = 2.0 * std::sqrt(1.0 + r[2][2] - r[0][0] - r[1][1]);
+        q[0] = (r[0][2] + r[2][0]) / s;
+        q[1] = (r[1][2] + r[2][1]) / s;
+        q[2] = 0.25 * s;
+        q[3] = (r[1][0] - r[0][1]) / s;
+    }
+}
+
+// Spherical interpolation between unit quaternions, along the shorter arc
+static void slerp(const double a[4], const double b[4], double t, double q[4])
+{
+    double cosTheta = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+    double sign = cosTheta < 0.0 ? -1.0 : 1.0;
+    cosTheta *= sign;
+
+    double wa, wb;
+    if (cosTheta > 0.9995)
+    {
+        // Nearly the same rotation: linear, normalized below
+        wa = 1.0 - t;
+        wb = t;
+    }
+    else
+    {
+        double theta = std::acos(cosTheta);
+        double sinTheta = std::sin(theta);
+        wa = std::sin((1.0 - t) * theta) / sinTheta;
+        wb = std::sin(t * theta) / sinTheta;
+    }
+    double length = 0.0;
+    for (int i = 0; i < 4; i++)
+    {
+        q[i] = wa * a[i] + wb * sign * b[i];
+        length += q[i] * q[i];
+    }
+    length = std::sqrt(length);
+    for (int i = 0; i < 4; i++)
+        q[i] /= length;
+}
+
+void TransformTrack::addKey(double time, const Matrix4x4 &transform)
+{
+    Key key;
+    key.time = time;
+
+    // The columns of the upper 3x3 are those of the rotation, each times
+    // its scale. A mirroring transform keeps it as a negative x scale
+    double r[3][3];
+    for (int j = 0; j < 3; j++)
+    {
+        key.translation[j] = transform.data[j][3];
+        key.scale[j] = std::sqrt(transform.data[0][j] * transform.data[0][j] +
+                                 transform.data[1][j] * transform.data[1][j] +
+                                 transform.data[2][j] * transform.data[2][j]);
+    }
+    double determinant =
+        transform.data[0][0] * (transform.data[1][1] * transform.data[2][2] - transform.data[1][2] * transform.data[2][1]) -
+        transform.data[0][1] * (transform.data[1][0] * transform.data[2][2] - transform.data[1][2] * transform.data[2][0]) +
+        transform.data[0][2] * (transform.data[1][0] * transform.data[2][1] - transform.data[1][1] * transform.data[2][0]);
+    if (determinant < 0.0)
+        key.scale[0] = -key.scale[0];
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            r[i][j] = key.scale[j] != 0.0 ? transform.data[i][j] / key.scale[j] : (i == j ? 1.0 : 0.0);
+    matrixToQuaternion(r, key.rotation);
+
+    auto after = std::lower_bound(keys.begin(), keys.end(), time,
+                                  [](const Key &k, double t) { return k.time < t; });
+    if (after != keys.end() && after->time == time)
+        *after = key;
+    else
+        keys.insert(after, key);
+}
+
+Matrix4x4 TransformTrack::evaluate(double time) const
+{
+    if (keys.empty())
+        return Matrix4x4();
+
+    // Keys a and b around time, and the position between them
+    auto after = std::lower_bound(keys.begin(), keys.end(), time,
+                                  [](const Key &k, double t) { return k.time < t; });
+    const Key &b = after == keys.end() ? keys.back() : *after;
+    const Key &a = after == keys.begin() || after == keys.end() ? b : *(after - 1);
+    double t = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0;
+
+    double rotation[4];
+    slerp(a.rotation, b.rotation, t, rotation);
+    double r[3][3];
+    quaternionToMatrix(rotation, r);
+
+    Matrix4x4 transform;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            transform.data[i][j] = r[i][j] * ((1.0 - t) * a.scale[j] + t * b.scale[j]);
+        transform.data[i][3] = (1.0 - t) * a.translation[i] + t * b.translation[i];
+    }
+    return transform;
+}
+
+bool TransformTrack::empty() const
+{
+    return keys.empty();
+}
+
+double TransformTrack::getStartTime() const
+{
+    return keys.empty() ? 0.0 : keys.front().time;
+}
+
+double TransformTrack::getEndTime() const
+{
+    return keys.empty() ? 0.0 : keys.back().time;
+}
+
+void Animation::animateCamera(const TransformTrack &track)
+{
+    cameraTrack = track;
+}
+
+void Animation::animateShape(Shape *shape, const TransformTrack &track)
+{
+    shapeTracks.push_back({ shape, track });
+}
+
+bool Animation::apply(double time, Camera &camera, Aggregate *aggregate) const
+{
+    if (!cameraTrack.empty())
+        camera.setCameraToWorld(cameraTrack.evaluate(time));
+
+    for (const ShapeTrack &shapeTrack : shapeTracks)
+    {
+        if (shapeTrack.track.empty())
+            continue;
+        Matrix4x4 transform = shapeTrack.track.evaluate(time);
+        if (aggregate)
+            aggregate->moveShape(shapeTrack.shape, transform);
+        else
+            shapeTrack.shape->setTransform(transform);
+    }
+    return aggregate ? aggregate->refit() : false;
+}
+
+double Animation::getStartTime() const
+{
+    double start = cameraTrack.empty() ? INFINITY : cameraTrack.getStartTime();
+    for (const ShapeTrack &shapeTrack : shapeTracks)
+        if (!shapeTrack.track.empty())
+            start = std::min(start, shapeTrack.track.getStartTime());
+    return std::isinf(start) ? 0.0 : start;
+}
+
+double Animation::getEndTime() const
+{
+    double end = cameraTrack.empty() ? -INFINITY : cameraTrack.getEndTime();
+    for (const ShapeTrack &shapeTrack : shapeTracks)
+        if (!shapeTrack.track.empty())
+            end = std::max(end, shapeTrack.track.getEndTime());
+    return std::isinf(end) ? 0.0 : end;
+}
@@ -0,0 +1,69 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <vector>
+
+#include "matrix4x4.h"
+
+class Camera;
+class Shape;
+class Aggregate;
+
+// Transform keyed at a few times and interpolated in between. Every key
+// is split into translation, rotation and scale (transforms without
+// shear, T * R * S): translation and scale are interpolated linearly, the
+// rotation along the shortest arc (quaternion slerp). Before the first
+// key and after the last the transform holds still
+class TransformTrack
+{
+public:
+    // Keys may be added in any order; a key at the time of another
+    // replaces it
+    void addKey(double time, const Matrix4x4 &transform);
+
+    Matrix4x4 evaluate(double time) const;
+
+    bool empty() const;
+    double getStartTime() const;
+    double getEndTime() const;
+
+private:
+    struct Key
+    {
+        double time;
+        double translation[3];
+        double rotation[4]; // Unit quaternion (x, y, z, w)
+        double scale[3];
+    };
+
+    std::vector<Key> keys; // By time
+};
+
+// Camera and shape tracks of an animation, set on the scene frame by frame
+class Animation
+{
+public:
+    void animateCamera(const TransformTrack &track);
+    void animateShape(Shape *shape, const TransformTrack &track);
+
+    // Places the camera and the animated shapes at time. The shapes of an
+    // aggregate are moved through it, which is refit afterwards; returns
+    // whether the refit had to rebuild its tree
+    bool apply(double time, Camera &camera, Aggregate *aggregate = nullptr) const;
+
+    // Times of the first and the last key of all the tracks
+    double getStartTime() const;
+    double getEndTime() const;
+
+private:
+    struct ShapeTrack
+    {
+        Shape *shape;
+        TransformTrack track;
+    };
+
+    TransformTrack cameraTrack;
+    std::vector<ShapeTrack> shapeTracks;
+};
+
+#endif // ANIMATION_H
@@ -0,0 +1,146 @@
+#include "aocache.h"
+
+#include <cmath>
+#include <mutex>
+
+#include "statistics.h"
+
+// Smallest total weight of the entries around a query for it to be
+// answered from the cache
+static const float MinCacheWeight = 0.3f;
+
+// Entries farther than this fraction of the radius from the tangent plane
+// of the query belong to another surface (e.g. the other side of a wall)
+static const float MaxPlaneDistance = 0.1f;
+
+AmbientOcclusionCache::AmbientOcclusionCache(double radius_, double minCosine_) :
+    radius(radius_), minCosine(minCosine_), cellSize(2.0 * radius_)
+{ }
+
+float AmbientOcclusionCache::lookup(const Vector3D &x, const Vector3D &n,
+                                    const std::function<float()> &compute)
+{
+    STAT_INC(AOCacheLookups);
+
+    float value;
+    if (interpolate(x, n, value))
+    {
+        STAT_INC(AOCacheHits);
+        return value;
+    }
+
+    // Two threads may compute the same missing value; both are kept
+    value = compute();
+    insert(x, n, value);
+    return value;
+}
+
+void AmbientOcclusionCache::clear()
+{
+    for (Shard &shard : shards)
+    {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.cells.clear();
+    }
+}
+
+size_t AmbientOcclusionCache::size() const
+{
+    size_t count = 0;
+    for (const Shard &shard : shards)
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        for (const auto &cell : shard.cells)
+            count += cell.second.size();
+    }
+    return count;
+}
+
+bool AmbientOcclusionCache::interpolate(const Vector3D &x, const Vector3D &n, float &value) const
+{
+    int64_t cell[3];
+    cellCoordinates(x, cell);
+
+    // The cells overlapped by the ball of radius `radius` around x: the cell
+    // of x and, on every axis, its neighbor on the side of x
+    int64_t neighbor[3];
+    const float p[3] = { x.x, x.y, x.z };
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double local = p[axis] / cellSize - (double)cell[axis];
+        neighbor[axis] = local < 0.5 ? cell[axis] - 1 : cell[axis] + 1;
+    }
+
+    const float invRadius = (float)(1.0 / radius);
+    const float cosineRange = (float)(1.0 - minCosine);
+    float weightSum = 0.0f, valueSum = 0.0f;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        int64_t cx = (corner & 1) ? neighbor[0] : cell[0];
+        int64_t cy = (corner & 2) ? neighbor[1] : cell[1];
+        int64_t cz = (corner & 4) ? neighbor[2] : cell[2];
+        uint64_t key = cellKey(cx, cy, cz);
+
+        const Shard &shard = shards[key % NumShards];
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto found = shard.cells.find(key);
+        if (found == shard.cells.end())
+            continue;
+
+        for (const Entry &e : found->second)
+        {
+            float dx = x.x - e.position.x, dy = x.y - e.position.y, dz = x.z - e.position.z;
+            float distance = std::sqrt(dx * dx + dy * dy + dz * dz) * invRadius;
+            if (distance >= 1.0f)
+                continue;
+
+            float cosine = n.x * e.normal.x + n.y * e.normal.y + n.z * e.normal.z;
+            if (cosine <= (float)minCosine)
+                continue;
+
+            float planeDistance = std::abs(dx * e.normal.x + dy * e.normal.y + dz * e.normal.z) * invRadius;
+            if (planeDistance > MaxPlaneDistance)
+                continue;
+
+            float weight = (1.0f - distance) * (cosine - (float)minCosine) / cosineRange;
+            weightSum += weight;
+            valueSum += weight * e.value;
+        }
+    }
+
+    if (weightSum < MinCacheWeight)
+        return false;
+
+    value = valueSum / weightSum;
+    return true;
+}
+
+void AmbientOcclusionCache::insert(const Vector3D &x, const Vector3D &n, float value)
+{
+    int64_t cell[3];
+    cellCoordinates(x, cell);
+    uint64_t key = cellKey(cell[0], cell[1], cell[2]);
+
+    Shard &shard = shards[key % NumShards];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    shard.cells[key].push_back(Entry{ x, n, value });
+}
+
+void AmbientOcclusionCache::cellCoordinates(const Vector3D &x, int64_t cell[3]) const
+{
+    cell[0] = (int64_t)std::floor(x.x / cellSize);
+    cell[1] = (int64_t)std::floor(x.y / cellSize);
+    cell[2] = (int64_t)std::floor(x.z / cellSize);
+}
+
+uint64_t AmbientOcclusionCache::cellKey(int64_t cx, int64_t cy, int64_t cz)
+{
+    // 21 bits per axis, then mixed so that neighboring cells spread over
+    // the shards
+    uint64_t key = ((uint64_t)(cx & 0x1FFFFF) << 42) | ((uint64_t)(cy & 0x1FFFFF) << 21)
+                 | (uint64_t)(cz & 0x1FFFFF);
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
@@ -0,0 +1,65 @@
+#ifndef AOCACHE_H
+#define AOCACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "vector3d.h"
+
+// Reuse distance of the cached occlusion values, relative to the length
+// of the occlusion rays: occlusion varies over that length
+static const double AOCacheRadius = 0.25;
+
+// World-space cache of ambient occlusion values, shared by all threads.
+//
+// Values are stored at the points where they were computed and reused at
+// nearby points with a similar normal, blended with weights that fall off
+// with the distance and the normal deviation. The cache is filled lazily:
+// a lookup with no close enough entry computes the value and stores it.
+// Entries are never invalidated, only emptied by clear().
+class AmbientOcclusionCache
+{
+public:
+    // radius_: distance up to which an entry is reused
+    // minCosine_: smallest cosine between the normals of a query and an entry
+    AmbientOcclusionCache(double radius_, double minCosine_ = 0.9);
+
+    // Cached (interpolated) occlusion at x with normal n, or compute() when
+    // the cache has no entry close enough; its result is then stored
+    float lookup(const Vector3D &x, const Vector3D &n, const std::function<float()> &compute);
+
+    void clear();
+    size_t size() const;
+
+private:
+    struct Entry
+    {
+        Vector3D position;
+        Vector3D normal;
+        float value;
+    };
+
+    // Entries are bucketed in a grid of cells twice as large as the radius,
+    // so that the ball of reuse of a query overlaps at most 2x2x2 cells
+    struct Shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<uint64_t, std::vector<Entry>> cells;
+    };
+    static const int NumShards = 64;
+
+    bool interpolate(const Vector3D &x, const Vector3D &n, float &value) const;
+    void insert(const Vector3D &x, const Vector3D &n, float value);
+    void cellCoordinates(const Vector3D &x, int64_t cell[3]) const;
+    static uint64_t cellKey(int64_t cx, int64_t cy, int64_t cz);
+
+    double radius;
+    double minCosine;
+    double cellSize;
+    Shard shards[NumShards];
+};
+
+#endif // AOCACHE_H
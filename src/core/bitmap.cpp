@@ -113,7 +113,8 @@ int BitMap::read(Vector3D** &dataOut, size_t &widthOut, size_t &heightOut, std::
     }
 }
 
-int BitMap::save(Vector3D** &data, const size_t &width, const size_t &height)
+int BitMap::save(Vector3D** &data, const size_t &width, const size_t &height,
+                 const char* fileName)
 {
     // Create file header
     bmp24_file_header fileHeader;
@@ -122,7 +123,7 @@ int BitMap::save(Vector3D** &data, const size_t &width, const size_t &height)
     bmp24_info_header infoHeader(width, height);
 
     std::ofstream outputFile;
-    outputFile.open("./output.bmp", std::ios::binary | std::ios::out);
+    outputFile.open(fileName, std::ios::binary | std::ios::out);
 
     if(outputFile.is_open())
     {
@@ -195,7 +196,7 @@ int BitMap::save(Vector3D** &data, const size_t &width, const size_t &height)
     {
         // Problem opening file
         std::cout << "Problem at BitMap::save() : Could not open file \""
-                  << "example.bmp" << "\"" << std::endl;
+                  << fileName << "\"" << std::endl;
         return 1;
     }
 }
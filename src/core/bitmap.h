@@ -1,6 +1,7 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <cstdint>
 #include <cstring>
 #include "vector3d.h"
 //#include <iostream>
@@ -35,10 +36,12 @@ struct bmp24_file_header
         char* block = (char*)malloc(14);
         block[0]  = magic1;
         block[1]  = magic2;
-        memcpy((void*)&block[2],  &size, sizeof(size));
+        // The fields of the file are 32 bits wide, whatever the size of long
+        int32_t size32 = (int32_t)size, offbits32 = (int32_t)offbits;
+        memcpy((void*)&block[2],  &size32, sizeof(size32));
         memcpy((void*)&block[6],  &reserved1, sizeof(reserved1));
         memcpy((void*)&block[8],  &reserved2, sizeof(reserved2));
-        memcpy((void*)&block[10], &offbits, sizeof(offbits));
+        memcpy((void*)&block[10], &offbits32, sizeof(offbits32));
         //long test = block[10];
         //std::cout << "Writing offbits value " << offbits << ": " << test << std::endl;
 
@@ -84,17 +87,23 @@ struct bmp24_info_header
     {
         char *block = (char *)malloc(40);
 
-        memcpy((void*)&block[0],  &size,   sizeof(long));
-        memcpy((void*)&block[4],  &width,  sizeof(long));
-        memcpy((void*)&block[8],  &height, sizeof(long));
+        // The fields of the file are 32 bits wide, whatever the size of long
+        auto write32 = [block](int offset, long value)
+        {
+            int32_t value32 = (int32_t)value;
+            memcpy((void*)&block[offset], &value32, sizeof(value32));
+        };
+        write32(0,  size);
+        write32(4,  width);
+        write32(8,  height);
         memcpy((void*)&block[12], &planes, sizeof(short int));
         memcpy((void*)&block[14], &bit_count,   sizeof(short int));
-        memcpy((void*)&block[16], &compression, sizeof(long));
-        memcpy((void*)&block[20], &size_image,  sizeof(long));
-        memcpy((void*)&block[24], &x_pels_per_meter, sizeof(long));
-        memcpy((void*)&block[28], &y_pels_per_meter, sizeof(long));
-        memcpy((void*)&block[32], &clr_used,         sizeof(long));
-        memcpy((void*)&block[36], &clr_important,    sizeof(long));
+        write32(16, compression);
+        write32(20, size_image);
+        write32(24, x_pels_per_meter);
+        write32(28, y_pels_per_meter);
+        write32(32, clr_used);
+        write32(36, clr_important);
 
         return block;
     }
@@ -106,7 +115,8 @@ class BitMap
 public:
     BitMap();
 
-    static int save(Vector3D** &data, const size_t &width, const size_t &height);
+    static int save(Vector3D** &data, const size_t &width, const size_t &height,
+                    const char* fileName = "./output.bmp");
     static int read(Vector3D** &dataOut, size_t &width, size_t &height, std::string &fileName);
 };
 
@@ -0,0 +1,898 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <sstream>
+
+#include "parallel.h"
+
+// Primitives binned by one task of the top levels
+static const size_t ChunkSize = 1 << 16;
+static const int MaxBins = 64;
+// Refits of fewer leaves are not worth the worker threads
+static const size_t ParallelRefitLeaves = 1024;
+// Refits of more than one leaf in this many nodes sweep the whole tree
+// instead of climbing from each leaf
+static const size_t RefitSweepRatio = 32;
+// Below this depth the builder stops trusting the SAH and splits ranges
+// in halves
+static const int MedianSplitDepth = 40;
+
+// Levels a range of count primitives needs when split in halves
+static int halvingDepth(uint32_t count)
+{
+    int levels = 0;
+    while (((uint64_t)1 << levels) < count)
+        levels++;
+    return levels;
+}
+
+namespace
+{
+
+// No initializers, so that arrays of bins can be left uninitialized: use
+// Box::empty()
+struct Box
+{
+    float min[3];
+    float max[3];
+
+    static Box empty()
+    {
+        return { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY } };
+    }
+
+    void grow(const Box &b)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            min[axis] = std::min(min[axis], b.min[axis]);
+            max[axis] = std::max(max[axis], b.max[axis]);
+        }
+    }
+
+    void grow(float x, float y, float z)
+    {
+        min[0] = std::min(min[0], x); max[0] = std::max(max[0], x);
+        min[1] = std::min(min[1], y); max[1] = std::max(max[1], y);
+        min[2] = std::min(min[2], z); max[2] = std::max(max[2], z);
+    }
+
+    float area() const
+    {
+        float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        if (dx < 0.0f || dy < 0.0f || dz < 0.0f)
+            return 0.0f;
+        return 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+// Boxes of the primitives of a range and of their centroids
+struct RangeBounds
+{
+    Box bounds = Box::empty();
+    Box centroids = Box::empty();
+
+    void grow(const RangeBounds &b)
+    {
+        bounds.grow(b.bounds);
+        centroids.grow(b.centroids);
+    }
+};
+
+struct Bin
+{
+    Box bounds;
+    uint32_t count;
+};
+
+// Only the first numBins of every axis are used, and only those are
+// cleared: clearing all of them would cost more than binning small ranges
+struct Bins
+{
+    Bin bins[3][MaxBins];
+
+    explicit Bins(int numBins)
+    {
+        for (int axis = 0; axis < 3; axis++)
+            for (int i = 0; i < numBins; i++)
+                bins[axis][i] = { Box::empty(), 0 };
+    }
+
+    void grow(const Bins &b, int numBins)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            for (int i = 0; i < numBins; i++)
+            {
+                bins[axis][i].bounds.grow(b.bins[axis][i].bounds);
+                bins[axis][i].count += b.bins[axis][i].count;
+            }
+        }
+    }
+};
+
+// Primitives [begin, end) of the index array, to become node 'node'
+struct Range
+{
+    uint32_t begin, end;
+    uint32_t node;
+    int depth;
+    RangeBounds boxes;
+
+    uint32_t size() const { return end - begin; }
+};
+
+// What to do with a range
+struct Split
+{
+    bool leaf;
+    int axis;
+    int bin;     // First bin of the right child (-1: split at the median)
+};
+
+// Builder state, shared by every task
+class Builder
+{
+public:
+    Builder(const BVHPrimitiveBounds &bounds, const BVHSettings &settings_,
+            std::vector<uint32_t> &indices_) :
+        settings(settings_), indices(indices_), numBins(std::clamp(settings_.bins, 2, MaxBins))
+    {
+        size_t count = bounds.size();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            boundsMin[axis].resize(count);
+            boundsMax[axis].resize(count);
+            centroids[axis].resize(count);
+        }
+        parallelFor((count + ChunkSize - 1) / ChunkSize, [&](size_t chunk, int)
+        {
+            size_t end = std::min(count, (chunk + 1) * ChunkSize);
+            for (size_t i = chunk * ChunkSize; i < end; i++)
+            {
+                indices[i] = (uint32_t)i;
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    boundsMin[axis][i] = bounds.boundsMin[axis][i];
+                    boundsMax[axis][i] = bounds.boundsMax[axis][i];
+                    centroids[axis][i] = 0.5f * (bounds.boundsMin[axis][i] + bounds.boundsMax[axis][i]);
+                }
+            }
+        });
+    }
+
+    void computeBounds(uint32_t begin, uint32_t end, RangeBounds &result) const
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            growByPrimitive(result.bounds, i);
+            result.centroids.grow(centroids[0][i], centroids[1][i], centroids[2][i]);
+        }
+    }
+
+    void binPrimitives(uint32_t begin, uint32_t end, const Box &centroidBox, Bins &result) const
+    {
+        float scale[3];
+        for (int axis = 0; axis < 3; axis++)
+            scale[axis] = binScale(axis, centroidBox);
+
+        for (uint32_t i = begin; i < end; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (scale[axis] == 0.0f)
+                    continue;
+                Bin &bin = result.bins[axis][binOf(axis, i, centroidBox, scale[axis])];
+                growByPrimitive(bin.bounds, i);
+                bin.count++;
+            }
+        }
+    }
+
+    // Cheapest split of the bins by the SAH, or a leaf when that is cheaper
+    Split chooseSplit(const Range &range, const Bins &bins) const
+    {
+        uint32_t count = range.size();
+        if (count <= 1)
+            return { true, 0, 0 };
+
+        const Box &centroidBox = range.boxes.centroids;
+        int largestAxis = 0;
+        for (int axis = 1; axis < 3; axis++)
+        {
+            if (centroidBox.max[axis] - centroidBox.min[axis] >
+                centroidBox.max[largestAxis] - centroidBox.min[largestAxis])
+                largestAxis = axis;
+        }
+        // Ranges split in halves from where the tree would otherwise
+        // outgrow the traversal stack: halving puts no node of the range
+        // deeper than depth + halvingDepth(count)
+        if (range.depth >= MedianSplitDepth || range.depth + halvingDepth(count) >= BVH::MaxDepth - 1 ||
+            !(centroidBox.max[largestAxis] > centroidBox.min[largestAxis]))
+        {
+            if (count <= (uint32_t)settings.maxLeafSize)
+                return { true, 0, 0 };
+            return { false, largestAxis, -1 };
+        }
+
+        // Cost of every plane between two bins: sweep the bins from the
+        // right accumulating the right side, then from the left
+        double bestCost = INFINITY;
+        Split best = { false, largestAxis, -1 };
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (binScale(axis, centroidBox) == 0.0f)
+                continue;
+
+            float rightArea[MaxBins];
+            uint32_t rightCount[MaxBins];
+            Box right = Box::empty();
+            uint32_t rightSum = 0;
+            for (int i = numBins - 1; i > 0; i--)
+            {
+                right.grow(bins.bins[axis][i].bounds);
+                rightSum += bins.bins[axis][i].count;
+                rightArea[i] = right.area();
+                rightCount[i] = rightSum;
+            }
+
+            Box left = Box::empty();
+            uint32_t leftSum = 0;
+            for (int i = 1; i < numBins; i++)
+            {
+                left.grow(bins.bins[axis][i - 1].bounds);
+                leftSum += bins.bins[axis][i - 1].count;
+                if (leftSum == 0 || rightCount[i] == 0)
+                    continue;
+                double cost = left.area() * (double)leftSum + rightArea[i] * (double)rightCount[i];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    best = { false, axis, i };
+                }
+            }
+        }
+
+        double nodeArea = range.boxes.bounds.area();
+        double splitCost = settings.traversalCost +
+                           settings.intersectionCost * (nodeArea > 0.0 ? bestCost / nodeArea : count);
+        double leafCost = settings.intersectionCost * count;
+        if (count <= (uint32_t)settings.maxLeafSize && leafCost <= splitCost)
+            return { true, 0, 0 };
+        return best;
+    }
+
+    // Reorders the range by the split into the ranges of its two children,
+    // with their boxes
+    void partition(const Range &range, const Split &split, const Bins &bins, Range children[2])
+    {
+        for (int c = 0; c < 2; c++)
+        {
+            children[c].depth = range.depth + 1;
+            children[c].boxes = RangeBounds();
+        }
+        children[0].begin = range.begin;
+        children[1].end = range.end;
+
+        if (split.bin >= 0)
+        {
+            // The boxes of the primitives come from the bins, and those of
+            // the centroids are grown as the partition goes
+            const Box &centroidBox = range.boxes.centroids;
+            float scale = binScale(split.axis, centroidBox);
+            uint32_t middle = partitionBy(range, children, [&](uint32_t i)
+            {
+                return binOf(split.axis, i, centroidBox, scale) < split.bin;
+            });
+            for (int i = 0; i < numBins; i++)
+                children[i < split.bin ? 0 : 1].boxes.bounds.grow(bins.bins[split.axis][i].bounds);
+            children[0].end = children[1].begin = middle;
+            return;
+        }
+
+        // Median split, in exact halves: the centroids below the median
+        // go left, then those equal to it, which the middle may cut
+        const std::vector<float> &c = centroids[split.axis];
+        std::vector<float> values(c.begin() + range.begin, c.begin() + range.end);
+        std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        float median = values[values.size() / 2];
+        Range equal = range;
+        equal.begin = partitionBy(range, children, [&](uint32_t i) { return c[i] < median; });
+        partitionBy(equal, children, [&](uint32_t i) { return c[i] == median; });
+        uint32_t middle = range.begin + range.size() / 2;
+        children[0].end = children[1].begin = middle;
+        for (int i = 0; i < 2; i++)
+        {
+            children[i].boxes = RangeBounds();
+            computeBounds(children[i].begin, children[i].end, children[i].boxes);
+        }
+    }
+
+    static void setNode(BVHNode &node, const Box &box)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.boundsMin[axis] = box.min[axis];
+            node.boundsMax[axis] = box.max[axis];
+        }
+    }
+
+    // Builds the whole subtree of a range into 'subtree' (its root at
+    // subtree[0]), by a single thread
+    void buildSubtree(const Range &range, std::vector<BVHNode> &subtree)
+    {
+        subtree.assign(1, BVHNode());
+        Range root = range;
+        root.node = 0;
+        buildNode(root, subtree);
+    }
+
+    const BVHSettings &settings;
+    std::vector<uint32_t> &indices; // Primitive at each position
+    // Boxes and centroids of the primitives at each position. Partitions
+    // move them along with the indices, so that every pass over a range
+    // reads them in order instead of gathering them
+    std::vector<float> boundsMin[3];
+    std::vector<float> boundsMax[3];
+    std::vector<float> centroids[3];
+    int numBins;
+
+private:
+    // Bins per unit of centroid extent along axis (0 when the centroids
+    // have no extent there)
+    float binScale(int axis, const Box &centroidBox) const
+    {
+        float extent = centroidBox.max[axis] - centroidBox.min[axis];
+        return extent > 0.0f ? numBins / extent : 0.0f;
+    }
+
+    int binOf(int axis, uint32_t i, const Box &centroidBox, float scale) const
+    {
+        int bin = (int)((centroids[axis][i] - centroidBox.min[axis]) * scale);
+        return std::clamp(bin, 0, numBins - 1);
+    }
+
+    void growByPrimitive(Box &box, uint32_t i) const
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            box.min[axis] = std::min(box.min[axis], boundsMin[axis][i]);
+            box.max[axis] = std::max(box.max[axis], boundsMax[axis][i]);
+        }
+    }
+
+    void growCentroids(Box &box, uint32_t i) const
+    {
+        box.grow(centroids[0][i], centroids[1][i], centroids[2][i]);
+    }
+
+    // Hoare partition of the range by isLeft, which also grows the
+    // centroid boxes of the children
+    template <typename Predicate>
+    uint32_t partitionBy(const Range &range, Range children[2], Predicate isLeft)
+    {
+        Box &left = children[0].boxes.centroids;
+        Box &right = children[1].boxes.centroids;
+        uint32_t i = range.begin, j = range.end;
+        while (true)
+        {
+            while (i < j && isLeft(i))
+                growCentroids(left, i++);
+            while (i < j && !isLeft(j - 1))
+                growCentroids(right, --j);
+            if (i >= j)
+                return i;
+            swapPrimitives(i, --j);
+            growCentroids(left, i++);
+            growCentroids(right, j);
+        }
+    }
+
+    void swapPrimitives(uint32_t a, uint32_t b)
+    {
+        std::swap(indices[a], indices[b]);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            std::swap(boundsMin[axis][a], boundsMin[axis][b]);
+            std::swap(boundsMax[axis][a], boundsMax[axis][b]);
+            std::swap(centroids[axis][a], centroids[axis][b]);
+        }
+    }
+
+    void buildNode(const Range &range, std::vector<BVHNode> &subtree)
+    {
+        Bins bins(numBins);
+        if (range.size() > 1)
+            binPrimitives(range.begin, range.end, range.boxes.centroids, bins);
+        Split split = chooseSplit(range, bins);
+
+        BVHNode node;
+        setNode(node, range.boxes.bounds);
+        if (split.leaf)
+        {
+            node.offset = range.begin;
+            node.count = (uint16_t)range.size();
+            node.axis = 0;
+            subtree[range.node] = node;
+            return;
+        }
+
+        Range children[2];
+        partition(range, split, bins, children);
+        uint32_t child = (uint32_t)subtree.size();
+        node.offset = child;
+        node.count = 0;
+        node.axis = (uint16_t)split.axis;
+        subtree[range.node] = node;
+        subtree.resize(subtree.size() + 2);
+        for (int c = 0; c < 2; c++)
+        {
+            children[c].node = child + c;
+            buildNode(children[c], subtree);
+        }
+    }
+};
+
+}
+
+BVHBuildMetrics::BVHBuildMetrics() :
+    seconds(0.0), primitives(0), nodes(0), leaves(0), maxDepth(0), sahCost(0.0), memoryBytes(0), cached(false)
+{ }
+
+std::string BVHBuildMetrics::toString() const
+{
+    std::ostringstream s;
+    if (cached)
+    {
+        s << "BVH: " << primitives << " primitives, " << nodes << " nodes, "
+          << memoryBytes / (1024.0 * 1024.0) << " MB, loaded from the cache in " << seconds << " s";
+        return s.str();
+    }
+    s << "BVH: " << primitives << " primitives, " << nodes << " nodes (" << leaves << " leaves, depth "
+      << maxDepth << "), SAH cost " << sahCost << ", " << memoryBytes / (1024.0 * 1024.0) << " MB ("
+      << (primitives > 0 ? (double)memoryBytes / primitives : 0.0) << " bytes per primitive), built in " << seconds
+      << " s";
+    return s.str();
+}
+
+void BVHPrimitiveBounds::resize(size_t count)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        boundsMin[axis].resize(count);
+        boundsMax[axis].resize(count);
+    }
+}
+
+void BVHPrimitiveBounds::set(size_t i, const Vector3D &min, const Vector3D &max)
+{
+    boundsMin[0][i] = min.x; boundsMin[1][i] = min.y; boundsMin[2][i] = min.z;
+    boundsMax[0][i] = max.x; boundsMax[1][i] = max.y; boundsMax[2][i] = max.z;
+}
+
+BVH::BVH() :
+    sahArea(0.0), builtSahCost(0.0)
+{ }
+
+void BVH::build(const BVHPrimitiveBounds &bounds, const BVHSettings &settings_)
+{
+    auto start = std::chrono::steady_clock::now();
+    settings = settings_;
+    // Leaf sizes are 16-bit in the nodes, 8-bit in the compressed ones
+    settings.maxLeafSize = std::clamp(settings.maxLeafSize, 1, settings.compressed ? 0xFF : 0xFFFF);
+    settings.taskSize = std::max(settings.taskSize, (size_t)settings.maxLeafSize);
+    nodes.clear();
+    primitiveIndices.assign(bounds.size(), 0);
+    metrics = BVHBuildMetrics();
+    parents.clear();
+    leafOf.clear();
+    if (bounds.size() == 0)
+        return;
+
+    Builder builder(bounds, settings, primitiveIndices);
+
+    // Top levels: the ranges above taskSize are too few to keep every
+    // thread busy, so each one is binned in parallel chunks
+    struct Chunk { size_t range; uint32_t begin, end; };
+    auto makeChunks = [](const std::vector<Range> &ranges)
+    {
+        std::vector<Chunk> chunks;
+        for (size_t r = 0; r < ranges.size(); r++)
+            for (size_t begin = ranges[r].begin; begin < ranges[r].end; begin += ChunkSize)
+                chunks.push_back({ r, (uint32_t)begin, (uint32_t)std::min<size_t>(ranges[r].end, begin + ChunkSize) });
+        return chunks;
+    };
+
+    nodes.resize(1);
+    std::vector<Range> frontier(1), subtrees;
+    Range &root = frontier[0];
+    root.begin = 0;
+    root.end = (uint32_t)bounds.size();
+    root.node = 0;
+    root.depth = 0;
+    std::vector<Chunk> chunks = makeChunks(frontier);
+    std::vector<RangeBounds> chunkBounds(chunks.size());
+    parallelFor(chunks.size(), [&](size_t c, int)
+    {
+        builder.computeBounds(chunks[c].begin, chunks[c].end, chunkBounds[c]);
+    });
+    for (const RangeBounds &b : chunkBounds)
+        root.boxes.grow(b);
+    if (root.size() <= settings.taskSize)
+        subtrees.swap(frontier);
+
+    while (!frontier.empty())
+    {
+        chunks = makeChunks(frontier);
+        std::vector<Bins> chunkBins(chunks.size(), Bins(builder.numBins));
+        parallelFor(chunks.size(), [&](size_t c, int)
+        {
+            builder.binPrimitives(chunks[c].begin, chunks[c].end,
+                                  frontier[chunks[c].range].boxes.centroids, chunkBins[c]);
+        });
+        std::vector<Bins> bins(frontier.size(), Bins(builder.numBins));
+        for (size_t c = 0; c < chunks.size(); c++)
+            bins[chunks[c].range].grow(chunkBins[c], builder.numBins);
+
+        // Ranges above taskSize are never leaves
+        std::vector<Split> splits(frontier.size());
+        std::vector<Range> children(2 * frontier.size());
+        parallelFor(frontier.size(), [&](size_t r, int)
+        {
+            splits[r] = builder.chooseSplit(frontier[r], bins[r]);
+            if (splits[r].leaf)
+                splits[r] = { false, 0, -1 };
+            builder.partition(frontier[r], splits[r], bins[r], &children[2 * r]);
+        });
+
+        std::vector<Range> next;
+        for (size_t r = 0; r < frontier.size(); r++)
+        {
+            uint32_t child = (uint32_t)nodes.size();
+            nodes.resize(nodes.size() + 2);
+            BVHNode &node = nodes[frontier[r].node];
+            Builder::setNode(node, frontier[r].boxes.bounds);
+            node.offset = child;
+            node.count = 0;
+            node.axis = (uint16_t)splits[r].axis;
+
+            for (int c = 0; c < 2; c++)
+            {
+                Range &range = children[2 * r + c];
+                range.node = child + c;
+                (range.size() > settings.taskSize ? next : subtrees).push_back(range);
+            }
+        }
+        frontier.swap(next);
+    }
+
+    // Subtrees: one task each, largest first. Each is built into its own
+    // array, then appended with its child indices shifted
+    std::sort(subtrees.begin(), subtrees.end(),
+              [](const Range &a, const Range &b) { return a.size() > b.size(); });
+    std::vector<std::vector<BVHNode>> subtreeNodes(subtrees.size());
+    parallelFor(subtrees.size(), [&](size_t s, int)
+    {
+        builder.buildSubtree(subtrees[s], subtreeNodes[s]);
+    });
+
+    for (size_t s = 0; s < subtrees.size(); s++)
+    {
+        // Subtree node i > 0 lands at base + i (after the nodes already
+        // there); its root replaces the node its range was given at the top
+        uint32_t base = (uint32_t)nodes.size() - 1;
+        for (BVHNode &node : subtreeNodes[s])
+            if (node.count == 0)
+                node.offset += base;
+        nodes[subtrees[s].node] = subtreeNodes[s][0];
+        nodes.insert(nodes.end(), subtreeNodes[s].begin() + 1, subtreeNodes[s].end());
+        std::vector<BVHNode>().swap(subtreeNodes[s]);
+    }
+    nodes.shrink_to_fit();
+
+    computeMetrics();
+    metrics.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool BVH::empty() const
+{
+    return nodes.empty();
+}
+
+void BVH::getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const
+{
+    boundsMin = Vector3D(nodes[0].boundsMin[0], nodes[0].boundsMin[1], nodes[0].boundsMin[2]);
+    boundsMax = Vector3D(nodes[0].boundsMax[0], nodes[0].boundsMax[1], nodes[0].boundsMax[2]);
+}
+
+const BVHBuildMetrics& BVH::getMetrics() const
+{
+    return metrics;
+}
+
+const BVHSettings& BVH::getSettings() const
+{
+    return settings;
+}
+
+const std::vector<BVHNode>& BVH::getNodes() const
+{
+    return nodes;
+}
+
+const std::vector<uint32_t>& BVH::getPrimitiveIndices() const
+{
+    return primitiveIndices;
+}
+
+uint64_t BVH::contentHash(const BVHPrimitiveBounds &bounds, const BVHSettings &settings_)
+{
+    // FNV-1a over 64-bit words, with a final mix of the bits
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](uint64_t word) { hash = (hash ^ word) * 1099511628211ull; };
+    auto addFloats = [&](const std::vector<float> &values)
+    {
+        size_t i = 0;
+        for (; i + 2 <= values.size(); i += 2)
+        {
+            uint64_t word;
+            std::memcpy(&word, &values[i], sizeof(word));
+            add(word);
+        }
+        if (i < values.size())
+        {
+            uint32_t last;
+            std::memcpy(&last, &values[i], sizeof(last));
+            add(last);
+        }
+    };
+
+    add(bounds.size());
+    for (int axis = 0; axis < 3; axis++)
+    {
+        addFloats(bounds.boundsMin[axis]);
+        addFloats(bounds.boundsMax[axis]);
+    }
+    uint64_t costs[2];
+    std::memcpy(&costs[0], &settings_.traversalCost, sizeof(uint64_t));
+    std::memcpy(&costs[1], &settings_.intersectionCost, sizeof(uint64_t));
+    for (uint64_t word : { (uint64_t)settings_.maxLeafSize, costs[0], costs[1], (uint64_t)settings_.bins,
+                           (uint64_t)settings_.taskSize, (uint64_t)settings_.width, (uint64_t)settings_.compressed })
+        add(word);
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void BVH::save(std::ostream &out) const
+{
+    out.write(reinterpret_cast<const char*>(&settings), sizeof(settings));
+    out.write(reinterpret_cast<const char*>(&metrics), sizeof(metrics));
+    writeBinaryArray(out, nodes);
+    writeBinaryArray(out, primitiveIndices);
+}
+
+bool BVH::load(std::istream &in, size_t primitives)
+{
+    BVHSettings loadedSettings;
+    BVHBuildMetrics loadedMetrics;
+    std::vector<BVHNode> loadedNodes;
+    std::vector<uint32_t> loadedIndices;
+    if (!in.read(reinterpret_cast<char*>(&loadedSettings), sizeof(loadedSettings)) ||
+        !in.read(reinterpret_cast<char*>(&loadedMetrics), sizeof(loadedMetrics)) ||
+        !readBinaryArray(in, loadedNodes) || !readBinaryArray(in, loadedIndices))
+        return false;
+    if (!validPrimitiveIndices(loadedIndices, primitives) || loadedNodes.empty() != (primitives == 0))
+        return false;
+
+    // Every node must be reached once from the root, within the stack
+    std::vector<bool> reached(loadedNodes.size(), false);
+    std::vector<std::pair<uint32_t, int>> stack;
+    if (!loadedNodes.empty())
+        stack.push_back({ 0, 0 });
+    while (!stack.empty())
+    {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        if (index >= loadedNodes.size() || reached[index] || depth >= MaxDepth)
+            return false;
+        reached[index] = true;
+        const BVHNode &node = loadedNodes[index];
+        if (node.count > 0)
+        {
+            if ((uint64_t)node.offset + node.count > loadedIndices.size())
+                return false;
+            continue;
+        }
+        if (node.axis > 2)
+            return false;
+        stack.push_back({ node.offset, depth + 1 });
+        stack.push_back({ node.offset + 1, depth + 1 });
+    }
+    if (std::find(reached.begin(), reached.end(), false) != reached.end())
+        return false;
+
+    settings = loadedSettings;
+    metrics = loadedMetrics;
+    nodes = std::move(loadedNodes);
+    primitiveIndices = std::move(loadedIndices);
+    parents.clear();
+    leafOf.clear();
+    return true;
+}
+
+static double boxArea(const float boundsMin[3], const float boundsMax[3])
+{
+    double dx = boundsMax[0] - boundsMin[0];
+    double dy = boundsMax[1] - boundsMin[1];
+    double dz = boundsMax[2] - boundsMin[2];
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+void BVH::prepareRefit()
+{
+    if (!parents.empty())
+        return;
+    parents.assign(nodes.size(), 0);
+    leafOf.assign(primitiveIndices.size(), 0);
+    sahArea = 0.0;
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        const BVHNode &node = nodes[i];
+        double area = boxArea(node.boundsMin, node.boundsMax);
+        if (node.count > 0)
+        {
+            for (uint32_t k = 0; k < node.count; k++)
+                leafOf[primitiveIndices[node.offset + k]] = i;
+            sahArea += area * settings.intersectionCost * node.count;
+            continue;
+        }
+        parents[node.offset] = parents[node.offset + 1] = i;
+        sahArea += area * settings.traversalCost;
+    }
+    double rootArea = boxArea(nodes[0].boundsMin, nodes[0].boundsMax);
+    builtSahCost = rootArea > 0.0 ? sahArea / rootArea : 0.0;
+}
+
+double BVH::refit(const std::vector<uint32_t> &primitives, const BVHBoundsFunction &boundsOf)
+{
+    if (nodes.empty())
+        return 1.0;
+    prepareRefit();
+
+    std::vector<uint32_t> leaves;
+    for (uint32_t primitive : primitives)
+        leaves.push_back(leafOf[primitive]);
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+    // The leaves first, each on its own, collecting their changes of
+    // weighted area
+    std::vector<double> areaChanges(leaves.size());
+    auto refitLeaf = [&](size_t i, int)
+    {
+        BVHNode &node = nodes[leaves[i]];
+        double before = boxArea(node.boundsMin, node.boundsMax);
+        Box box = Box::empty();
+        for (uint32_t k = 0; k < node.count; k++)
+        {
+            Vector3D boundsMin, boundsMax;
+            boundsOf(primitiveIndices[node.offset + k], boundsMin, boundsMax);
+            const float min[3] = { boundsMin.x, boundsMin.y, boundsMin.z };
+            const float max[3] = { boundsMax.x, boundsMax.y, boundsMax.z };
+            for (int axis = 0; axis < 3; axis++)
+            {
+                box.min[axis] = std::min(box.min[axis], min[axis]);
+                box.max[axis] = std::max(box.max[axis], max[axis]);
+            }
+        }
+        std::copy(box.min, box.min + 3, node.boundsMin);
+        std::copy(box.max, box.max + 3, node.boundsMax);
+        areaChanges[i] = (boxArea(node.boundsMin, node.boundsMax) - before) * settings.intersectionCost * node.count;
+    };
+    if (leaves.size() >= ParallelRefitLeaves)
+        parallelFor(leaves.size(), refitLeaf);
+    else
+        for (size_t i = 0; i < leaves.size(); i++)
+            refitLeaf(i, 0);
+    for (double change : areaChanges)
+        sahArea += change;
+
+    // Then the nodes above, children before parents: a child always has a
+    // larger index than its parent. A node whose box does not change stops
+    // the climb
+    std::priority_queue<uint32_t> pending;
+    bool sweep = leaves.size() * RefitSweepRatio > nodes.size();
+    if (!sweep)
+        for (uint32_t leaf : leaves)
+            if (leaf != 0)
+                pending.push(parents[leaf]);
+    uint32_t last = UINT32_MAX;
+    uint32_t swept = (uint32_t)nodes.size();
+    while (sweep ? swept > 0 : !pending.empty())
+    {
+        uint32_t index;
+        if (sweep)
+        {
+            index = --swept;
+            if (nodes[index].count > 0)
+                continue;
+        }
+        else
+        {
+            index = pending.top();
+            pending.pop();
+            if (index == last)
+                continue;
+            last = index;
+        }
+
+        BVHNode &node = nodes[index];
+        const BVHNode &first = nodes[node.offset];
+        const BVHNode &second = nodes[node.offset + 1];
+        Box box;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            box.min[axis] = std::min(first.boundsMin[axis], second.boundsMin[axis]);
+            box.max[axis] = std::max(first.boundsMax[axis], second.boundsMax[axis]);
+        }
+        if (std::equal(box.min, box.min + 3, node.boundsMin) && std::equal(box.max, box.max + 3, node.boundsMax))
+            continue;
+        double before = boxArea(node.boundsMin, node.boundsMax);
+        std::copy(box.min, box.min + 3, node.boundsMin);
+        std::copy(box.max, box.max + 3, node.boundsMax);
+        sahArea += (boxArea(node.boundsMin, node.boundsMax) - before) * settings.traversalCost;
+        if (!sweep && index != 0)
+            pending.push(parents[index]);
+    }
+
+    double rootArea = boxArea(nodes[0].boundsMin, nodes[0].boundsMax);
+    if (rootArea <= 0.0 || builtSahCost <= 0.0)
+        return 1.0;
+    return sahArea / rootArea / builtSahCost;
+}
+
+void BVH::computeMetrics()
+{
+    metrics.primitives = primitiveIndices.size();
+    metrics.nodes = nodes.size();
+    metrics.memoryBytes = nodes.size() * sizeof(BVHNode) + primitiveIndices.size() * sizeof(uint32_t);
+
+    auto area = [](const BVHNode &node)
+    {
+        double dx = node.boundsMax[0] - node.boundsMin[0];
+        double dy = node.boundsMax[1] - node.boundsMin[1];
+        double dz = node.boundsMax[2] - node.boundsMin[2];
+        return 2.0 * (dx * dy + dy * dz + dz * dx);
+    };
+
+    // SAH cost: every node costs its traversal or intersection cost times
+    // the probability that a ray through the root reaches it
+    double rootArea = area(nodes[0]);
+    double cost = 0.0;
+    std::vector<std::pair<uint32_t, int>> stack = { { 0, 0 } };
+    while (!stack.empty())
+    {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        const BVHNode &node = nodes[index];
+        double probability = rootArea > 0.0 ? area(node) / rootArea : 1.0;
+        metrics.maxDepth = std::max(metrics.maxDepth, depth);
+        if (node.count > 0)
+        {
+            metrics.leaves++;
+            cost += probability * settings.intersectionCost * node.count;
+            continue;
+        }
+        cost += probability * settings.traversalCost;
+        stack.push_back({ node.offset, depth + 1 });
+        stack.push_back({ node.offset + 1, depth + 1 });
+    }
+    metrics.sahCost = cost;
+}
@@ -0,0 +1,268 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ray.h"
+#include "statistics.h"
+
+// Build options of the bounding volume hierarchy
+struct BVHSettings
+{
+    BVHSettings() :
+        maxLeafSize(4), traversalCost(1.0), intersectionCost(1.0), bins(16), taskSize(16384), width(4),
+        compressed(false), rebuildThreshold(1.5)
+    { }
+
+    int maxLeafSize;         // Primitives a leaf may hold: larger ranges are always split
+    double traversalCost;    // SAH cost of visiting a node...
+    double intersectionCost; // ... and of testing one primitive
+    int bins;                // Buckets per axis the split planes are chosen between (2 to 64)
+    size_t taskSize;         // Ranges of fewer primitives are built whole by a single thread
+    int width;               // Children per node traced: 2, or 4 for the SIMD layout (WideBVH)
+    bool compressed;         // Four-wide only: child boxes quantized to 8 bits, 64-byte nodes
+    double rebuildThreshold; // Aggregate::refit() rebuilds past this SAH cost, relative to the cost as built
+};
+
+// Figures of the last build
+struct BVHBuildMetrics
+{
+    BVHBuildMetrics();
+
+    std::string toString() const;
+
+    double seconds;
+    size_t primitives;
+    size_t nodes;
+    size_t leaves;
+    int maxDepth;
+    double sahCost;     // Expected cost of a ray through the root box, in BVHSettings units
+    size_t memoryBytes; // Nodes and primitive indices of the layout traced
+    bool cached;        // Loaded from a cache file: seconds is the time of the load
+};
+
+// Bounding boxes of the primitives to build over, as structure of arrays
+struct BVHPrimitiveBounds
+{
+    void resize(size_t count);
+    size_t size() const { return boundsMin[0].size(); }
+    void set(size_t i, const Vector3D &min, const Vector3D &max);
+
+    std::vector<float> boundsMin[3];
+    std::vector<float> boundsMax[3];
+};
+
+// Current box of a primitive, for refits
+using BVHBoundsFunction = std::function<void(uint32_t primitive, Vector3D &boundsMin, Vector3D &boundsMax)>;
+
+// Arrays of trivially copyable values as their count and their bytes, for
+// the cache files of the trees
+template <typename T>
+void writeBinaryArray(std::ostream &out, const std::vector<T> &values)
+{
+    uint64_t count = values.size();
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(values.data()), count * sizeof(T));
+}
+
+template <typename T>
+bool readBinaryArray(std::istream &in, std::vector<T> &values)
+{
+    // The count is checked against the bytes left, so that a damaged file
+    // cannot ask for more memory than its own size
+    uint64_t count;
+    if (!in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+        return false;
+    std::streampos position = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streamoff left = in.tellg() - position;
+    in.seekg(position);
+    if (count > (uint64_t)left / sizeof(T))
+        return false;
+    values.resize(count);
+    return (bool)in.read(reinterpret_cast<char*>(values.data()), count * sizeof(T));
+}
+
+// Whether the primitive indices of a loaded tree are one per primitive,
+// each below primitives
+inline bool validPrimitiveIndices(const std::vector<uint32_t> &indices, size_t primitives)
+{
+    if (indices.size() != primitives)
+        return false;
+    for (uint32_t index : indices)
+        if (index >= primitives)
+            return false;
+    return true;
+}
+
+// 32 bytes, two per cache line. The two children of an interior node are
+// adjacent in the node array
+struct BVHNode
+{
+    float boundsMin[3];
+    float boundsMax[3];
+    uint32_t offset; // Interior: index of the first child. Leaf: first entry of its primitives
+    uint16_t count;  // Primitives of a leaf, 0 for interior nodes
+    uint16_t axis;   // Split axis of an interior node
+};
+
+// Bounding volume hierarchy over boxes, built top-down with the binned
+// surface area heuristic (Wald 2007, "On fast Construction of SAH-based
+// Bounding Volume Hierarchies").
+//
+// The build works on structure-of-arrays copies of the boxes and their
+// centroids and runs on the worker threads of parallelFor(): the top of
+// the tree is built level by level, binning the large ranges in parallel
+// chunks, and the subtrees below BVHSettings::taskSize are then built as
+// independent tasks. The tree refers to the primitives by their index in
+// the bounds it was built over; it is read-only afterwards, so any number
+// of threads can traverse it.
+class BVH
+{
+public:
+    BVH();
+
+    // Replaces the tree with one over the given boxes
+    void build(const BVHPrimitiveBounds &bounds, const BVHSettings &settings_ = BVHSettings());
+
+    // Hash of everything the tree depends on: the boxes, in order, and
+    // the settings. Keys the cache files of the tree
+    static uint64_t contentHash(const BVHPrimitiveBounds &bounds, const BVHSettings &settings_);
+
+    // Raw copy of the tree, for the machine that wrote it. load() fails
+    // on a stream cut short, or on a tree that is not one over primitives
+    // primitives the traversal can walk (indices out of range, nodes
+    // reached twice, deeper than its stack), and replaces the tree only if
+    // it succeeds
+    void save(std::ostream &out) const;
+    bool load(std::istream &in, size_t primitives);
+
+    // Refits the leaves that hold the given primitives to the boxes
+    // boundsOf gives now, and the nodes above them, bottom-up. The tree
+    // keeps its topology, so its quality drops as the primitives move:
+    // returns its SAH cost relative to the cost as built. The first refit
+    // links the nodes to their parents. Not to be run during a traversal
+    double refit(const std::vector<uint32_t> &primitives, const BVHBoundsFunction &boundsOf);
+
+    // Calls test(primitive) for the primitives of every leaf the segment
+    // [minT, maxT] of the ray crosses, nearer children first. test returns
+    // whether it hit, and a hit is expected to shorten ray.maxT, which
+    // culls the farther nodes. With anyHit the traversal ends at the
+    // first hit. Returns whether any test hit.
+    template <typename PrimitiveTest>
+    bool traverse(const Ray &ray, bool anyHit, PrimitiveTest test) const;
+
+    bool empty() const;
+    // Box of the whole tree (only valid when not empty)
+    void getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+    const BVHBuildMetrics& getMetrics() const;
+    const BVHSettings& getSettings() const;
+
+    // The tree, for the layouts built from it (WideBVH)
+    const std::vector<BVHNode>& getNodes() const;
+    const std::vector<uint32_t>& getPrimitiveIndices() const;
+
+    // Relative rounding margin of the box tests
+    static constexpr float BoxMargin = 1.0f + 6.0f * 0x1p-24f;
+
+    // Deepest tree the traversal stack holds: nodes lie at depths below it
+    static const int MaxDepth = 64;
+
+private:
+    static bool intersectBox(const BVHNode &node, const float origin[3], const float invDir[3],
+                             float tMin, float tMax);
+
+    void computeMetrics();
+    void prepareRefit();
+
+    BVHSettings settings;
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> primitiveIndices;
+    BVHBuildMetrics metrics;
+
+    // Refit state, built by the first refit: parent of every node, leaf
+    // of every primitive, and the SAH cost times the area of the root
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> leafOf;
+    double sahArea;
+    double builtSahCost;
+};
+
+inline bool BVH::intersectBox(const BVHNode &node, const float origin[3], const float invDir[3],
+                              float tMin, float tMax)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float tNear = (node.boundsMin[axis] - origin[axis]) * invDir[axis];
+        float tFar = (node.boundsMax[axis] - origin[axis]) * invDir[axis];
+        if (tNear > tFar)
+            std::swap(tNear, tFar);
+        // Rounding margin of the far distance (PBRT, section 3.9.2). A NaN,
+        // from an origin on a slab plane of an axis the ray is parallel
+        // to, fails the comparisons and leaves the interval as it was
+        tFar *= BoxMargin;
+        tMin = tNear > tMin ? tNear : tMin;
+        tMax = tFar < tMax ? tFar : tMax;
+        if (tMin > tMax)
+            return false;
+    }
+    return true;
+}
+
+template <typename PrimitiveTest>
+bool BVH::traverse(const Ray &ray, bool anyHit, PrimitiveTest test) const
+{
+    if (nodes.empty())
+        return false;
+
+    const float origin[3] = { ray.o.x, ray.o.y, ray.o.z };
+    const float invDir[3] = { 1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z };
+    const bool dirIsNeg[3] = { invDir[0] < 0.0f, invDir[1] < 0.0f, invDir[2] < 0.0f };
+
+    uint32_t stack[MaxDepth];
+    int stackSize = 0;
+    uint32_t current = 0;
+    bool hit = false;
+    while (true)
+    {
+        STAT_INC(BVHNodeVisits);
+        const BVHNode &node = nodes[current];
+        // The margin keeps the boxes of shapes hit at exactly maxT, like a
+        // light on a wall, from being culled by rounding
+        if (intersectBox(node, origin, invDir, (float)ray.minT, (float)ray.maxT * BoxMargin))
+        {
+            if (node.count == 0)
+            {
+                // Visit the child on the side the ray comes from first
+                bool secondFirst = dirIsNeg[node.axis];
+                stack[stackSize++] = node.offset + (secondFirst ? 0 : 1);
+                current = node.offset + (secondFirst ? 1 : 0);
+                continue;
+            }
+
+            for (uint32_t i = 0; i < node.count; i++)
+            {
+                if (test(primitiveIndices[node.offset + i]))
+                {
+                    hit = true;
+                    if (anyHit)
+                        return true;
+                }
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+    return hit;
+}
+
+#endif // BVH_H
@@ -0,0 +1,204 @@
+#include "denoiser.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "parallel.h"
+
+// B3-spline kernel of the a-trous transform
+static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// Taps whose edge-stopping weight is below exp(-MaxExponent) are skipped
+static const float MaxExponent = 12.0f;
+
+// Tolerance on the light coverage difference. Light sources are much
+// brighter than their surroundings, so their edges must never be blurred.
+static const double EmissiveSigma = 0.02;
+
+// Albedo below this value is considered black and not demodulated
+static const double MinAlbedo = 1e-3;
+
+static double demodulate(double value, double albedo)
+{
+    return albedo > MinAlbedo ? value / albedo : value;
+}
+
+static double remodulate(double value, double albedo)
+{
+    return albedo > MinAlbedo ? value * albedo : value;
+}
+
+// Compresses HDR values so that fireflies do not dominate color distances
+static double toneMap(double c)
+{
+    c = std::max(0.0, c);
+    return std::log1p(c);
+}
+
+static Vector3D toneMap(const Vector3D &c)
+{
+    return Vector3D(toneMap(c.x), toneMap(c.y), toneMap(c.z));
+}
+
+Denoiser::Denoiser(int iterations_, double colorSigma_, double normalSigma_,
+                   double depthSigma_, double albedoSigma_) :
+    iterations(iterations_), colorSigma(colorSigma_), normalSigma(normalSigma_),
+    depthSigma(depthSigma_), albedoSigma(albedoSigma_)
+{ }
+
+void Denoiser::denoise(const Film &input, Film &output) const
+{
+    size_t width = input.getWidth();
+    size_t height = input.getHeight();
+
+    // Filter the illumination only, so that textures are not blurred.
+    // The guides are copied to a flat array for cache-friendly access
+    std::vector<Vector3D> current(width * height);
+    std::vector<Vector3D> next(width * height);
+    std::vector<PixelFeatures> guides(width * height);
+    for (size_t h = 0; h < height; h++)
+    {
+        for (size_t w = 0; w < width; w++)
+        {
+            Vector3D c = input.getPixelValue(w, h);
+            PixelFeatures &f = guides[h * width + w];
+            f = input.getPixelFeatures(w, h);
+            // Averaging the samples shortens the normals of edge pixels
+            if (f.depth > 0.0 && f.normal.lengthSq() > 0.0)
+                f.normal = f.normal.normalized();
+            const Vector3D &a = f.albedo;
+            current[h * width + w] = Vector3D(demodulate(c.x, a.x), demodulate(c.y, a.y),
+                                              demodulate(c.z, a.z));
+        }
+    }
+
+    // The color tolerance follows the noise level of the input
+    double sigma = colorSigma * estimateNoise(current, guides, width, height);
+    for (int i = 0; i < iterations; i++)
+    {
+        filterPass(current, next, guides, (int)width, (int)height, 1 << i, sigma);
+        std::swap(current, next);
+        sigma *= 0.5;
+    }
+
+    for (size_t h = 0; h < height; h++)
+    {
+        for (size_t w = 0; w < width; w++)
+        {
+            const Vector3D &c = current[h * width + w];
+            const Vector3D &a = guides[h * width + w].albedo;
+            Vector3D value(remodulate(c.x, a.x), remodulate(c.y, a.y), remodulate(c.z, a.z));
+            output.setPixelValue(w, h, value);
+        }
+    }
+}
+
+double Denoiser::estimateNoise(const std::vector<Vector3D> &color,
+                               const std::vector<PixelFeatures> &guides,
+                               size_t width, size_t height) const
+{
+    // Median absolute difference between horizontal neighbours that lie on
+    // the same kind of surface; the median ignores the remaining edges
+    std::vector<double> differences;
+    differences.reserve(width * height);
+    for (size_t h = 0; h < height; h++)
+    {
+        for (size_t w = 0; w + 1 < width; w++)
+        {
+            size_t p = h * width + w;
+            if (guides[p].depth <= 0.0 || guides[p + 1].depth <= 0.0 ||
+                guides[p].emissive > 0.0 || guides[p + 1].emissive > 0.0)
+                continue;
+
+            Vector3D tp = toneMap(color[p]);
+            Vector3D tq = toneMap(color[p + 1]);
+            differences.push_back(std::abs((tp.x + tp.y + tp.z) - (tq.x + tq.y + tq.z)) / 3.0);
+        }
+    }
+    if (differences.empty())
+        return 1.0;
+
+    std::nth_element(differences.begin(), differences.begin() + differences.size() / 2,
+                     differences.end());
+
+    // Standard deviation of gaussian noise from the median absolute
+    // difference of two independent pixels
+    return std::max(1e-4, 1.4826 * differences[differences.size() / 2] / std::sqrt(2.0));
+}
+
+void Denoiser::filterPass(const std::vector<Vector3D> &in, std::vector<Vector3D> &out,
+                          const std::vector<PixelFeatures> &guides, int width, int height,
+                          int step, double sigma) const
+{
+    // Tone-mapped colors, compared by the color edge-stopping function
+    std::vector<Vector3D> toneMapped(in.size());
+    for (size_t i = 0; i < in.size(); i++)
+        toneMapped[i] = toneMap(in[i]);
+
+    const float invColor = (float)(1.0 / (sigma * sigma));
+    const float invNormal = (float)(1.0 / normalSigma);
+    const float invAlbedo = (float)(1.0 / (albedoSigma * albedoSigma));
+    const float invEmissive = (float)(1.0 / (EmissiveSigma * EmissiveSigma));
+
+    parallelFor(height, [&](size_t row, int thread)
+    {
+        const int y = (int)row;
+        for (int x = 0; x < width; x++)
+        {
+            const Vector3D &tp = toneMapped[y * width + x];
+            const PixelFeatures &fp = guides[y * width + x];
+            const float depthScale = (float)(1.0 / (depthSigma * step * std::max(fp.depth, 1e-4)));
+
+            // Accumulated per component: this loop runs 25 times per pixel
+            // and iteration, so it avoids the out-of-line Vector3D operators
+            float sumX = 0.0f, sumY = 0.0f, sumZ = 0.0f;
+            float weightSum = 0.0f;
+            for (int j = -2; j <= 2; j++)
+            {
+                const int qy = y + j * step;
+                if (qy < 0 || qy >= height)
+                    continue;
+
+                for (int i = -2; i <= 2; i++)
+                {
+                    const int qx = x + i * step;
+                    if (qx < 0 || qx >= width)
+                        continue;
+
+                    const int q = qy * width + qx;
+                    const PixelFeatures &fq = guides[q];
+
+                    // All the edge-stopping functions share a single exponential
+                    const Vector3D &tq = toneMapped[q];
+                    float dcx = tq.x - tp.x, dcy = tq.y - tp.y, dcz = tq.z - tp.z;
+                    float dax = fq.albedo.x - fp.albedo.x, day = fq.albedo.y - fp.albedo.y,
+                           daz = fq.albedo.z - fp.albedo.z;
+                    float exponent = (dcx * dcx + dcy * dcy + dcz * dcz) * invColor
+                                    + (dax * dax + day * day + daz * daz) * invAlbedo
+                                    + (float)std::abs(fq.depth - fp.depth) * depthScale
+                                    + (float)((fq.emissive - fp.emissive) * (fq.emissive - fp.emissive)) * invEmissive;
+                    if (fp.depth > 0.0 && fq.depth > 0.0)
+                    {
+                        float cosine = fp.normal.x * fq.normal.x + fp.normal.y * fq.normal.y
+                                      + fp.normal.z * fq.normal.z;
+                        exponent += std::max(0.0f, 1.0f - cosine) * invNormal;
+                    }
+
+                    // Taps this dissimilar have no visible contribution
+                    if (exponent > MaxExponent)
+                        continue;
+
+                    float weight = kernel[i + 2] * kernel[j + 2] * std::exp(-exponent);
+                    const Vector3D &cq = in[q];
+                    sumX += cq.x * weight;
+                    sumY += cq.y * weight;
+                    sumZ += cq.z * weight;
+                    weightSum += weight;
+                }
+            }
+
+            // The center tap always has a positive weight
+            out[y * width + x] = Vector3D(sumX / weightSum, sumY / weightSum, sumZ / weightSum);
+        }
+    });
+}
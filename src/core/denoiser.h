@@ -0,0 +1,44 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <vector>
+
+#include "film.h"
+
+// Edge-aware a-trous wavelet denoiser (Dammertz et al. 2010).
+//
+// The radiance of the film is divided by the albedo guide, filtered with
+// a 5x5 B3-spline kernel whose taps are spread 2^i pixels apart at
+// iteration i, and multiplied back by the albedo. Every tap is weighted
+// by how similar the color, normal, depth and albedo of its pixel are to
+// those of the filtered pixel, so that geometric and texture edges stop
+// the blur. The guides are the pixel features accumulated by raytrace();
+// the color tolerance adapts to the noise level measured on the input.
+class Denoiser
+{
+public:
+    Denoiser(int iterations_ = 5, double colorSigma_ = 8.0, double normalSigma_ = 0.02,
+             double depthSigma_ = 0.05, double albedoSigma_ = 0.1);
+
+    // Writes the filtered radiance of input into output (same size)
+    void denoise(const Film &input, Film &output) const;
+
+private:
+    // Robust estimate of the standard deviation of the (tone-mapped) noise
+    double estimateNoise(const std::vector<Vector3D> &color, const std::vector<PixelFeatures> &guides,
+                         size_t width, size_t height) const;
+
+    // One a-trous pass with taps 'step' pixels apart
+    void filterPass(const std::vector<Vector3D> &in, std::vector<Vector3D> &out,
+                    const std::vector<PixelFeatures> &guides, int width, int height,
+                    int step, double sigma) const;
+
+    int iterations;
+    double colorSigma;  // Tolerance on the demodulated color, in multiples of the estimated noise
+                        // level; halved at every iteration
+    double normalSigma; // Tolerance on 1 - dot(n_p, n_q)
+    double depthSigma;  // Tolerance on the relative depth difference, per pixel of tap distance
+    double albedoSigma; // Tolerance on the albedo difference
+};
+
+#endif // DENOISER_H
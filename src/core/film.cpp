@@ -1,9 +1,15 @@
 #include "film.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <string>
 #include <vector>
 
+#include "utils.h"
+
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
 
@@ -19,9 +25,23 @@ Film::Film(size_t width_, size_t height_)
 
     // Allocate memory for the image matrix
     data = new Vector3D*[height];
+    weights = new double*[height];
+    features = new PixelFeatures*[height];
+    sampleCounts = new int*[height];
+    luminanceM2 = new double*[height];
+    shapeIdWeight = new double*[height];
+    costs = new double*[height];
+    splats = new std::atomic<float>*[height];
     for( size_t i=0; i<height; i++)
     {
         data[i] = new Vector3D[width];
+        weights[i] = new double[width];
+        features[i] = new PixelFeatures[width];
+        sampleCounts[i] = new int[width];
+        luminanceM2[i] = new double[width];
+        shapeIdWeight[i] = new double[width];
+        costs[i] = new double[width];
+        splats[i] = new std::atomic<float>[3 * width];
     }
 
     // Set all values to zero
@@ -34,8 +54,22 @@ Film::~Film()
     for( size_t i=0; i<height; i++)
     {
         delete [] data[i];
+        delete [] weights[i];
+        delete [] features[i];
+        delete [] sampleCounts[i];
+        delete [] luminanceM2[i];
+        delete [] shapeIdWeight[i];
+        delete [] costs[i];
+        delete [] splats[i];
     }
     delete [] data;
+    delete [] weights;
+    delete [] features;
+    delete [] sampleCounts;
+    delete [] luminanceM2;
+    delete [] shapeIdWeight;
+    delete [] costs;
+    delete [] splats;
 }
 
 size_t Film::getWidth() const
@@ -53,9 +87,121 @@ Vector3D Film::getPixelValue(size_t w, size_t h) const
     return data[h][w];
 }
 
+double Film::getPixelWeight(size_t w, size_t h) const
+{
+    return weights[h][w];
+}
+
+const PixelFeatures& Film::getPixelFeatures(size_t w, size_t h) const
+{
+    return features[h][w];
+}
+
+int Film::getPixelSampleCount(size_t w, size_t h) const
+{
+    return sampleCounts[h][w];
+}
+
+double Film::getPixelVariance(size_t w, size_t h) const
+{
+    return weights[h][w] > 0.0 ? luminanceM2[h][w] / weights[h][w] : 0.0;
+}
+
+double Film::getPixelCost(size_t w, size_t h) const
+{
+    return costs[h][w];
+}
+
 void Film::setPixelValue(size_t w, size_t h, Vector3D &value)
 {
     data[h][w] = value;
+    weights[h][w] = 1.0;
+}
+
+void Film::addSample(size_t w, size_t h, const Vector3D &value, double weight)
+{
+    if (weight == 0.0)
+        return;
+
+    // Incremental weighted mean
+    Vector3D previousMean = data[h][w];
+    weights[h][w] += weight;
+    data[h][w] += (value - data[h][w]) * (weight / weights[h][w]);
+
+    accumulateStatistics(w, h, value, previousMean, weight);
+}
+
+void Film::addSample(size_t w, size_t h, const Vector3D &value,
+                     const PixelFeatures &sampleFeatures, double weight)
+{
+    if (weight == 0.0)
+        return;
+
+    Vector3D previousMean = data[h][w];
+    weights[h][w] += weight;
+    double t = weight / weights[h][w];
+    data[h][w] += (value - data[h][w]) * t;
+
+    accumulateStatistics(w, h, value, previousMean, weight);
+
+    PixelFeatures &f = features[h][w];
+    f.albedo += (sampleFeatures.albedo - f.albedo) * t;
+    f.normal += (sampleFeatures.normal - f.normal) * t;
+    f.depth += (sampleFeatures.depth - f.depth) * t;
+    f.emissive += (sampleFeatures.emissive - f.emissive) * t;
+
+    if (weight > shapeIdWeight[h][w])
+    {
+        f.shapeId = sampleFeatures.shapeId;
+        shapeIdWeight[h][w] = weight;
+    }
+}
+
+void Film::addCost(size_t w, size_t h, double cost)
+{
+    costs[h][w] += cost;
+}
+
+void Film::addSplat(double x, double y, const Vector3D &value)
+{
+    if (!(x >= 0.0 && y >= 0.0 && x < width && y < height))
+        return;
+
+    // Relaxed: the adds only need to be atomic, raytrace() joins the
+    // threads before the splats are read
+    std::atomic<float> *pixel = &splats[(size_t)y][3 * (size_t)x];
+    pixel[0].fetch_add((float)value.x, std::memory_order_relaxed);
+    pixel[1].fetch_add((float)value.y, std::memory_order_relaxed);
+    pixel[2].fetch_add((float)value.z, std::memory_order_relaxed);
+}
+
+void Film::mergeSplats(double scale)
+{
+    for (size_t h = 0; h < height; h++)
+    {
+        for (size_t w = 0; w < width; w++)
+        {
+            std::atomic<float> *pixel = &splats[h][3 * w];
+            data[h][w] += Vector3D(pixel[0].exchange(0.0f, std::memory_order_relaxed),
+                                   pixel[1].exchange(0.0f, std::memory_order_relaxed),
+                                   pixel[2].exchange(0.0f, std::memory_order_relaxed)) * scale;
+        }
+    }
+}
+
+static double luminance(const Vector3D &c)
+{
+    return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+void Film::accumulateStatistics(size_t w, size_t h, const Vector3D &value,
+                                const Vector3D &previousMean, double weight)
+{
+    sampleCounts[h][w]++;
+
+    // Weighted Welford update; the luminance of the mean is the mean of the luminances
+    double y = luminance(value);
+    luminanceM2[h][w] += weight * (y - luminance(previousMean)) * (y - luminance(data[h][w]));
 }
 
 void Film::clearData()
@@ -66,21 +212,71 @@ void Film::clearData()
     {
         for(size_t w=0; w<width; w++)
         {
-            setPixelValue(w, h, zero);
+            data[h][w] = zero;
+            weights[h][w] = 0.0;
+            features[h][w] = PixelFeatures();
+            sampleCounts[h][w] = 0;
+            luminanceM2[h][w] = 0.0;
+            shapeIdWeight[h][w] = 0.0;
+            costs[h][w] = 0.0;
+            for (int c = 0; c < 3; c++)
+                splats[h][3 * w + c].store(0.0f, std::memory_order_relaxed);
         }
     }
 }
 
-int Film::save()
+double Film::computeRMSE(const Film &reference) const
 {
-    return BitMap::save(data, width, height);
+    double sumSq = 0.0;
+    for(size_t h=0; h<height; h++)
+    {
+        for(size_t w=0; w<width; w++)
+        {
+            Vector3D diff = data[h][w] - reference.getPixelValue(w, h);
+            sumSq += diff.lengthSq() / 3.0;
+        }
+    }
+    return std::sqrt(sumSq / (double)(width * height));
 }
 
+int Film::save(const char* fname)
+{
+    return BitMap::save(data, width, height, fname);
+}
 
-int Film::saveEXR()
+int Film::saveHeatmap(const char* fname)
 {
-    const char* fname = "output.exr";
+    // Percentiles rather than the extremes, so that a few outliers do not
+    // squeeze every other pixel into one end of the scale
+    std::vector<double> sorted;
+    sorted.reserve(width * height);
+    for (size_t h = 0; h < height; h++)
+        sorted.insert(sorted.end(), costs[h], costs[h] + width);
+    std::sort(sorted.begin(), sorted.end());
+    double low = sorted[(size_t)(0.01 * (sorted.size() - 1))];
+    double high = sorted[(size_t)(0.99 * (sorted.size() - 1))];
+    double scale = high > low ? 1.0 / (high - low) : 0.0;
+
+    Vector3D** colors = new Vector3D*[height];
+    for (size_t h = 0; h < height; h++)
+    {
+        colors[h] = new Vector3D[width];
+        for (size_t w = 0; w < width; w++)
+            colors[h][w] = Utils::scalarToRGB(std::clamp((costs[h][w] - low) * scale, 0.0, 1.0));
+    }
+
+    std::cout << "Heatmap scale: blue = " << low << ", red = " << high << std::endl;
+    int ret = BitMap::save(colors, width, height, fname);
 
+    for (size_t h = 0; h < height; h++)
+        delete [] colors[h];
+    delete [] colors;
+    return ret;
+}
+
+
+int Film::saveEXR(const char* fname)
+{
     unsigned int N_COMPONENTS = 3;
 
     ImageBufferEXR buffer;
@@ -127,3 +323,79 @@ int Film::saveEXR()
 
 }
 
+int Film::saveEXRWithAOVs(const char* fname)
+{
+    // One float channel per value, stored with the same row order as saveEXR()
+    struct Channel
+    {
+        std::string name;
+        std::vector<float> values;
+    };
+    std::vector<Channel> channels;
+    auto addChannel = [&](const char* name, const std::function<float(size_t, size_t)> &value)
+    {
+        Channel channel;
+        channel.name = name;
+        channel.values.resize(width * height);
+        for (size_t j = 0; j < height; j++)
+            for (size_t i = 0; i < width; i++)
+                channel.values[j * width + i] = value(i, height - j - 1);
+        channels.push_back(std::move(channel));
+    };
+
+    addChannel("R", [&](size_t w, size_t h) { return data[h][w].x; });
+    addChannel("G", [&](size_t w, size_t h) { return data[h][w].y; });
+    addChannel("B", [&](size_t w, size_t h) { return data[h][w].z; });
+    addChannel("Z", [&](size_t w, size_t h) { return (float)features[h][w].depth; });
+    addChannel("N.X", [&](size_t w, size_t h) { return features[h][w].normal.x; });
+    addChannel("N.Y", [&](size_t w, size_t h) { return features[h][w].normal.y; });
+    addChannel("N.Z", [&](size_t w, size_t h) { return features[h][w].normal.z; });
+    addChannel("albedo.R", [&](size_t w, size_t h) { return features[h][w].albedo.x; });
+    addChannel("albedo.G", [&](size_t w, size_t h) { return features[h][w].albedo.y; });
+    addChannel("albedo.B", [&](size_t w, size_t h) { return features[h][w].albedo.z; });
+    addChannel("shapeId", [&](size_t w, size_t h) { return (float)features[h][w].shapeId; });
+    addChannel("sampleCount", [&](size_t w, size_t h) { return (float)sampleCounts[h][w]; });
+    addChannel("variance", [&](size_t w, size_t h) { return (float)getPixelVariance(w, h); });
+    addChannel("cost", [&](size_t w, size_t h) { return (float)costs[h][w]; });
+
+    // Readers expect the channels sorted by name
+    std::sort(channels.begin(), channels.end(),
+              [](const Channel &a, const Channel &b) { return a.name < b.name; });
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+    EXRImage image;
+    InitEXRImage(&image);
+
+    std::vector<unsigned char*> images(channels.size());
+    std::vector<EXRChannelInfo> channelInfos(channels.size());
+    std::vector<int> pixelTypes(channels.size(), TINYEXR_PIXELTYPE_FLOAT);
+    for (size_t c = 0; c < channels.size(); c++)
+    {
+        images[c] = reinterpret_cast<unsigned char*>(channels[c].values.data());
+        memset(&channelInfos[c], 0, sizeof(EXRChannelInfo));
+        strncpy(channelInfos[c].name, channels[c].name.c_str(), 255);
+    }
+
+    image.images = images.data();
+    image.num_channels = (int)channels.size();
+    image.width = (int)width;
+    image.height = (int)height;
+
+    header.num_channels = (int)channels.size();
+    header.channels = channelInfos.data();
+    header.pixel_types = pixelTypes.data();
+    header.requested_pixel_types = pixelTypes.data();
+
+    const char* err = nullptr;
+    int ret = SaveEXRImageToFile(&image, &header, fname, &err);
+    if (ret != TINYEXR_SUCCESS)
+    {
+        std::cout << "Error storing EXR file :( --> " << (err ? err : "") << std::endl;
+        FreeEXRErrorMessage(err);
+        return 0;
+    }
+
+    printf("EXR with %d channels stored correctly :) \n", (int)channels.size());
+    return 1;
+}
@@ -4,6 +4,7 @@
 #include "vector3d.h"
 #include "bitmap.h"
 
+#include <atomic>
 #include <iostream>
 
 
@@ -28,6 +29,21 @@ struct ImageBufferEXR
     void destroy();
 };
 
+// First-hit features of a sample, used as guides by the denoiser and
+// written as arbitrary output variables (AOVs) next to the radiance
+struct PixelFeatures
+{
+    Vector3D albedo; // Diffuse reflectance (1 on light sources, 0 on the background)
+    Vector3D normal; // World-space normal (0 on the background)
+    double depth;    // Distance along the camera ray (0 on the background)
+    double emissive; // 1 on light sources; its pixel mean is the coverage of the lights
+    int shapeId;     // Id of the shape hit, or of its instance for shared geometry
+                     // (0 on the background). Not averaged: a pixel keeps the id
+                     // of its sample with the largest weight
+
+    PixelFeatures() : depth(0.0), emissive(0.0), shapeId(0) { }
+};
+
 /**
  * @brief The Film class
  */
@@ -46,14 +62,47 @@ public:
     size_t getHeight() const;
     Vector3D getPixelValue(size_t w, size_t h) const;
 
+    double getPixelWeight(size_t w, size_t h) const;
+    const PixelFeatures& getPixelFeatures(size_t w, size_t h) const;
+    int getPixelSampleCount(size_t w, size_t h) const;
+    // Weighted variance of the luminance of the samples of pixel (w, h)
+    double getPixelVariance(size_t w, size_t h) const;
+    double getPixelCost(size_t w, size_t h) const;
+
     // Setters
     void setPixelValue(size_t w, size_t h, Vector3D &value);
 
+    // Accumulates a filter-weighted sample into pixel (w, h). The pixel
+    // value is kept as the weighted mean of all the samples added so far.
+    void addSample(size_t w, size_t h, const Vector3D &value, double weight);
+    // Same as above, also accumulating the features of the sample
+    void addSample(size_t w, size_t h, const Vector3D &value,
+                   const PixelFeatures &features, double weight);
+
+    // Adds to the render cost of pixel (w, h), in any unit (heatmap mode)
+    void addCost(size_t w, size_t h, double cost);
+
+    // Adds light to the pixel at raster position (x, y), in pixels, from
+    // any thread (lock-free). Used by integrators that trace from the
+    // light sources and may reach any pixel; splats are kept apart from
+    // the samples until mergeSplats()
+    void addSplat(double x, double y, const Vector3D &value);
+    // Adds the splatted light, times scale, to the pixel values
+    void mergeSplats(double scale);
+
     // Other functions
-    int save();
-    int saveEXR();
+    int save(const char* fname = "./output.bmp");
+    int saveEXR(const char* fname = "output.exr");
+    // False-color BMP of the pixel costs, scaled so that the 1st
+    // percentile (and below) is blue and the 99th (and above) is red
+    int saveHeatmap(const char* fname = "./output_heatmap.bmp");
+    // Radiance and every AOV as named channels of a single EXR
+    int saveEXRWithAOVs(const char* fname = "output.exr");
     void clearData();
 
+    // Root mean squared error against a reference image of the same size
+    double computeRMSE(const Film &reference) const;
+
 private:
     // Image size
     size_t width;
@@ -61,6 +110,27 @@ private:
 
     // Pointer to image data
     Vector3D **data;
+
+    // Sum of the reconstruction filter weights of every pixel
+    double **weights;
+
+    // Filter-weighted mean of the features of the samples of every pixel
+    PixelFeatures **features;
+
+    // Per-pixel sample statistics
+    int **sampleCounts;
+    double **luminanceM2;   // Weighted sum of squared luminance deviations (Welford)
+    double **shapeIdWeight; // Weight of the sample that set features.shapeId
+
+    // Per-pixel render cost, recorded by the heatmap mode of the renderer
+    double **costs;
+
+    // Light splatted by addSplat(), not yet in data: RGB triplets of
+    // atomic floats, so that any number of threads can add to any pixel
+    std::atomic<float> **splats;
+
+    void accumulateStatistics(size_t w, size_t h, const Vector3D &value,
+                              const Vector3D &previousMean, double weight);
 };
 
 #endif // FILM_H
@@ -0,0 +1,121 @@
+#include "filter.h"
+
+#include <algorithm>
+#define _USE_MATH_DEFINES
+#include <cmath>
+
+// Resolution of the tabulated 1D sampling distribution
+static const int FilterTableSize = 64;
+
+Filter::Filter(double radius_) : radius(radius_)
+{ }
+
+Filter* Filter::create(FilterType type)
+{
+    Filter* filter;
+    switch (type)
+    {
+    case FilterType::Tent:
+        filter = new TentFilter();
+        break;
+    case FilterType::Gaussian:
+        filter = new GaussianFilter();
+        break;
+    case FilterType::BlackmanHarris:
+        filter = new BlackmanHarrisFilter();
+        break;
+    case FilterType::Box:
+    default:
+        filter = new BoxFilter();
+        break;
+    }
+    filter->buildSamplingTable();
+    return filter;
+}
+
+double Filter::evaluate(double dx, double dy) const
+{
+    return evaluate1D(dx) * evaluate1D(dy);
+}
+
+void Filter::buildSamplingTable()
+{
+    cdf.assign(FilterTableSize + 1, 0.0);
+    double binWidth = 2.0 * radius / FilterTableSize;
+    for (int i = 0; i < FilterTableSize; i++)
+    {
+        double center = -radius + (i + 0.5) * binWidth;
+        cdf[i + 1] = cdf[i] + std::abs(evaluate1D(center));
+    }
+}
+
+double Filter::sample1D(double u, double &d) const
+{
+    // Find the bin containing u and sample it uniformly
+    double target = u * cdf[FilterTableSize];
+    int bin = (int)(std::upper_bound(cdf.begin(), cdf.end(), target) - cdf.begin()) - 1;
+    bin = std::clamp(bin, 0, FilterTableSize - 1);
+
+    double binMass = cdf[bin + 1] - cdf[bin];
+    double t = binMass > 0.0 ? (target - cdf[bin]) / binMass : 0.5;
+    double binWidth = 2.0 * radius / FilterTableSize;
+    d = -radius + (bin + t) * binWidth;
+
+    // f(d) / pdf(d), up to a constant factor that cancels out in the film
+    double pdf = binMass / (cdf[FilterTableSize] * binWidth);
+    return pdf > 0.0 ? evaluate1D(d) / pdf : 0.0;
+}
+
+double Filter::sample(double u, double v, double &dx, double &dy) const
+{
+    double wx = sample1D(u, dx);
+    double wy = sample1D(v, dy);
+    return wx * wy;
+}
+
+
+BoxFilter::BoxFilter(double radius_) : Filter(radius_)
+{ }
+
+double BoxFilter::evaluate1D(double d) const
+{
+    return std::abs(d) <= radius ? 1.0 : 0.0;
+}
+
+
+TentFilter::TentFilter(double radius_) : Filter(radius_)
+{ }
+
+double TentFilter::evaluate1D(double d) const
+{
+    return std::max(0.0, radius - std::abs(d));
+}
+
+
+GaussianFilter::GaussianFilter(double radius_, double sigma_) :
+    Filter(radius_), sigma(sigma_)
+{
+    edgeValue = std::exp(-(radius * radius) / (2.0 * sigma * sigma));
+}
+
+double GaussianFilter::evaluate1D(double d) const
+{
+    return std::max(0.0, std::exp(-(d * d) / (2.0 * sigma * sigma)) - edgeValue);
+}
+
+
+BlackmanHarrisFilter::BlackmanHarrisFilter(double radius_) : Filter(radius_)
+{ }
+
+double BlackmanHarrisFilter::evaluate1D(double d) const
+{
+    if (std::abs(d) > radius)
+        return 0.0;
+
+    // 4-term Blackman-Harris window, mapped from [-radius, radius] to [0, 1]
+    const double a0 = 0.35875, a1 = 0.48829, a2 = 0.14128, a3 = 0.01168;
+    double t = 0.5 + d / (2.0 * radius);
+    return a0 - a1 * std::cos(2.0 * M_PI * t)
+              + a2 * std::cos(4.0 * M_PI * t)
+              - a3 * std::cos(6.0 * M_PI * t);
+}
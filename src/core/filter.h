@@ -0,0 +1,85 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <vector>
+
+// Pixel reconstruction filters
+enum class FilterType
+{
+    Box,           // radius 0.5: plain average of the jittered samples
+    Tent,          // radius 1.0: bilinear falloff
+    Gaussian,      // radius 1.5, sigma 0.5
+    BlackmanHarris // radius 2.0
+};
+
+// A separable reconstruction filter centered at the pixel center.
+// Offsets are expressed in pixels.
+//
+// Sample offsets are importance sampled from the filter itself, so that
+// wide filters do not waste samples on their low-weight tails; the weight
+// returned with each offset is the ratio between the filter and the pdf.
+class Filter
+{
+public:
+    Filter() = delete;
+    Filter(double radius_);
+    virtual ~Filter() {}
+
+    static Filter* create(FilterType type);
+
+    // 1D profile of the filter; the 2D filter is profile(dx) * profile(dy)
+    virtual double evaluate1D(double d) const = 0;
+    double evaluate(double dx, double dy) const;
+
+    // Maps (u, v) in [0,1)^2 to a sample offset distributed like the
+    // filter and returns the weight of that sample
+    double sample(double u, double v, double &dx, double &dy) const;
+
+    double getRadius() const { return radius; }
+
+protected:
+    // Half-width of the support of the filter
+    double radius;
+
+private:
+    // Tabulated CDF of |evaluate1D| over [-radius, radius], built by create()
+    void buildSamplingTable();
+    double sample1D(double u, double &d) const;
+
+    std::vector<double> cdf;
+};
+
+class BoxFilter : public Filter
+{
+public:
+    BoxFilter(double radius_ = 0.5);
+    double evaluate1D(double d) const;
+};
+
+class TentFilter : public Filter
+{
+public:
+    TentFilter(double radius_ = 1.0);
+    double evaluate1D(double d) const;
+};
+
+class GaussianFilter : public Filter
+{
+public:
+    GaussianFilter(double radius_ = 1.5, double sigma_ = 0.5);
+    double evaluate1D(double d) const;
+
+private:
+    double sigma;
+    // Value at the border, subtracted so that the filter reaches zero
+    double edgeValue;
+};
+
+class BlackmanHarrisFilter : public Filter
+{
+public:
+    BlackmanHarrisFilter(double radius_ = 2.0);
+    double evaluate1D(double d) const;
+};
+
+#endif // FILTER_H
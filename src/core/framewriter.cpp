@@ -0,0 +1,55 @@
+#include "framewriter.h"
+
+#include <cstdio>
+#include <filesystem>
+
+FrameWriter::FrameWriter(const std::string &prefix_, int formats_)
+    : prefix(prefix_), formats(formats_)
+{
+    std::filesystem::path directory = std::filesystem::path(prefix).parent_path();
+    std::error_code error;
+    if (!directory.empty())
+        std::filesystem::create_directories(directory, error);
+}
+
+FrameWriter::~FrameWriter()
+{
+    finish();
+}
+
+void FrameWriter::write(const Film &film, int frame)
+{
+    finish();
+
+    if (!buffer || buffer->getWidth() != film.getWidth() || buffer->getHeight() != film.getHeight())
+        buffer = std::make_unique<Film>(film.getWidth(), film.getHeight());
+    for (size_t h = 0; h < film.getHeight(); h++)
+    {
+        for (size_t w = 0; w < film.getWidth(); w++)
+        {
+            Vector3D value = film.getPixelValue(w, h);
+            buffer->setPixelValue(w, h, value);
+        }
+    }
+
+    writer = std::thread([this, frame]()
+    {
+        if (formats & FrameBMP)
+            buffer->save(frameName(prefix, frame, ".bmp").c_str());
+        if (formats & FrameEXR)
+            buffer->saveEXR(frameName(prefix, frame, ".exr").c_str());
+    });
+}
+
+void FrameWriter::finish()
+{
+    if (writer.joinable())
+        writer.join();
+}
+
+std::string FrameWriter::frameName(const std::string &prefix, int frame, const char *extension)
+{
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    return prefix + number + extension;
+}
@@ -0,0 +1,45 @@
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "film.h"
+
+// Files written for every frame, combinable
+enum FrameFormat
+{
+    FrameBMP = 1,
+    FrameEXR = 2
+};
+
+// Writes the frames of a sequence as numbered images (prefix_0000.bmp,
+// prefix_0000.exr...) on a thread of its own, so that the next frame
+// renders while the last one is being encoded. The radiance of a frame is
+// copied before write() returns, and a single frame is written at a time:
+// write() first waits for the previous one
+class FrameWriter
+{
+public:
+    // Directories in prefix_ are created if needed
+    FrameWriter(const std::string &prefix_, int formats_ = FrameBMP | FrameEXR);
+    // Waits for the last frame
+    ~FrameWriter();
+
+    void write(const Film &film, int frame);
+    // Waits until every frame given is written
+    void finish();
+
+    // Name of a frame, e.g. "frames/shot_0042.exr" for frame 42 of prefix
+    // "frames/shot" and extension ".exr"
+    static std::string frameName(const std::string &prefix, int frame, const char *extension);
+
+private:
+    std::string prefix;
+    int formats;
+    std::unique_ptr<Film> buffer; // Frame being written, sized on the first write
+    std::thread writer;
+};
+
+#endif // FRAMEWRITER_H
@@ -0,0 +1,107 @@
+#include "gbuffer.h"
+
+#include "filter.h"
+#include "parallel.h"
+#include "statistics.h"
+#include "utils.h"
+#include "../cameras/camera.h"
+#include "../shaders/shader.h"
+
+PrimaryHit::PrimaryHit() :
+    x(0.5f), y(0.5f), weight(1.0f), aoFactor(-1.0f), hit(false)
+{
+    its.shape = nullptr;
+}
+
+void PrimaryHit::trace(const Ray &r, const std::vector<Shape*> &objList)
+{
+    hit = Utils::getClosestIntersection(r, objList, its);
+    aoFactor = -1.0f;
+}
+
+PixelFeatures PrimaryHit::getFeatures(const Ray &r) const
+{
+    PixelFeatures features;
+    if (!hit)
+        return features;
+
+    // Specular surfaces and lights keep their full radiance in the
+    // (albedo-demodulated) color the denoiser filters
+    const Material &mat = its.shape->getMaterial();
+    if (mat.hasDiffuseOrGlossy() && !mat.isEmissive())
+        features.albedo = mat.getDiffuseReflectance();
+    else
+        features.albedo = Vector3D(1.0);
+
+    features.normal = its.normal.normalized();
+    features.depth = (its.itsPoint - r.o).length();
+    features.emissive = mat.isEmissive() ? 1.0 : 0.0;
+    features.shapeId = its.shape->getId() != 0 ? its.shape->getId() : its.instanceId;
+    return features;
+}
+
+
+GBuffer::GBuffer(size_t width_, size_t height_, int strata_) :
+    width(width_), height(height_), strata(strata_ < 1 ? 1 : strata_),
+    entries(width_ * height_ * (strata_ < 1 ? 1 : strata_))
+{ }
+
+PrimaryHit& GBuffer::at(size_t w, size_t h, int stratum)
+{
+    return entries[(h * width + w) * strata + stratum];
+}
+
+const PrimaryHit& GBuffer::at(size_t w, size_t h, int stratum) const
+{
+    return entries[(h * width + w) * strata + stratum];
+}
+
+void GBuffer::build(const Camera &cam, const Shader &shader, const Filter *filter,
+                    SamplerType samplerType, const std::vector<Shape*> &objList,
+                    uint64_t seed)
+{
+    // The strata positions are the first samples of the pixel sequence
+    std::vector<Sampler*> samplers(numWorkerThreads());
+    samplers[0] = Sampler::create(samplerType, strata, seed);
+    for (size_t t = 1; t < samplers.size(); t++)
+        samplers[t] = samplers[0]->clone();
+
+    parallelFor(height, [&](size_t lin, int thread)
+    {
+        Sampler* sampler = samplers[thread];
+        Sampler::setActive(sampler);
+
+        for (size_t col = 0; col < width; col++)
+        {
+            for (int s = 0; s < strata; s++)
+            {
+                sampler->startPixelSample(col, lin, s);
+
+                double dx = 0.0, dy = 0.0;
+                double weight = 1.0;
+                if (filter)
+                {
+                    double u, v;
+                    sampler->getPixelSample(u, v);
+                    weight = filter->sample(u, v, dx, dy);
+                }
+
+                PrimaryHit &primary = at(col, lin, s);
+                primary.x = (float)((col + 0.5 + dx) / width);
+                primary.y = (float)((lin + 0.5 + dy) / height);
+                primary.weight = (float)weight;
+
+                Ray cameraRay = cam.generateRay(primary.x, primary.y);
+                STAT_INC(CameraRays);
+                primary.trace(cameraRay, objList);
+
+                // Let the shader cache its own per-hit quantities
+                shader.preparePrimaryHit(cameraRay, primary, objList);
+            }
+        }
+    });
+
+    Sampler::setActive(nullptr);
+    for (Sampler* sampler : samplers)
+        delete sampler;
+}
@@ -0,0 +1,65 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <vector>
+
+#include "film.h"
+#include "intersection.h"
+#include "ray.h"
+#include "sampler.h"
+
+class Shape;
+class Camera;
+class Shader;
+class Filter;
+
+// First hit of a camera ray, shared by all the samples of a pixel (or of
+// a sub-pixel stratum) so that integrators can start their paths from it
+struct PrimaryHit
+{
+    PrimaryHit();
+
+    // Finds the closest hit of the camera ray r
+    void trace(const Ray &r, const std::vector<Shape*> &objList);
+
+    // Denoiser guides of the hit of the camera ray r
+    PixelFeatures getFeatures(const Ray &r) const;
+
+    float x, y;        // Position of the camera sample in NDC
+    float weight;      // Reconstruction filter weight of the sample
+    float aoFactor;    // First-hit ambient occlusion cached by the shader (< 0: not computed)
+    bool hit;          // False when the camera ray escaped the scene
+    Intersection its;  // Closest hit (valid only when hit is true)
+};
+
+// Geometry buffer: the primary hit of every pixel stratum. Building it
+// replaces one primary visibility pass per sample by a single one per
+// stratum; with a pinhole camera all the samples falling in the same
+// stratum follow exactly the same camera ray.
+class GBuffer
+{
+public:
+    GBuffer() = delete;
+    GBuffer(size_t width_, size_t height_, int strata_);
+
+    // Traces the camera ray of every stratum. Without a filter there is a
+    // single stratum per pixel, located at the pixel center. seed is that
+    // of the samplers of the render, whose first samples the strata are
+    void build(const Camera &cam, const Shader &shader, const Filter *filter,
+               SamplerType samplerType, const std::vector<Shape*> &objList,
+               uint64_t seed = 0);
+
+    PrimaryHit& at(size_t w, size_t h, int stratum);
+    const PrimaryHit& at(size_t w, size_t h, int stratum) const;
+
+    int getStrata() const { return strata; }
+
+private:
+    size_t width;
+    size_t height;
+    int strata;
+
+    std::vector<PrimaryHit> entries;
+};
+
+#endif // GBUFFER_H
@@ -1,6 +1,7 @@
 #include "hemisphericalsampler.h"
 #include "matrix4x4.h"
 
+#include <algorithm>
 #include <random>
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -19,6 +20,11 @@ Vector3D HemisphericalSampler::getSample(const Vector3D &normal) const
     double psi1 = (double)std::rand() / RAND_MAX;
     double psi2 = (double)std::rand() / RAND_MAX;
 
+    return getSample(normal, psi1, psi2);
+}
+
+Vector3D HemisphericalSampler::getSample(const Vector3D &normal, double psi1, double psi2) const
+{
     // Generate the direction in spherical coordinates (arround (0, 1, 0))
     double theta = std::acos(psi1);
     double phi   = psi2 * 2 * M_PI;
@@ -28,7 +34,21 @@ Vector3D HemisphericalSampler::getSample(const Vector3D &normal) const
                         psi1,
                         sin(phi) * sin(theta));
 
+    return toWorld(normal, randomDir);
+}
 
+Vector3D HemisphericalSampler::getCosineSample(const Vector3D &normal, double psi1, double psi2) const
+{
+    // Uniform point on the unit disk, projected up to the hemisphere (Malley's method)
+    double r = std::sqrt(psi1);
+    double phi = psi2 * 2 * M_PI;
+    Vector3D randomDir(r * cos(phi), std::sqrt(std::max(0.0, 1.0 - psi1)), r * sin(phi));
+
+    return toWorld(normal, randomDir);
+}
+
+Vector3D HemisphericalSampler::toWorld(const Vector3D &normal, const Vector3D &localDir) const
+{
     // Construct the local frame (n = yy local)
     Vector3D yL = normal.normalized();
     Vector3D xL = cross(yL, Vector3D(0.0, 1.0, 0.0));
@@ -50,7 +70,7 @@ Vector3D HemisphericalSampler::getSample(const Vector3D &normal) const
                 0.0,    0.0,    0.0,    1.0);
 
     // Rotate the random direction
-    randomDir = R.transformVector(randomDir);
+    Vector3D randomDir = R.transformVector(localDir);
 
     //Center the hemisphere on the provided normal
     return randomDir.normalized();
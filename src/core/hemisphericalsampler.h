@@ -11,7 +11,15 @@ class HemisphericalSampler
 public:
     HemisphericalSampler();
     Vector3D getSample(const Vector3D &normal) const;
+    // Same mapping, driven by the provided uniform numbers (u1, u2) in [0,1)
+    Vector3D getSample(const Vector3D &normal, double u1, double u2) const;
+    // Cosine-weighted direction around the normal (pdf = cos(theta) / pi)
+    Vector3D getCosineSample(const Vector3D &normal, double u1, double u2) const;
     //Vector3D getSample_OMP(const Vector3D &normal, const double rand_numbers[], int idx, int n_spp) const;
+
+private:
+    // Rotates a direction around (0, 1, 0) to the hemisphere of the normal
+    Vector3D toWorld(const Vector3D &normal, const Vector3D &localDir) const;
 };
 
 #endif // HEMISPHERICALSAMPLER_H
@@ -1,6 +1,6 @@
 #include "intersection.h"
 
-Intersection::Intersection()
+Intersection::Intersection() : instanceId(0)
 {
 
 }
@@ -21,6 +21,10 @@ public:
 
     // Pointer to the shape that the intersection point lies on
     const Shape *shape;
+
+    // Id of the instance whose shared geometry was hit, for shapes that
+    // are not in the scene themselves (0 = none)
+    int instanceId;
 };
 
 #endif // INTERSECTION_H
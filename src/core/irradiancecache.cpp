@@ -0,0 +1,297 @@
+#include "irradiancecache.h"
+
+#include <algorithm>
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstring>
+#include <mutex>
+
+#include "sampler.h"
+#include "statistics.h"
+
+// Depth limit of the octree; nodes this deep hold records of any size
+static const int MaxOctreeDepth = 16;
+
+// Half size of the cube covered by the octree. Records reaching out of it
+// are stored in the root node, which every lookup visits: that still
+// works, only slower
+static const double OctreeExtent = 1024.0;
+
+// Records slightly in front of the query point (relative to their
+// radius) are rejected: they see a different part of the scene
+static const double MaxFrontDistance = 0.05;
+
+// Hash of the bits of a position
+static uint64_t positionHash(const Vector3D &x)
+{
+    uint64_t hash = 0;
+    for (float coordinate : { x.x, x.y, x.z })
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &coordinate, sizeof(bits));
+        hash = (hash ^ bits) * 0x9e3779b97f4a7c15ull;
+    }
+    return hash;
+}
+
+IrradianceCache::IrradianceCache(const IrradianceCacheSettings &settings_) :
+    settings(settings_), rootMin(-OctreeExtent), rootSize(2.0 * OctreeExtent)
+{ }
+
+IrradianceCache::~IrradianceCache()
+{ }
+
+bool IrradianceCache::lookup(const Vector3D &x, const Vector3D &n, Vector3D &irradiance) const
+{
+    STAT_INC(IrradianceCacheLookups);
+
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    double sum[3] = { 0.0, 0.0, 0.0 };
+    double weightSum = 0.0;
+
+    // Records are stored in every node they can influence, so those of the
+    // nodes along the path to the leaf containing x are enough
+    const Node *node = &root;
+    Vector3D nodeMin = rootMin;
+    double nodeSize = rootSize;
+    while (node != nullptr)
+    {
+        for (const Record *record : node->records)
+        {
+            Vector3D d = x - record->position;
+            double error = std::sqrt(d.lengthSq()) / record->radius
+                         + std::sqrt(std::max(0.0, 1.0 - dot(n, record->normal)));
+            if (error >= settings.errorThreshold)
+                continue;
+
+            Vector3D averageNormal = n + record->normal;
+            if (0.5 * dot(d, averageNormal) < -MaxFrontDistance * record->radius)
+                continue;
+
+            // First-order extrapolation of the record to (x, n)
+            double weight = 1.0 / std::max(error, 1e-6);
+            Vector3D rotation = cross(record->normal, n);
+            const float E[3] = { record->irradiance.x, record->irradiance.y, record->irradiance.z };
+            for (int c = 0; c < 3; c++)
+            {
+                sum[c] += weight * (E[c] + dot(rotation, record->rotationalGradient[c])
+                                         + dot(d, record->translationalGradient[c]));
+            }
+            weightSum += weight;
+        }
+
+        nodeSize *= 0.5;
+        int child = 0;
+        if (x.x >= nodeMin.x + nodeSize) { child |= 1; nodeMin.x += nodeSize; }
+        if (x.y >= nodeMin.y + nodeSize) { child |= 2; nodeMin.y += nodeSize; }
+        if (x.z >= nodeMin.z + nodeSize) { child |= 4; nodeMin.z += nodeSize; }
+        node = node->children[child].get();
+    }
+
+    if (weightSum == 0.0)
+        return false;
+
+    STAT_INC(IrradianceCacheHits);
+    irradiance = Vector3D(std::max(0.0, sum[0] / weightSum), std::max(0.0, sum[1] / weightSum),
+                          std::max(0.0, sum[2] / weightSum));
+    return true;
+}
+
+Vector3D IrradianceCache::addRecord(const Vector3D &x, const Vector3D &n, const IncomingRadiance &incoming)
+{
+    STAT_INC(IrradianceRecords);
+
+    const int M = std::max(1, settings.thetaStrata);
+    const int N = std::max(1, (int)std::lround(M_PI * M));
+
+    // Tangent frame (e1, e2, n)
+    Vector3D e1 = std::abs(n.x) > 0.9f ? cross(Vector3D(0, 1, 0), n) : cross(Vector3D(1, 0, 0), n);
+    e1 = e1.normalized();
+    Vector3D e2 = cross(n, e1);
+
+    // The paths estimating the incoming radiance take their random numbers
+    // from their own independent sampler: the pixel sampler would hand the
+    // same numbers to all of them. It is seeded by the pixel sample and the
+    // position of the record, so that renders are reproducible
+    Sampler* pixelSampler = &Sampler::active();
+    IndependentSampler recordSampler(1, pixelSampler->getStreamSeed() ^ positionHash(x));
+    Sampler::setActive(&recordSampler);
+
+    // Cosine-weighted stratified sampling: stratum (j, k) spans
+    // sin^2(theta) in [j/M, (j+1)/M) and phi in [2 pi k/N, 2 pi (k+1)/N)
+    std::vector<Vector3D> L(M * N);
+    std::vector<double> r(M * N);
+    std::vector<double> tanTheta(M * N);
+    for (int j = 0; j < M; j++)
+    {
+        for (int k = 0; k < N; k++)
+        {
+            double u1, u2;
+            recordSampler.get2D(SampleDimension::BSDF, 0, u1, u2);
+            double sin2Theta = (j + u1) / M;
+            double sinTheta = std::sqrt(sin2Theta);
+            double cosTheta = std::sqrt(std::max(0.0, 1.0 - sin2Theta));
+            double phi = 2.0 * M_PI * (k + u2) / N;
+
+            Vector3D wi = e1 * (std::cos(phi) * sinTheta) + e2 * (std::sin(phi) * sinTheta) + n * cosTheta;
+            L[j * N + k] = incoming(wi, r[j * N + k]);
+            tanTheta[j * N + k] = sinTheta / std::max(cosTheta, 1e-3);
+        }
+    }
+    Sampler::setActive(pixelSampler);
+
+    auto record = std::make_unique<Record>();
+    record->position = x;
+    record->normal = n;
+
+    Vector3D irradiance(0.0);
+    double inverseDistanceSum = 0.0;
+    for (int i = 0; i < M * N; i++)
+    {
+        irradiance += L[i];
+        if (std::isfinite(r[i]) && r[i] > 0.0)
+            inverseDistanceSum += 1.0 / r[i];
+    }
+    irradiance *= M_PI / (M * N);
+    record->irradiance = irradiance;
+
+    // Gradients (Ward and Heckbert 1992), per color channel. Moving x
+    // shifts the boundaries between strata by an angle inversely
+    // proportional to the distance of the geometry seen across them
+    double rotational[3][3] = {}, translational[3][3] = {};
+    auto accumulate = [](double gradient[3][3], const Vector3D &direction, double scale, const Vector3D &value)
+    {
+        const double v[3] = { value.x, value.y, value.z };
+        for (int c = 0; c < 3; c++)
+        {
+            gradient[c][0] += direction.x * scale * v[c];
+            gradient[c][1] += direction.y * scale * v[c];
+            gradient[c][2] += direction.z * scale * v[c];
+        }
+    };
+    for (int k = 0; k < N; k++)
+    {
+        double phi = 2.0 * M_PI * (k + 0.5) / N;
+        double phiMin = 2.0 * M_PI * k / N;
+        Vector3D uk = e1 * std::cos(phi) + e2 * std::sin(phi);
+        Vector3D vk = e1 * -std::sin(phi) + e2 * std::cos(phi);
+        Vector3D vkMin = e1 * -std::sin(phiMin) + e2 * std::cos(phiMin);
+        int previousK = (k + N - 1) % N;
+
+        for (int j = 0; j < M; j++)
+        {
+            const Vector3D &Ljk = L[j * N + k];
+
+            // Tilting the normal towards vk weights this direction by tan(theta)
+            accumulate(rotational, vk, M_PI / (M * N) * tanTheta[j * N + k], Ljk);
+
+            // Boundary with the stratum of smaller theta
+            if (j > 0)
+            {
+                double distance = std::min(r[j * N + k], r[(j - 1) * N + k]);
+                if (std::isfinite(distance) && distance > 0.0)
+                {
+                    double sinThetaMin = std::sqrt((double)j / M);
+                    double cos2ThetaMin = 1.0 - (double)j / M;
+                    accumulate(translational, uk, 2.0 * M_PI / N * sinThetaMin * cos2ThetaMin / distance,
+                               Ljk - L[(j - 1) * N + k]);
+                }
+            }
+
+            // Boundary with the stratum of smaller phi
+            double distance = std::min(r[j * N + k], r[j * N + previousK]);
+            if (N > 1 && std::isfinite(distance) && distance > 0.0)
+            {
+                double ringWidth = std::sqrt((double)(j + 1) / M) - std::sqrt((double)j / M);
+                accumulate(translational, vkMin, ringWidth / distance, Ljk - L[j * N + previousK]);
+            }
+        }
+    }
+
+    // Validity radius: harmonic mean distance to the surrounding geometry,
+    // shrunk where the irradiance changes quickly
+    double radius = inverseDistanceSum > 0.0 ? (M * N) / inverseDistanceSum : settings.maxRadius;
+    const double E[3] = { irradiance.x, irradiance.y, irradiance.z };
+    for (int c = 0; c < 3; c++)
+    {
+        double gradientLength = std::sqrt(translational[c][0] * translational[c][0] +
+                                          translational[c][1] * translational[c][1] +
+                                          translational[c][2] * translational[c][2]);
+        if (gradientLength > 0.0 && E[c] > 0.0)
+            radius = std::min(radius, E[c] / gradientLength);
+    }
+    radius = std::clamp(radius, settings.minRadius, settings.maxRadius);
+    record->radius = radius;
+
+    for (int c = 0; c < 3; c++)
+    {
+        // Extrapolation within the radius must not change the sign of E
+        double gradientLength = std::sqrt(translational[c][0] * translational[c][0] +
+                                          translational[c][1] * translational[c][1] +
+                                          translational[c][2] * translational[c][2]);
+        double scale = gradientLength * radius > E[c] && gradientLength > 0.0
+                     ? E[c] / (gradientLength * radius) : 1.0;
+        record->translationalGradient[c] = Vector3D(translational[c][0], translational[c][1],
+                                                    translational[c][2]) * scale;
+        record->rotationalGradient[c] = Vector3D(rotational[c][0], rotational[c][1], rotational[c][2]);
+    }
+
+    // The record influences the points where its error is below the threshold
+    double influence = settings.errorThreshold * radius;
+    Vector3D boundMin = x - Vector3D(influence);
+    Vector3D boundMax = x + Vector3D(influence);
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    Vector3D rootMax = rootMin + Vector3D(rootSize);
+    if (boundMin.x < rootMin.x || boundMin.y < rootMin.y || boundMin.z < rootMin.z ||
+        boundMax.x > rootMax.x || boundMax.y > rootMax.y || boundMax.z > rootMax.z)
+        root.records.push_back(record.get());
+    else
+        insert(root, rootMin, rootSize, 0, record.get(), boundMin, boundMax);
+    records.push_back(std::move(record));
+    return irradiance;
+}
+
+void IrradianceCache::insert(Node &node, const Vector3D &nodeMin, double nodeSize, int depth,
+                             const Record *record, const Vector3D &boundMin, const Vector3D &boundMax)
+{
+    // Stop at the first nodes no larger than the area of influence
+    double extent = boundMax.x - boundMin.x;
+    if (depth == MaxOctreeDepth || nodeSize <= 2.0 * extent)
+    {
+        node.records.push_back(record);
+        return;
+    }
+
+    double half = 0.5 * nodeSize;
+    for (int child = 0; child < 8; child++)
+    {
+        Vector3D childMin(nodeMin.x + ((child & 1) ? half : 0.0),
+                          nodeMin.y + ((child & 2) ? half : 0.0),
+                          nodeMin.z + ((child & 4) ? half : 0.0));
+        if (boundMax.x < childMin.x || boundMin.x > childMin.x + half ||
+            boundMax.y < childMin.y || boundMin.y > childMin.y + half ||
+            boundMax.z < childMin.z || boundMin.z > childMin.z + half)
+            continue;
+
+        if (!node.children[child])
+            node.children[child] = std::make_unique<Node>();
+        insert(*node.children[child], childMin, half, depth + 1, record, boundMin, boundMax);
+    }
+}
+
+void IrradianceCache::clear()
+{
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    for (auto &child : root.children)
+        child.reset();
+    root.records.clear();
+    records.clear();
+}
+
+size_t IrradianceCache::size() const
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return records.size();
+}
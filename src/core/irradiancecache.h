@@ -0,0 +1,88 @@
+#ifndef IRRADIANCECACHE_H
+#define IRRADIANCECACHE_H
+
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "vector3d.h"
+
+// Accuracy and sampling options of the irradiance cache
+struct IrradianceCacheSettings
+{
+    IrradianceCacheSettings() :
+        errorThreshold(0.25), minRadius(0.02), maxRadius(1.0), thetaStrata(8)
+    { }
+
+    double errorThreshold; // Ward's a: larger values reuse records farther away
+    double minRadius;      // Bounds of the validity radius of a record (world units)
+    double maxRadius;
+    int thetaStrata;       // M; records sample M x round(pi M) hemisphere strata
+};
+
+// Ward-style irradiance cache (Ward et al. 1988, Ward and Heckbert 1992).
+//
+// Records hold the irradiance at a point together with its rotational and
+// translational gradients, estimated from a stratified cosine-weighted
+// sampling of the hemisphere. A record is valid up to a radius given by
+// the harmonic mean distance to the surrounding geometry, and irradiance
+// between records is interpolated with Ward's error weights, extrapolated
+// with the gradients. Records are stored in an octree guarded by a
+// reader/writer lock: lookups from all threads run concurrently, while
+// adding a record takes the lock exclusively.
+class IrradianceCache
+{
+public:
+    // Radiance arriving at the record position from direction wi, and the
+    // distance to the surface it comes from (INFINITY if none)
+    typedef std::function<Vector3D(const Vector3D &wi, double &distance)> IncomingRadiance;
+
+    IrradianceCache(const IrradianceCacheSettings &settings_ = IrradianceCacheSettings());
+    ~IrradianceCache();
+
+    // Interpolates the irradiance at x with normal n. Returns false when
+    // no record is valid there
+    bool lookup(const Vector3D &x, const Vector3D &n, Vector3D &irradiance) const;
+
+    // Samples the hemisphere around (x, n), stores the new record and
+    // returns its irradiance
+    Vector3D addRecord(const Vector3D &x, const Vector3D &n, const IncomingRadiance &incoming);
+
+    void clear();
+    size_t size() const;
+
+private:
+    struct Record
+    {
+        Vector3D position;
+        Vector3D normal;
+        Vector3D irradiance;
+        double radius;                  // Validity radius R
+        Vector3D rotationalGradient[3];    // Per color channel
+        Vector3D translationalGradient[3];
+    };
+
+    struct Node
+    {
+        std::unique_ptr<Node> children[8];
+        std::vector<const Record*> records;
+    };
+
+    void insert(Node &node, const Vector3D &nodeMin, double nodeSize, int depth,
+                const Record *record, const Vector3D &boundMin, const Vector3D &boundMax);
+
+    IrradianceCacheSettings settings;
+
+    // Octree over a fixed cube around the origin; records are stored in
+    // every node their area of influence overlaps, in the first nodes no
+    // larger than that area
+    Node root;
+    Vector3D rootMin;
+    double rootSize;
+
+    std::vector<std::unique_ptr<Record>> records;
+    mutable std::shared_mutex mutex;
+};
+
+#endif // IRRADIANCECACHE_H
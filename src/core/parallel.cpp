@@ -0,0 +1,46 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static int workerThreads = 0;
+
+int numWorkerThreads()
+{
+    if (workerThreads > 0)
+        return workerThreads;
+    return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+void setWorkerThreads(int count)
+{
+    workerThreads = std::max(0, count);
+}
+
+void parallelFor(size_t count, const std::function<void(size_t, int)> &body)
+{
+    int numThreads = (int)std::min((size_t)numWorkerThreads(), count);
+    if (numThreads <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            body(i, 0);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&](int threadIndex)
+    {
+        for (size_t i = next++; i < count; i = next++)
+            body(i, threadIndex);
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++)
+        threads.emplace_back(worker, t);
+    worker(0);
+
+    for (std::thread &thread : threads)
+        thread.join();
+}
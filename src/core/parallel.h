@@ -0,0 +1,19 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstddef>
+#include <functional>
+
+// Number of threads used by parallelFor(). Defaults to the hardware
+// concurrency; setWorkerThreads(0) restores the default.
+int numWorkerThreads();
+void setWorkerThreads(int count);
+
+// Runs body(index, threadIndex) for every index in [0, count). Indices are
+// handed out dynamically, one at a time, so that rows of very different
+// cost still balance well. threadIndex is in [0, numWorkerThreads()) and
+// identifies the thread, so that callers can keep per-thread state (e.g.
+// samplers); thread 0 is the calling thread.
+void parallelFor(size_t count, const std::function<void(size_t, int)> &body);
+
+#endif // PARALLEL_H
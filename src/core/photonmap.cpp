@@ -0,0 +1,115 @@
+#include "photonmap.h"
+
+#include <algorithm>
+
+static float axisValue(const Vector3D &v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Max-heap on the distance: the farthest gathered photon is at the front
+static bool closerPhoton(const NearestPhoton &a, const NearestPhoton &b)
+{
+    return a.distance2 < b.distance2;
+}
+
+PhotonMap::PhotonMap()
+{ }
+
+void PhotonMap::build(std::vector<Photon> &photons_)
+{
+    photons.swap(photons_);
+    photons_.clear();
+    buildNode(0, photons.size());
+}
+
+void PhotonMap::clear()
+{
+    photons.clear();
+}
+
+void PhotonMap::buildNode(size_t begin, size_t end)
+{
+    if (end - begin <= 1)
+    {
+        if (begin < end)
+            photons[begin].splitAxis = 0;
+        return;
+    }
+
+    // Split along the axis of largest extent of the photons of the range
+    Vector3D lo = photons[begin].position;
+    Vector3D hi = lo;
+    for (size_t i = begin + 1; i < end; i++)
+    {
+        const Vector3D &p = photons[i].position;
+        lo = Vector3D(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vector3D(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    int axis = 0;
+    if (hi.y - lo.y > hi.x - lo.x)
+        axis = 1;
+    if (hi.z - lo.z > axisValue(hi, axis) - axisValue(lo, axis))
+        axis = 2;
+
+    // Median photon in the middle, smaller ones to its left
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(photons.begin() + begin, photons.begin() + mid, photons.begin() + end,
+                     [axis](const Photon &a, const Photon &b)
+                     { return axisValue(a.position, axis) < axisValue(b.position, axis); });
+    photons[mid].splitAxis = (uint8_t)axis;
+
+    buildNode(begin, mid);
+    buildNode(mid + 1, end);
+}
+
+float PhotonMap::findNearest(const Vector3D &x, int k, float maxDistance2,
+                             std::vector<NearestPhoton> &result) const
+{
+    result.clear();
+    if (k <= 0 || photons.empty())
+        return 0.0f;
+
+    locate(0, photons.size(), x, (size_t)k, maxDistance2, result);
+    return result.empty() ? 0.0f : result.front().distance2;
+}
+
+void PhotonMap::locate(size_t begin, size_t end, const Vector3D &x, size_t k, float &maxDistance2,
+                       std::vector<NearestPhoton> &heap) const
+{
+    if (begin >= end)
+        return;
+
+    size_t mid = begin + (end - begin) / 2;
+    const Photon &photon = photons[mid];
+    int axis = photon.splitAxis;
+    float delta = axisValue(x, axis) - axisValue(photon.position, axis);
+
+    // Side of the split plane that contains x first: it is the most likely
+    // to hold the nearest photons, which then shrink the search radius
+    size_t nearBegin = delta < 0.0f ? begin : mid + 1;
+    size_t nearEnd = delta < 0.0f ? mid : end;
+    locate(nearBegin, nearEnd, x, k, maxDistance2, heap);
+
+    float dx = photon.position.x - x.x;
+    float dy = photon.position.y - x.y;
+    float dz = photon.position.z - x.z;
+    float distance2 = dx * dx + dy * dy + dz * dz;
+    if (distance2 < maxDistance2)
+    {
+        if (heap.size() == k)
+        {
+            std::pop_heap(heap.begin(), heap.end(), closerPhoton);
+            heap.pop_back();
+        }
+        heap.push_back({ &photon, distance2 });
+        std::push_heap(heap.begin(), heap.end(), closerPhoton);
+
+        // With k photons, only closer ones can still enter the result
+        if (heap.size() == k)
+            maxDistance2 = heap.front().distance2;
+    }
+
+    if (delta * delta < maxDistance2)
+        locate(delta < 0.0f ? mid + 1 : begin, delta < 0.0f ? end : mid, x, k, maxDistance2, heap);
+}
@@ -0,0 +1,57 @@
+#ifndef PHOTONMAP_H
+#define PHOTONMAP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "vector3d.h"
+
+// Photon stored at a diffuse or glossy surface
+struct Photon
+{
+    Vector3D position;
+    Vector3D direction; // Towards where the photon came from (unit length)
+    Vector3D power;     // Flux carried by the photon (watts)
+    uint8_t splitAxis;  // Set by PhotonMap::build()
+};
+
+// Result of PhotonMap::findNearest()
+struct NearestPhoton
+{
+    const Photon *photon;
+    float distance2; // Squared distance to the query point
+};
+
+// Balanced kd-tree of photons (Jensen 2001), stored implicitly in a
+// flat array: the node of the range [begin, end) is the photon in its
+// middle, which splits the range along the axis of largest extent. There
+// are no child pointers, so a query only touches the photons themselves.
+// The map is built once and is read-only afterwards, so any number of
+// threads can query it concurrently.
+class PhotonMap
+{
+public:
+    PhotonMap();
+
+    // Builds the tree from the given photons, which are moved into the map
+    void build(std::vector<Photon> &photons_);
+    void clear();
+
+    // Gathers the (at most) k photons nearest to x within sqrt(maxDistance2)
+    // in result, in no particular order. Returns the squared distance of
+    // the farthest gathered photon, or 0 if none was found.
+    float findNearest(const Vector3D &x, int k, float maxDistance2,
+                      std::vector<NearestPhoton> &result) const;
+
+    size_t size() const { return photons.size(); }
+    bool empty() const { return photons.empty(); }
+
+private:
+    void buildNode(size_t begin, size_t end);
+    void locate(size_t begin, size_t end, const Vector3D &x, size_t k, float &maxDistance2,
+                std::vector<NearestPhoton> &heap) const;
+
+    std::vector<Photon> photons;
+};
+
+#endif // PHOTONMAP_H
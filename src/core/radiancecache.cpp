@@ -0,0 +1,126 @@
+#include "radiancecache.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "statistics.h"
+
+// Slots probed after the one a key hashes to before giving up
+static const size_t MaxProbes = 32;
+
+RadianceCache::RadianceCache(const RadianceCacheSettings &settings_) :
+    settings(settings_), used(0)
+{
+    size_t capacity = 1;
+    while (capacity < std::max(settings.capacity, (size_t)MaxProbes))
+        capacity *= 2;
+    entries = std::make_unique<Entry[]>(capacity);
+    mask = capacity - 1;
+    clear();
+}
+
+bool RadianceCache::lookup(const Vector3D &x, const Vector3D &n, Vector3D &radiance) const
+{
+    STAT_INC(RadianceCacheLookups);
+    const Entry *entry = find(makeKey(x, n), false);
+    if (!entry)
+        return false;
+
+    // The sums may be read while another thread adds to them: the average
+    // is then off by part of one sample, which is harmless
+    uint32_t count = entry->count.load(std::memory_order_relaxed);
+    if (count < (uint32_t)settings.minSamples)
+        return false;
+
+    STAT_INC(RadianceCacheHits);
+    radiance = Vector3D(entry->radiance[0].load(std::memory_order_relaxed),
+                        entry->radiance[1].load(std::memory_order_relaxed),
+                        entry->radiance[2].load(std::memory_order_relaxed)) / (double)count;
+    return true;
+}
+
+void RadianceCache::add(const Vector3D &x, const Vector3D &n, const Vector3D &radiance)
+{
+    if (!std::isfinite(radiance.x) || !std::isfinite(radiance.y) || !std::isfinite(radiance.z))
+        return;
+
+    Entry *entry = find(makeKey(x, n), true);
+    if (!entry)
+        return;
+
+    entry->radiance[0].fetch_add(radiance.x, std::memory_order_relaxed);
+    entry->radiance[1].fetch_add(radiance.y, std::memory_order_relaxed);
+    entry->radiance[2].fetch_add(radiance.z, std::memory_order_relaxed);
+    entry->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RadianceCache::clear()
+{
+    for (size_t i = 0; i <= mask; i++)
+    {
+        entries[i].key.store(0, std::memory_order_relaxed);
+        for (std::atomic<float> &channel : entries[i].radiance)
+            channel.store(0.0f, std::memory_order_relaxed);
+        entries[i].count.store(0, std::memory_order_relaxed);
+    }
+    used = 0;
+}
+
+size_t RadianceCache::size() const
+{
+    return used;
+}
+
+const RadianceCacheSettings& RadianceCache::getSettings() const
+{
+    return settings;
+}
+
+uint64_t RadianceCache::makeKey(const Vector3D &x, const Vector3D &n) const
+{
+    // 18 bits per cell coordinate and 3 per normal component (rounded to
+    // sevenths of the [-1, 1] range); the top bit keeps keys away from 0
+    uint64_t key = 1ULL << 63;
+    const float p[3] = { x.x, x.y, x.z };
+    const float normal[3] = { n.x, n.y, n.z };
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int64_t cell = (int64_t)std::floor(p[axis] / settings.cellSize);
+        key |= (uint64_t)(cell & 0x3FFFF) << (45 - 18 * axis);
+        int64_t direction = std::lround(std::clamp(normal[axis], -1.0f, 1.0f) * 3.0f) + 3;
+        key |= (uint64_t)direction << (6 - 3 * axis);
+    }
+    return key;
+}
+
+RadianceCache::Entry* RadianceCache::find(uint64_t key, bool insert) const
+{
+    uint64_t hash = key;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    // Linear probing. A slot, once claimed, keeps its key until clear(), so
+    // a free slot ends the search
+    for (size_t probe = 0; probe < MaxProbes; probe++)
+    {
+        Entry &entry = entries[(hash + probe) & mask];
+        uint64_t found = entry.key.load(std::memory_order_acquire);
+        if (found == key)
+            return &entry;
+        if (found != 0)
+            continue;
+        if (!insert)
+            return nullptr;
+
+        // Another thread may claim the slot first, for this key or another
+        if (entry.key.compare_exchange_strong(found, key, std::memory_order_acq_rel))
+        {
+            used++;
+            return &entry;
+        }
+        if (found == key)
+            return &entry;
+    }
+    return nullptr;
+}
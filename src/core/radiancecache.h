@@ -0,0 +1,68 @@
+#ifndef RADIANCECACHE_H
+#define RADIANCECACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "vector3d.h"
+
+// Resolution and termination options of the radiance cache. Larger cells,
+// fewer samples per entry and a shallower termination depth end the paths
+// sooner: less noise and work, more bias (blur and leaking across cells)
+struct RadianceCacheSettings
+{
+    RadianceCacheSettings() :
+        cellSize(0.1), terminationDepth(2), minSamples(8), capacity(1 << 20)
+    { }
+
+    double cellSize;      // Edge of the position cells (world units)
+    int terminationDepth; // Bounces traced before a path may end at a cached value
+    int minSamples;       // Samples an entry averages before it may end paths
+    size_t capacity;      // Entries of the hash table (rounded up to a power of two)
+};
+
+// World-space cache of the radiance reflected by diffuse surfaces.
+//
+// Entries are keyed by the position, quantized to a grid of cells, and the
+// normal, quantized per component, and average every value added in their
+// cell. They live in a fixed-size open-addressing hash table: a new key
+// claims its slot with a compare-and-swap and values are accumulated with
+// atomic adds, so any number of threads can look up and add concurrently
+// without locks. Keys that find no free slot near their hash are dropped.
+class RadianceCache
+{
+public:
+    RadianceCache(const RadianceCacheSettings &settings_ = RadianceCacheSettings());
+
+    // Average radiance of the entry of (x, n). Returns false when it has
+    // fewer than minSamples samples
+    bool lookup(const Vector3D &x, const Vector3D &n, Vector3D &radiance) const;
+
+    // Adds a radiance sample to the entry of (x, n)
+    void add(const Vector3D &x, const Vector3D &n, const Vector3D &radiance);
+
+    // Not thread-safe: no lookup or add may run at the same time
+    void clear();
+    size_t size() const;
+
+    const RadianceCacheSettings& getSettings() const;
+
+private:
+    struct Entry
+    {
+        std::atomic<uint64_t> key; // 0 for a free slot
+        std::atomic<float> radiance[3];
+        std::atomic<uint32_t> count;
+    };
+
+    uint64_t makeKey(const Vector3D &x, const Vector3D &n) const;
+    Entry* find(uint64_t key, bool insert) const;
+
+    RadianceCacheSettings settings;
+    std::unique_ptr<Entry[]> entries;
+    size_t mask;
+    mutable std::atomic<size_t> used;
+};
+
+#endif // RADIANCECACHE_H
@@ -0,0 +1,403 @@
+#include "renderserver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+#include "../lightsources/lightsource.h"
+#include "../shapes/aggregate.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+// Largest side of the images of a job
+static const size_t MaxResolution = 16384;
+// Largest image of a job, whose film and G-buffer take a few hundred
+// bytes a pixel, and largest number of samples it may trace
+static const size_t MaxPixels = 2048 * 2048;
+static const size_t MaxSamples = (size_t)1 << 32;
+// Longest line a client may send
+static const size_t MaxLineLength = 64 * 1024;
+
+RenderJob::RenderJob()
+    : integrator("nee"), samples(32), width(720), height(512), customCamera(false), fovDegrees(0.0)
+{ }
+
+bool RenderJob::parse(const std::string &line, RenderJob &job, std::string &error)
+{
+    job = RenderJob();
+    std::istringstream tokens(line);
+    std::string token;
+    if (!(tokens >> token) || token != "render")
+    {
+        error = "not a render job";
+        return false;
+    }
+
+    while (tokens >> token)
+    {
+        size_t equals = token.find('=');
+        if (equals == std::string::npos)
+        {
+            error = "expected key=value, got " + token;
+            return false;
+        }
+        std::string key = token.substr(0, equals);
+        std::istringstream value(token.substr(equals + 1));
+        bool valid = true;
+        if (key == "scene")
+            valid = (bool)(value >> job.sceneId);
+        else if (key == "integrator")
+            valid = (bool)(value >> job.integrator);
+        else if (key == "spp")
+            valid = (value >> job.samples) && job.samples > 0;
+        else if (key == "width")
+            valid = (value >> job.width) && job.width > 0 && job.width <= MaxResolution;
+        else if (key == "height")
+            valid = (value >> job.height) && job.height > 0 && job.height <= MaxResolution;
+        else if (key == "fov")
+            valid = (value >> job.fovDegrees) && job.fovDegrees > 0.0 && job.fovDegrees < 180.0;
+        else if (key == "camera")
+        {
+            for (int i = 0; i < 16 && valid; i++)
+            {
+                char comma;
+                valid = (bool)(value >> job.cameraToWorld.data[i / 4][i % 4]);
+                if (valid && i < 15)
+                    valid = (value >> comma) && comma == ',';
+            }
+            job.customCamera = true;
+        }
+        else
+        {
+            error = "unknown key " + key;
+            return false;
+        }
+        // The whole value must have been read
+        if (!valid || value.peek() != EOF)
+        {
+            error = "invalid value of " + key;
+            return false;
+        }
+    }
+
+    if (job.sceneId.empty())
+    {
+        error = "no scene";
+        return false;
+    }
+    if (job.width * job.height > MaxPixels || job.width * job.height * job.samples > MaxSamples)
+    {
+        error = "job too large";
+        return false;
+    }
+    return true;
+}
+
+ResidentScene::ResidentScene()
+    : aggregate(nullptr), objects(nullptr), fov(0.0), memoryBytes(0)
+{ }
+
+ResidentScene::~ResidentScene()
+{
+    // Materials are shared between shapes: each is deleted once
+    std::unordered_set<const Material*> materials;
+    for (const std::vector<Shape*> *shapes : { scene.objectsList, &sharedShapes })
+    {
+        for (Shape *shape : *shapes)
+        {
+            if (shape->hasMaterial())
+                materials.insert(&shape->getMaterial());
+            delete shape;
+        }
+    }
+    for (const Material *material : materials)
+        delete material;
+    for (LightSource *light : *scene.LightSourceList)
+        delete light;
+    delete scene.objectsList;
+    delete scene.LightSourceList;
+    delete aggregate;
+    delete objects;
+}
+
+// Bytes the process holds on the heap, where the C library tells (0
+// elsewhere)
+static size_t heapBytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+SceneCache::SceneCache(const SceneBuilder &builder_, size_t budgetBytes_)
+    : builder(builder_), budgetBytes(budgetBytes_), memoryBytes(0)
+{ }
+
+std::shared_ptr<ResidentScene> SceneCache::get(const std::string &sceneId, bool &built)
+{
+    auto resident = index.find(sceneId);
+    if (resident != index.end())
+    {
+        built = false;
+        scenes.splice(scenes.begin(), scenes, resident->second);
+        return scenes.front().second;
+    }
+
+    built = true;
+    size_t heapBefore = heapBytes();
+    auto scene = std::make_shared<ResidentScene>();
+    if (!builder(sceneId, *scene))
+        return nullptr;
+    scene->aggregate = new Aggregate(*scene->scene.objectsList);
+    scene->objects = new std::vector<Shape*>{ scene->aggregate };
+    size_t heapAfter = heapBytes();
+    scene->memoryBytes = std::max(heapAfter > heapBefore ? heapAfter - heapBefore : 0,
+                                  scene->aggregate->getMetrics().memoryBytes);
+
+    scenes.emplace_front(sceneId, scene);
+    index[sceneId] = scenes.begin();
+    memoryBytes += scene->memoryBytes;
+    evict();
+    return scene;
+}
+
+void SceneCache::evict()
+{
+    while (memoryBytes > budgetBytes && scenes.size() > 1)
+    {
+        std::cout << "Evicting scene " << scenes.back().first << " ("
+                  << scenes.back().second->memoryBytes / (1024.0 * 1024.0) << " MB)" << std::endl;
+        memoryBytes -= scenes.back().second->memoryBytes;
+        index.erase(scenes.back().first);
+        scenes.pop_back();
+    }
+}
+
+size_t SceneCache::size() const
+{
+    return scenes.size();
+}
+
+size_t SceneCache::getMemoryBytes() const
+{
+    return memoryBytes;
+}
+
+size_t SceneCache::getBudgetBytes() const
+{
+    return budgetBytes;
+}
+
+RenderServer::RenderServer(const std::string &socketPath_, SceneCache &cache_, const JobRenderer &render_)
+    : socketPath(socketPath_), cache(cache_), render(render_)
+{ }
+
+#if defined(__unix__) || defined(__APPLE__)
+
+static bool sendAll(int connection, const void *data, size_t size)
+{
+    const char *bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t sent = send(connection, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool sendLine(int connection, const std::string &line)
+{
+    std::string text = line + "\n";
+    return sendAll(connection, text.data(), text.size());
+}
+
+bool RenderServer::run()
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        std::cout << "Warning! The socket path " << socketPath << " is too long" << std::endl;
+        return false;
+    }
+    std::copy(socketPath.begin(), socketPath.end(), address.sun_path);
+
+    // A socket left by a server that did not stop cleanly is replaced.
+    // Only the owner may connect: the socket is created without
+    // permissions for the others
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    mode_t previousMask = umask(0177);
+    bool bound = listener >= 0 && bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    umask(previousMask);
+    if (!bound || listen(listener, 8) < 0)
+    {
+        std::cout << "Warning! Could not listen on " << socketPath << std::endl;
+        if (listener >= 0)
+            close(listener);
+        return false;
+    }
+    std::cout << "Render server listening on " << socketPath << std::endl;
+
+    bool running = true;
+    while (running)
+    {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // Lines may arrive split over several reads, or several in one
+        std::string pending;
+        char buffer[4096];
+        while (running)
+        {
+            ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                break;
+            pending.append(buffer, received);
+            if (pending.find('\n') == std::string::npos && pending.size() > MaxLineLength)
+            {
+                sendLine(connection, "ERROR line too long");
+                break;
+            }
+            size_t end;
+            while (running && (end = pending.find('\n')) != std::string::npos)
+            {
+                std::string line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                running = handle(connection, line);
+            }
+        }
+        close(connection);
+    }
+
+    close(listener);
+    unlink(socketPath.c_str());
+    return true;
+}
+
+bool RenderServer::handle(int connection, const std::string &line)
+{
+    if (line.find_first_not_of(" \t") == std::string::npos)
+        return true;
+    if (line == "shutdown")
+    {
+        sendLine(connection, "OK");
+        return false;
+    }
+    if (line == "status")
+    {
+        sendLine(connection, "OK " + std::to_string(cache.size()) + " " + std::to_string(cache.getMemoryBytes()) +
+                             " " + std::to_string(cache.getBudgetBytes()));
+        return true;
+    }
+
+    RenderJob job;
+    std::string error;
+    if (!RenderJob::parse(line, job, error))
+    {
+        sendLine(connection, "ERROR " + error);
+        return true;
+    }
+
+    // A job the memory cannot hold fails alone, the server keeps serving
+    auto start = std::chrono::steady_clock::now();
+    auto rendering = start, stop = start;
+    bool built = false;
+    std::unique_ptr<Film> film;
+    try
+    {
+        std::shared_ptr<ResidentScene> scene = cache.get(job.sceneId, built);
+        rendering = std::chrono::steady_clock::now();
+        if (!scene)
+        {
+            sendLine(connection, "ERROR unknown scene " + job.sceneId);
+            return true;
+        }
+        film = std::make_unique<Film>(job.width, job.height);
+        if (!render(job, *scene, *film, error))
+        {
+            sendLine(connection, "ERROR " + error);
+            return true;
+        }
+        stop = std::chrono::steady_clock::now();
+    }
+    catch (const std::exception &exception)
+    {
+        sendLine(connection, std::string("ERROR ") + exception.what());
+        return true;
+    }
+    double buildMs = std::chrono::duration<double, std::milli>(rendering - start).count();
+    double renderMs = std::chrono::duration<double, std::milli>(stop - rendering).count();
+    std::cout << "\nJob on scene " << job.sceneId << (built ? " (built, " : " (resident, ") << buildMs
+              << " ms): " << renderMs << " ms" << std::endl;
+
+    // The header, then the image row by row
+    char header[128];
+    std::snprintf(header, sizeof(header), "OK %zu %zu %.3f %.3f %d", job.width, job.height,
+                  buildMs, renderMs, built ? 0 : 1);
+    if (!sendLine(connection, header))
+        return true;
+    std::vector<float> row(job.width * 3);
+    for (size_t h = 0; h < job.height; h++)
+    {
+        for (size_t w = 0; w < job.width; w++)
+        {
+            Vector3D value = film->getPixelValue(w, h);
+            row[w * 3 + 0] = value.x;
+            row[w * 3 + 1] = value.y;
+            row[w * 3 + 2] = value.z;
+        }
+        if (!sendAll(connection, row.data(), row.size() * sizeof(float)))
+            break;
+    }
+    return true;
+}
+
+#else
+
+bool RenderServer::run()
+{
+    std::cout << "Warning! The render server needs Unix domain sockets" << std::endl;
+    return false;
+}
+
+bool RenderServer::handle(int connection, const std::string &line)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef RENDERSERVER_H
+#define RENDERSERVER_H
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "film.h"
+#include "matrix4x4.h"
+#include "scene.h"
+
+class Aggregate;
+
+// Render job of the server, sent as one line of text:
+//
+//   render scene=<id> [integrator=<name>] [spp=<n>] [width=<w>] [height=<h>]
+//          [fov=<degrees>] [camera=<16 comma-separated numbers>]
+//
+// camera is the cameraToWorld matrix, row by row. Without it, or without
+// fov, the job uses the camera the scene was built with. Jobs of more
+// than 2048 x 2048 pixels, or 2^32 samples, are refused
+struct RenderJob
+{
+    RenderJob();
+
+    // False, with the reason in error, for malformed lines
+    static bool parse(const std::string &line, RenderJob &job, std::string &error);
+
+    std::string sceneId;
+    std::string integrator;
+    int samples;
+    size_t width;
+    size_t height;
+    bool customCamera;
+    Matrix4x4 cameraToWorld;
+    double fovDegrees; // 0: that of the scene
+};
+
+// Scene built by the server and kept between jobs: the objects and their
+// BVH, traced through objects, and the camera it was built with. Owns the
+// shapes, their materials and the lights, and deletes them on eviction,
+// along with the shapes the builder registers in sharedShapes (e.g. the
+// geometry of instances, which is not in the scene)
+struct ResidentScene
+{
+    ResidentScene();
+    ~ResidentScene();
+
+    Scene scene;
+    std::vector<Shape*> sharedShapes;
+    Aggregate *aggregate;
+    std::vector<Shape*> *objects; // What is traced: the aggregate
+    Matrix4x4 cameraToWorld;
+    double fov; // Radians
+    size_t memoryBytes;
+};
+
+// Builds the scene of an id into scene (objects, lights and camera), or
+// returns false for unknown ids
+using SceneBuilder = std::function<bool(const std::string &sceneId, ResidentScene &scene)>;
+
+// Scenes built for the last jobs, the least recently used evicted first
+// once their memory passes the budget. The memory of a scene is that the
+// heap grew by while it was built, its BVH included
+class SceneCache
+{
+public:
+    SceneCache(const SceneBuilder &builder_, size_t budgetBytes_);
+
+    // The scene of sceneId, built unless resident (built tells which).
+    // Null for unknown ids. The scene stays valid while it is held, even
+    // if it is evicted meanwhile
+    std::shared_ptr<ResidentScene> get(const std::string &sceneId, bool &built);
+
+    size_t size() const;
+    size_t getMemoryBytes() const;
+    size_t getBudgetBytes() const;
+
+private:
+    void evict(); // Down to the budget, keeping the most recent scene
+
+    SceneBuilder builder;
+    size_t budgetBytes;
+    size_t memoryBytes;
+    std::list<std::pair<std::string, std::shared_ptr<ResidentScene>>> scenes; // Most recent first
+    std::unordered_map<std::string, decltype(scenes)::iterator> index;
+};
+
+// Renders job into film, created at the job's resolution. False, with
+// the reason in error, if it cannot (e.g. an unknown integrator)
+using JobRenderer = std::function<bool(const RenderJob &job, ResidentScene &scene, Film &film,
+                                       std::string &error)>;
+
+// Long-lived render server on a Unix domain socket, so that jobs on the
+// same scene skip its construction and its BVH build. Clients are served
+// one after the other, each with any number of lines:
+//
+//   render ...   runs a RenderJob. Answers "OK <width> <height> <build ms>
+//                <render ms> <resident>\n", resident being 1 if the scene
+//                was already built, followed by the radiance as
+//                width * height * 3 floats (RGB, rows top to bottom, in
+//                the byte order of the server), or "ERROR <reason>\n"
+//   status       "OK <resident scenes> <memory bytes> <budget bytes>\n"
+//   shutdown     "OK\n", and the server stops
+//
+// The socket is only open to the user running the server (mode 0600).
+// Unix systems only
+class RenderServer
+{
+public:
+    RenderServer(const std::string &socketPath_, SceneCache &cache_, const JobRenderer &render_);
+
+    // Serves until a shutdown. False if the socket cannot be opened
+    bool run();
+
+private:
+    // Answers a line; false once the server must stop
+    bool handle(int connection, const std::string &line);
+
+    std::string socketPath;
+    SceneCache &cache;
+    JobRenderer render;
+};
+
+#endif // RENDERSERVER_H
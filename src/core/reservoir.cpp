@@ -0,0 +1,88 @@
+#include "reservoir.h"
+
+Reservoir::Reservoir() :
+    sample{ Vector3D(0.0), -1 }, targetPdf(0.0), weightSum(0.0), count(0)
+{ }
+
+bool Reservoir::update(const LightSample &candidate, double weight, double targetPdf_, int count_, double u)
+{
+    weightSum += weight;
+    count += count_;
+    if (!(weight > 0.0) || u * weightSum >= weight)
+        return false;
+
+    sample = candidate;
+    targetPdf = targetPdf_;
+    return true;
+}
+
+double Reservoir::getWeight() const
+{
+    if (count == 0 || !(targetPdf > 0.0))
+        return 0.0;
+    return weightSum / (count * targetPdf);
+}
+
+ReservoirBuffer::ReservoirBuffer(size_t width_, size_t height_) :
+    width(width_), height(height_), entries(std::make_unique<Entry[]>(width_ * height_))
+{
+    clear();
+}
+
+void ReservoirBuffer::store(size_t x, size_t y, const Vector3D &point, const Vector3D &normal,
+                            const Reservoir &reservoir)
+{
+    if (x >= width || y >= height)
+        return;
+
+    const float values[NumFields] = {
+        point.x, point.y, point.z, normal.x, normal.y, normal.z,
+        reservoir.sample.position.x, reservoir.sample.position.y, reservoir.sample.position.z,
+        (float)reservoir.sample.light, (float)reservoir.getWeight(), (float)reservoir.count };
+
+    // Only the thread rendering the pixel writes its entry
+    Entry &entry = entries[y * width + x];
+    uint32_t version = entry.version.load(std::memory_order_relaxed);
+    entry.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < NumFields; i++)
+        entry.fields[i].store(values[i], std::memory_order_relaxed);
+    entry.version.store(version + 2, std::memory_order_release);
+}
+
+bool ReservoirBuffer::load(size_t x, size_t y, Vector3D &point, Vector3D &normal,
+                           LightSample &sample, double &weight, int &count) const
+{
+    if (x >= width || y >= height)
+        return false;
+
+    const Entry &entry = entries[y * width + x];
+    uint32_t version = entry.version.load(std::memory_order_acquire);
+    if (version == 0 || (version & 1) != 0)
+        return false;
+
+    float values[NumFields];
+    for (int i = 0; i < NumFields; i++)
+        values[i] = entry.fields[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.version.load(std::memory_order_relaxed) != version)
+        return false;
+
+    point = Vector3D(values[0], values[1], values[2]);
+    normal = Vector3D(values[3], values[4], values[5]);
+    sample.position = Vector3D(values[6], values[7], values[8]);
+    sample.light = (int)values[9];
+    weight = values[10];
+    count = (int)values[11];
+    return count > 0;
+}
+
+void ReservoirBuffer::clear()
+{
+    for (size_t i = 0; i < width * height; i++)
+    {
+        entries[i].version.store(0, std::memory_order_relaxed);
+        for (std::atomic<float> &field : entries[i].fields)
+            field.store(0.0f, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef RESERVOIR_H
+#define RESERVOIR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "vector3d.h"
+
+// Options of the resampled direct lighting
+struct ReservoirSettings
+{
+    ReservoirSettings() :
+        candidates(32), spatialNeighbors(0), spatialRadius(3.0)
+    { }
+
+    int candidates;        // Light samples evaluated (without visibility) per shading point
+    int spatialNeighbors;  // Pixels whose candidates are reused at first hits (0 = no reuse)
+    double spatialRadius;  // Distance of those pixels, in pixels
+};
+
+// Point sampled on a light source
+struct LightSample
+{
+    Vector3D position;
+    int light; // Index in the light source list (-1 = none)
+};
+
+// Weighted reservoir sampling (Chao 1982) of light samples, as used by
+// resampled importance sampling (Talbot et al. 2005) and ReSTIR (Bitterli
+// et al. 2020): candidates are streamed in with weights p_hat / p, and
+// the reservoir keeps one of them with probability proportional to its
+// weight. f(y) * getWeight() is then an estimator of the integral of f,
+// for any target p_hat that is nonzero wherever f is.
+class Reservoir
+{
+public:
+    Reservoir();
+
+    // Streams a candidate with resampling weight 'weight' and target
+    // density targetPdf at the shading point; u is uniform in [0, 1).
+    // count is the number of candidates it stands for (more than 1 for
+    // the reservoir of another pixel)
+    bool update(const LightSample &candidate, double weight, double targetPdf, int count, double u);
+
+    // Unbiased contribution weight of the kept sample: the average
+    // resampling weight over its target density
+    double getWeight() const;
+
+    LightSample sample;
+    double targetPdf;  // p_hat of the kept sample
+    double weightSum;
+    int count;         // M: candidates seen
+};
+
+// Latest fresh reservoir of every pixel, with the shading point it was
+// built for, so that neighboring pixels can reuse its candidates. Each
+// entry is written by the thread rendering its pixel and read by any
+// other under a sequence lock: readers never wait, and give up on an
+// entry that changes while they read it.
+class ReservoirBuffer
+{
+public:
+    ReservoirBuffer(size_t width_, size_t height_);
+
+    void store(size_t x, size_t y, const Vector3D &point, const Vector3D &normal,
+               const Reservoir &reservoir);
+    // Kept sample of the stored reservoir, with its contribution weight
+    // and candidate count. False when the entry is empty or was being written
+    bool load(size_t x, size_t y, Vector3D &point, Vector3D &normal,
+              LightSample &sample, double &weight, int &count) const;
+
+    // Not thread-safe: empties every entry
+    void clear();
+
+    size_t getWidth() const { return width; }
+    size_t getHeight() const { return height; }
+
+private:
+    // point (3), normal (3), sample position (3), light, weight, count
+    static const int NumFields = 12;
+
+    struct Entry
+    {
+        std::atomic<uint32_t> version; // Odd while being written
+        std::atomic<float> fields[NumFields];
+    };
+
+    size_t width, height;
+    std::unique_ptr<Entry[]> entries;
+};
+
+#endif // RESERVOIR_H
@@ -0,0 +1,397 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+// Largest double strictly below 1
+static const double OneMinusEpsilon = 0x1.fffffffffffffp-1;
+
+// Path vertex layout: 2 dimensions for the pixel position, then
+// DimensionsPerBounce dimensions for every depth
+static const int PixelDimensions = 2;
+static const int DimensionsPerBounce = 10;
+
+// First primes, used as Halton bases (one per dimension)
+static const int NumPrimes = 128;
+static const int Primes[NumPrimes] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71,
+    73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151,
+    157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233,
+    239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311, 313, 317,
+    331, 337, 347, 349, 353, 359, 367, 373, 379, 383, 389, 397, 401, 409, 419,
+    421, 431, 433, 439, 443, 449, 457, 461, 463, 467, 479, 487, 491, 499, 503,
+    509, 521, 523, 541, 547, 557, 563, 569, 571, 577, 587, 593, 599, 601, 607,
+    613, 617, 619, 631, 641, 643, 647, 653, 659, 661, 673, 677, 683, 691, 701,
+    709, 719 };
+
+
+/* ************** */
+/* Hash utilities */
+/* ************** */
+
+static uint64_t mixBits(uint64_t v)
+{
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ull;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= (v >> 33);
+    return v;
+}
+
+static double hashToUniform(uint64_t h)
+{
+    return std::min((double)(h >> 11) * 0x1p-53, OneMinusEpsilon);
+}
+
+// Kensler's hashed permutation: returns the element i of a random
+// permutation of {0, ..., l-1} selected by p, without storing it
+static uint32_t permutationElement(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+static uint32_t reverseBits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+// Hash-based base-2 Owen scrambling (Burley 2020)
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverseBits(x);
+}
+
+// First two dimensions of the Sobol sequence, which form a (0,2)-sequence
+static uint32_t sobolFirstDimension(uint32_t index)
+{
+    return reverseBits(index);
+}
+
+static uint32_t sobolSecondDimension(uint32_t index)
+{
+    uint32_t v = 1u << 31;
+    uint32_t result = 0;
+    for (; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+
+/* ******* */
+/* Sampler */
+/* ******* */
+
+static thread_local Sampler* activeSampler = nullptr;
+
+Sampler::Sampler(int samplesPerPixel_, uint64_t seed_) :
+    samplesPerPixel(std::max(samplesPerPixel_, 1)), seed(seed_),
+    pixelX(0), pixelY(0), sampleIndex(0)
+{ }
+
+Sampler* Sampler::create(SamplerType type, int samplesPerPixel, uint64_t seed)
+{
+    switch (type)
+    {
+    case SamplerType::Stratified:
+        return new StratifiedSampler(samplesPerPixel, seed);
+    case SamplerType::Halton:
+        return new HaltonSampler(samplesPerPixel, seed);
+    case SamplerType::Sobol:
+        return new SobolSampler(samplesPerPixel, seed);
+    case SamplerType::Independent:
+    default:
+        return new IndependentSampler(samplesPerPixel, seed);
+    }
+}
+
+const char* Sampler::typeName(SamplerType type)
+{
+    switch (type)
+    {
+    case SamplerType::Stratified: return "stratified";
+    case SamplerType::Halton:     return "halton";
+    case SamplerType::Sobol:      return "sobol";
+    default:                      return "independent";
+    }
+}
+
+void Sampler::startPixelSample(size_t px, size_t py, int sampleIndex_)
+{
+    pixelX = px;
+    pixelY = py;
+    sampleIndex = sampleIndex_;
+}
+
+void Sampler::getPixelSample(double &u, double &v)
+{
+    sample2D(0, sampleIndex, samplesPerPixel, u, v);
+}
+
+int Sampler::dimensionOf(SampleDimension slot, int depth)
+{
+    int base = PixelDimensions + std::max(depth, 0) * DimensionsPerBounce;
+    switch (slot)
+    {
+    case SampleDimension::BSDF:             return base;
+    case SampleDimension::Light:            return base + 2;
+    case SampleDimension::RussianRoulette:  return base + 4;
+    case SampleDimension::AmbientOcclusion: return base + 5;
+    case SampleDimension::Resampling:       return base + 7;
+    case SampleDimension::ReuseNeighbor:    return base + 8;
+    }
+    return base;
+}
+
+double Sampler::get1D(SampleDimension slot, int depth, int index, int count)
+{
+    count = std::max(count, 1);
+    uint64_t i = (uint64_t)sampleIndex * count + index;
+    return sample1D(dimensionOf(slot, depth), i, (uint64_t)samplesPerPixel * count);
+}
+
+void Sampler::get2D(SampleDimension slot, int depth, double &u1, double &u2,
+                    int index, int count)
+{
+    count = std::max(count, 1);
+    uint64_t i = (uint64_t)sampleIndex * count + index;
+    sample2D(dimensionOf(slot, depth), i, (uint64_t)samplesPerPixel * count, u1, u2);
+}
+
+uint64_t Sampler::getStreamSeed() const
+{
+    // No dimension is negative
+    return pixelHash(-1, (uint64_t)sampleIndex);
+}
+
+uint64_t Sampler::pixelHash(int dimension, uint64_t extra) const
+{
+    uint64_t h = mixBits((uint64_t)pixelX * 0x9e3779b97f4a7c15ull ^ seed);
+    h = mixBits(h ^ ((uint64_t)pixelY + 0x632be59bd9b4e019ull));
+    return mixBits(h ^ ((uint64_t)dimension << 32) ^ extra);
+}
+
+Sampler& Sampler::active()
+{
+    if (activeSampler != nullptr)
+        return *activeSampler;
+
+    // Integrators called outside raytrace() keep the old i.i.d. behaviour
+    static thread_local IndependentSampler fallback(1, std::random_device{}());
+    return fallback;
+}
+
+void Sampler::setActive(Sampler* sampler)
+{
+    activeSampler = sampler;
+}
+
+
+/* ****************** */
+/* IndependentSampler */
+/* ****************** */
+
+IndependentSampler::IndependentSampler(int samplesPerPixel_, uint64_t seed_) :
+    Sampler(samplesPerPixel_, seed_), rng(mixBits(seed_)), uniform(0.0, 1.0)
+{ }
+
+Sampler* IndependentSampler::clone() const
+{
+    // Every copy gets its own stream, whichever thread clones it
+    static std::atomic<uint64_t> streams(0);
+    return new IndependentSampler(samplesPerPixel, seed + (++streams));
+}
+
+double IndependentSampler::sample1D(int dimension, uint64_t index, uint64_t count)
+{
+    return uniform(rng);
+}
+
+void IndependentSampler::sample2D(int dimension, uint64_t index, uint64_t count,
+                                  double &u1, double &u2)
+{
+    u1 = uniform(rng);
+    u2 = uniform(rng);
+}
+
+
+/* ***************** */
+/* StratifiedSampler */
+/* ***************** */
+
+StratifiedSampler::StratifiedSampler(int samplesPerPixel_, uint64_t seed_) :
+    Sampler(samplesPerPixel_, seed_)
+{ }
+
+Sampler* StratifiedSampler::clone() const
+{
+    return new StratifiedSampler(samplesPerPixel, seed);
+}
+
+double StratifiedSampler::sample1D(int dimension, uint64_t index, uint64_t count)
+{
+    // The strata are visited in a different random order for every pixel
+    // and dimension (padding), which avoids correlation between dimensions
+    uint64_t hash = pixelHash(dimension);
+    uint32_t stratum = permutationElement((uint32_t)index, (uint32_t)count, (uint32_t)hash);
+    double jitter = hashToUniform(mixBits(hash ^ (index + 1)));
+    return std::min((stratum + jitter) / count, OneMinusEpsilon);
+}
+
+void StratifiedSampler::sample2D(int dimension, uint64_t index, uint64_t count,
+                                 double &u1, double &u2)
+{
+    uint64_t hash = pixelHash(dimension);
+    uint32_t stratum = permutationElement((uint32_t)index, (uint32_t)count, (uint32_t)hash);
+    double jitter1 = hashToUniform(mixBits(hash ^ (2 * index + 1)));
+    double jitter2 = hashToUniform(mixBits(hash ^ (2 * index + 2)));
+
+    // Largest nx * ny grid that fits in the sample count
+    uint64_t nx = (uint64_t)std::sqrt((double)count);
+    uint64_t ny = count / nx;
+    if (stratum < nx * ny)
+    {
+        u1 = std::min(((stratum % nx) + jitter1) / nx, OneMinusEpsilon);
+        u2 = std::min(((stratum / nx) + jitter2) / ny, OneMinusEpsilon);
+    }
+    else
+    {
+        // Remaining samples are left unstratified
+        u1 = jitter1;
+        u2 = jitter2;
+    }
+}
+
+
+/* ************* */
+/* HaltonSampler */
+/* ************* */
+
+HaltonSampler::HaltonSampler(int samplesPerPixel_, uint64_t seed_) :
+    Sampler(samplesPerPixel_, seed_)
+{ }
+
+Sampler* HaltonSampler::clone() const
+{
+    return new HaltonSampler(samplesPerPixel, seed);
+}
+
+double HaltonSampler::scrambledRadicalInverse(int primeIndex, uint64_t a, uint64_t scramble) const
+{
+    const uint32_t base = Primes[primeIndex];
+    const double invBase = 1.0 / base;
+    double invBaseM = 1.0;
+    double result = 0.0;
+    uint64_t prefix = 0;
+
+    // Owen scrambling: each digit is permuted according to a hash of the
+    // digits that precede it. Digits are generated until they no longer
+    // change the double-precision result.
+    while (invBaseM > 1e-10)
+    {
+        uint64_t next = a / base;
+        uint32_t digit = (uint32_t)(a - next * base);
+        uint32_t digitSeed = (uint32_t)mixBits(scramble ^ prefix);
+        uint32_t permuted = permutationElement(digit, base, digitSeed);
+
+        invBaseM *= invBase;
+        result += permuted * invBaseM;
+
+        prefix = mixBits(prefix + digit + 1);
+        a = next;
+    }
+    return std::min(result, OneMinusEpsilon);
+}
+
+double HaltonSampler::sample1D(int dimension, uint64_t index, uint64_t count)
+{
+    if (dimension >= NumPrimes)
+        return hashToUniform(mixBits(pixelHash(dimension) ^ index));
+    return scrambledRadicalInverse(dimension, index, pixelHash(dimension));
+}
+
+void HaltonSampler::sample2D(int dimension, uint64_t index, uint64_t count,
+                             double &u1, double &u2)
+{
+    u1 = sample1D(dimension, index, count);
+    u2 = sample1D(dimension + 1, index, count);
+}
+
+
+/* ************ */
+/* SobolSampler */
+/* ************ */
+
+SobolSampler::SobolSampler(int samplesPerPixel_, uint64_t seed_) :
+    Sampler(samplesPerPixel_, seed_)
+{ }
+
+Sampler* SobolSampler::clone() const
+{
+    return new SobolSampler(samplesPerPixel, seed);
+}
+
+// Padded Sobol: every dimension (or pair of dimensions) uses the first
+// Sobol dimensions with an independent Owen scramble and an independent
+// shuffle of the sample order. This keeps the (0,2)-net stratification of
+// each 2D slot without needing high-dimensional direction numbers.
+double SobolSampler::sample1D(int dimension, uint64_t index, uint64_t count)
+{
+    uint64_t hash = pixelHash(dimension);
+    uint32_t shuffled = permutationElement((uint32_t)index, (uint32_t)count, (uint32_t)hash);
+    uint32_t x = nestedUniformScramble(sobolFirstDimension(shuffled), (uint32_t)(hash >> 32));
+    return std::min(x * 0x1p-32, OneMinusEpsilon);
+}
+
+void SobolSampler::sample2D(int dimension, uint64_t index, uint64_t count,
+                            double &u1, double &u2)
+{
+    uint64_t hash = pixelHash(dimension);
+    uint64_t scramble = mixBits(hash);
+    uint32_t shuffled = permutationElement((uint32_t)index, (uint32_t)count, (uint32_t)hash);
+    uint32_t x = nestedUniformScramble(sobolFirstDimension(shuffled), (uint32_t)scramble);
+    uint32_t y = nestedUniformScramble(sobolSecondDimension(shuffled), (uint32_t)(scramble >> 32));
+    u1 = std::min(x * 0x1p-32, OneMinusEpsilon);
+    u2 = std::min(y * 0x1p-32, OneMinusEpsilon);
+}
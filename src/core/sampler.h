@@ -0,0 +1,147 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+
+// Sample generators available to raytrace()
+enum class SamplerType
+{
+    Independent, // i.i.d. uniform numbers (same convergence as std::rand())
+    Stratified,  // Jittered strata, randomly permuted per pixel and dimension
+    Halton,      // Owen-scrambled Halton sequence
+    Sobol        // Owen-scrambled (0,2)-Sobol points, padded per dimension
+};
+
+// Random decisions taken at every path vertex. Each slot owns its own
+// dimensions so that, e.g., the BSDF direction of bounce 2 always comes
+// from the same pair of sequence dimensions.
+enum class SampleDimension
+{
+    BSDF,            // 2D: direction of the next bounce
+    Light,           // 2D: point on an area light source
+    RussianRoulette, // 1D: path termination
+    AmbientOcclusion, // 2D: occlusion test direction
+    Resampling,      // 1D: candidate kept by resampled importance sampling
+    ReuseNeighbor    // 2D: neighboring pixel whose samples are reused
+};
+
+// Base class of all the sample generators.
+//
+// The renderer calls startPixelSample() before tracing each camera ray;
+// integrators then ask for the numbers of a given slot and path depth.
+// When an integrator takes several samples of the same slot at one vertex
+// (e.g. 16 AO rays), it passes the sample index and the total count so that
+// all of them are stratified together with the pixel samples.
+class Sampler
+{
+public:
+    Sampler() = delete;
+    Sampler(int samplesPerPixel_, uint64_t seed_);
+    virtual ~Sampler() {}
+
+    static Sampler* create(SamplerType type, int samplesPerPixel, uint64_t seed = 0);
+    static const char* typeName(SamplerType type);
+
+    // Copy with the same configuration, to be used by another thread
+    virtual Sampler* clone() const = 0;
+
+    void startPixelSample(size_t px, size_t py, int sampleIndex_);
+
+    // Sub-pixel position in [0,1)^2 of the current pixel sample
+    void getPixelSample(double &u, double &v);
+
+    double get1D(SampleDimension slot, int depth, int index = 0, int count = 1);
+    void get2D(SampleDimension slot, int depth, double &u1, double &u2,
+               int index = 0, int count = 1);
+
+    int getSamplesPerPixel() const { return samplesPerPixel; }
+
+    // Pixel of the current sample
+    size_t getPixelX() const { return pixelX; }
+    size_t getPixelY() const { return pixelY; }
+
+    // Seed of a stream of its own for the current pixel sample, for work
+    // done on its behalf with a sampler of its own (e.g. the paths of an
+    // irradiance cache record), so that it is as reproducible as the rest
+    uint64_t getStreamSeed() const;
+
+    // Sampler used by the integrators running on the calling thread.
+    // Falls back to an independent sampler when none has been activated.
+    static Sampler& active();
+    static void setActive(Sampler* sampler);
+
+protected:
+    // Dimension-indexed generators. 'index' is the sample number inside
+    // the current pixel and 'count' the total number of samples the pixel
+    // will draw from that dimension.
+    virtual double sample1D(int dimension, uint64_t index, uint64_t count) = 0;
+    virtual void sample2D(int dimension, uint64_t index, uint64_t count,
+                          double &u1, double &u2) = 0;
+
+    // Hash of (pixel, dimension, extra) used to decorrelate the sequences
+    uint64_t pixelHash(int dimension, uint64_t extra = 0) const;
+
+    int samplesPerPixel;
+    uint64_t seed;
+    size_t pixelX;
+    size_t pixelY;
+    int sampleIndex;
+
+private:
+    static int dimensionOf(SampleDimension slot, int depth);
+};
+
+class IndependentSampler : public Sampler
+{
+public:
+    IndependentSampler(int samplesPerPixel_, uint64_t seed_);
+    Sampler* clone() const;
+
+protected:
+    double sample1D(int dimension, uint64_t index, uint64_t count);
+    void sample2D(int dimension, uint64_t index, uint64_t count, double &u1, double &u2);
+
+private:
+    std::mt19937_64 rng;
+    std::uniform_real_distribution<double> uniform;
+};
+
+class StratifiedSampler : public Sampler
+{
+public:
+    StratifiedSampler(int samplesPerPixel_, uint64_t seed_);
+    Sampler* clone() const;
+
+protected:
+    double sample1D(int dimension, uint64_t index, uint64_t count);
+    void sample2D(int dimension, uint64_t index, uint64_t count, double &u1, double &u2);
+};
+
+class HaltonSampler : public Sampler
+{
+public:
+    HaltonSampler(int samplesPerPixel_, uint64_t seed_);
+    Sampler* clone() const;
+
+protected:
+    double sample1D(int dimension, uint64_t index, uint64_t count);
+    void sample2D(int dimension, uint64_t index, uint64_t count, double &u1, double &u2);
+
+private:
+    double scrambledRadicalInverse(int primeIndex, uint64_t a, uint64_t scramble) const;
+};
+
+class SobolSampler : public Sampler
+{
+public:
+    SobolSampler(int samplesPerPixel_, uint64_t seed_);
+    Sampler* clone() const;
+
+protected:
+    double sample1D(int dimension, uint64_t index, uint64_t count);
+    void sample2D(int dimension, uint64_t index, uint64_t count, double &u1, double &u2);
+};
+
+#endif // SAMPLER_H
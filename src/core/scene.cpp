@@ -11,7 +11,9 @@ Scene::Scene()
 void Scene::AddObject(Shape* new_object)
 {
 	objectsList->push_back(new_object);
-	if (new_object->getMaterial().isEmissive())
+	new_object->setId((int)objectsList->size());
+	// Shapes without a material of their own (instances) are never lights
+	if (new_object->hasMaterial() && new_object->getMaterial().isEmissive())
 		LightSourceList->push_back(new AreaLightSource(dynamic_cast<Square*>(new_object)));
 
 }	
@@ -0,0 +1,410 @@
+#include "sdtree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+#include "hemisphericalsampler.h"
+#include "parallel.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Largest double below 1, to keep rescaled random numbers in [0, 1)
+static const double OneMinusEpsilon = 0x1.fffffffffffffp-1;
+
+// Canonical coordinates of a unit direction: x = (cos theta + 1) / 2 and
+// y = phi / (2 pi), both in [0, 1). The mapping preserves areas, so a
+// uniform density in the square is uniform over the sphere
+static void directionToCanonical(const Vector3D &d, double &x, double &y)
+{
+    double cosTheta = std::clamp((double)d.z, -1.0, 1.0);
+    double phi = std::atan2((double)d.y, (double)d.x);
+    if (phi < 0.0)
+        phi += 2.0 * M_PI;
+    x = std::min((cosTheta + 1.0) * 0.5, OneMinusEpsilon);
+    y = std::min(phi / (2.0 * M_PI), OneMinusEpsilon);
+}
+
+static Vector3D canonicalToDirection(double x, double y)
+{
+    double cosTheta = 2.0 * x - 1.0;
+    double sinTheta = std::sqrt(std::max(0.0, 1.0 - cosTheta * cosTheta));
+    double phi = 2.0 * M_PI * y;
+    return Vector3D(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+}
+
+// Quadrant of a node containing (x, y), which are then rescaled to the
+// coordinates inside that quadrant
+static int selectQuadrant(double &x, double &y)
+{
+    int qx = x >= 0.5 ? 1 : 0;
+    int qy = y >= 0.5 ? 1 : 0;
+    x = std::min(2.0 * x - qx, OneMinusEpsilon);
+    y = std::min(2.0 * y - qy, OneMinusEpsilon);
+    return qx + 2 * qy;
+}
+
+static void atomicMin(float &target, float value)
+{
+    std::atomic_ref<float> current(target);
+    float seen = current.load(std::memory_order_relaxed);
+    while (value < seen && !current.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+    { }
+}
+
+static void atomicMax(float &target, float value)
+{
+    std::atomic_ref<float> current(target);
+    float seen = current.load(std::memory_order_relaxed);
+    while (value > seen && !current.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+    { }
+}
+
+//--------------------------------------------------------------------------
+// DirectionalQuadtree
+
+DirectionalQuadtree::DirectionalQuadtree() :
+    nodes(1, Node{ { 0.0f, 0.0f, 0.0f, 0.0f }, { 0, 0, 0, 0 } }), sampleCount(0)
+{ }
+
+void DirectionalQuadtree::record(const Vector3D &wi, float value)
+{
+    double x, y;
+    directionToCanonical(wi, x, y);
+
+    // The nodes do not move during a pass: the sums are updated in place
+    uint32_t node = 0;
+    while (true)
+    {
+        int quadrant = selectQuadrant(x, y);
+        std::atomic_ref<float>(nodes[node].energy[quadrant]).fetch_add(value, std::memory_order_relaxed);
+        if (nodes[node].child[quadrant] == 0)
+            break;
+        node = nodes[node].child[quadrant];
+    }
+    std::atomic_ref<uint64_t>(sampleCount).fetch_add(1, std::memory_order_relaxed);
+}
+
+Vector3D DirectionalQuadtree::sample(double u, double v, double &pdf) const
+{
+    // Each level picks the column with u and the quadrant inside it with
+    // v, and rescales them to sample the level below
+    double density = 1.0;
+    double originX = 0.0, originY = 0.0, size = 1.0;
+    uint32_t node = 0;
+    while (true)
+    {
+        const float *energy = nodes[node].energy;
+        double total = (double)energy[0] + energy[1] + energy[2] + energy[3];
+
+        double left = (double)energy[0] + energy[2];
+        double fractionLeft = left / total;
+        int qx;
+        if (u < fractionLeft)
+        {
+            qx = 0;
+            u /= fractionLeft;
+        }
+        else
+        {
+            qx = 1;
+            u = (u - fractionLeft) / (1.0 - fractionLeft);
+        }
+
+        double column = qx == 0 ? left : (double)energy[1] + energy[3];
+        double fractionBottom = energy[qx] / column;
+        int qy;
+        if (v < fractionBottom)
+        {
+            qy = 0;
+            v /= fractionBottom;
+        }
+        else
+        {
+            qy = 1;
+            v = (v - fractionBottom) / (1.0 - fractionBottom);
+        }
+        u = std::min(u, OneMinusEpsilon);
+        v = std::min(v, OneMinusEpsilon);
+
+        int quadrant = qx + 2 * qy;
+        density *= 4.0 * energy[quadrant] / total;
+        size *= 0.5;
+        originX += qx * size;
+        originY += qy * size;
+
+        if (nodes[node].child[quadrant] == 0)
+            break;
+        node = nodes[node].child[quadrant];
+    }
+
+    pdf = density / (4.0 * M_PI);
+    return canonicalToDirection(originX + u * size, originY + v * size);
+}
+
+double DirectionalQuadtree::pdf(const Vector3D &wi) const
+{
+    double x, y;
+    directionToCanonical(wi, x, y);
+
+    double density = 1.0;
+    uint32_t node = 0;
+    while (true)
+    {
+        const float *energy = nodes[node].energy;
+        double total = (double)energy[0] + energy[1] + energy[2] + energy[3];
+        if (total <= 0.0)
+            return 0.0;
+
+        int quadrant = selectQuadrant(x, y);
+        density *= 4.0 * energy[quadrant] / total;
+        if (nodes[node].child[quadrant] == 0)
+            break;
+        node = nodes[node].child[quadrant];
+    }
+    return density / (4.0 * M_PI);
+}
+
+void DirectionalQuadtree::refine(const DirectionalQuadtree &from, double energyThreshold, int maxDepth)
+{
+    const float *energy = from.nodes[0].energy;
+    float total = energy[0] + energy[1] + energy[2] + energy[3];
+
+    nodes.clear();
+    sampleCount = 0;
+    buildNode(from, 0, energy, total, energyThreshold, 1, maxDepth);
+}
+
+uint32_t DirectionalQuadtree::buildNode(const DirectionalQuadtree &from, int fromNode, const float energy[4],
+                                        float total, double energyThreshold, int depth, int maxDepth)
+{
+    uint32_t index = (uint32_t)nodes.size();
+    nodes.push_back(Node{ { 0.0f, 0.0f, 0.0f, 0.0f }, { 0, 0, 0, 0 } });
+
+    for (int quadrant = 0; quadrant < 4; quadrant++)
+    {
+        if (depth >= maxDepth || !(energy[quadrant] > total * energyThreshold))
+            continue;
+
+        // Below the leaves of 'from' the energy is assumed uniform, so a
+        // bright leaf is split as deep as its energy calls for at once
+        int fromChild = fromNode >= 0 ? (int)from.nodes[fromNode].child[quadrant] : 0;
+        float childEnergy[4];
+        for (int i = 0; i < 4; i++)
+            childEnergy[i] = fromChild != 0 ? from.nodes[fromChild].energy[i] : energy[quadrant] * 0.25f;
+
+        uint32_t child = buildNode(from, fromChild != 0 ? fromChild : -1, childEnergy,
+                                   total, energyThreshold, depth + 1, maxDepth);
+        nodes[index].child[quadrant] = child;
+    }
+    return index;
+}
+
+void DirectionalQuadtree::halve()
+{
+    for (Node &node : nodes)
+        for (float &energy : node.energy)
+            energy *= 0.5f;
+    sampleCount /= 2;
+}
+
+float DirectionalQuadtree::getEnergy() const
+{
+    const float *energy = nodes[0].energy;
+    return energy[0] + energy[1] + energy[2] + energy[3];
+}
+
+uint64_t DirectionalQuadtree::getSampleCount() const
+{
+    return sampleCount;
+}
+
+size_t DirectionalQuadtree::getNodeCount() const
+{
+    return nodes.size();
+}
+
+//--------------------------------------------------------------------------
+// SDTree
+
+SDTree::SDTree(const PathGuidingSettings &settings_) :
+    settings(settings_)
+{
+    reset();
+}
+
+void SDTree::reset()
+{
+    nodes.assign(1, Node{ { 0, 0 }, 0 });
+    leaves.assign(1, Leaf());
+    bounded = false;
+    training = settings.trainingPasses > 0;
+    pointsMin = Vector3D(std::numeric_limits<float>::max());
+    pointsMax = Vector3D(-std::numeric_limits<float>::max());
+}
+
+uint32_t SDTree::findLeaf(const Vector3D &x) const
+{
+    if (!bounded)
+        return 0;
+
+    // Points outside of the bounds go to the closest leaf
+    double p[3] = { (x.x - boundMin.x) / boundSize.x,
+                    (x.y - boundMin.y) / boundSize.y,
+                    (x.z - boundMin.z) / boundSize.z };
+    for (double &coordinate : p)
+        coordinate = std::clamp(coordinate, 0.0, OneMinusEpsilon);
+
+    // The node at depth d halves its box along axis d % 3
+    uint32_t node = 0;
+    int axis = 0;
+    while (nodes[node].child[0] != 0)
+    {
+        int half = p[axis] >= 0.5 ? 1 : 0;
+        p[axis] = std::min(2.0 * p[axis] - half, OneMinusEpsilon);
+        node = nodes[node].child[half];
+        axis = (axis + 1) % 3;
+    }
+    return nodes[node].leaf;
+}
+
+const DirectionalQuadtree* SDTree::getDistribution(const Vector3D &x) const
+{
+    const DirectionalQuadtree &distribution = leaves[findLeaf(x)].sampling;
+    return distribution.getEnergy() > 0.0f ? &distribution : nullptr;
+}
+
+double SDTree::sampleDirection(const Vector3D &x, const Vector3D &n, double u1, double u2,
+                               Vector3D &wi) const
+{
+    HemisphericalSampler hemisphere;
+    const DirectionalQuadtree *distribution = getDistribution(x);
+    if (!distribution)
+    {
+        wi = hemisphere.getCosineSample(n, u1, u2);
+        return std::max(0.0, (double)dot(n, wi)) / M_PI;
+    }
+
+    // One-sample mixture: u1 picks the strategy and is reused, rescaled,
+    // for the direction
+    double bsdfFraction = settings.bsdfSamplingFraction;
+    if (u1 < bsdfFraction)
+    {
+        wi = hemisphere.getCosineSample(n, std::min(u1 / bsdfFraction, OneMinusEpsilon), u2);
+    }
+    else
+    {
+        double guidedPdf;
+        u1 = std::min((u1 - bsdfFraction) / (1.0 - bsdfFraction), OneMinusEpsilon);
+        wi = distribution->sample(u1, u2, guidedPdf);
+    }
+    return bsdfFraction * std::max(0.0, (double)dot(n, wi)) / M_PI
+         + (1.0 - bsdfFraction) * distribution->pdf(wi);
+}
+
+void SDTree::record(const Vector3D &x, const Vector3D &wi, const Vector3D &Li, double pdf)
+{
+    if (!training || !(pdf > 0.0))
+        return;
+
+    // Radiance over density: each sample is an estimate of the integral
+    // of the radiance over the quadrant it falls in
+    float value = (float)((Li.x + Li.y + Li.z) / (3.0 * pdf));
+    if (!std::isfinite(value) || value < 0.0f)
+        return;
+
+    if (!bounded)
+    {
+        atomicMin(pointsMin.x, x.x);
+        atomicMin(pointsMin.y, x.y);
+        atomicMin(pointsMin.z, x.z);
+        atomicMax(pointsMax.x, x.x);
+        atomicMax(pointsMax.y, x.y);
+        atomicMax(pointsMax.z, x.z);
+    }
+    leaves[findLeaf(x)].building.record(wi, value);
+}
+
+void SDTree::endPass(int pass)
+{
+    if (!training)
+        return;
+
+    // The first pass fixes the bounds to those of the recorded points,
+    // slightly enlarged (and never flat)
+    if (!bounded && pointsMin.x <= pointsMax.x)
+    {
+        Vector3D extent = pointsMax - pointsMin;
+        boundSize = Vector3D(std::max(extent.x * 1.02f, 1e-3f),
+                             std::max(extent.y * 1.02f, 1e-3f),
+                             std::max(extent.z * 1.02f, 1e-3f));
+        boundMin = pointsMin - (boundSize - extent) * 0.5;
+        bounded = true;
+    }
+
+    // Spatial refinement: the sample count needed to split grows with the
+    // square root of the samples per pixel of the pass
+    if (bounded)
+    {
+        double threshold = settings.spatialThreshold * std::sqrt(std::pow(2.0, pass));
+        std::vector<uint32_t> leafNodes;
+        for (uint32_t node = 0; node < nodes.size(); node++)
+            if (nodes[node].child[0] == 0)
+                leafNodes.push_back(node);
+        for (uint32_t node : leafNodes)
+            split(node, threshold);
+    }
+
+    // What was learned guides the next pass, which learns on a tree
+    // refined to that energy
+    parallelFor(leaves.size(), [&](size_t i, int thread)
+    {
+        Leaf &leaf = leaves[i];
+        leaf.sampling = leaf.building;
+        leaf.building.refine(leaf.sampling, settings.energyThreshold, settings.maxQuadtreeDepth);
+    });
+
+    if (pass + 1 >= settings.trainingPasses)
+        training = false;
+}
+
+void SDTree::split(uint32_t node, double threshold)
+{
+    uint32_t leaf = nodes[node].leaf;
+    if (leaves[leaf].building.getSampleCount() <= threshold)
+        return;
+
+    // Both halves start from the parent's distribution, with half of its
+    // samples each
+    leaves[leaf].building.halve();
+    Leaf copy = leaves[leaf];
+    uint32_t otherLeaf = (uint32_t)leaves.size();
+    leaves.push_back(copy);
+
+    uint32_t first = (uint32_t)nodes.size();
+    nodes.push_back(Node{ { 0, 0 }, leaf });
+    nodes.push_back(Node{ { 0, 0 }, otherLeaf });
+    nodes[node].child[0] = first;
+    nodes[node].child[1] = first + 1;
+
+    split(first, threshold);
+    split(first + 1, threshold);
+}
+
+bool SDTree::isTraining() const
+{
+    return training;
+}
+
+const PathGuidingSettings& SDTree::getSettings() const
+{
+    return settings;
+}
+
+size_t SDTree::getLeafCount() const
+{
+    return leaves.size();
+}
@@ -0,0 +1,143 @@
+#ifndef SDTREE_H
+#define SDTREE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "vector3d.h"
+
+// Training and sampling options of the path guiding mode
+struct PathGuidingSettings
+{
+    PathGuidingSettings() :
+        trainingPasses(6), bsdfSamplingFraction(0.5), spatialThreshold(12000.0),
+        energyThreshold(0.01), maxQuadtreeDepth(20)
+    { }
+
+    int trainingPasses;          // Passes of 1, 2, 4... samples per pixel rendered to learn the radiance
+    double bsdfSamplingFraction; // Probability of a BSDF sample instead of a guided one
+    double spatialThreshold;     // c: a leaf splits once it records c * sqrt(2^pass) samples.
+                                 // The default suits images of about a megapixel; scale it with the pixel count
+    double energyThreshold;      // rho: quadtree nodes with more of the energy are split
+    int maxQuadtreeDepth;
+};
+
+// Piecewise-constant distribution over the sphere of directions, stored
+// as a quadtree over the cylindrical coordinates (cos theta, phi), a
+// mapping that preserves areas. Every node holds the energy recorded in
+// each of its four quadrants; sampling descends the tree choosing the
+// quadrants in proportion to their energy.
+class DirectionalQuadtree
+{
+public:
+    DirectionalQuadtree();
+
+    // Adds value to every node containing wi. Safe from any number of
+    // threads, as long as the tree is not refined at the same time
+    void record(const Vector3D &wi, float value);
+
+    // Direction with a density proportional to the recorded energy, and
+    // that density (solid angle). Only valid when getEnergy() > 0
+    Vector3D sample(double u, double v, double &pdf) const;
+    double pdf(const Vector3D &wi) const;
+
+    // Rebuilds the nodes with the structure the energy of 'from' calls
+    // for: quadrants above energyThreshold of the total are split, those
+    // below it merged. The new tree records nothing yet
+    void refine(const DirectionalQuadtree &from, double energyThreshold, int maxDepth);
+
+    // Halves the energy and sample count, when the tree is copied in
+    // the two halves of a spatial node
+    void halve();
+
+    float getEnergy() const;
+    uint64_t getSampleCount() const;
+    size_t getNodeCount() const;
+
+private:
+    // Quadrant i covers [x, x + 1/2) x [y, y + 1/2) of its node, with
+    // x = (i & 1) / 2 and y = (i >> 1) / 2; child 0 marks a leaf quadrant
+    struct Node
+    {
+        float energy[4];
+        uint32_t child[4];
+    };
+
+    uint32_t buildNode(const DirectionalQuadtree &from, int fromNode, const float energy[4],
+                       float total, double energyThreshold, int depth, int maxDepth);
+
+    std::vector<Node> nodes;
+    uint64_t sampleCount;
+};
+
+// Spatio-directional tree of the incident radiance (Mueller et al. 2017,
+// "Practical Path Guiding for Efficient Light-Transport Simulation").
+//
+// A binary tree splits the scene bounds, cycling through the axes, and
+// every leaf holds two directional quadtrees: one that learns from the
+// samples of the current pass, and one, learned in the previous pass,
+// that guides the paths. After each training pass the leaves that
+// recorded enough samples are split, the quadtrees refined to the new
+// energy, and the learned ones take over the guiding. Samples are
+// recorded lock-free from all the render threads; the tree may only be
+// refined between passes.
+class SDTree
+{
+public:
+    SDTree(const PathGuidingSettings &settings_ = PathGuidingSettings());
+
+    // Learned distribution around x, or nullptr where nothing has been
+    // learned yet
+    const DirectionalQuadtree* getDistribution(const Vector3D &x) const;
+
+    // Mixture of cosine-weighted (BSDF) sampling around n and the learned
+    // distribution at x: fills wi and returns its solid angle density
+    double sampleDirection(const Vector3D &x, const Vector3D &n, double u1, double u2,
+                           Vector3D &wi) const;
+
+    // Records the radiance Li arriving at x from wi, sampled with
+    // density pdf. Ignored once the training is over
+    void record(const Vector3D &x, const Vector3D &wi, const Vector3D &Li, double pdf);
+
+    // Refines the tree with the samples of training pass 'pass' (0-based)
+    void endPass(int pass);
+
+    // Forgets what was learned, to train again from the first pass
+    void reset();
+
+    bool isTraining() const;
+    const PathGuidingSettings& getSettings() const;
+    size_t getLeafCount() const;
+
+private:
+    struct Node
+    {
+        uint32_t child[2]; // 0 marks a leaf
+        uint32_t leaf;     // Index in leaves, for leaves
+    };
+
+    struct Leaf
+    {
+        DirectionalQuadtree sampling;
+        DirectionalQuadtree building;
+    };
+
+    uint32_t findLeaf(const Vector3D &x) const;
+    void split(uint32_t node, double threshold);
+
+    PathGuidingSettings settings;
+    std::vector<Node> nodes;
+    std::vector<Leaf> leaves;
+
+    // The bounds are only known once the first pass has seen the scene:
+    // until then, every sample falls in the root leaf and only grows the
+    // box of the recorded points
+    bool bounded;
+    bool training;
+    Vector3D boundMin;
+    Vector3D boundSize;
+    Vector3D pointsMin;
+    Vector3D pointsMax;
+};
+
+#endif // SDTREE_H
@@ -0,0 +1,183 @@
+#include "statistics.h"
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+constinit thread_local ThreadStatistics* Statistics::threadBlock = nullptr;
+
+// Every block ever handed out, and the ones whose thread has exited. The
+// blocks of exited threads keep their counts and are reused by new threads.
+static std::mutex blocksMutex;
+static std::vector<std::unique_ptr<ThreadStatistics>> allBlocks;
+static std::vector<ThreadStatistics*> freeBlocks;
+
+namespace
+{
+// Returns the block of its thread to the free list when the thread exits
+struct BlockReleaser
+{
+    ThreadStatistics* block = nullptr;
+    ~BlockReleaser()
+    {
+        std::lock_guard<std::mutex> lock(blocksMutex);
+        freeBlocks.push_back(block);
+    }
+};
+}
+
+static const char* counterNames[(int)StatCounter::Count] = {
+    "cameraRays", "closestHitQueries", "closestHits", "anyHitQueries", "anyHitsOccluded",
+    "sphereTests", "planeTests", "squareTests", "bvhNodeVisits", "materialEvaluations", "aoCacheLookups", "aoCacheHits",
+    "irradianceCacheLookups", "irradianceCacheHits", "irradianceRecords", "radianceCacheLookups",
+    "radianceCacheHits", "globalPhotons", "causticPhotons"
+};
+
+bool Statistics::isEnabled()
+{
+#ifdef ACG_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+ThreadStatistics* Statistics::acquireBlock()
+{
+    static thread_local BlockReleaser releaser;
+
+    std::lock_guard<std::mutex> lock(blocksMutex);
+    if (freeBlocks.empty())
+    {
+        allBlocks.push_back(std::make_unique<ThreadStatistics>());
+        memset(allBlocks.back().get(), 0, sizeof(ThreadStatistics));
+        releaser.block = allBlocks.back().get();
+    }
+    else
+    {
+        releaser.block = freeBlocks.back();
+        freeBlocks.pop_back();
+    }
+    return releaser.block;
+}
+
+void Statistics::reset()
+{
+    std::lock_guard<std::mutex> lock(blocksMutex);
+    for (auto &block : allBlocks)
+        memset(block.get(), 0, sizeof(ThreadStatistics));
+}
+
+StatisticsReport Statistics::report(double seconds)
+{
+    StatisticsReport result;
+    result.seconds = seconds;
+
+    std::lock_guard<std::mutex> lock(blocksMutex);
+    for (auto &block : allBlocks)
+    {
+        for (int c = 0; c < (int)StatCounter::Count; c++)
+            result.counters[c] += block->counters[c];
+        for (int d = 0; d < StatMaxPathDepth; d++)
+            result.pathVertices[d] += block->pathVertices[d];
+    }
+    return result;
+}
+
+
+StatisticsReport::StatisticsReport() : seconds(0.0)
+{
+    memset(counters, 0, sizeof(counters));
+    memset(pathVertices, 0, sizeof(pathVertices));
+}
+
+static double ratio(double a, double b)
+{
+    return b > 0.0 ? a / b : 0.0;
+}
+
+std::string StatisticsReport::toString() const
+{
+    if (!Statistics::isEnabled())
+        return "Render statistics disabled (build with ACG_STATS)\n";
+
+    uint64_t rays = get(StatCounter::ClosestHitQueries) + get(StatCounter::AnyHitQueries);
+    uint64_t tests = get(StatCounter::SphereTests) + get(StatCounter::PlaneTests)
+                   + get(StatCounter::SquareTests);
+    uint64_t vertices = 0;
+    for (int d = 0; d < StatMaxPathDepth; d++)
+        vertices += pathVertices[d];
+
+    std::ostringstream s;
+    s.setf(std::ios::fixed);
+    s.precision(3);
+    s << "Render statistics (" << seconds << " s)\n";
+    s << "  Camera rays          " << get(StatCounter::CameraRays) << " ("
+      << ratio(get(StatCounter::CameraRays), seconds) * 1e-6 << " Mrays/s)\n";
+    s << "  Closest-hit rays     " << get(StatCounter::ClosestHitQueries) << " ("
+      << ratio(get(StatCounter::ClosestHitQueries), seconds) * 1e-6 << " Mrays/s, "
+      << 100.0 * ratio(get(StatCounter::ClosestHits), get(StatCounter::ClosestHitQueries)) << "% hit)\n";
+    s << "  Any-hit rays         " << get(StatCounter::AnyHitQueries) << " ("
+      << ratio(get(StatCounter::AnyHitQueries), seconds) * 1e-6 << " Mrays/s, "
+      << 100.0 * ratio(get(StatCounter::AnyHitsOccluded), get(StatCounter::AnyHitQueries)) << "% occluded)\n";
+    s << "  All rays             " << rays << " (" << ratio(rays, seconds) * 1e-6 << " Mrays/s)\n";
+    s << "  Intersection tests   " << tests << " (" << ratio(tests, rays) << " per ray: "
+      << get(StatCounter::SphereTests) << " sphere, " << get(StatCounter::PlaneTests) << " plane, "
+      << get(StatCounter::SquareTests) << " square)\n";
+    if (get(StatCounter::BVHNodeVisits) > 0)
+        s << "  BVH node visits      " << get(StatCounter::BVHNodeVisits) << " ("
+          << ratio(get(StatCounter::BVHNodeVisits), rays) << " per ray)\n";
+    s << "  Material evaluations " << get(StatCounter::MaterialEvaluations) << "\n";
+    if (get(StatCounter::AOCacheLookups) > 0)
+        s << "  AO cache lookups     " << get(StatCounter::AOCacheLookups) << " ("
+          << 100.0 * ratio(get(StatCounter::AOCacheHits), get(StatCounter::AOCacheLookups)) << "% hits)\n";
+    if (get(StatCounter::IrradianceCacheLookups) > 0)
+        s << "  Irradiance cache     " << get(StatCounter::IrradianceCacheLookups) << " lookups ("
+          << 100.0 * ratio(get(StatCounter::IrradianceCacheHits), get(StatCounter::IrradianceCacheLookups))
+          << "% hits), " << get(StatCounter::IrradianceRecords) << " records\n";
+    if (get(StatCounter::RadianceCacheLookups) > 0)
+        s << "  Radiance cache       " << get(StatCounter::RadianceCacheLookups) << " lookups ("
+          << 100.0 * ratio(get(StatCounter::RadianceCacheHits), get(StatCounter::RadianceCacheLookups))
+          << "% hits)\n";
+    if (get(StatCounter::GlobalPhotons) + get(StatCounter::CausticPhotons) > 0)
+        s << "  Photon maps          " << get(StatCounter::GlobalPhotons) << " global, "
+          << get(StatCounter::CausticPhotons) << " caustic photons\n";
+    s << "  Path vertices        " << vertices << " ("
+      << ratio(vertices, get(StatCounter::CameraRays)) << " per camera ray)\n";
+    for (int d = 0; d < StatMaxPathDepth; d++)
+    {
+        if (pathVertices[d] == 0)
+            continue;
+        s << "    depth " << d << (d == StatMaxPathDepth - 1 ? "+" : "") << ": " << pathVertices[d] << "\n";
+    }
+    return s.str();
+}
+
+std::string StatisticsReport::toJSON() const
+{
+    uint64_t rays = get(StatCounter::ClosestHitQueries) + get(StatCounter::AnyHitQueries);
+    uint64_t tests = get(StatCounter::SphereTests) + get(StatCounter::PlaneTests)
+                   + get(StatCounter::SquareTests);
+
+    std::ostringstream s;
+    s << "{\n";
+    s << "  \"enabled\": " << (Statistics::isEnabled() ? "true" : "false") << ",\n";
+    s << "  \"seconds\": " << seconds << ",\n";
+    s << "  \"counters\": {";
+    for (int c = 0; c < (int)StatCounter::Count; c++)
+        s << (c ? ", " : " ") << "\"" << counterNames[c] << "\": " << counters[c];
+    s << " },\n";
+    s << "  \"raysPerSecond\": { \"camera\": " << ratio(get(StatCounter::CameraRays), seconds)
+      << ", \"closestHit\": " << ratio(get(StatCounter::ClosestHitQueries), seconds)
+      << ", \"anyHit\": " << ratio(get(StatCounter::AnyHitQueries), seconds)
+      << ", \"all\": " << ratio(rays, seconds) << " },\n";
+    s << "  \"testsPerRay\": " << ratio(tests, rays) << ",\n";
+    s << "  \"pathVerticesByDepth\": [";
+    for (int d = 0; d < StatMaxPathDepth; d++)
+        s << (d ? ", " : "") << pathVertices[d];
+    s << "]\n";
+    s << "}\n";
+    return s.str();
+}
@@ -0,0 +1,96 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <cstdint>
+#include <string>
+
+// Events counted on the rendering hot paths
+enum class StatCounter
+{
+    CameraRays,          // Camera rays generated
+    ClosestHitQueries,   // Utils::getClosestIntersection() calls
+    ClosestHits,         // ... that found a hit
+    AnyHitQueries,       // Occlusion rays (Utils::isOccluded(), Utils::countOccluded())
+    AnyHitsOccluded,     // ... that found an occluder
+    SphereTests,         // Ray/shape intersection tests, by shape type
+    PlaneTests,
+    SquareTests,
+    BVHNodeVisits,       // Bounding boxes tested by BVH traversals
+    MaterialEvaluations, // BRDF evaluations (Material::getReflectance())
+    AOCacheLookups,      // AmbientOcclusionCache::lookup() calls
+    AOCacheHits,         // ... answered from the cache
+    IrradianceCacheLookups, // IrradianceCache::lookup() calls
+    IrradianceCacheHits,    // ... interpolated from existing records
+    IrradianceRecords,      // Records computed
+    RadianceCacheLookups,   // RadianceCache::lookup() calls
+    RadianceCacheHits,      // ... that ended the path with a cached value
+    GlobalPhotons,          // Photons stored by PhotonMappingIntegrator::preprocess()
+    CausticPhotons,
+    Count
+};
+
+// Path vertices are binned by depth; the last bin holds every deeper vertex
+static const int StatMaxPathDepth = 16;
+
+// Counters of a single thread. Each thread increments its own block, so
+// counting needs neither atomics nor locks.
+struct ThreadStatistics
+{
+    uint64_t counters[(int)StatCounter::Count];
+    uint64_t pathVertices[StatMaxPathDepth];
+};
+
+// Totals of every thread, with derived rates
+class StatisticsReport
+{
+public:
+    StatisticsReport();
+
+    std::string toString() const;
+    std::string toJSON() const;
+
+    uint64_t get(StatCounter counter) const { return counters[(int)counter]; }
+
+    double seconds;
+    uint64_t counters[(int)StatCounter::Count];
+    uint64_t pathVertices[StatMaxPathDepth];
+};
+
+// Per-thread hot-path counters, compiled out unless ACG_STATS is defined
+// (CMake option ACG_STATS). Increment them through the STAT_* macros.
+class Statistics
+{
+public:
+    static bool isEnabled();
+
+    // Zeroes the counters of every thread. Call it between renders only.
+    static void reset();
+
+    // Sums the counters of every thread. Call it between renders only.
+    static StatisticsReport report(double seconds);
+
+    // Counters of the calling thread
+    static ThreadStatistics& local()
+    {
+        if (threadBlock == nullptr)
+            threadBlock = acquireBlock();
+        return *threadBlock;
+    }
+
+private:
+    static ThreadStatistics* acquireBlock();
+    static constinit thread_local ThreadStatistics* threadBlock;
+};
+
+#ifdef ACG_STATS
+#define STAT_INC(counter) (Statistics::local().counters[(int)StatCounter::counter]++)
+#define STAT_ADD(counter, n) (Statistics::local().counters[(int)StatCounter::counter] += (n))
+#define STAT_PATH_VERTEX(depth) \
+    (Statistics::local().pathVertices[(depth) < StatMaxPathDepth ? (depth) : StatMaxPathDepth - 1]++)
+#else
+#define STAT_INC(counter) ((void)0)
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_PATH_VERTEX(depth) ((void)0)
+#endif
+
+#endif // STATISTICS_H
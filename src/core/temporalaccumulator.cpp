@@ -0,0 +1,111 @@
+#include "temporalaccumulator.h"
+
+#include <cmath>
+
+#include "parallel.h"
+#include "../cameras/perspective.h"
+
+TemporalAccumulator::TemporalAccumulator(const TemporalSettings &settings_)
+    : settings(settings_), width(0), height(0), reuseRatio(0.0)
+{ }
+
+void TemporalAccumulator::reset()
+{
+    history.clear();
+}
+
+double TemporalAccumulator::getReuseRatio() const
+{
+    return reuseRatio;
+}
+
+void TemporalAccumulator::accumulate(const PerspectiveCamera &camera, Film &film)
+{
+    bool hasHistory = !history.empty() && width == film.getWidth() && height == film.getHeight();
+    width = film.getWidth();
+    height = film.getHeight();
+    next.resize(width * height);
+
+    PerspectiveCamera previous(previousCameraToWorld, camera.fov, camera.film);
+    Vector3D previousPosition = previous.getPosition();
+
+    std::vector<size_t> reused(numWorkerThreads(), 0);
+    parallelFor(height, [&](size_t h, int thread)
+    {
+        for (size_t w = 0; w < width; w++)
+        {
+            const PixelFeatures &features = film.getPixelFeatures(w, h);
+            Vector3D radiance = film.getPixelValue(w, h);
+            Ray ray = camera.generateRay((w + 0.5) / width, (h + 0.5) / height);
+            bool background = features.depth <= 0.0;
+            Vector3D normal = features.normal.lengthSq() > 0.0 ? features.normal.normalized() : Vector3D(0.0);
+            Vector3D point = ray.o + ray.d * features.depth;
+
+            // Pixel of the point (of the direction, for the background)
+            // in the previous frame, as the four pixels around it
+            double x, y;
+            Vector3D historyRadiance(0.0);
+            double historyFrames = 0.0, weightSum = 0.0;
+            if (hasHistory && previous.worldToRaster(background ? previousPosition + ray.d : point, x, y))
+            {
+                double fx = x - 0.5, fy = y - 0.5;
+                int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+                fx -= x0;
+                fy -= y0;
+                for (int tap = 0; tap < 4; tap++)
+                {
+                    int tx = x0 + (tap & 1), ty = y0 + (tap >> 1);
+                    if (tx < 0 || ty < 0 || tx >= (int)width || ty >= (int)height)
+                        continue;
+                    const HistoryPixel &stored = history[ty * width + tx];
+                    if (background != (stored.depth <= 0.0f) || stored.shapeId != features.shapeId ||
+                        std::abs(stored.emissive - features.emissive) > settings.coverageTolerance)
+                        continue;
+                    if (!background)
+                    {
+                        // The stored point must lie on the plane of the
+                        // current one (a depth test that holds on
+                        // surfaces seen at grazing angles), facing alike
+                        Ray storedRay = previous.generateRay((tx + 0.5) / width, (ty + 0.5) / height);
+                        Vector3D storedPoint = storedRay.o + storedRay.d * stored.depth;
+                        double distance = (storedPoint - previousPosition).length();
+                        if (std::abs(dot(storedPoint - point, normal)) > settings.depthTolerance * distance ||
+                            dot(stored.normal, normal) < settings.normalThreshold)
+                            continue;
+                    }
+                    double weight = (tap & 1 ? fx : 1.0 - fx) * (tap >> 1 ? fy : 1.0 - fy);
+                    historyRadiance += stored.radiance * weight;
+                    historyFrames += stored.frames * weight;
+                    weightSum += weight;
+                }
+            }
+
+            HistoryPixel &pixel = next[h * width + w];
+            pixel.normal = normal;
+            pixel.depth = (float)features.depth;
+            pixel.emissive = (float)features.emissive;
+            pixel.shapeId = features.shapeId;
+            if (weightSum > 1e-3)
+            {
+                historyRadiance = historyRadiance / weightSum;
+                pixel.frames = (float)std::min(historyFrames / weightSum + 1.0, (double)settings.maxFrames);
+                pixel.radiance = historyRadiance + (radiance - historyRadiance) / pixel.frames;
+                reused[thread]++;
+            }
+            else
+            {
+                pixel.frames = 1.0f;
+                pixel.radiance = radiance;
+            }
+            film.setPixelValue(w, h, pixel.radiance);
+        }
+    });
+
+    size_t totalReused = 0;
+    for (size_t count : reused)
+        totalReused += count;
+    reuseRatio = (double)totalReused / (width * height);
+
+    history.swap(next);
+    previousCameraToWorld = camera.cameraToWorld;
+}
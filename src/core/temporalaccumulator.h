@@ -0,0 +1,80 @@
+#ifndef TEMPORALACCUMULATOR_H
+#define TEMPORALACCUMULATOR_H
+
+#include <vector>
+
+#include "film.h"
+#include "matrix4x4.h"
+
+class PerspectiveCamera;
+
+// Reprojection and rejection options of the temporal accumulation
+struct TemporalSettings
+{
+    TemporalSettings() :
+        maxFrames(32), depthTolerance(0.03), normalThreshold(0.9), coverageTolerance(0.2)
+    { }
+
+    int maxFrames;            // Frames a pixel averages at most: the newest one always weighs
+                              // 1 / maxFrames or more, so that changes of the lighting come through
+    double depthTolerance;    // Largest distance of the stored point to the plane of the current
+                              // one, relative to its distance to the previous camera
+    double normalThreshold;   // Smallest cosine between the current and the stored normal
+    double coverageTolerance; // Largest difference of the fraction of the pixel covered by lights
+};
+
+// Temporal accumulation for previews with a moving camera.
+//
+// Every pixel of a new frame is reprojected into the previous one: its
+// first hit, rebuilt from the camera ray through the pixel center and the
+// depth feature of the film, is projected with the previous camera
+// transform. The accumulated radiance there is read bilinearly, from the
+// taps of the same shape whose depth, normal and coverage by lights
+// agree with the point (the last two keep lights, orders of magnitude
+// brighter, from bleeding into the walls that share their plane and into
+// the pixels of their edges); where none does (a disocclusion, or the edge of the
+// image) the pixel starts over. The rest keep averaging their frames,
+// the new one weighing 1 / frames (an exponential average past
+// TemporalSettings::maxFrames), so a preview of a few samples per pixel
+// converges over the frames as if it stood still. The frames must be
+// rendered with different sampler seeds.
+//
+// Only the camera may move: shapes moving under a still camera keep the
+// radiance of where they were until their depth or normal changes.
+class TemporalAccumulator
+{
+public:
+    TemporalAccumulator(const TemporalSettings &settings_ = TemporalSettings());
+
+    // Blends the radiance of film, just rendered by camera, with the
+    // reprojected history, writes the result back into film and keeps it
+    // as the history of the next frame
+    void accumulate(const PerspectiveCamera &camera, Film &film);
+
+    // Forgets the history (cuts, scene changes)
+    void reset();
+
+    // Fraction of the pixels of the last frame that reused their history
+    double getReuseRatio() const;
+
+private:
+    struct HistoryPixel
+    {
+        Vector3D radiance;
+        Vector3D normal;
+        float depth;  // 0 on the background
+        float frames; // Frames averaged
+        float emissive;
+        int shapeId;
+    };
+
+    TemporalSettings settings;
+    std::vector<HistoryPixel> history;
+    std::vector<HistoryPixel> next;
+    size_t width;
+    size_t height;
+    Matrix4x4 previousCameraToWorld;
+    double reuseRatio;
+};
+
+#endif // TEMPORALACCUMULATOR_H
@@ -1,5 +1,11 @@
 #include "utils.h"
 
+#include "sampler.h"
+#include "statistics.h"
+#include "../lightsources/lightsource.h"
+
+#include <algorithm>
+
 Utils::Utils()
 { }
 
@@ -10,27 +16,133 @@ double Utils::degreesToRadians(double degrees)
 
 
 
-bool Utils::hasIntersection(const Ray& cameraRay, const std::vector<Shape*>& objectsList) //or Shadow Ray
+// Last occluder found by each thread. Occlusion rays traced one after the
+// other (the samples of a pixel, the rays of a batch) tend to be blocked
+// by the same shape, so it is tested first. The index is only trusted for
+// the list it was found in.
+struct OccluderCache
 {
+    const std::vector<Shape*>* objectsList = nullptr;
+    size_t index = 0;
+};
+
+static thread_local OccluderCache occluderCache;
+
+bool Utils::isOccluded(const Ray& ray, const std::vector<Shape*>& objectsList) //or Shadow Ray
+{
+    STAT_INC(AnyHitQueries);
+
+    size_t numObjects = objectsList.size();
+    size_t cached = occluderCache.objectsList == &objectsList ? occluderCache.index : numObjects;
+    if (cached < numObjects && objectsList[cached]->rayIntersectP(ray))
+    {
+        STAT_INC(AnyHitsOccluded);
+        return true;
+    }
 
     // For each object on the scene...
-    for(size_t objIndex = 0; objIndex < objectsList.size(); objIndex ++)
+    for(size_t objIndex = 0; objIndex < numObjects; objIndex ++)
     {
-          // Get the current object
-          const Shape *obj = objectsList.at(objIndex);
-          if (obj->rayIntersectP(cameraRay))
+          if (objIndex == cached)
+              continue;
+
+          if (objectsList[objIndex]->rayIntersectP(ray))
+          {
+              occluderCache.objectsList = &objectsList;
+              occluderCache.index = objIndex;
+              STAT_INC(AnyHitsOccluded);
               return true;
+          }
     }   
 
     return false;
 }
 
+int Utils::countOccluded(const Ray* rays, int count, const std::vector<Shape*>& objectsList, bool* occluded)
+{
+    if (count <= 0)
+        return 0;
+
+    // Culling only pays off when shared by several rays
+    if (count == 1)
+    {
+        bool rayOccluded = isOccluded(rays[0], objectsList);
+        if (occluded)
+            occluded[0] = rayOccluded;
+        return rayOccluded ? 1 : 0;
+    }
+
+    // Farthest point reachable by the batch
+    double reach = 0.0;
+    for (int r = 0; r < count; r++)
+        reach = std::max(reach, rays[r].maxT * rays[r].d.length());
+
+    // Shapes that some ray of the batch can reach. The cached occluder,
+    // if still a candidate, goes first
+    static thread_local std::vector<const Shape*> candidates;
+    candidates.clear();
+    size_t cached = occluderCache.objectsList == &objectsList ? occluderCache.index : objectsList.size();
+    size_t cachedCandidate = 0;
+    bool hasCachedCandidate = false;
+    for (size_t objIndex = 0; objIndex < objectsList.size(); objIndex++)
+    {
+        if (!objectsList[objIndex]->overlapsSphere(rays[0].o, reach))
+            continue;
+        if (objIndex == cached)
+        {
+            hasCachedCandidate = true;
+            cachedCandidate = candidates.size();
+        }
+        candidates.push_back(objectsList[objIndex]);
+    }
+    if (hasCachedCandidate)
+        std::swap(candidates[0], candidates[cachedCandidate]);
+
+    int numOccluded = 0;
+    for (int r = 0; r < count; r++)
+    {
+        STAT_INC(AnyHitQueries);
+
+        bool rayOccluded = false;
+        for (size_t c = 0; c < candidates.size(); c++)
+        {
+            if (candidates[c]->rayIntersectP(rays[r]))
+            {
+                // Keep the occluder in front for the next rays
+                std::swap(candidates[0], candidates[c]);
+                rayOccluded = true;
+                break;
+            }
+        }
+
+        if (rayOccluded)
+        {
+            STAT_INC(AnyHitsOccluded);
+            numOccluded++;
+        }
+        if (occluded)
+            occluded[r] = rayOccluded;
+    }
+
+    // Remember the last occluder for the next queries of this thread
+    if (numOccluded > 0)
+    {
+        auto found = std::find(objectsList.begin(), objectsList.end(), candidates[0]);
+        occluderCache.objectsList = &objectsList;
+        occluderCache.index = (size_t)(found - objectsList.begin());
+    }
+
+    return numOccluded;
+}
+
 
 
 bool Utils::getClosestIntersection(const Ray& cameraRay, const std::vector<Shape*>& objectsList, Intersection& its) //or Closest Hit Ray
 {
     //std::cout << "Need to implement the function Utils::getClosestIntersection() in the file utils.cpp" << std::endl;
 
+    STAT_INC(ClosestHitQueries);
+
     bool hasIntersection = false;
 
     for (size_t objIndex = 0; objIndex < objectsList.size(); objIndex++)
@@ -40,6 +152,8 @@ bool Utils::getClosestIntersection(const Ray& cameraRay, const std::vector<Shape
         if (obj->rayIntersect(cameraRay, its))
             hasIntersection =  true;
     }
+    if (hasIntersection)
+        STAT_INC(ClosestHits);
     return hasIntersection;
 }
 
@@ -91,3 +205,71 @@ Vector3D Utils::computeReflectionDirection(const Vector3D &Direction, const Vect
     return wr;
 }
 
+bool Utils::sampleSpecular(const Vector3D &n, const Vector3D &wo, const Material &mat,
+                           Vector3D &wi, Vector3D &weight)
+{
+    if (mat.hasSpecular())
+    {
+        wi = (2.0 * dot(n, wo) * n - wo).normalized();
+        weight = mat.getDiffuseReflectance();
+        return true;
+    }
+
+    double n_dot_wo = dot(n, wo);
+    bool entering = n_dot_wo > 0;
+    double mu_t = mat.getIndexOfRefraction();
+    Vector3D n_refr = entering ? n : -n;
+    double mu = entering ? mu_t : 1.0 / mu_t;
+    double cos_theta = std::abs(n_dot_wo);
+    double radicand = 1.0 - mu * mu * (1.0 - cos_theta * cos_theta);
+    if (radicand < 0.0)
+        return false;
+
+    wi = (-mu * wo + n_refr * (mu * cos_theta - std::sqrt(radicand))).normalized();
+    weight = Vector3D(1.0);
+    return true;
+}
+
+bool Utils::isSpecular(const Material &mat)
+{
+    return mat.hasSpecular() || mat.hasTransmission();
+}
+
+Vector3D Utils::computeDirectRadiance(const Vector3D &x, const Vector3D &n, const Vector3D &wo,
+                                      const Material &mat, int depth,
+                                      const std::vector<Shape*> &objectsList,
+                                      const std::vector<LightSource*> &lsList)
+{
+    Vector3D L_dir(0.0);
+    Sampler& rng = Sampler::active();
+    const int numLights = (int)lsList.size();
+    for (int lightIndex = 0; lightIndex < numLights; lightIndex++)
+    {
+        const LightSource* light = lsList[lightIndex];
+
+        double u, v;
+        rng.get2D(SampleDimension::Light, depth, u, v, lightIndex, numLights);
+        Vector3D y = light->generatePoint(u, v);
+
+        Vector3D toLight = y - x;
+        double distance2 = toLight.lengthSq();
+        double distance = std::sqrt(distance2);
+        Vector3D wi = toLight / distance;
+        double cosX = dot(n, wi);
+        double cosY = -dot(wi, light->getNormal());
+        if (cosX <= 0.0 || cosY <= 0.0)
+            continue;
+
+        Ray shadowRay(x, wi);
+        shadowRay.maxT = distance - Epsilon;
+        if (isOccluded(shadowRay, objectsList))
+            continue;
+
+        // Le * BRDF * G / pdf, with pdf = 1 / area
+        L_dir += light->getIntensity() * mat.getReflectance(n, wo, wi)
+               * (cosX * cosY / distance2 * light->getArea());
+    }
+
+    return L_dir;
+}
+
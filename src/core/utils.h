@@ -9,6 +9,8 @@
 #include "ray.h"
 #include "../shapes/shape.h"
 
+class LightSource;
+
 
 #define PBSTR "||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||"
 #define PBWIDTH 60
@@ -19,7 +21,18 @@ public:
     Utils();
 
     static bool getClosestIntersection(const Ray &cameraRay, const std::vector<Shape*> &objectsList, Intersection &its);
-    static bool hasIntersection(const Ray &ray, const std::vector<Shape*> &objectsList);
+
+    // Occlusion (any-hit) queries: whether anything lies on the ray
+    // segment [minT, maxT]. They stop at the first hit found and try the
+    // last occluder found by the calling thread first.
+    static bool isOccluded(const Ray &ray, const std::vector<Shape*> &objectsList);
+    // Batched form for rays leaving the same point (ambient occlusion,
+    // shadow rays towards several lights). Shapes out of reach of every
+    // ray are culled once for the whole batch. Returns the number of
+    // occluded rays and, if occluded is given, the result of every ray.
+    static int countOccluded(const Ray *rays, int count, const std::vector<Shape*> &objectsList,
+                             bool *occluded = nullptr);
+
     static Vector3D scalarToRGB(double scalar);
     static double degreesToRadians(double degrees);
 
@@ -27,6 +40,24 @@ public:
 
     static Vector3D computeReflectionDirection(const Vector3D &Direction, const Vector3D &normal);
 
+    // Perfect specular bounce at a Mirror (reflection) or Transmissive
+    // (refraction) surface with normal n, for the light leaving towards
+    // wo: wi is the other direction of the bounce and weight the fraction
+    // of the light carried. False under total internal reflection, where
+    // the path is dropped (as in PurePathTracingIntegrator)
+    static bool sampleSpecular(const Vector3D &n, const Vector3D &wo, const Material &mat,
+                               Vector3D &wi, Vector3D &weight);
+    // Whether mat scatters through sampleSpecular() rather than its BRDF
+    static bool isSpecular(const Material &mat);
+
+    // Radiance reflected at x (normal n) towards wo from one uniform point
+    // on every light, each with its own shadow ray. The points take the
+    // Light dimension of the active sampler at the given path depth
+    static Vector3D computeDirectRadiance(const Vector3D &x, const Vector3D &n, const Vector3D &wo,
+                                          const Material &mat, int depth,
+                                          const std::vector<Shape*> &objectsList,
+                                          const std::vector<LightSource*> &lsList);
+
 
 
     static void printProgress(double percentage) {
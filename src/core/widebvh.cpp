@@ -0,0 +1,564 @@
+#include "widebvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <type_traits>
+
+#include "parallel.h"
+
+// Inverted box of the unused slots
+static const BVHNode EmptyChild = { { INFINITY, INFINITY, INFINITY }, { -INFINITY, -INFINITY, -INFINITY }, 0, 0, 0 };
+// Refits of fewer nodes are not worth the worker threads
+static const size_t ParallelRefitNodes = 1024;
+// Refits of more than one node in this many sweep the whole tree instead
+// of climbing from each node
+static const size_t RefitSweepRatio = 32;
+
+static bool slotUsed(const WideBVHNode &node, int slot)
+{
+    return node.bounds[0][slot] <= node.bounds[3][slot];
+}
+
+static double boxArea(const float boundsMin[3], const float boundsMax[3])
+{
+    double dx = boundsMax[0] - boundsMin[0];
+    double dy = boundsMax[1] - boundsMin[1];
+    double dz = boundsMax[2] - boundsMin[2];
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+static double slotArea(const WideBVHNode &node, int slot)
+{
+    double dx = node.bounds[3][slot] - node.bounds[0][slot];
+    double dy = node.bounds[4][slot] - node.bounds[1][slot];
+    double dz = node.bounds[5][slot] - node.bounds[2][slot];
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+WideBVH::WideBVH() :
+    compressed(false), sahArea(0.0), builtSahCost(0.0)
+{ }
+
+void WideBVH::build(const BVH &bvh, bool compressed_)
+{
+    settings = bvh.getSettings();
+    compressed = compressed_;
+    nodes.clear();
+    compressedNodes.clear();
+    parents.clear();
+    leafSlots.clear();
+    primitiveIndices = bvh.getPrimitiveIndices();
+    if (bvh.empty())
+        return;
+
+    Vector3D treeMin, treeMax;
+    bvh.getBounds(treeMin, treeMax);
+    boundsMin[0] = treeMin.x; boundsMin[1] = treeMin.y; boundsMin[2] = treeMin.z;
+    boundsMax[0] = treeMax.x; boundsMax[1] = treeMax.y; boundsMax[2] = treeMax.z;
+
+    const BVHNode &root = bvh.getNodes()[0];
+    if (root.count > 0)
+    {
+        // A single leaf: a root with one child
+        nodes.resize(1);
+        setChild(nodes[0], 0, root);
+        for (int slot = 1; slot < 4; slot++)
+            setChild(nodes[0], slot, EmptyChild);
+        nodes[0].axes[0] = nodes[0].axes[1] = nodes[0].axes[2] = 0;
+    }
+    else
+        collapse(bvh, 0);
+
+    if (compressed)
+    {
+        // The nodes keep their indices
+        compressedNodes.resize(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++)
+            compressedNodes[i] = compress(nodes[i]);
+        std::vector<WideBVHNode>().swap(nodes);
+    }
+}
+
+bool WideBVH::empty() const
+{
+    return nodes.empty() && compressedNodes.empty();
+}
+
+void WideBVH::getBounds(Vector3D &boundsMin_, Vector3D &boundsMax_) const
+{
+    boundsMin_ = Vector3D(boundsMin[0], boundsMin[1], boundsMin[2]);
+    boundsMax_ = Vector3D(boundsMax[0], boundsMax[1], boundsMax[2]);
+}
+
+size_t WideBVH::getNodeCount() const
+{
+    return compressed ? compressedNodes.size() : nodes.size();
+}
+
+size_t WideBVH::getMemoryBytes() const
+{
+    return nodes.size() * sizeof(WideBVHNode) + compressedNodes.size() * sizeof(CompressedWideBVHNode) +
+           primitiveIndices.size() * sizeof(uint32_t);
+}
+
+void WideBVH::save(std::ostream &out) const
+{
+    uint8_t isCompressed = compressed;
+    out.write(reinterpret_cast<const char*>(&settings), sizeof(settings));
+    out.write(reinterpret_cast<const char*>(&isCompressed), sizeof(isCompressed));
+    out.write(reinterpret_cast<const char*>(boundsMin), sizeof(boundsMin));
+    out.write(reinterpret_cast<const char*>(boundsMax), sizeof(boundsMax));
+    writeBinaryArray(out, nodes);
+    writeBinaryArray(out, compressedNodes);
+    writeBinaryArray(out, primitiveIndices);
+}
+
+template <typename Node>
+bool WideBVH::validTree(const std::vector<Node> &nodes_, const std::vector<uint32_t> &indices)
+{
+    // Every node must be reached once from the root. A node pushes up to
+    // four children where it popped one, so the stack holds three entries
+    // per level of the nodes above
+    std::vector<bool> reached(nodes_.size(), false);
+    std::vector<std::pair<uint32_t, int>> stack;
+    if (!nodes_.empty())
+        stack.push_back({ 0, 0 });
+    while (!stack.empty())
+    {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        if (index >= nodes_.size() || reached[index] || 3 * depth + 4 > StackSize)
+            return false;
+        reached[index] = true;
+        const Node &node = nodes_[index];
+        if (node.axes[0] > 2 || node.axes[1] > 2 || node.axes[2] > 2)
+            return false;
+        for (int slot = 0; slot < 4; slot++)
+        {
+            // Slots the traversal or a refit may enter: in use, or with
+            // a box that is not inverted
+            bool used = usedSlots(node) & (1 << slot);
+            if constexpr (std::is_same_v<Node, WideBVHNode>)
+                used = slotUsed(node, slot) ||
+                       !(node.bounds[0][slot] > node.bounds[3][slot] || node.bounds[1][slot] > node.bounds[4][slot] ||
+                         node.bounds[2][slot] > node.bounds[5][slot]);
+            if (!used)
+                continue;
+            if (node.count[slot] > 0)
+            {
+                if ((uint64_t)node.child[slot] + node.count[slot] > indices.size())
+                    return false;
+            }
+            else
+                stack.push_back({ node.child[slot], depth + 1 });
+        }
+    }
+    return std::find(reached.begin(), reached.end(), false) == reached.end();
+}
+
+bool WideBVH::load(std::istream &in, size_t primitives)
+{
+    BVHSettings loadedSettings;
+    uint8_t isCompressed;
+    float loadedMin[3], loadedMax[3];
+    std::vector<WideBVHNode> loadedNodes;
+    std::vector<CompressedWideBVHNode> loadedCompressed;
+    std::vector<uint32_t> loadedIndices;
+    if (!in.read(reinterpret_cast<char*>(&loadedSettings), sizeof(loadedSettings)) ||
+        !in.read(reinterpret_cast<char*>(&isCompressed), sizeof(isCompressed)) ||
+        !in.read(reinterpret_cast<char*>(loadedMin), sizeof(loadedMin)) ||
+        !in.read(reinterpret_cast<char*>(loadedMax), sizeof(loadedMax)) ||
+        !readBinaryArray(in, loadedNodes) || !readBinaryArray(in, loadedCompressed) ||
+        !readBinaryArray(in, loadedIndices))
+        return false;
+    // The nodes are those of one layout, and none for no primitives
+    size_t loadedCount = isCompressed ? loadedCompressed.size() : loadedNodes.size();
+    if (!validPrimitiveIndices(loadedIndices, primitives) ||
+        loadedNodes.size() + loadedCompressed.size() != loadedCount || (loadedCount == 0) != (primitives == 0) ||
+        !validTree(loadedNodes, loadedIndices) || !validTree(loadedCompressed, loadedIndices))
+        return false;
+
+    settings = loadedSettings;
+    compressed = isCompressed != 0;
+    std::copy(loadedMin, loadedMin + 3, boundsMin);
+    std::copy(loadedMax, loadedMax + 3, boundsMax);
+    nodes = std::move(loadedNodes);
+    compressedNodes = std::move(loadedCompressed);
+    primitiveIndices = std::move(loadedIndices);
+    parents.clear();
+    leafSlots.clear();
+    return true;
+}
+
+void WideBVH::nodeBox(const WideBVHNode &node, float min[3], float max[3])
+{
+    std::fill(min, min + 3, INFINITY);
+    std::fill(max, max + 3, -INFINITY);
+    for (int slot = 0; slot < 4; slot++)
+    {
+        if (!slotUsed(node, slot))
+            continue;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            min[axis] = std::min(min[axis], node.bounds[axis][slot]);
+            max[axis] = std::max(max[axis], node.bounds[3 + axis][slot]);
+        }
+    }
+}
+
+bool WideBVH::setSlotBox(WideBVHNode &node, int slot, const float min[3], const float max[3])
+{
+    bool same = true;
+    for (int axis = 0; axis < 3; axis++)
+        same = same && node.bounds[axis][slot] == min[axis] && node.bounds[3 + axis][slot] == max[axis];
+    if (same)
+        return false;
+    double before = slotArea(node, slot);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        node.bounds[axis][slot] = min[axis];
+        node.bounds[3 + axis][slot] = max[axis];
+    }
+    double weight = node.count[slot] > 0 ? settings.intersectionCost * node.count[slot] : settings.traversalCost;
+    sahArea += (slotArea(node, slot) - before) * weight;
+    return true;
+}
+
+WideBVHNode WideBVH::readNode(uint32_t index) const
+{
+    return compressed ? decompress(compressedNodes[index]) : nodes[index];
+}
+
+void WideBVH::leafBox(const WideBVHNode &node, int slot, const BVHBoundsFunction &boundsOf,
+                      float min[3], float max[3]) const
+{
+    std::fill(min, min + 3, INFINITY);
+    std::fill(max, max + 3, -INFINITY);
+    for (uint32_t k = 0; k < node.count[slot]; k++)
+    {
+        Vector3D boundsMin_, boundsMax_;
+        boundsOf(primitiveIndices[node.child[slot] + k], boundsMin_, boundsMax_);
+        min[0] = std::min(min[0], boundsMin_.x); max[0] = std::max(max[0], boundsMax_.x);
+        min[1] = std::min(min[1], boundsMin_.y); max[1] = std::max(max[1], boundsMax_.y);
+        min[2] = std::min(min[2], boundsMin_.z); max[2] = std::max(max[2], boundsMax_.z);
+    }
+}
+
+bool WideBVH::repack(uint32_t index, const BVHBoundsFunction &boundsOf, double &areaChange)
+{
+    const CompressedWideBVHNode &stored = compressedNodes[index];
+    WideBVHNode before = decompress(stored);
+    WideBVHNode node = before;
+    for (int slot = 0; slot < 4; slot++)
+    {
+        if (!slotUsed(node, slot))
+            continue;
+        float min[3], max[3];
+        if (node.count[slot] > 0)
+            leafBox(node, slot, boundsOf, min, max);
+        else
+            nodeBox(readNode(node.child[slot]), min, max);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.bounds[axis][slot] = min[axis];
+            node.bounds[3 + axis][slot] = max[axis];
+        }
+    }
+
+    CompressedWideBVHNode packed = compress(node);
+    if (std::memcmp(packed.origin, stored.origin, sizeof(packed.origin)) == 0 &&
+        std::memcmp(packed.exponent, stored.exponent, sizeof(packed.exponent)) == 0 &&
+        std::memcmp(packed.bounds, stored.bounds, sizeof(packed.bounds)) == 0)
+        return false;
+    compressedNodes[index] = packed;
+    WideBVHNode after = decompress(packed);
+    for (int slot = 0; slot < 4; slot++)
+    {
+        if (!slotUsed(node, slot))
+            continue;
+        double weight = node.count[slot] > 0 ? settings.intersectionCost * node.count[slot] : settings.traversalCost;
+        areaChange += (slotArea(after, slot) - slotArea(before, slot)) * weight;
+    }
+    return true;
+}
+
+void WideBVH::prepareRefit()
+{
+    if (!parents.empty())
+        return;
+    parents.assign(getNodeCount(), 0);
+    leafSlots.assign(primitiveIndices.size(), 0);
+    sahArea = 0.0;
+    for (uint32_t i = 0; i < getNodeCount(); i++)
+    {
+        WideBVHNode node = readNode(i);
+        for (int slot = 0; slot < 4; slot++)
+        {
+            if (!slotUsed(node, slot))
+                continue;
+            if (node.count[slot] > 0)
+            {
+                for (uint32_t k = 0; k < node.count[slot]; k++)
+                    leafSlots[primitiveIndices[node.child[slot] + k]] = 4 * i + slot;
+                sahArea += slotArea(node, slot) * settings.intersectionCost * node.count[slot];
+                continue;
+            }
+            parents[node.child[slot]] = i;
+            sahArea += slotArea(node, slot) * settings.traversalCost;
+        }
+    }
+    double rootArea = boxArea(boundsMin, boundsMax);
+    builtSahCost = rootArea > 0.0 ? settings.traversalCost + sahArea / rootArea : 0.0;
+}
+
+double WideBVH::refit(const std::vector<uint32_t> &primitives, const BVHBoundsFunction &boundsOf)
+{
+    if (empty())
+        return 1.0;
+    prepareRefit();
+
+    std::vector<uint32_t> slots;
+    for (uint32_t primitive : primitives)
+        slots.push_back(leafSlots[primitive]);
+    std::sort(slots.begin(), slots.end());
+    slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+    // Runs of slots of the same node
+    std::vector<size_t> runs;
+    for (size_t i = 0; i < slots.size(); i++)
+        if (i == 0 || slots[i] / 4 != slots[i - 1] / 4)
+            runs.push_back(i);
+    runs.push_back(slots.size());
+
+    // The leaf slots first, one node each, collecting the changes of
+    // weighted area. Compressed nodes are repacked whole in the climb
+    // below instead, as a node reads the boxes of its children
+    size_t numRuns = runs.size() - 1;
+    std::vector<double> areaChanges(numRuns, 0.0);
+    auto refitNode = [&](size_t run, int)
+    {
+        uint32_t index = slots[runs[run]] / 4;
+        WideBVHNode &node = nodes[index];
+        for (size_t i = runs[run]; i < runs[run + 1]; i++)
+        {
+            int slot = slots[i] % 4;
+            double before = slotArea(node, slot);
+            float min[3], max[3];
+            leafBox(node, slot, boundsOf, min, max);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                node.bounds[axis][slot] = min[axis];
+                node.bounds[3 + axis][slot] = max[axis];
+            }
+            areaChanges[run] += (slotArea(node, slot) - before) * settings.intersectionCost * node.count[slot];
+        }
+    };
+    if (!compressed)
+    {
+        if (numRuns >= ParallelRefitNodes)
+            parallelFor(numRuns, refitNode);
+        else
+            for (size_t run = 0; run < numRuns; run++)
+                refitNode(run, 0);
+    }
+    for (double change : areaChanges)
+        sahArea += change;
+
+    // Then the box of each changed node in the slot of its parent,
+    // children before parents: a child always has a larger index. A slot
+    // (a compressed node) that does not change stops the climb. Refits of
+    // many leaves sweep the whole tree instead, unless it is compressed:
+    // repacking a node reads the boxes of all the primitives of its leaves
+    if (!compressed && numRuns * RefitSweepRatio > getNodeCount())
+    {
+        for (uint32_t index = (uint32_t)getNodeCount(); index-- > 0;)
+        {
+            WideBVHNode &node = nodes[index];
+            for (int slot = 0; slot < 4; slot++)
+            {
+                if (!slotUsed(node, slot) || node.count[slot] > 0)
+                    continue;
+                float min[3], max[3];
+                nodeBox(nodes[node.child[slot]], min, max);
+                setSlotBox(node, slot, min, max);
+            }
+        }
+        nodeBox(readNode(0), boundsMin, boundsMax);
+    }
+    else
+    {
+        std::priority_queue<uint32_t> pending;
+        for (size_t run = 0; run < numRuns; run++)
+            pending.push(slots[runs[run]] / 4);
+        uint32_t last = UINT32_MAX;
+        while (!pending.empty())
+        {
+            uint32_t index = pending.top();
+            pending.pop();
+            if (index == last)
+                continue;
+            last = index;
+
+            if (compressed && !repack(index, boundsOf, sahArea))
+                continue;
+            float min[3], max[3];
+            nodeBox(readNode(index), min, max);
+            if (index == 0)
+            {
+                std::copy(min, min + 3, boundsMin);
+                std::copy(max, max + 3, boundsMax);
+                continue;
+            }
+            uint32_t parentIndex = parents[index];
+            if (!compressed)
+            {
+                WideBVHNode &parent = nodes[parentIndex];
+                int slot = 0;
+                while (!(slotUsed(parent, slot) && parent.count[slot] == 0 && parent.child[slot] == index))
+                    slot++;
+                if (!setSlotBox(parent, slot, min, max))
+                    continue;
+            }
+            pending.push(parentIndex);
+        }
+    }
+
+    double rootArea = boxArea(boundsMin, boundsMax);
+    if (rootArea <= 0.0 || builtSahCost <= 0.0)
+        return 1.0;
+    return (settings.traversalCost + sahArea / rootArea) / builtSahCost;
+}
+
+void WideBVH::setChild(WideBVHNode &node, int slot, const BVHNode &from)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        node.bounds[axis][slot] = from.boundsMin[axis];
+        node.bounds[3 + axis][slot] = from.boundsMax[axis];
+    }
+    node.child[slot] = from.offset;
+    node.count[slot] = from.count;
+}
+
+uint32_t WideBVH::collapse(const BVH &bvh, uint32_t binaryNode)
+{
+    const std::vector<BVHNode> &binary = bvh.getNodes();
+
+    // The node takes the grandchildren of binaryNode, or its children
+    // where those are leaves
+    uint32_t index = (uint32_t)nodes.size();
+    nodes.emplace_back();
+    WideBVHNode node;
+    node.axes[0] = (uint8_t)binary[binaryNode].axis;
+    uint32_t grandchildren[4];
+    for (int pair = 0; pair < 2; pair++)
+    {
+        const BVHNode &child = binary[binary[binaryNode].offset + pair];
+        if (child.count > 0)
+        {
+            setChild(node, 2 * pair, child);
+            setChild(node, 2 * pair + 1, EmptyChild);
+            node.axes[1 + pair] = 0;
+            grandchildren[2 * pair] = grandchildren[2 * pair + 1] = 0;
+            continue;
+        }
+        node.axes[1 + pair] = (uint8_t)child.axis;
+        for (int k = 0; k < 2; k++)
+        {
+            setChild(node, 2 * pair + k, binary[child.offset + k]);
+            grandchildren[2 * pair + k] = binary[child.offset + k].count == 0 ? child.offset + k : 0;
+        }
+    }
+
+    // Interior grandchildren become nodes of their own (node 0 is the
+    // root, so it cannot be a grandchild)
+    for (int slot = 0; slot < 4; slot++)
+        if (grandchildren[slot] != 0)
+            node.child[slot] = collapse(bvh, grandchildren[slot]);
+    nodes[index] = node;
+    return index;
+}
+
+CompressedWideBVHNode WideBVH::compress(const WideBVHNode &node)
+{
+    CompressedWideBVHNode packed = {};
+    for (int slot = 0; slot < 4; slot++)
+        if (node.bounds[0][slot] <= node.bounds[3][slot])
+            packed.used |= 1 << slot;
+    for (int i = 0; i < 3; i++)
+        packed.axes[i] = node.axes[i];
+    if (packed.used == 0)
+        return packed;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // The grid spans the box around the children in 255 steps
+        float lower = INFINITY, upper = -INFINITY;
+        for (int slot = 0; slot < 4; slot++)
+        {
+            if (!(packed.used & (1 << slot)))
+                continue;
+            lower = std::min(lower, node.bounds[axis][slot]);
+            upper = std::max(upper, node.bounds[3 + axis][slot]);
+        }
+        int exponent = -126;
+        if (upper > lower)
+        {
+            std::frexp((upper - lower) / 255.0f, &exponent);
+            exponent = std::clamp(exponent, -126, 127);
+        }
+        // Rounding may leave the last step short of the upper bound
+        while (exponent < 127 && lower + 255.0f * gridScale(exponent) < upper)
+            exponent++;
+        packed.origin[axis] = lower;
+        packed.exponent[axis] = (int8_t)exponent;
+
+        // Planes rounded outwards, checked against the dequantization of
+        // the traversal: origin + q * scale
+        float scale = gridScale(exponent);
+        auto dequantize = [&](int q) { return lower + (float)q * scale; };
+        for (int slot = 0; slot < 4; slot++)
+        {
+            if (!(packed.used & (1 << slot)))
+                continue;
+            float min = node.bounds[axis][slot], max = node.bounds[3 + axis][slot];
+            int qMin = (int)std::clamp(std::floor((min - lower) / scale), 0.0f, 255.0f);
+            while (qMin > 0 && dequantize(qMin) > min)
+                qMin--;
+            int qMax = (int)std::clamp(std::ceil((max - lower) / scale), 0.0f, 255.0f);
+            while (qMax < 255 && dequantize(qMax) < max)
+                qMax++;
+            packed.bounds[axis][slot] = (uint8_t)qMin;
+            packed.bounds[3 + axis][slot] = (uint8_t)qMax;
+        }
+    }
+
+    for (int slot = 0; slot < 4; slot++)
+    {
+        packed.child[slot] = node.child[slot];
+        packed.count[slot] = (uint8_t)node.count[slot];
+    }
+    return packed;
+}
+
+WideBVHNode WideBVH::decompress(const CompressedWideBVHNode &packed)
+{
+    WideBVHNode node;
+    for (int slot = 0; slot < 4; slot++)
+    {
+        for (int row = 0; row < 6; row++)
+        {
+            int axis = row % 3;
+            if (packed.used & (1 << slot))
+                node.bounds[row][slot] = packed.origin[axis] +
+                                         (float)packed.bounds[row][slot] * gridScale(packed.exponent[axis]);
+            else
+                node.bounds[row][slot] = row < 3 ? INFINITY : -INFINITY;
+        }
+        node.child[slot] = packed.child[slot];
+        node.count[slot] = packed.count[slot];
+    }
+    for (int i = 0; i < 3; i++)
+        node.axes[i] = packed.axes[i];
+    return node;
+}
@@ -0,0 +1,338 @@
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WIDEBVH_SSE
+#endif
+
+#include "bvh.h"
+
+// Node of four children, 128 bytes. The boxes of the children are stored
+// as structure of arrays, so that one SSE instruction handles one slab of
+// all four: bounds[axis] holds their minima and bounds[3 + axis] their
+// maxima along axis. Unused slots have inverted boxes, which no ray hits.
+struct alignas(16) WideBVHNode
+{
+    float bounds[6][4];
+    uint32_t child[4];  // Interior child: node index. Leaf child: first entry of its primitives
+    uint16_t count[4];  // Primitives of a leaf child, 0 for interior children
+    // Split axes of the two levels of the binary tree collapsed into the
+    // node: children 0-1 and 2-3 were split along axes[0], then 0 from 1
+    // along axes[1] and 2 from 3 along axes[2]
+    uint8_t axes[3];
+};
+
+// The same node in 64 bytes, one cache line. The child boxes are quantized
+// to 8 bits per plane, on a grid of power-of-two spacing along each axis
+// anchored at the lower corner of the box around them (Ylitie et al.
+// 2017, "Efficient Incoherent Ray Traversal on GPUs Through Compressed
+// Wide BVHs"). The quantized boxes are rounded outwards, so that
+// origin + q * 2^exponent holds the exact box.
+struct alignas(64) CompressedWideBVHNode
+{
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t used;          // Mask of the slots that hold a child
+    uint8_t bounds[6][4];  // Same rows as WideBVHNode::bounds
+    uint32_t child[4];
+    uint8_t count[4];
+    uint8_t axes[3];
+};
+
+static_assert(sizeof(CompressedWideBVHNode) == 64, "a compressed node must fill one cache line");
+
+// Four-wide BVH, collapsed from a binary BVH by merging every node with
+// its children, so that a ray is tested against four boxes at once
+// (Wald et al. 2008, "Getting Rid of Packets"). The traversal visits the
+// children in the order given by the sign of the ray direction along the
+// collapsed split axes, and skips the entries of its stack that a closer
+// hit has put out of reach. The nodes may be compressed, for half the
+// memory and a little more arithmetic per node. Read-only once built.
+class WideBVH
+{
+public:
+    WideBVH();
+
+    // Replaces the tree with the collapse of bvh, with compressed nodes if
+    // asked. bvh must have been built with BVHSettings::compressed then,
+    // so that its leaves fit the 8-bit counts
+    void build(const BVH &bvh, bool compressed_ = false);
+
+    // Same contract as BVH::save() and BVH::load()
+    void save(std::ostream &out) const;
+    bool load(std::istream &in, size_t primitives);
+
+    // Same contract as BVH::refit(). Compressed nodes are packed again
+    // around the exact boxes of their children, so they stay conservative
+    // without growing over repeated refits
+    double refit(const std::vector<uint32_t> &primitives, const BVHBoundsFunction &boundsOf);
+
+    // Same contract as BVH::traverse()
+    template <typename PrimitiveTest>
+    bool traverse(const Ray &ray, bool anyHit, PrimitiveTest test) const;
+
+    bool empty() const;
+    // Box of the whole tree (only valid when not empty)
+    void getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+    size_t getNodeCount() const;
+    size_t getMemoryBytes() const;
+
+private:
+    // Entries the traversal stack holds: three per level
+    static const int StackSize = 128;
+
+    struct StackEntry
+    {
+        uint32_t node;
+        float tNear;
+    };
+
+    void setChild(WideBVHNode &node, int slot, const BVHNode &from);
+    uint32_t collapse(const BVH &bvh, uint32_t binaryNode);
+    static CompressedWideBVHNode compress(const WideBVHNode &node);
+    static WideBVHNode decompress(const CompressedWideBVHNode &packed);
+    // Whether loaded nodes form a tree over indices the traversal can walk
+    template <typename Node>
+    static bool validTree(const std::vector<Node> &nodes_, const std::vector<uint32_t> &indices);
+
+    // Node index as a float node, whatever the layout
+    WideBVHNode readNode(uint32_t index) const;
+    void prepareRefit();
+    // Box around the primitives of a leaf slot, as boundsOf gives them
+    void leafBox(const WideBVHNode &node, int slot, const BVHBoundsFunction &boundsOf,
+                 float min[3], float max[3]) const;
+    // Packs the compressed node index again around the exact boxes of its
+    // children: those of the primitives of its leaves, and those around
+    // the children of its child nodes as stored. Its own boxes, already
+    // rounded outwards, would be rounded again on every refit. Returns
+    // whether the node changed, adding the change of weighted area of its
+    // slots to areaChange
+    bool repack(uint32_t index, const BVHBoundsFunction &boundsOf, double &areaChange);
+    // Box around the children of node
+    static void nodeBox(const WideBVHNode &node, float min[3], float max[3]);
+    // Sets a child box, keeping the SAH cost up to date. Returns whether
+    // the box changed
+    bool setSlotBox(WideBVHNode &node, int slot, const float min[3], const float max[3]);
+
+    template <typename Node, typename PrimitiveTest>
+    bool traverseNodes(const std::vector<Node> &nodes_, const Ray &ray, bool anyHit, PrimitiveTest test) const;
+
+    // Entry distances of the ray into the four children of node, and the
+    // mask of those it hits within [tMin, tMax]
+    template <typename Node>
+    static int intersectChildren(const Node &node, const float origin[3], const float invDir[3],
+                                 const int nearRow[3], const int farRow[3], float tMin, float tMax,
+                                 float tNear[4]);
+
+    // One row of bounds[] of the four children, and the mask of the
+    // slots in use
+#ifdef WIDEBVH_SSE
+    static __m128 loadRow(const WideBVHNode &node, int row);
+    static __m128 loadRow(const CompressedWideBVHNode &node, int row);
+#else
+    static void loadRow(const WideBVHNode &node, int row, float values[4]);
+    static void loadRow(const CompressedWideBVHNode &node, int row, float values[4]);
+#endif
+    static int usedSlots(const WideBVHNode &node);
+    static int usedSlots(const CompressedWideBVHNode &node);
+
+    // Spacing of the grid of a compressed node along an axis
+    static float gridScale(int exponent);
+
+    BVHSettings settings; // Of the binary tree collapsed, for the SAH costs
+    bool compressed;
+    std::vector<WideBVHNode> nodes;
+    std::vector<CompressedWideBVHNode> compressedNodes;
+    std::vector<uint32_t> primitiveIndices;
+    float boundsMin[3], boundsMax[3];
+
+    // Refit state, built by the first refit: parent of every node, leaf
+    // slot (node * 4 + slot) of every primitive, and the SAH cost, less
+    // the root's, times the area of the root
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> leafSlots;
+    double sahArea;
+    double builtSahCost;
+};
+
+inline float WideBVH::gridScale(int exponent)
+{
+    // 2^exponent, built from its bits: exponent is a normal float exponent
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+#ifdef WIDEBVH_SSE
+inline __m128 WideBVH::loadRow(const WideBVHNode &node, int row)
+{
+    return _mm_load_ps(node.bounds[row]);
+}
+
+inline __m128 WideBVH::loadRow(const CompressedWideBVHNode &node, int row)
+{
+    int axis = row % 3;
+    int32_t packed;
+    std::memcpy(&packed, node.bounds[row], sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    // q * scale is exact, so the sum rounds once, as in compress()
+    return _mm_add_ps(_mm_set1_ps(node.origin[axis]),
+                      _mm_mul_ps(_mm_cvtepi32_ps(q), _mm_set1_ps(gridScale(node.exponent[axis]))));
+}
+#else
+inline void WideBVH::loadRow(const WideBVHNode &node, int row, float values[4])
+{
+    for (int i = 0; i < 4; i++)
+        values[i] = node.bounds[row][i];
+}
+
+inline void WideBVH::loadRow(const CompressedWideBVHNode &node, int row, float values[4])
+{
+    int axis = row % 3;
+    float scale = gridScale(node.exponent[axis]);
+    for (int i = 0; i < 4; i++)
+        values[i] = node.origin[axis] + (float)node.bounds[row][i] * scale;
+}
+#endif
+
+inline int WideBVH::usedSlots(const WideBVHNode &)
+{
+    // The unused slots have inverted boxes
+    return 0xF;
+}
+
+inline int WideBVH::usedSlots(const CompressedWideBVHNode &node)
+{
+    return node.used;
+}
+
+template <typename Node>
+inline int WideBVH::intersectChildren(const Node &node, const float origin[3], const float invDir[3],
+                                      const int nearRow[3], const int farRow[3], float tMin, float tMax,
+                                      float tNear[4])
+{
+#ifdef WIDEBVH_SSE
+    // A NaN slab distance (origin on the slab plane of an axis the ray is
+    // parallel to) is dropped by min/max, which return their second
+    // operand when either is NaN
+    __m128 entry = _mm_set1_ps(tMin);
+    __m128 exit = _mm_set1_ps(tMax * BVH::BoxMargin);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        __m128 o = _mm_set1_ps(origin[axis]);
+        __m128 inv = _mm_set1_ps(invDir[axis]);
+        __m128 slabNear = _mm_mul_ps(_mm_sub_ps(loadRow(node, nearRow[axis]), o), inv);
+        __m128 slabFar = _mm_mul_ps(_mm_sub_ps(loadRow(node, farRow[axis]), o), inv);
+        entry = _mm_max_ps(slabNear, entry);
+        exit = _mm_min_ps(_mm_mul_ps(slabFar, _mm_set1_ps(BVH::BoxMargin)), exit);
+    }
+    _mm_storeu_ps(tNear, entry);
+    return _mm_movemask_ps(_mm_cmple_ps(entry, exit)) & usedSlots(node);
+#else
+    float bounds[6][4];
+    for (int row = 0; row < 6; row++)
+        loadRow(node, row, bounds[row]);
+    int mask = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        float entry = tMin, exit = tMax * BVH::BoxMargin;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float slabNear = (bounds[nearRow[axis]][i] - origin[axis]) * invDir[axis];
+            float slabFar = (bounds[farRow[axis]][i] - origin[axis]) * invDir[axis];
+            slabFar *= BVH::BoxMargin;
+            entry = slabNear > entry ? slabNear : entry;
+            exit = slabFar < exit ? slabFar : exit;
+        }
+        tNear[i] = entry;
+        mask |= (entry <= exit) << i;
+    }
+    return mask & usedSlots(node);
+#endif
+}
+
+template <typename PrimitiveTest>
+bool WideBVH::traverse(const Ray &ray, bool anyHit, PrimitiveTest test) const
+{
+    return compressed ? traverseNodes(compressedNodes, ray, anyHit, test) : traverseNodes(nodes, ray, anyHit, test);
+}
+
+template <typename Node, typename PrimitiveTest>
+bool WideBVH::traverseNodes(const std::vector<Node> &nodes_, const Ray &ray, bool anyHit, PrimitiveTest test) const
+{
+    if (nodes_.empty())
+        return false;
+
+    const float origin[3] = { ray.o.x, ray.o.y, ray.o.z };
+    const float invDir[3] = { 1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z };
+    const bool dirIsNeg[3] = { invDir[0] < 0.0f, invDir[1] < 0.0f, invDir[2] < 0.0f };
+    // Rows of bounds[] of the slabs the ray enters and leaves, per axis
+    const int nearRow[3] = { dirIsNeg[0] ? 3 : 0, dirIsNeg[1] ? 4 : 1, dirIsNeg[2] ? 5 : 2 };
+    const int farRow[3] = { dirIsNeg[0] ? 0 : 3, dirIsNeg[1] ? 1 : 4, dirIsNeg[2] ? 2 : 5 };
+
+    StackEntry stack[StackSize];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, (float)ray.minT };
+    bool hit = false;
+    while (stackSize > 0)
+    {
+        const StackEntry entry = stack[--stackSize];
+        if (entry.tNear > (float)ray.maxT * BVH::BoxMargin)
+            continue;
+
+        STAT_INC(BVHNodeVisits);
+        const Node &node = nodes_[entry.node];
+        float tNear[4];
+        int mask = intersectChildren(node, origin, invDir, nearRow, farRow, (float)ray.minT, (float)ray.maxT, tNear);
+        if (mask == 0)
+            continue;
+
+        // Front-to-back order of the children for this ray's octant. Leaves
+        // are tested right away, in that order; interior children go to
+        // the stack, which takes them back to front
+        int firstPair = dirIsNeg[node.axes[0]] ? 2 : 0;
+        int firstInPair[2] = { dirIsNeg[node.axes[1]] ? 1 : 0, dirIsNeg[node.axes[2]] ? 1 : 0 };
+        const int order[4] = { firstPair + firstInPair[firstPair / 2], firstPair + 1 - firstInPair[firstPair / 2],
+                               (2 - firstPair) + firstInPair[1 - firstPair / 2],
+                               (2 - firstPair) + 1 - firstInPair[1 - firstPair / 2] };
+        int interior[4];
+        int numInterior = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            int slot = order[k];
+            if (!(mask & (1 << slot)))
+                continue;
+            if (node.count[slot] == 0)
+            {
+                interior[numInterior++] = slot;
+                continue;
+            }
+            if (tNear[slot] > (float)ray.maxT * BVH::BoxMargin)
+                continue;
+            for (uint32_t i = 0; i < node.count[slot]; i++)
+            {
+                if (test(primitiveIndices[node.child[slot] + i]))
+                {
+                    hit = true;
+                    if (anyHit)
+                        return true;
+                }
+            }
+        }
+        while (numInterior > 0)
+        {
+            int slot = interior[--numInterior];
+            stack[stackSize++] = { node.child[slot], tNear[slot] };
+        }
+    }
+    return hit;
+}
+
+#endif // WIDEBVH_H
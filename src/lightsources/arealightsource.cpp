@@ -18,7 +18,13 @@ Vector3D AreaLightSource::generateRandomPoint() const
     // Generate two random numbers between 0 and 1
     double u = ((double)rand() / RAND_MAX);
     double v = ((double)rand() / RAND_MAX);
-    
+
+    return generatePoint(u, v);
+}
+
+
+Vector3D AreaLightSource::generatePoint(double u, double v) const
+{
     // Use barycentric coordinates to get random point on rectangle
     // Point = corner + u * v1 + v * v2
     // where corner is one corner of the rectangle,
@@ -15,6 +15,7 @@ public:
 
     Vector3D getIntensity() const;        
     Vector3D generateRandomPoint() const; 
+    Vector3D generatePoint(double u, double v) const;
 
     double getArea() const {
         Vector3D square_dim = myAreaLightsource->v1 + myAreaLightsource->v2;
@@ -34,6 +35,9 @@ public:
         return myAreaLightsource->normal;
     };
 
+    // Emitting shape of the light
+    const Square* getShape() const { return myAreaLightsource; }
+
 private:
     Square* myAreaLightsource;
 };
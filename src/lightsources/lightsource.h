@@ -12,10 +12,13 @@ class LightSource
 {
 public:
     LightSource() {}; 
+    virtual ~LightSource() {}
 
 
     virtual Vector3D getIntensity() const = 0;
     virtual Vector3D generateRandomPoint() const = 0;
+    // Point on the light driven by two uniform numbers (u, v) in [0,1)
+    virtual Vector3D generatePoint(double u, double v) const = 0;
 
     virtual double getArea() const = 0;
     virtual Vector3D getNormal() const = 0;
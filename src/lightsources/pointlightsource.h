@@ -17,6 +17,7 @@ public:
 
     Vector3D getIntensity() const { return intensity; };
     Vector3D generateRandomPoint() const { return pos; };
+    Vector3D generatePoint(double u, double v) const { return pos; };
 
     ////A point light emits light uniformly in all directions
     //Its Area is zero and have no Normal
@@ -6,17 +6,29 @@
 #include "core/ray.h"
 #include "core/utils.h"
 #include "core/scene.h"
+#include "core/sampler.h"
+#include "core/filter.h"
+#include "core/gbuffer.h"
+#include "core/parallel.h"
+#include "core/denoiser.h"
+#include "core/statistics.h"
+#include "core/bvh.h"
+#include "core/widebvh.h"
+#include "core/animation.h"
+#include "core/framewriter.h"
+#include "core/temporalaccumulator.h"
+#include "core/renderserver.h"
 
 
 #include "shapes/sphere.h"
 #include "shapes/infiniteplan.h"
+#include "shapes/aggregate.h"
+#include "shapes/instance.h"
 
 #include "cameras/ortographic.h"
 #include "cameras/perspective.h"
 
 #include "shaders/intersectionshader.h"
-#include "shaders/depthshader.h"
-#include "shaders/normalshader.h"
 #include "shaders/whittedintegrator.h"
 #include "shaders/hemisfericaldirectintegrator.h"
 #include "shaders/areadirectintegrator.h"
@@ -24,6 +36,9 @@
 #include "shaders/nexteventestimatorintegration.h"
 #include "shaders/ambientocclusionintegrator.h"
 #include "shaders/constantambientintegrator.h"
+#include "shaders/photonmappingintegrator.h"
+#include "shaders/bidirectionalpathtracingintegrator.h"
+#include "shaders/lighttracingintegrator.h"
 
 
 #include "materials/phong.h"
@@ -31,7 +46,11 @@
 #include "materials/mirror.h"
 #include "materials/transmissive.h"
 
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <map>
+#include <random>
 
 using namespace std::chrono;
 
@@ -143,6 +162,199 @@ void buildSceneCornellBox(Camera*& cam, Film*& film,
 }
 
 
+// Cornell Box with a glass and a mirror sphere, for caustics (photon mapping)
+void buildSceneCornellBoxCaustics(Camera*& cam, Film*& film,
+    Scene myScene)
+{
+    Matrix4x4 cameraToWorld = Matrix4x4::translate(Vector3D(0, 0, -3));
+    double fovRadians = Utils::degreesToRadians(60);
+    cam = new PerspectiveCamera(cameraToWorld, fovRadians, *film);
+
+    Material* redDiffuse = new Phong(Vector3D(0.7, 0.2, 0.3), Vector3D(0, 0, 0), 100);
+    Material* greenDiffuse = new Phong(Vector3D(0.2, 0.7, 0.3), Vector3D(0, 0, 0), 100);
+    Material* greyDiffuse = new Phong(Vector3D(0.8, 0.8, 0.8), Vector3D(0, 0, 0), 100);
+    Material* emissive = new Emissive(Vector3D(25, 25, 25), Vector3D(0.5));
+    Material* mirror = new Mirror(Vector3D(1.0, 1.0, 1.0));
+    Material* transmissive = new Transmissive(0.7);
+
+    double offset = 3.0;
+    myScene.AddObject(new InfinitePlan(Vector3D(-offset - 1, 0, 0), Vector3D(1, 0, 0), redDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(offset + 1, 0, 0), Vector3D(-1, 0, 0), greenDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, offset, 0), Vector3D(0, -1, 0), greyDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, -offset, 0), Vector3D(0, 1, 0), greyDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, 0, 3 * offset), Vector3D(0, 0, -1), greyDiffuse));
+    myScene.AddObject(new Square(Vector3D(-1.0, 3.0, 3.0), Vector3D(2.0, 0.0, 0.0), Vector3D(0.0, 0.0, 2.0),
+                                 Vector3D(0.0, -1.0, 0.0), emissive));
+
+    // The glass sphere focuses the light on the floor, the mirror one
+    // reflects it onto the walls
+    double radius = 1.2;
+    Shape* glassSphere = new Sphere(radius, Matrix4x4::translate(Vector3D(1.5, -offset + radius, 4.0)), transmissive);
+    Shape* mirrorSphere = new Sphere(radius, Matrix4x4::translate(Vector3D(-1.8, -offset + radius, 6.0)), mirror);
+    myScene.AddObject(glassSphere);
+    myScene.AddObject(mirrorSphere);
+}
+
+
+// Cornell Box whose light is covered by a panel just below the ceiling:
+// the room only receives the light reflected out of the gap between the
+// two, through the ceiling (difficult indirect lighting, path guiding)
+void buildSceneCornellBoxCoveredLight(Camera*& cam, Film*& film,
+    Scene myScene)
+{
+    Matrix4x4 cameraToWorld = Matrix4x4::translate(Vector3D(0, 0, -3));
+    double fovRadians = Utils::degreesToRadians(60);
+    cam = new PerspectiveCamera(cameraToWorld, fovRadians, *film);
+
+    Material* redDiffuse = new Phong(Vector3D(0.7, 0.2, 0.3), Vector3D(0, 0, 0), 100);
+    Material* greenDiffuse = new Phong(Vector3D(0.2, 0.7, 0.3), Vector3D(0, 0, 0), 100);
+    Material* greyDiffuse = new Phong(Vector3D(0.8, 0.8, 0.8), Vector3D(0, 0, 0), 100);
+    Material* orangeDiffuse = new Phong(Vector3D(0.9, 0.5, 0.2), Vector3D(0, 0, 0), 100);
+    Material* emissive = new Emissive(Vector3D(100, 100, 100), Vector3D(0.5));
+
+    double offset = 3.0;
+    myScene.AddObject(new InfinitePlan(Vector3D(-offset - 1, 0, 0), Vector3D(1, 0, 0), redDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(offset + 1, 0, 0), Vector3D(-1, 0, 0), greenDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, offset, 0), Vector3D(0, -1, 0), greyDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, -offset, 0), Vector3D(0, 1, 0), greyDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, 0, 3 * offset), Vector3D(0, 0, -1), greyDiffuse));
+    myScene.AddObject(new Square(Vector3D(-1.0, 3.0, 3.0), Vector3D(2.0, 0.0, 0.0), Vector3D(0.0, 0.0, 2.0),
+                                 Vector3D(0.0, -1.0, 0.0), emissive));
+
+    // Squares are one-sided: the panel is made of two, back to back
+    Vector3D panelCorner(-1.6, 2.6, 1.8);
+    Vector3D panelX(3.2, 0.0, 0.0), panelZ(0.0, 0.0, 4.4);
+    myScene.AddObject(new Square(panelCorner + Vector3D(0.0, 0.01, 0.0), panelX, panelZ,
+                                 Vector3D(0.0, 1.0, 0.0), greyDiffuse));
+    myScene.AddObject(new Square(panelCorner, panelX, panelZ, Vector3D(0.0, -1.0, 0.0), greyDiffuse));
+
+    double radius = 1.0;
+    myScene.AddObject(new Sphere(radius, Matrix4x4::translate(Vector3D(-1.5, -offset + radius, 5.0)), orangeDiffuse));
+    myScene.AddObject(new Sphere(radius, Matrix4x4::translate(Vector3D(1.5, -offset + radius, 6.5)), greyDiffuse));
+}
+
+
+// Cornell Box lit by a grid of small colored lights on the ceiling, for
+// the many-light direct lighting (reservoir resampling)
+void buildSceneCornellBoxManyLights(Camera*& cam, Film*& film,
+    Scene myScene)
+{
+    Matrix4x4 cameraToWorld = Matrix4x4::translate(Vector3D(0, 0, -3));
+    double fovRadians = Utils::degreesToRadians(60);
+    cam = new PerspectiveCamera(cameraToWorld, fovRadians, *film);
+
+    Material* redDiffuse = new Phong(Vector3D(0.7, 0.2, 0.3), Vector3D(0, 0, 0), 100);
+    Material* greenDiffuse = new Phong(Vector3D(0.2, 0.7, 0.3), Vector3D(0, 0, 0), 100);
+    Material* greyDiffuse = new Phong(Vector3D(0.8, 0.8, 0.8), Vector3D(0, 0, 0), 100);
+    Material* orangeDiffuse = new Phong(Vector3D(0.9, 0.5, 0.2), Vector3D(0, 0, 0), 100);
+
+    double offset = 3.0;
+    myScene.AddObject(new InfinitePlan(Vector3D(-offset - 1, 0, 0), Vector3D(1, 0, 0), redDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(offset + 1, 0, 0), Vector3D(-1, 0, 0), greenDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, offset, 0), Vector3D(0, -1, 0), greyDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, -offset, 0), Vector3D(0, 1, 0), greyDiffuse));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, 0, 3 * offset), Vector3D(0, 0, -1), greyDiffuse));
+
+    // 6 x 6 lights, alternately warm and cool, brighter towards the back
+    const int gridSize = 6;
+    const double lightSize = 0.3;
+    for (int i = 0; i < gridSize; i++)
+    {
+        for (int j = 0; j < gridSize; j++)
+        {
+            Vector3D color = (i + j) % 2 == 0 ? Vector3D(1.0, 0.7, 0.4) : Vector3D(0.4, 0.6, 1.0);
+            Material* emissive = new Emissive(color * (20.0 + 10.0 * j), Vector3D(0.5));
+            Vector3D corner(-3.5 + 1.3 * i, offset, 1.0 + 1.3 * j);
+            myScene.AddObject(new Square(corner, Vector3D(lightSize, 0.0, 0.0), Vector3D(0.0, 0.0, lightSize),
+                                         Vector3D(0.0, -1.0, 0.0), emissive));
+        }
+    }
+
+    double radius = 1.0;
+    myScene.AddObject(new Sphere(radius, Matrix4x4::translate(Vector3D(-1.5, -offset + radius, 5.0)), orangeDiffuse));
+    myScene.AddObject(new Sphere(radius, Matrix4x4::translate(Vector3D(1.5, -offset + radius, 6.5)), greyDiffuse));
+}
+
+
+// Forest of count instances of one tree, on a ground lit by a sky panel.
+// The tree is built once, with a BVH of its own, and every instance
+// places it with a transform; one in five overrides its materials. Render
+// it with the BVH aggregate of the scene, the top level over the instances.
+// The tree and its parts are not in the scene: they are appended to
+// sharedShapes, if given, for their owner to delete
+void buildSceneForest(Camera*& cam, Film*& film,
+    Scene myScene, size_t count = 10000, std::vector<Shape*>* sharedShapes = nullptr)
+{
+    Matrix4x4 cameraToWorld = Matrix4x4::translate(Vector3D(0, 3, -4)) *
+                              Matrix4x4::rotate(Utils::degreesToRadians(15), Vector3D(1, 0, 0));
+    double fovRadians = Utils::degreesToRadians(60);
+    cam = new PerspectiveCamera(cameraToWorld, fovRadians, *film);
+
+    Material* greyDiffuse = new Phong(Vector3D(0.6, 0.6, 0.6), Vector3D(0, 0, 0), 100);
+    Material* barkDiffuse = new Phong(Vector3D(0.4, 0.25, 0.1), Vector3D(0, 0, 0), 100);
+    Material* leafDiffuse = new Phong(Vector3D(0.2, 0.6, 0.2), Vector3D(0, 0, 0), 100);
+    Material* autumnDiffuse = new Phong(Vector3D(0.9, 0.4, 0.1), Vector3D(0, 0, 0), 100);
+
+    // The trees stand on a square of side forestSize in front of the camera
+    const double spacing = 2.0;
+    double forestSize = spacing * std::ceil(std::sqrt((double)count));
+    myScene.AddObject(new InfinitePlan(Vector3D(0, 0, 0), Vector3D(0, 1, 0), greyDiffuse));
+    Material* sky = new Emissive(Vector3D(2.0, 2.0, 2.2), Vector3D(0.5));
+    myScene.AddObject(new Square(Vector3D(-forestSize, 50.0, -forestSize), Vector3D(2.0 * forestSize, 0.0, 0.0),
+                                 Vector3D(0.0, 0.0, 2.0 * forestSize), Vector3D(0.0, -1.0, 0.0), sky));
+
+    // The tree: a trunk and a crown of two spheres, about 2.2 units tall
+    std::vector<Shape*> treeParts = {
+        new Sphere(1.0, Matrix4x4::translate(Vector3D(0, 0.6, 0)) * Matrix4x4::scale(Vector3D(0.12, 0.6, 0.12)),
+                   barkDiffuse),
+        new Sphere(0.5, Matrix4x4::translate(Vector3D(0, 1.4, 0)), leafDiffuse),
+        new Sphere(0.35, Matrix4x4::translate(Vector3D(0, 1.9, 0)), leafDiffuse)
+    };
+    Shape* tree = new Aggregate(treeParts);
+    if (sharedShapes)
+    {
+        sharedShapes->insert(sharedShapes->end(), treeParts.begin(), treeParts.end());
+        sharedShapes->push_back(tree);
+    }
+
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    size_t perRow = (size_t)std::ceil(std::sqrt((double)count));
+    for (size_t i = 0; i < count; i++)
+    {
+        Vector3D position(-0.5 * forestSize + spacing * ((i % perRow) + uniform(rng)), 0.0,
+                          spacing * ((i / perRow) + uniform(rng)));
+        Matrix4x4 transform = Matrix4x4::translate(position) *
+                              Matrix4x4::rotate(Utils::degreesToRadians(360.0 * uniform(rng)), Vector3D(0, 1, 0)) *
+                              Matrix4x4::scale(Vector3D(0.7 + 0.6 * uniform(rng)));
+        myScene.AddObject(new Instance(tree, transform, i % 5 == 0 ? autumnDiffuse : nullptr));
+    }
+}
+
+
+// Cornell Box animation, one second long: the camera moves in and turns
+// to the right while the top sphere of the pyramid hops
+void buildAnimationCornellBox(Camera*& cam, Film*& film,
+    Scene myScene, Animation &animation)
+{
+    buildSceneCornellBox(cam, film, myScene);
+
+    TransformTrack cameraTrack;
+    cameraTrack.addKey(0.0, cam->cameraToWorld);
+    cameraTrack.addKey(1.0, Matrix4x4::translate(Vector3D(-1.0, 0.5, -1.0)) *
+                            Matrix4x4::rotate(Utils::degreesToRadians(15), Vector3D(0, 1, 0)));
+    animation.animateCamera(cameraTrack);
+
+    // The top sphere is the last object of the scene
+    Shape* topSphere = myScene.objectsList->back();
+    Vector3D rest(0.0, -0.4, 6.0);
+    TransformTrack hop;
+    hop.addKey(0.0, Matrix4x4::translate(rest));
+    hop.addKey(0.5, Matrix4x4::translate(rest + Vector3D(0.0, 1.5, 0.0)));
+    hop.addKey(1.0, Matrix4x4::translate(rest));
+    animation.animateShape(topSphere, hop);
+}
+
 void buildSceneSphere(Camera*& cam, Film*& film,
     Scene myScene)
 {
@@ -185,9 +397,44 @@ void buildSceneSphere(Camera*& cam, Film*& film,
    
 }
 
+// Per-pixel cost recorded in the film during a render (Film::saveHeatmap)
+enum class HeatmapMode
+{
+    None,
+    Time,             // Wall time spent on the pixel, in microseconds
+    IntersectionTests // Ray/shape intersection tests (needs ACG_STATS)
+};
+
+// Options of a single call to raytrace()
+struct RenderSettings
+{
+    RenderSettings(int numSamples_ = 1, SamplerType samplerType_ = SamplerType::Independent) :
+        numSamples(numSamples_), samplerType(samplerType_),
+        jitter(false), filterType(FilterType::Box),
+        cachePrimaryHits(true), primaryHitStrata(8), heatmap(HeatmapMode::None), seed(0)
+    { }
+
+    int numSamples;          // Samples per pixel
+    SamplerType samplerType; // Generator of every random dimension of the paths
+    bool jitter;             // Spread the samples over the pixel (antialiasing)
+    FilterType filterType;   // Reconstruction filter of the jittered samples
+    bool cachePrimaryHits;   // Share the first hit between the samples of a stratum (G-buffer)
+    int primaryHitStrata;    // Sub-pixel positions traced per pixel when jittering with the G-buffer
+    HeatmapMode heatmap;     // Per-pixel cost to record. The G-buffer pass is not included
+    uint64_t seed;           // Scrambling of the samplers: renders with different seeds are independent
+};
+
+// Intersection tests done so far by the calling thread
+static uint64_t intersectionTestCount()
+{
+    const ThreadStatistics &stats = Statistics::local();
+    return stats.counters[(int)StatCounter::SphereTests] + stats.counters[(int)StatCounter::PlaneTests]
+         + stats.counters[(int)StatCounter::SquareTests];
+}
+
 void raytrace(Camera* &cam, Shader* &shader, Film* &film,
               std::vector<Shape*>* &objectsList, std::vector<LightSource*>* &lightSourceList,
-              int numSamples = 1)
+              const RenderSettings &settings = RenderSettings())
 {
     
     double my_PI = 0.0;
@@ -196,43 +443,449 @@ void raytrace(Camera* &cam, Shader* &shader, Film* &film,
 
     size_t resX = film->getWidth();
     size_t resY = film->getHeight();
+    int numSamples = settings.numSamples;
+
+    // Without jittering, every sample of a deterministic shader follows
+    // the same camera ray and returns the same color
+    if (!settings.jitter && shader->isDeterministic(*lightSourceList))
+        numSamples = 1;
+
+    shader->preprocess(*objectsList, *lightSourceList);
+
+    // Jittered samples are distributed over the support of the filter
+    Filter* filter = settings.jitter ? Filter::create(settings.filterType) : nullptr;
+
+    // Camera rays only depend on the sub-pixel position, so the samples that
+    // share a stratum can start from the same first hit: the primary
+    // visibility pass is traced once per stratum instead of once per sample
+    GBuffer* gbuffer = nullptr;
+    int strata = filter ? std::min(settings.primaryHitStrata, numSamples) : 1;
+    if (settings.cachePrimaryHits && strata < numSamples)
+    {
+        gbuffer = new GBuffer(resX, resY, strata);
+        gbuffer->build(*cam, *shader, filter, settings.samplerType, *objectsList, settings.seed);
+    }
+
+    HeatmapMode heatmap = settings.heatmap;
+    if (heatmap == HeatmapMode::IntersectionTests && !Statistics::isEnabled())
+    {
+        std::cout << "Intersection tests are not counted without ACG_STATS, "
+                     "recording the time per pixel instead" << std::endl;
+        heatmap = HeatmapMode::Time;
+    }
 
-    // Main raytracing loop
-    // Out-most loop invariant: we have rendered lin lines
-    for(size_t lin=0; lin<resY; lin++)
+    // Renders passSamples samples per pixel into the (cleared) film
+    auto renderPass = [&](int passSamples, uint64_t passSeed)
     {
-        // Show progression 
-        double progress = (double)lin / double(resY);
-        Utils::printProgress(progress);
+        // The samplers hand out the random numbers used by the integrators,
+        // one per thread
+        std::vector<Sampler*> samplers(numWorkerThreads());
+        samplers[0] = Sampler::create(settings.samplerType, passSamples, passSeed);
+        for (size_t t = 1; t < samplers.size(); t++)
+            samplers[t] = samplers[0]->clone();
+
+        film->clearData();
 
-        // Inner loop invariant: we have rendered col columns
-        for(size_t col=0; col<resX; col++)
+        // Main raytracing loop, one line at a time on every thread.
+        // Lines are independent: each pixel is written by a single thread
+        std::atomic<size_t> linesDone(0);
+        std::atomic<size_t> tracedSamples(0);
+        parallelFor(resY, [&](size_t lin, int thread)
         {
-            // Compute the pixel position in NDC
-            double x = (double)(col + 0.5) / resX;
-            double y = (double)(lin + 0.5) / resY;
-            
-            Vector3D pixelColor = Vector3D(0.0);
-
-            // Trace multiple samples per pixel, if no numSamples is provided, use 1 sample per pixel
-            for (int sample = 0; sample < numSamples; sample++)
+            Sampler* sampler = samplers[thread];
+            Sampler::setActive(sampler);
+
+            size_t lineSamples = 0;
+
+            // Inner loop invariant: we have rendered col columns
+            for(size_t col=0; col<resX; col++)
             {
-                // Generate the camera ray
-                Ray cameraRay = cam->generateRay(x, y);
-                
-                // Compute ray color according to the used shader
-                pixelColor += shader->computeColor(cameraRay, *objectsList, *lightSourceList);
+                // Two clock or counter reads per pixel, only with a heatmap
+                steady_clock::time_point pixelStart;
+                if (heatmap == HeatmapMode::Time)
+                    pixelStart = steady_clock::now();
+                uint64_t pixelTests = heatmap == HeatmapMode::IntersectionTests ? intersectionTestCount() : 0;
+
+                // Trace multiple samples per pixel, if no numSamples is provided, use 1 sample per pixel
+                for (int sample = 0; sample < passSamples; sample++)
+                {
+                    sampler->startPixelSample(col, lin, sample);
+
+                    if (gbuffer)
+                    {
+                        const PrimaryHit &primary = gbuffer->at(col, lin, sample % strata);
+                        if (primary.weight == 0.0f)
+                            continue;
+
+                        Ray cameraRay = cam->generateRay(primary.x, primary.y);
+                        lineSamples++;
+                        Vector3D sampleColor = shader->computeColorFromHit(cameraRay, primary,
+                                                                           *objectsList, *lightSourceList);
+                        film->addSample(col, lin, sampleColor, primary.getFeatures(cameraRay), primary.weight);
+                        continue;
+                    }
+
+                    // Offset of the sample from the pixel center (in pixels)
+                    double dx = 0.0, dy = 0.0;
+                    double weight = 1.0;
+                    if (filter)
+                    {
+                        double u, v;
+                        sampler->getPixelSample(u, v);
+                        weight = filter->sample(u, v, dx, dy);
+                        if (weight == 0.0)
+                            continue;
+                    }
+
+                    // Compute the sample position in NDC
+                    double x = (col + 0.5 + dx) / resX;
+                    double y = (lin + 0.5 + dy) / resY;
+
+                    // Generate the camera ray and find its first hit
+                    Ray cameraRay = cam->generateRay(x, y);
+                    STAT_INC(CameraRays);
+                    lineSamples++;
+                    PrimaryHit primary;
+                    primary.trace(cameraRay, *objectsList);
+
+                    // Compute ray color according to the used shader
+                    Vector3D sampleColor = shader->computeColorFromHit(cameraRay, primary,
+                                                                       *objectsList, *lightSourceList);
+
+                    // Accumulate the filter-weighted sample (and its denoiser guides) in the film
+                    film->addSample(col, lin, sampleColor, primary.getFeatures(cameraRay), weight);
+                }
+
+                if (heatmap == HeatmapMode::Time)
+                    film->addCost(col, lin, duration<double, std::micro>(steady_clock::now() - pixelStart).count());
+                else if (heatmap == HeatmapMode::IntersectionTests)
+                    film->addCost(col, lin, (double)(intersectionTestCount() - pixelTests));
             }
 
-            // Average all samples
-            pixelColor = pixelColor / numSamples;
+            tracedSamples += lineSamples;
+
+            // Show progression
+            size_t done = ++linesDone;
+            if (thread == 0)
+                Utils::printProgress((double)done / double(resY));
+        });
+
+        // Light splatted by the shader (e.g. from bidirectional light subpaths,
+        // one per traced sample), averaged over the samples of a pixel
+        if (tracedSamples > 0)
+            film->mergeSplats((double)(resX * resY) / tracedSamples);
+
+        Sampler::setActive(nullptr);
+        for (Sampler* sampler : samplers)
+            delete sampler;
+    };
+
+    // Training passes of the shaders that learn from their own samples;
+    // only the final render is kept in the film. Each pass has a seed of
+    // its own, so that the final render does not trace again the samples
+    // the shader learned from
+    for (int pass = 0; pass < shader->getTrainingPasses(); pass++)
+    {
+        renderPass(1 << pass, settings.seed + pass + 1);
+        shader->endTrainingPass(pass);
+        std::cout << "\nTraining pass " << pass + 1 << " of " << shader->getTrainingPasses() << " ("
+                  << (1 << pass) << " spp)" << std::endl;
+    }
+    renderPass(numSamples, settings.seed);
+
+    delete filter;
+    delete gbuffer;
+}
+
+
+// Renders the scene with every sampler at increasing sample counts and
+// prints the RMSE against a high sample count reference (RMSE vs spp curves)
+void samplerConvergenceStudy(Camera* &cam, Shader* &shader, Film* &film,
+                             std::vector<Shape*>* &objectsList, std::vector<LightSource*>* &lightSourceList,
+                             int maxSamples, int referenceSamples)
+{
+    Film reference(film->getWidth(), film->getHeight());
+    Film* referencePtr = &reference;
+    raytrace(cam, shader, referencePtr, objectsList, lightSourceList,
+             RenderSettings(referenceSamples, SamplerType::Sobol));
+
+    const SamplerType types[] = { SamplerType::Independent, SamplerType::Stratified,
+                                  SamplerType::Halton, SamplerType::Sobol };
+    for (SamplerType type : types)
+    {
+        for (int spp = 1; spp <= maxSamples; spp *= 2)
+        {
+            raytrace(cam, shader, film, objectsList, lightSourceList, RenderSettings(spp, type));
+            std::cout << "\nRMSE " << Sampler::typeName(type) << " " << spp << "spp: "
+                      << film->computeRMSE(reference) << std::endl;
+        }
+    }
+}
+
+
+// Frames of an animation and their output
+struct SequenceSettings
+{
+    SequenceSettings(int frameCount_ = 24, double framesPerSecond_ = 24.0) :
+        frameCount(frameCount_), framesPerSecond(framesPerSecond_), startTime(0.0),
+        outputPrefix("frames/frame"), formats(FrameBMP | FrameEXR), temporalAccumulation(false)
+    { }
+
+    int frameCount;
+    double framesPerSecond;   // Frame i shows the animation at startTime + i / framesPerSecond
+    double startTime;
+    std::string outputPrefix; // Frame i is written to outputPrefix_<i>.bmp/.exr
+    int formats;              // FrameFormat flags
+    // Preview mode (perspective camera moving, shapes still): every frame
+    // is blended with the previous ones, reprojected (TemporalAccumulator)
+    bool temporalAccumulation;
+    TemporalSettings temporal;
+};
+
+// Renders the frames of animation one after the other in this process.
+// Between frames the camera and the shapes are moved, and the aggregate,
+// if they are traced through one, refit; each frame is written to disk
+// while the next one renders. With temporal accumulation the frames
+// are rendered with different seeds and written accumulated; it needs a
+// perspective camera, without which the frames are rendered on their own
+void renderSequence(Camera* &cam, Shader* &shader, Film* &film,
+                    std::vector<Shape*>* &objectsList, std::vector<LightSource*>* &lightSourceList,
+                    const Animation &animation, Aggregate *aggregate,
+                    const SequenceSettings &sequence, const RenderSettings &settings = RenderSettings())
+{
+    FrameWriter writer(sequence.outputPrefix, sequence.formats);
+    TemporalAccumulator accumulator(sequence.temporal);
+    PerspectiveCamera* perspective = dynamic_cast<PerspectiveCamera*>(cam);
+    bool temporal = sequence.temporalAccumulation && perspective;
+    if (sequence.temporalAccumulation && !perspective)
+        std::cout << "Warning! Temporal accumulation needs a perspective camera: "
+                  << "the frames are rendered without it" << std::endl;
+    RenderSettings frameSettings = settings;
+    for (int frame = 0; frame < sequence.frameCount; frame++)
+    {
+        auto start = high_resolution_clock::now();
+        double time = sequence.startTime + frame / sequence.framesPerSecond;
+        bool rebuilt = animation.apply(time, *cam, aggregate);
+        shader->sceneChanged();
+        if (temporal)
+            frameSettings.seed = settings.seed + frame;
+        raytrace(cam, shader, film, objectsList, lightSourceList, frameSettings);
+        if (temporal)
+            accumulator.accumulate(*perspective, *film);
+        writer.write(*film, frame);
+        std::cout << "\nFrame " << frame << " (t = " << time << " s): "
+                  << durationMs(high_resolution_clock::now() - start).count() << " ms"
+                  << (rebuilt ? ", BVH rebuilt" : "");
+        if (temporal)
+            std::cout << ", " << 100.0 * accumulator.getReuseRatio() << "% of the pixels reprojected";
+        std::cout << std::endl;
+    }
+    writer.finish();
+}
+
 
-            // Store the pixel color
-            film->setPixelValue(col, lin, pixelColor);
+// Integrator of the server jobs of that name, null if unknown. The ones
+// built around a camera and a film (bidirectional, light tracing) are
+// not served
+Shader* createServerShader(const std::string &name, Vector3D bgColor)
+{
+    if (name == "intersection")
+        return new IntersectionShader(Vector3D(1, 0, 0), bgColor);
+    if (name == "whitted")
+        return new WhittedIntegrator(bgColor, 10, 0.25f);
+    if (name == "hemispherical")
+        return new HemisphericalDirectIntegrator(bgColor, 64);
+    if (name == "area")
+        return new AreaDirectIntegrator(bgColor, 64);
+    if (name == "path")
+        return new PurePathTracingIntegrator(bgColor, 5);
+    if (name == "nee")
+        return new NextEventEstimatorIntegrator(bgColor, 5, 16, 0.3f);
+    if (name == "photon")
+        return new PhotonMappingIntegrator(bgColor, 5);
+    if (name == "ao")
+        return new AmbientOcclusionIntegrator(bgColor, 64, 0.5f);
+    return nullptr;
+}
+
+// Serves render jobs on a Unix socket (RenderServer) until a shutdown.
+// The scenes are those of the buildScene functions, by name (cornell,
+// caustics, coveredlight, manylights, forest, sphere), kept built with
+// their BVH up to budgetBytes. The integrators are created on their first
+// job and kept too, their caches emptied when the scene changes
+void runRenderServer(const std::string &socketPath, size_t budgetBytes)
+{
+    SceneBuilder builder = [](const std::string &sceneId, ResidentScene &resident)
+    {
+        using Builder = std::function<void(Camera*&, Film*&, ResidentScene&)>;
+        static const std::map<std::string, Builder> builders = {
+            { "cornell", [](Camera*& cam, Film*& film, ResidentScene& r) { buildSceneCornellBox(cam, film, r.scene); } },
+            { "caustics", [](Camera*& cam, Film*& film, ResidentScene& r) { buildSceneCornellBoxCaustics(cam, film, r.scene); } },
+            { "coveredlight", [](Camera*& cam, Film*& film, ResidentScene& r) { buildSceneCornellBoxCoveredLight(cam, film, r.scene); } },
+            { "manylights", [](Camera*& cam, Film*& film, ResidentScene& r) { buildSceneCornellBoxManyLights(cam, film, r.scene); } },
+            { "forest", [](Camera*& cam, Film*& film, ResidentScene& r) { buildSceneForest(cam, film, r.scene, 10000, &r.sharedShapes); } },
+            { "sphere", [](Camera*& cam, Film*& film, ResidentScene& r) { buildSceneSphere(cam, film, r.scene); } }
+        };
+        auto build = builders.find(sceneId);
+        if (build == builders.end())
+            return false;
+
+        // The scenes place their camera on a film; the jobs bring their own
+        Film placeholder(1, 1);
+        Film* film = &placeholder;
+        Camera* cam = nullptr;
+        build->second(cam, film, resident);
+        PerspectiveCamera* camera = dynamic_cast<PerspectiveCamera*>(cam);
+        if (!camera)
+        {
+            // The jobs are rendered with perspective cameras only
+            std::cout << "Warning! The scene " << sceneId << " has no perspective camera" << std::endl;
+            delete cam;
+            return false;
+        }
+        resident.cameraToWorld = camera->cameraToWorld;
+        resident.fov = camera->fov;
+        delete cam;
+        return true;
+    };
+
+    std::map<std::string, Shader*> shaders;
+    std::string shadersScene;
+    JobRenderer render = [&](const RenderJob &job, ResidentScene &scene, Film &film, std::string &error)
+    {
+        Shader* &shader = shaders[job.integrator];
+        if (!shader)
+            shader = createServerShader(job.integrator, Vector3D(0.0));
+        if (!shader)
+        {
+            shaders.erase(job.integrator);
+            error = "unknown integrator " + job.integrator;
+            return false;
         }
+        if (job.sceneId != shadersScene)
+        {
+            for (auto &named : shaders)
+                named.second->sceneChanged();
+            shadersScene = job.sceneId;
+        }
+
+        Film* filmPtr = &film;
+        Camera* cam = new PerspectiveCamera(job.customCamera ? job.cameraToWorld : scene.cameraToWorld,
+                                            job.fovDegrees > 0.0 ? Utils::degreesToRadians(job.fovDegrees) : scene.fov,
+                                            film);
+        RenderSettings settings(job.samples, SamplerType::Sobol);
+        settings.jitter = true;
+        settings.filterType = FilterType::BlackmanHarris;
+        raytrace(cam, shader, filmPtr, scene.objects, scene.scene.LightSourceList, settings);
+        delete cam;
+        return true;
+    };
+
+    SceneCache cache(builder, budgetBytes);
+    RenderServer server(socketPath, cache, render);
+    server.run();
+    for (auto &named : shaders)
+        delete named.second;
+}
+
+
+// count random boxes, the size of the triangles of a mesh filling the
+// unit cube
+BVHPrimitiveBounds randomBoxes(size_t count)
+{
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    float size = 2.0f / std::cbrt((float)count);
+
+    BVHPrimitiveBounds bounds;
+    bounds.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        Vector3D center(uniform(rng), uniform(rng), uniform(rng));
+        Vector3D extent(uniform(rng) * size, uniform(rng) * size, uniform(rng) * size);
+        bounds.set(i, center - extent * 0.5, center + extent * 0.5);
     }
+    return bounds;
+}
+
+// Builds a BVH over count random boxes and prints the build metrics
+void bvhBuildBenchmark(size_t count)
+{
+    BVH bvh;
+    bvh.build(randomBoxes(count));
+    std::cout << bvh.getMetrics().toString() << " (" << numWorkerThreads() << " threads)" << std::endl;
+}
+
+// Traces rays through count random boxes with the binary, four-wide and
+// compressed four-wide layouts, and prints the memory per primitive and
+// the closest hit throughput of each
+void bvhTraversalBenchmark(size_t count, size_t numRays = 1000000)
+{
+    BVHPrimitiveBounds bounds = randomBoxes(count);
+    BVHSettings settings;
+    settings.compressed = true;
+    BVH bvh;
+    bvh.build(bounds, settings);
+    WideBVH wideBvh, compressedBvh;
+    wideBvh.build(bvh);
+    compressedBvh.build(bvh, true);
 
+    // Rays from a square in front of the cube through random points of it
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < numRays; i++)
+    {
+        Vector3D origin(uniform(rng) * 3.0 - 1.0, uniform(rng) * 3.0 - 1.0, -1.0);
+        Vector3D target(uniform(rng), uniform(rng), uniform(rng));
+        rays.push_back(Ray(origin, (target - origin).normalized()));
+    }
+
+    // The primitives are the boxes themselves
+    auto boxTest = [&](const Ray &ray, uint32_t primitive)
+    {
+        double tMin = ray.minT, tMax = ray.maxT;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double o = axis == 0 ? ray.o.x : axis == 1 ? ray.o.y : ray.o.z;
+            double invDir = 1.0 / (axis == 0 ? ray.d.x : axis == 1 ? ray.d.y : ray.d.z);
+            double tNear = (bounds.boundsMin[axis][primitive] - o) * invDir;
+            double tFar = (bounds.boundsMax[axis][primitive] - o) * invDir;
+            if (tNear > tFar)
+                std::swap(tNear, tFar);
+            tMin = std::max(tMin, tNear);
+            tMax = std::min(tMax, tFar);
+            if (tMin > tMax)
+                return false;
+        }
+        ray.maxT = tMin;
+        return true;
+    };
+    auto run = [&](const char *name, size_t memoryBytes, auto traverse)
+    {
+        std::vector<size_t> hits(numWorkerThreads(), 0);
+        auto start = high_resolution_clock::now();
+        parallelFor(numRays, [&](size_t i, int thread)
+        {
+            Ray ray = rays[i];
+            if (traverse(ray, [&](uint32_t primitive) { return boxTest(ray, primitive); }))
+                hits[thread]++;
+        });
+        double seconds = duration<double>(high_resolution_clock::now() - start).count();
+        size_t totalHits = 0;
+        for (size_t h : hits)
+            totalHits += h;
+        std::cout << name << ": " << (double)memoryBytes / count << " bytes per primitive, "
+                  << numRays / seconds * 1e-6 << " Mrays/s (" << totalHits << " hits)" << std::endl;
+    };
 
+    std::cout << bvh.getMetrics().toString() << " (" << numWorkerThreads() << " threads)" << std::endl;
+    run("Binary", bvh.getMetrics().memoryBytes, [&](const Ray &ray, auto test)
+        { return bvh.traverse(ray, false, test); });
+    run("Four-wide", wideBvh.getMemoryBytes(), [&](const Ray &ray, auto test)
+        { return wideBvh.traverse(ray, false, test); });
+    run("Four-wide compressed", compressedBvh.getMemoryBytes(), [&](const Ray &ray, auto test)
+        { return compressedBvh.traverse(ray, false, test); });
 }
 
 
@@ -278,8 +931,7 @@ int main()
     
     //First Assignment
     Shader *shader = new IntersectionShader (intersectionColor, bgColor);
-    Shader *depthshader = new DepthShader (intersectionColor,7.5f, bgColor);
-    Shader *normalshader = new NormalShader(bgColor);
+    // Depth and normals are written as AOV channels of the beauty render (output.exr)
     Shader *whittedshader = new WhittedIntegrator(bgColor,10, 0.25f);
     //4.2.1: Hemispherical Direct Integrator
     Shader *hemisfericaldirectshader = new HemisphericalDirectIntegrator(bgColor, 64);
@@ -289,6 +941,14 @@ int main()
     Shader *purepathshader = new PurePathTracingIntegrator(bgColor, 5);
     //4.3.2: Next Event Estimation Integrator (with AO: 16 samples, 0.3 max distance)
     Shader *neeshader = new NextEventEstimatorIntegrator(bgColor, 5, 16, 0.3f);
+    //Irradiance caching mode: indirect light at diffuse first hits interpolated from cached records
+    //static_cast<NextEventEstimatorIntegrator*>(neeshader)->enableIrradianceCache();
+    //Path guiding mode: the bounces learn where the indirect light comes from over training passes
+    //static_cast<NextEventEstimatorIntegrator*>(neeshader)->enablePathGuiding();
+    //Radiance caching mode (previews): paths end at the cached radiance of the surfaces they reach
+    //static_cast<NextEventEstimatorIntegrator*>(neeshader)->enableRadianceCache();
+    //Photon Mapping Integrator (caustics from the mirror and transmissive objects)
+    Shader *photonmapshader = new PhotonMappingIntegrator(bgColor, 5);
     //Ambient Occlusion Integrator
     Shader *ambientOcclusionShader = new AmbientOcclusionIntegrator(bgColor, 64, 0.5f);
     //Constant Ambient Integrator (for comparison)
@@ -297,6 +957,9 @@ int main()
 
   
 
+    //Render server: serves render jobs on a Unix socket, keeping the last scenes built (up to 4 GB)
+    //runRenderServer("/tmp/acg.sock", (size_t)4 << 30); return 0;
+
     // Build the scene---------------------------------------------------------
     // 
     // Declare pointers to all the variables which describe the scene
@@ -305,6 +968,28 @@ int main()
     //Create Scene Geometry and Illumiantion
     //buildSceneSphere(cam, film, myScene); //Task 2,3,4;
     buildSceneCornellBox(cam, film, myScene); //Task 5
+    //buildSceneCornellBoxCaustics(cam, film, myScene); //Photon mapping
+    //buildSceneCornellBoxCoveredLight(cam, film, myScene); //Path guiding
+    //buildSceneCornellBoxManyLights(cam, film, myScene); //Reservoir resampling
+    //buildSceneForest(cam, film, myScene, 1000000); //Instancing (with the BVH aggregate)
+    //Animation animation; buildAnimationCornellBox(cam, film, myScene, animation); //Sequence mode
+    //Many lights: one shadow ray per vertex, for the light sample kept by resampling
+    //static_cast<NextEventEstimatorIntegrator*>(neeshader)->enableReservoirSampling(*film);
+    //Bidirectional Path Tracing: splats the light subpaths seen by the camera into the film
+    //Shader *bdptshader = new BidirectionalPathTracingIntegrator(bgColor, 5, *static_cast<PerspectiveCamera*>(cam), *film);
+    //Light Tracing: connects every light path vertex to the camera
+    //Shader *lighttracingshader = new LightTracingIntegrator(bgColor, 5, *static_cast<PerspectiveCamera*>(cam), *film);
+
+    //BVH: the integrators trace a single aggregate of the scene objects
+    //Aggregate *aggregate = new Aggregate(*myScene.objectsList);
+    //BVH cache: later runs load the tree from bvhcache/ instead of building it
+    //Aggregate *aggregate = new Aggregate(*myScene.objectsList, BVHSettings(), "bvhcache");
+    //std::cout << aggregate->getMetrics().toString() << std::endl;
+    //myScene.objectsList = new std::vector<Shape*>{ aggregate };
+    //BVH build benchmark (10M primitives)
+    //bvhBuildBenchmark(10000000);
+    //BVH layouts: memory and traversal speed (1M primitives)
+    //bvhTraversalBenchmark(1000000);
 
     //---------------------------------------------------------------------------
 
@@ -312,6 +997,7 @@ int main()
     //PaintImage(film);
 
     // Launch some rays! TASK 2,3,...   
+    Statistics::reset();
     auto start = high_resolution_clock::now();
     //Task 4.1
     //raytrace(cam, whittedshader, film, myScene.objectsList, myScene.LightSourceList);
@@ -322,19 +1008,53 @@ int main()
     //Task 4.3.1: Pure Path Tracing Integrator
     //raytrace(cam, purepathshader, film, myScene.objectsList, myScene.LightSourceList, 32);
     //Task 4.3.2: Next Event Estimation Integrator
-    raytrace(cam, neeshader, film, myScene.objectsList, myScene.LightSourceList, 64);
+    RenderSettings settings(32, SamplerType::Sobol);
+    settings.jitter = true;
+    settings.filterType = FilterType::BlackmanHarris;
+    //settings.heatmap = HeatmapMode::Time; // Per-pixel cost, saved to output_heatmap.bmp
+    raytrace(cam, neeshader, film, myScene.objectsList, myScene.LightSourceList, settings);
+    //Photon Mapping (with buildSceneCornellBoxCaustics)
+    //raytrace(cam, photonmapshader, film, myScene.objectsList, myScene.LightSourceList, settings);
+    //Bidirectional Path Tracing
+    //raytrace(cam, bdptshader, film, myScene.objectsList, myScene.LightSourceList, settings);
+
+    //Light Tracing
+    //raytrace(cam, lighttracingshader, film, myScene.objectsList, myScene.LightSourceList, settings);
     //Ambient Occlusion
     //raytrace(cam, ambientOcclusionShader, film, myScene.objectsList, myScene.LightSourceList);
     //Constant Ambient (for comparison with AO)
     //raytrace(cam, constantAmbientShader, film, myScene.objectsList, myScene.LightSourceList);
+    //Sampler comparison: RMSE vs spp for every sampler
+    //samplerConvergenceStudy(cam, neeshader, film, myScene.objectsList, myScene.LightSourceList, 64, 1024);
+    //Sequence mode (with buildAnimationCornellBox): 24 frames written to frames/, each while the next renders.
+    //With the BVH, pass the aggregate instead of nullptr: the moved shapes are refit in it
+    //renderSequence(cam, neeshader, film, myScene.objectsList, myScene.LightSourceList, animation, nullptr, SequenceSettings(24), settings);
+    //Fly-through preview: a few samples per frame, accumulated over the frames by reprojection
+    //SequenceSettings preview(24); preview.temporalAccumulation = true;
+    //renderSequence(cam, neeshader, film, myScene.objectsList, myScene.LightSourceList, animation, nullptr, preview, RenderSettings(2, SamplerType::Sobol));
     auto stop = high_resolution_clock::now();
 
-    
+    // Ray throughput and hot-path counters of the render (needs ACG_STATS)
+    StatisticsReport stats = Statistics::report((durationMs(stop - start) / 1000.0).count());
+    std::cout << "\n" << stats.toString();
+    std::ofstream("output_stats.json") << stats.toJSON();
+
+    // Denoise the result, guided by the features collected by raytrace()
+    auto denoiseStart = high_resolution_clock::now();
+    Film denoisedFilm(film->getWidth(), film->getHeight());
+    Denoiser denoiser;
+    denoiser.denoise(*film, denoisedFilm);
+    auto denoiseStop = high_resolution_clock::now();
+    std::cout << "\nDENOISE_TIME(s): " << (durationMs(denoiseStop - denoiseStart) / 1000.0).count() << std::endl;
+
 
     // Save the final result to file
     std::cout << "\n\nSaving the result to file output.bmp\n" << std::endl;
     film->save();
-    film->saveEXR();
+    film->saveEXRWithAOVs("output.exr");
+    if (settings.heatmap != HeatmapMode::None)
+        film->saveHeatmap("output_heatmap.bmp");
+    denoisedFilm.saveEXR("output_denoised.exr");
 
     float durationS = (durationMs(stop - start) / 1000.0).count() ;
     std::cout <<  "FINAL_TIME(s): " << durationS << std::endl;
@@ -1,5 +1,7 @@
 #include "emissive.h"
 
+#include "../core/statistics.h"
+
 #include <iostream>
 
 Emissive::Emissive()
@@ -10,6 +12,7 @@ Ke(Ke_), rho_d(rho_d_){}
 
 Vector3D Emissive::getReflectance(const Vector3D& n, const Vector3D& wo,
     const Vector3D& wi) const {
+    STAT_INC(MaterialEvaluations);
     return  rho_d/3.1416;
 };
 
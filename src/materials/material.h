@@ -7,6 +7,7 @@ class Material
 {
 public:
     Material();
+    virtual ~Material() {}
 
     virtual Vector3D getReflectance(const Vector3D &n, const Vector3D &wo,
                                     const Vector3D &wi) const = 0; //Return Phong BRDF of Phong Materials and Emissive Diffuse
@@ -20,6 +21,8 @@ public:
     virtual bool hasTransmission() const = 0;
     virtual bool hasDiffuseOrGlossy() const = 0;
     virtual bool isEmissive() const = 0;
+    // Purely diffuse (reflectance getDiffuseReflectance() / pi everywhere)
+    virtual bool isLambertian() const { return false; }
 
 
     
@@ -1,5 +1,7 @@
 #include "mirror.h"
 
+#include "../core/statistics.h"
+
 #include <iostream>
 
 Mirror::Mirror()
@@ -12,6 +14,7 @@ Mirror::Mirror(Vector3D reflectance_):
 
 Vector3D Mirror::getReflectance(const Vector3D& n, const Vector3D& wo,
     const Vector3D& wi) const {
+    STAT_INC(MaterialEvaluations);
     // Mirror materials handle reflection recursively in the integrator
     return Vector3D(0.0);
 }
@@ -1,5 +1,7 @@
 #include "phong.h"
 
+#include "../core/statistics.h"
+
 #include <iostream>
 #include <cmath>
 
@@ -16,6 +18,7 @@ rho_d(Kd_), Ks(Ks_), alpha(alpha_){}
 
 Vector3D Phong::getReflectance(const Vector3D& n, const Vector3D& wo,
     const Vector3D& wi) const {
+    STAT_INC(MaterialEvaluations);
     //   - n is the surface normal
     //   - ω_i is the incident light direction (towards the light)
     //   - ω_o is the outgoing view direction (towards the camera)
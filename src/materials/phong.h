@@ -16,6 +16,7 @@ public:
     bool hasTransmission() const { return false; }
     bool hasDiffuseOrGlossy() const { return true; }
     bool isEmissive() const { return false; }
+    bool isLambertian() const { return Ks.lengthSq() == 0.0; }
 
     double getIndexOfRefraction() const;
     Vector3D getEmissiveRadiance() const;
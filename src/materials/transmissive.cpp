@@ -1,5 +1,7 @@
 #include "transmissive.h"
 
+#include "../core/statistics.h"
+
 Transmissive::Transmissive()
 { }
 
@@ -10,6 +12,7 @@ Transmissive::Transmissive(double mu_t_):
 
 Vector3D Transmissive::getReflectance(const Vector3D& n, const Vector3D& wo,
     const Vector3D& wi) const {
+    STAT_INC(MaterialEvaluations);
     // Perfect transmission - this function is not used
     // Transmissive materials handle refraction recursively in the integrator
     return Vector3D(0.0);
@@ -1,22 +1,45 @@
 #include "ambientocclusionintegrator.h"
 #include "../core/utils.h"
 #include "../core/hemisphericalsampler.h"
+#include "../core/sampler.h"
+#include "../core/statistics.h"
 #include <cmath>
 
-AmbientOcclusionIntegrator::AmbientOcclusionIntegrator(Vector3D bgColor_, int numSamples_, float maxDistance_) :
+AmbientOcclusionIntegrator::AmbientOcclusionIntegrator(Vector3D bgColor_, int numSamples_, float maxDistance_,
+                                                       bool useCache_) :
     Shader(bgColor_), numSamples(numSamples_), maxDistance(maxDistance_)
-{ }
+{
+    if (useCache_)
+        cache = std::make_unique<AmbientOcclusionCache>(AOCacheRadius * maxDistance);
+}
+
+void AmbientOcclusionIntegrator::sceneChanged()
+{
+    if (cache)
+        cache->clear();
+}
 
 Vector3D AmbientOcclusionIntegrator::computeColor(const Ray &ray,
                                           const std::vector<Shape*> &objList,
                                           const std::vector<LightSource*> &lsList) const
 {
     // Step 1: Find closest intersection with scene geometry
-    Intersection its;
-    if (!Utils::getClosestIntersection(ray, objList, its))
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D AmbientOcclusionIntegrator::computeColorFromHit(const Ray &ray, const PrimaryHit &primary,
+                                                         const std::vector<Shape*> &objList,
+                                                         const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
         return bgColor;  // Ray escaped scene, return background color
 
+    STAT_PATH_VERTEX(0);
+
     // Step 2: Get material and surface properties
+    const Intersection& its = primary.its;
     const Material& mat = its.shape->getMaterial();
     const Vector3D x = its.itsPoint;              // Surface point
     const Vector3D normal = its.normal.normalized(); // Surface normal
@@ -26,42 +49,62 @@ Vector3D AmbientOcclusionIntegrator::computeColor(const Ray &ray,
     if (mat.isEmissive())
         return Vector3D(1.0, 1.0, 1.0);  // White - no occlusion for lights
     
-    // Step 4: Compute Ambient Occlusion for all other materials
+    // Step 4: Compute Ambient Occlusion for all other materials (unless cached)
+    float ao = primary.aoFactor >= 0.0f ? primary.aoFactor
+                                        : getAmbientOcclusion(x, normal, (int)ray.depth, objList);
+
+    // Get material diffuse color
+    Vector3D materialColor = mat.getDiffuseReflectance();
+
+    // Return AO modulated by material color
+    return materialColor * ao;
+}
+
+void AmbientOcclusionIntegrator::preparePrimaryHit(const Ray &ray, PrimaryHit &primary,
+                                                   const std::vector<Shape*> &objList) const
+{
+    if (primary.hit && !primary.its.shape->getMaterial().isEmissive())
+        primary.aoFactor = getAmbientOcclusion(primary.its.itsPoint, primary.its.normal.normalized(),
+                                               (int)ray.depth, objList);
+}
+
+float AmbientOcclusionIntegrator::getAmbientOcclusion(const Vector3D &x, const Vector3D &normal, int depth,
+                                                      const std::vector<Shape*> &objList) const
+{
+    if (!cache)
+        return computeAmbientOcclusion(x, normal, depth, objList);
+    return cache->lookup(x, normal, [&]() { return computeAmbientOcclusion(x, normal, depth, objList); });
+}
+
+float AmbientOcclusionIntegrator::computeAmbientOcclusion(const Vector3D &x, const Vector3D &normal, int depth,
+                                                          const std::vector<Shape*> &objList) const
+{
     HemisphericalSampler sampler;
-    int blockedRays = 0;  // Count how many rays hit something nearby
+    Sampler& rng = Sampler::active();
     
     // Cast numSamples rays in random hemisphere directions
+    std::vector<Ray> occlusionRays;
+    occlusionRays.reserve(numSamples);
     for (int i = 0; i < numSamples; i++)
     {
         // Get a random direction in the hemisphere around the normal
-        Vector3D wi = sampler.getSample(normal);
+        double u1, u2;
+        rng.get2D(SampleDimension::AmbientOcclusion, depth, u1, u2, i, numSamples);
+        Vector3D wi = sampler.getSample(normal, u1, u2);
         
-        // Create occlusion test ray from surface point in direction wi
-        Ray occlusionRay(x, wi);
-        occlusionRay.minT = Epsilon;  // Avoid self-intersection
-        occlusionRay.maxT = maxDistance;  // Only check within maxDistance
-        
-        // Check if ray hits something within maxDistance
-        Intersection occlusionHit;
-        if (Utils::getClosestIntersection(occlusionRay, objList, occlusionHit))
-        {
-            // Ray hit something within maxDistance -> it's occluded
-            blockedRays++;
-        }
-        // If no hit within maxDistance, ray "escaped" -> not occluded
+        // Occlusion test ray from surface point in direction wi, only
+        // checked within maxDistance
+        occlusionRays.emplace_back(x, wi, 0, Epsilon, maxDistance);
     }
+
+    // Count how many rays hit something nearby; the rest "escaped"
+    int blockedRays = Utils::countOccluded(occlusionRays.data(), numSamples, objList);
     
     // Step 5: Compute AO factor
     // Occlusion factor: ratio of blocked rays
     float occlusionFactor = (float)blockedRays / (float)numSamples;
     
     // AO value: 1.0 = fully exposed (bright), 0.0 = fully occluded (dark)
-    float ao = 1.0f - occlusionFactor;
-    
-    // Get material diffuse color
-    Vector3D materialColor = mat.getDiffuseReflectance();
-    
-    // Return AO modulated by material color
-    return materialColor * ao;
+    return 1.0f - occlusionFactor;
 }
 
@@ -2,19 +2,43 @@
 #define AMBIENTOCCLUSIONINTEGRATOR_H
 
 #include "shader.h"
+#include "../core/aocache.h"
+
+#include <memory>
 
 class AmbientOcclusionIntegrator : public Shader
 {
 public:
-    AmbientOcclusionIntegrator(Vector3D bgColor_, int numSamples_, float maxDistance_);
+    // With useCache_, occlusion values are shared between nearby points
+    // through a world-space cache
+    AmbientOcclusionIntegrator(Vector3D bgColor_, int numSamples_, float maxDistance_,
+                               bool useCache_ = false);
     
     virtual Vector3D computeColor(const Ray &r,
                                  const std::vector<Shape*> &objList,
                                  const std::vector<LightSource*> &lsList) const;
+    virtual Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                         const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList) const;
+
+    // Caches the occlusion of the first hit
+    virtual void preparePrimaryHit(const Ray &r, PrimaryHit &primary,
+                                   const std::vector<Shape*> &objList) const;
+
+    // Empties the occlusion cache
+    virtual void sceneChanged();
 
 private:
     int numSamples;      // Number of rays to cast for AO computation
     float maxDistance;   // Maximum distance for occlusion (beyond this = not occluded)
+    std::unique_ptr<AmbientOcclusionCache> cache; // Null when caching is disabled
+
+    // Occlusion at x, from the cache when enabled
+    float getAmbientOcclusion(const Vector3D &x, const Vector3D &normal, int depth,
+                              const std::vector<Shape*> &objList) const;
+    // Fraction of the numSamples occlusion rays that escape within maxDistance
+    float computeAmbientOcclusion(const Vector3D &x, const Vector3D &normal, int depth,
+                                  const std::vector<Shape*> &objList) const;
 };
 
 #endif // AMBIENTOCCLUSIONINTEGRATOR_H
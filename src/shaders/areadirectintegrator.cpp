@@ -1,5 +1,7 @@
 #include "areadirectintegrator.h"
 #include "../core/utils.h"
+#include "../core/sampler.h"
+#include "../core/statistics.h"
 #include <cmath>
 
 #ifndef M_PI
@@ -15,10 +17,22 @@ Vector3D AreaDirectIntegrator::computeColor(const Ray &ray,
                                            const std::vector<LightSource*> &lsList) const
 {
     // Find closest intersection with scene geometry
-    Intersection its;
-    if (!Utils::getClosestIntersection(ray, objList, its))
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D AreaDirectIntegrator::computeColorFromHit(const Ray &ray, const PrimaryHit &primary,
+                                                   const std::vector<Shape*> &objList,
+                                                   const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
         return bgColor;  // Ray escaped scene, return background color
 
+    STAT_PATH_VERTEX(0);
+
+    const Intersection& its = primary.its;
+
     // Setup local shading frame at intersection point
     const Vector3D x = its.itsPoint;           // Surface point x
     const Vector3D normal = its.normal.normalized(); // Surface normal n_x
@@ -104,9 +118,12 @@ Vector3D AreaDirectIntegrator::computeDirectIllumination(const Vector3D& x, cons
                                                         const std::vector<LightSource*>& lsList) const
 {
     Vector3D Lo(0.0f);
+    Sampler& rng = Sampler::active();
+    const int numLights = (int)lsList.size();
         
-    for (const LightSource* light : lsList)
+    for (int lightIndex = 0; lightIndex < numLights; lightIndex++)
     {
+        const LightSource* light = lsList[lightIndex];
         // Only process area lights (skip point lights)
         if (light->getArea() > 0.0)
         {
@@ -116,7 +133,10 @@ Vector3D AreaDirectIntegrator::computeDirectIllumination(const Vector3D& x, cons
             for (int i = 0; i < numSamples; i++)
             {
                 // Sample random point on light source
-                Vector3D y = light->generateRandomPoint();
+                double u, v;
+                rng.get2D(SampleDimension::Light, 0, u, v,
+                          lightIndex * numSamples + i, numLights * numSamples);
+                Vector3D y = light->generatePoint(u, v);
                 
                 // Compute direction from x to y
                 Vector3D wi = (y - x).normalized();
@@ -183,6 +203,6 @@ bool AreaDirectIntegrator::computeVisibility(const Vector3D& x, const Vector3D&
     shadowRay.maxT = distance - Epsilon;  // Stop at y
         
     // Check if any object blocks the path from x to y
-    return !Utils::hasIntersection(shadowRay, objList);
+    return !Utils::isOccluded(shadowRay, objList);
 }
 
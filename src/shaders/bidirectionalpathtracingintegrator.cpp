@@ -0,0 +1,439 @@
+#include "bidirectionalpathtracingintegrator.h"
+#include "core/hemisphericalsampler.h"
+#include "core/sampler.h"
+#include "core/intersection.h"
+#include "core/utils.h"
+#include "core/statistics.h"
+#include "core/vector3d.h"
+#include "shapes/shape.h"
+#include "lightsources/arealightsource.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static bool isBlack(const Vector3D &v)
+{
+    return v.x == 0.0 && v.y == 0.0 && v.z == 0.0;
+}
+
+// Ratios of densities treat the missing densities of delta vertices as 1
+static double remap0(double pdf)
+{
+    return pdf != 0.0 ? pdf : 1.0;
+}
+
+BidirectionalPathTracingIntegrator::BidirectionalPathTracingIntegrator(Vector3D bgColor_, int maxDepth_,
+                                                                       const PerspectiveCamera &camera_,
+                                                                       Film &film_):
+    Shader(bgColor_), maxDepth(maxDepth_), camera(camera_), film(film_)
+{ }
+
+void BidirectionalPathTracingIntegrator::preprocess(const std::vector<Shape*> &objList,
+                                                    const std::vector<LightSource*> &lsList)
+{
+    emitters.clear();
+    for (const LightSource* light : lsList)
+    {
+        const AreaLightSource* areaLight = dynamic_cast<const AreaLightSource*>(light);
+        if (areaLight)
+            emitters[areaLight->getShape()] = light;
+    }
+}
+
+Vector3D BidirectionalPathTracingIntegrator::computeColor(const Ray &ray,
+                                                          const std::vector<Shape*> &objList,
+                                                          const std::vector<LightSource*> &lsList) const
+{
+    // Vertex storage of the calling thread, reused by all its paths
+    static thread_local std::vector<PathVertex> cameraPath;
+    static thread_local std::vector<PathVertex> lightPath;
+    if ((int)cameraPath.size() < maxDepth + 2)
+    {
+        cameraPath.resize(maxDepth + 2);
+        lightPath.resize(maxDepth + 1);
+    }
+
+    // The light subpath is traced even when the camera ray escapes: its
+    // splats onto the film (t = 1) belong to this sample all the same
+    int numCamera = generateCameraSubpath(ray, cameraPath.data(), objList);
+    int numLight = generateLightSubpath(lightPath.data(), objList, lsList);
+
+    // Every strategy (s light vertices, t camera vertices) of every path
+    // length up to maxDepth bounces. s = 1, t = 1 (the camera seeing the
+    // light directly) is the same path as s = 0, t = 2
+    Vector3D L = numCamera < 2 ? bgColor : Vector3D(0.0);
+    for (int t = 1; t <= numCamera; t++)
+    {
+        for (int s = 0; s <= numLight; s++)
+        {
+            int depth = s + t - 2;
+            if ((s == 1 && t == 1) || depth < 0 || depth > maxDepth)
+                continue;
+            L += connect(lightPath.data(), cameraPath.data(), s, t, (int)lsList.size(), objList);
+        }
+    }
+    return L;
+}
+
+int BidirectionalPathTracingIntegrator::generateCameraSubpath(const Ray &ray, PathVertex *path,
+                                                              const std::vector<Shape*> &objList) const
+{
+    PathVertex &cameraVertex = path[0];
+    cameraVertex.type = VertexType::Camera;
+    cameraVertex.p = ray.o;
+    cameraVertex.n = camera.getForward();
+    cameraVertex.beta = Vector3D(1.0);
+    cameraVertex.material = nullptr;
+    cameraVertex.light = nullptr;
+    cameraVertex.delta = false;
+    cameraVertex.pdfFwd = 0.0;
+    cameraVertex.pdfRev = 0.0;
+
+    return 1 + randomWalk(ray, Vector3D(1.0), camera.directionPdf(ray.d), maxDepth + 1, path + 1,
+                          0, objList);
+}
+
+int BidirectionalPathTracingIntegrator::generateLightSubpath(PathVertex *path,
+                                                             const std::vector<Shape*> &objList,
+                                                             const std::vector<LightSource*> &lsList) const
+{
+    const int numLights = (int)lsList.size();
+    if (numLights == 0)
+        return 0;
+
+    // The light subpath takes the sampler dimensions after those of the
+    // longest camera subpath
+    Sampler& rng = Sampler::active();
+    const int dimension = maxDepth + 2;
+
+    int lightIndex = std::min((int)(rng.get1D(SampleDimension::RussianRoulette, dimension) * numLights),
+                              numLights - 1);
+    const LightSource* light = lsList[lightIndex];
+    if (light->getArea() <= 0.0)
+        return 0;
+
+    // Uniform point on the light, cosine-weighted direction
+    double u, v;
+    rng.get2D(SampleDimension::Light, dimension, u, v);
+    Vector3D y = light->generatePoint(u, v);
+    rng.get2D(SampleDimension::BSDF, dimension, u, v);
+    Vector3D ny = light->getNormal();
+    HemisphericalSampler hemisphere;
+    Vector3D wi = hemisphere.getCosineSample(ny, u, v);
+    double pdfPos = 1.0 / (numLights * light->getArea());
+    double pdfDir = dot(ny, wi) / M_PI;
+    if (pdfDir <= 0.0)
+        return 0;
+
+    PathVertex &lightVertex = path[0];
+    lightVertex.type = VertexType::Light;
+    lightVertex.p = y;
+    lightVertex.n = ny;
+    lightVertex.beta = light->getIntensity() / pdfPos;
+    lightVertex.material = nullptr;
+    lightVertex.light = light;
+    lightVertex.delta = false;
+    lightVertex.pdfFwd = pdfPos;
+    lightVertex.pdfRev = 0.0;
+
+    // Le * cos / (pdfPos * pdfDir), with pdfDir = cos / pi
+    Vector3D beta = light->getIntensity() * (M_PI / pdfPos);
+    return 1 + randomWalk(Ray(y, wi, 0), beta, pdfDir, maxDepth, path + 1, dimension + 1, objList);
+}
+
+int BidirectionalPathTracingIntegrator::randomWalk(Ray ray, Vector3D beta, double pdfFwd, int maxVertices,
+                                                   PathVertex *path, int dimension,
+                                                   const std::vector<Shape*> &objList) const
+{
+    if (maxVertices <= 0)
+        return 0;
+
+    HemisphericalSampler hemisphere;
+    Sampler& rng = Sampler::active();
+    int bounces = 0;
+    while (true)
+    {
+        Intersection its;
+        if (!Utils::getClosestIntersection(ray, objList, its))
+            break;
+
+        PathVertex &vertex = path[bounces];
+        PathVertex &prev = path[bounces - 1];
+        const Material& mat = its.shape->getMaterial();
+        auto emitter = emitters.find(its.shape);
+
+        vertex.type = VertexType::Surface;
+        vertex.p = its.itsPoint;
+        vertex.n = its.normal.normalized();
+        vertex.beta = beta;
+        vertex.material = &mat;
+        vertex.light = emitter != emitters.end() ? emitter->second : nullptr;
+        vertex.delta = mat.hasSpecular() || mat.hasTransmission();
+        vertex.pdfFwd = convertDensity(pdfFwd, prev, vertex);
+        vertex.pdfRev = 0.0;
+        STAT_PATH_VERTEX(bounces);
+
+        if (++bounces >= maxVertices)
+            break;
+
+        // Next direction, and the density of the reverse one for the MIS weights
+        const Vector3D wo = (-ray.d).normalized();
+        Vector3D wi;
+        double pdfRev;
+        if (vertex.delta)
+        {
+            Vector3D weight;
+            if (!Utils::sampleSpecular(vertex.n, wo, mat, wi, weight))
+                break;
+            beta = beta * weight;
+            pdfFwd = pdfRev = 0.0;
+        }
+        else
+        {
+            Vector3D n = dot(vertex.n, wo) < 0.0 ? -vertex.n : vertex.n;
+            double u1, u2;
+            rng.get2D(SampleDimension::BSDF, dimension + bounces - 1, u1, u2);
+            wi = hemisphere.getCosineSample(n, u1, u2);
+            pdfFwd = dot(n, wi) / M_PI;
+            if (pdfFwd <= 0.0)
+                break;
+            // f * cos / pdf, with pdf = cos / pi
+            beta = beta * mat.getReflectance(n, wo, wi) * M_PI;
+            pdfRev = dot(n, wo) / M_PI;
+        }
+        if (isBlack(beta))
+            break;
+
+        prev.pdfRev = convertDensity(pdfRev, vertex, prev);
+        ray = Ray(vertex.p, wi, bounces);
+    }
+    return bounces;
+}
+
+Vector3D BidirectionalPathTracingIntegrator::connect(PathVertex *lightPath, PathVertex *cameraPath,
+                                                     int s, int t, int numLights,
+                                                     const std::vector<Shape*> &objList) const
+{
+    Vector3D L(0.0);
+    if (s == 0)
+    {
+        // The camera subpath hit a light source
+        const PathVertex &pt = cameraPath[t - 1];
+        if (!pt.light)
+            return L;
+        L = pt.beta * emittedRadiance(pt, cameraPath[t - 2]);
+        if (isBlack(L))
+            return L;
+    }
+    else if (t == 1)
+    {
+        // Light vertex seen by the camera: splatted at its projection
+        const PathVertex &qs = lightPath[s - 1];
+        const PathVertex &cameraVertex = cameraPath[0];
+        double x, y;
+        if (qs.delta || !camera.worldToRaster(qs.p, x, y))
+            return L;
+
+        // Importance of the camera over the density of the connection:
+        // 1 / (A cos^3 d^2), A being the image plane area at distance 1
+        Vector3D toCamera = cameraVertex.p - qs.p;
+        double distance2 = toCamera.lengthSq();
+        Vector3D w = toCamera / std::sqrt(distance2);
+        double cosCamera = -dot(cameraVertex.n, w);
+        L = qs.beta * evaluate(qs, s > 1 ? &lightPath[s - 2] : nullptr, cameraVertex)
+          * (std::abs(dot(qs.n, w)) / (camera.imagePlaneArea() * cosCamera * cosCamera * cosCamera * distance2));
+        if (isBlack(L) || !isVisible(qs, cameraVertex, objList))
+            return Vector3D(0.0);
+
+        film.addSplat(x, y, L * misWeight(lightPath, cameraPath, s, t, numLights));
+        return Vector3D(0.0);
+    }
+    else
+    {
+        // Connection of two vertices, both with a finite BSDF
+        const PathVertex &qs = lightPath[s - 1];
+        const PathVertex &pt = cameraPath[t - 1];
+        if (qs.delta || pt.delta)
+            return L;
+
+        L = qs.beta * evaluate(qs, s > 1 ? &lightPath[s - 2] : nullptr, pt)
+          * evaluate(pt, &cameraPath[t - 2], qs) * pt.beta;
+        if (isBlack(L))
+            return L;
+        L = L * geometricTerm(qs, pt);
+        if (isBlack(L) || !isVisible(qs, pt, objList))
+            return Vector3D(0.0);
+    }
+
+    return L * misWeight(lightPath, cameraPath, s, t, numLights);
+}
+
+double BidirectionalPathTracingIntegrator::misWeight(PathVertex *lightPath, PathVertex *cameraPath,
+                                                     int s, int t, int numLights) const
+{
+    if (s + t == 2)
+        return 1.0;
+
+    PathVertex *qs = s > 0 ? &lightPath[s - 1] : nullptr;
+    PathVertex *pt = &cameraPath[t - 1];
+    PathVertex *qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+    PathVertex *ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+
+    // Reverse densities of the vertices next to the connection, which only
+    // exist once the two subpaths are joined. They replace the stored ones
+    // while the weight is computed
+    double ptPdfRev = s > 0 ? pdf(*qs, qsMinus, *pt) : pdfLightOrigin(*pt, numLights);
+    double ptMinusPdfRev = 0.0, qsPdfRev = 0.0, qsMinusPdfRev = 0.0;
+    if (ptMinus)
+        ptMinusPdfRev = s > 0 ? pdf(*pt, qs, *ptMinus) : pdfLight(*pt, *ptMinus);
+    if (qs)
+        qsPdfRev = pdf(*pt, ptMinus, *qs);
+    if (qsMinus)
+        qsMinusPdfRev = pdf(*qs, pt, *qsMinus);
+
+    double savedPt = pt->pdfRev;
+    double savedPtMinus = ptMinus ? ptMinus->pdfRev : 0.0;
+    double savedQs = qs ? qs->pdfRev : 0.0;
+    double savedQsMinus = qsMinus ? qsMinus->pdfRev : 0.0;
+    pt->pdfRev = ptPdfRev;
+    if (ptMinus)
+        ptMinus->pdfRev = ptMinusPdfRev;
+    if (qs)
+        qs->pdfRev = qsPdfRev;
+    if (qsMinus)
+        qsMinus->pdfRev = qsMinusPdfRev;
+
+    // Densities of the other strategies of the same path, relative to this
+    // one: moving the connection towards the camera...
+    double sumRi = 0.0;
+    double ri = 1.0;
+    for (int i = t - 1; i > 0; i--)
+    {
+        ri *= remap0(cameraPath[i].pdfRev) / remap0(cameraPath[i].pdfFwd);
+        if (!cameraPath[i].delta && !cameraPath[i - 1].delta)
+            sumRi += ri;
+    }
+
+    // ...and towards the light
+    ri = 1.0;
+    for (int i = s - 1; i >= 0; i--)
+    {
+        ri *= remap0(lightPath[i].pdfRev) / remap0(lightPath[i].pdfFwd);
+        bool deltaPrev = i > 0 && lightPath[i - 1].delta;
+        if (!lightPath[i].delta && !deltaPrev)
+            sumRi += ri;
+    }
+
+    pt->pdfRev = savedPt;
+    if (ptMinus)
+        ptMinus->pdfRev = savedPtMinus;
+    if (qs)
+        qs->pdfRev = savedQs;
+    if (qsMinus)
+        qsMinus->pdfRev = savedQsMinus;
+
+    return 1.0 / (1.0 + sumRi);
+}
+
+Vector3D BidirectionalPathTracingIntegrator::evaluate(const PathVertex &v, const PathVertex *prev,
+                                                      const PathVertex &next) const
+{
+    Vector3D wn = (next.p - v.p).normalized();
+    if (v.type == VertexType::Light)
+        return dot(v.n, wn) > 0.0 ? Vector3D(1.0) : Vector3D(0.0);
+
+    // Reflection only: both directions on the same side of the surface
+    Vector3D wp = (prev->p - v.p).normalized();
+    if (dot(v.n, wp) * dot(v.n, wn) <= 0.0)
+        return Vector3D(0.0);
+    return v.material->getReflectance(v.n, wp, wn);
+}
+
+Vector3D BidirectionalPathTracingIntegrator::emittedRadiance(const PathVertex &v,
+                                                             const PathVertex &towards) const
+{
+    // One-sided emitters, as sampled by the light subpaths
+    if (dot(v.light->getNormal(), towards.p - v.p) <= 0.0)
+        return Vector3D(0.0);
+    return v.material->getEmissiveRadiance();
+}
+
+double BidirectionalPathTracingIntegrator::pdf(const PathVertex &v, const PathVertex *prev,
+                                               const PathVertex &next) const
+{
+    if (v.type == VertexType::Light)
+        return pdfLight(v, next);
+
+    Vector3D wn = (next.p - v.p).normalized();
+    double pdfDir;
+    if (v.type == VertexType::Camera)
+        pdfDir = camera.directionPdf(wn);
+    else
+    {
+        if (v.delta)
+            return 0.0;
+        // Cosine-weighted sampling around the normal on the side of prev
+        Vector3D wp = prev->p - v.p;
+        Vector3D n = dot(v.n, wp) < 0.0 ? -v.n : v.n;
+        pdfDir = std::max(0.0, dot(n, wn)) / M_PI;
+    }
+    return convertDensity(pdfDir, v, next);
+}
+
+double BidirectionalPathTracingIntegrator::pdfLight(const PathVertex &v, const PathVertex &next) const
+{
+    Vector3D w = next.p - v.p;
+    double distance2 = w.lengthSq();
+    w = w / std::sqrt(distance2);
+    double pdfDir = std::max(0.0, dot(v.light->getNormal(), w)) / M_PI;
+    double pdf = pdfDir / distance2;
+    if (next.type != VertexType::Camera)
+        pdf *= std::abs(dot(next.n, w));
+    return pdf;
+}
+
+double BidirectionalPathTracingIntegrator::pdfLightOrigin(const PathVertex &v, int numLights) const
+{
+    return 1.0 / (numLights * v.light->getArea());
+}
+
+double BidirectionalPathTracingIntegrator::geometricTerm(const PathVertex &a, const PathVertex &b) const
+{
+    Vector3D d = b.p - a.p;
+    double distance2 = d.lengthSq();
+    Vector3D w = d / std::sqrt(distance2);
+    double G = 1.0 / distance2;
+    if (a.type != VertexType::Camera)
+        G *= std::abs(dot(a.n, w));
+    if (b.type != VertexType::Camera)
+        G *= std::abs(dot(b.n, w));
+    return G;
+}
+
+bool BidirectionalPathTracingIntegrator::isVisible(const PathVertex &a, const PathVertex &b,
+                                                   const std::vector<Shape*> &objList) const
+{
+    Vector3D d = b.p - a.p;
+    double distance = d.length();
+    Ray shadowRay(a.p, d / distance);
+    shadowRay.maxT = distance - Epsilon;
+    return !Utils::isOccluded(shadowRay, objList);
+}
+
+double BidirectionalPathTracingIntegrator::convertDensity(double pdfDir, const PathVertex &from,
+                                                          const PathVertex &to)
+{
+    // Solid angle to area at 'to': cos / d^2 (the camera is a point)
+    Vector3D w = to.p - from.p;
+    double distance2 = w.lengthSq();
+    if (distance2 == 0.0)
+        return 0.0;
+    double pdf = pdfDir / distance2;
+    if (to.type != VertexType::Camera)
+        pdf *= std::abs(dot(to.n, w)) / std::sqrt(distance2);
+    return pdf;
+}
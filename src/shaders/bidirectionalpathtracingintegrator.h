@@ -0,0 +1,91 @@
+#ifndef BIDIRECTIONALPATHTRACINGINTEGRATOR_H
+#define BIDIRECTIONALPATHTRACINGINTEGRATOR_H
+
+#include "shader.h"
+#include "../cameras/perspective.h"
+#include "../core/film.h"
+
+#include <unordered_map>
+
+// Bidirectional path tracing (Veach 1997).
+//
+// Every sample traces a camera subpath and a light subpath, from a point
+// of an area light source, and connects every pair of their vertices.
+// Each connection is an estimator of the light of one path length; those
+// of the same length are combined with multiple importance sampling
+// (balance heuristic). Connections of light vertices to the camera land
+// on arbitrary pixels, so they are splatted into the film, which
+// raytrace() merges at the end of the render. Light reaching the camera
+// through mirrors and glass, or around corners, is then found from the
+// light side instead of waiting for a camera path to hit the emitter.
+//
+// Only PerspectiveCamera and area light sources are supported.
+class BidirectionalPathTracingIntegrator : public Shader
+{
+public:
+    // film_ receives the splats; it must be the film rendered by raytrace()
+    BidirectionalPathTracingIntegrator(Vector3D bgColor_, int maxDepth_,
+                                       const PerspectiveCamera &camera_, Film &film_);
+
+    // Finds the light source of every emitting shape
+    virtual void preprocess(const std::vector<Shape*> &objList,
+                            const std::vector<LightSource*> &lsList);
+
+    virtual Vector3D computeColor(const Ray &r,
+                             const std::vector<Shape*> &objList,
+                             const std::vector<LightSource*> &lsList) const;
+
+private:
+    enum class VertexType { Camera, Light, Surface };
+
+    struct PathVertex
+    {
+        VertexType type;
+        Vector3D p;
+        Vector3D n;                 // Geometric normal (viewing direction of the camera)
+        Vector3D beta;              // Throughput of the subpath up to this vertex
+        const Material *material;   // Surfaces only
+        const LightSource *light;   // Light vertices and emitting surfaces
+        bool delta;                 // Mirror or transmissive surface
+        double pdfFwd;              // Area density of the vertex, sampled from its subpath
+        double pdfRev;              // Same, if it was sampled from the other end of the path
+    };
+
+    int maxDepth;
+    const PerspectiveCamera &camera;
+    Film &film;
+    std::unordered_map<const Shape*, const LightSource*> emitters;
+
+    int generateCameraSubpath(const Ray &ray, PathVertex *path,
+                              const std::vector<Shape*> &objList) const;
+    int generateLightSubpath(PathVertex *path, const std::vector<Shape*> &objList,
+                             const std::vector<LightSource*> &lsList) const;
+    // Extends a subpath from path[-1] with at most maxVertices vertices.
+    // dimension is the sampler depth of the first bounce
+    int randomWalk(Ray ray, Vector3D beta, double pdfFwd, int maxVertices, PathVertex *path,
+                   int dimension, const std::vector<Shape*> &objList) const;
+
+    // Contribution of the path made of the first s light vertices and the
+    // first t camera vertices. Splatted into the film when t == 1
+    Vector3D connect(PathVertex *lightPath, PathVertex *cameraPath, int s, int t,
+                     int numLights, const std::vector<Shape*> &objList) const;
+    double misWeight(PathVertex *lightPath, PathVertex *cameraPath, int s, int t,
+                     int numLights) const;
+
+    // BSDF (or emission profile of a light vertex) from prev to next
+    Vector3D evaluate(const PathVertex &v, const PathVertex *prev, const PathVertex &next) const;
+    Vector3D emittedRadiance(const PathVertex &v, const PathVertex &towards) const;
+    // Area density of next when sampled from v (coming from prev)
+    double pdf(const PathVertex &v, const PathVertex *prev, const PathVertex &next) const;
+    // Area density of next when emitted from the light vertex v
+    double pdfLight(const PathVertex &v, const PathVertex &next) const;
+    // Area density of v as the origin of a light subpath
+    double pdfLightOrigin(const PathVertex &v, int numLights) const;
+
+    double geometricTerm(const PathVertex &a, const PathVertex &b) const;
+    bool isVisible(const PathVertex &a, const PathVertex &b,
+                   const std::vector<Shape*> &objList) const;
+    static double convertDensity(double pdfDir, const PathVertex &from, const PathVertex &to);
+};
+
+#endif // BIDIRECTIONALPATHTRACINGINTEGRATOR_H
@@ -1,5 +1,6 @@
 #include "constantambientintegrator.h"
 #include "../core/utils.h"
+#include "../core/statistics.h"
 
 ConstantAmbientIntegrator::ConstantAmbientIntegrator(Vector3D bgColor_, float ambientTerm_) :
     Shader(bgColor_), ambientTerm(ambientTerm_)
@@ -10,10 +11,22 @@ Vector3D ConstantAmbientIntegrator::computeColor(const Ray &ray,
                                           const std::vector<LightSource*> &lsList) const
 {
     // Step 1: Find closest intersection with scene geometry
-    Intersection its;
-    if (!Utils::getClosestIntersection(ray, objList, its))
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D ConstantAmbientIntegrator::computeColorFromHit(const Ray &ray, const PrimaryHit &primary,
+                                                        const std::vector<Shape*> &objList,
+                                                        const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
         return bgColor;  // Ray escaped scene, return background color
 
+    STAT_PATH_VERTEX(0);
+
+    const Intersection& its = primary.its;
+
     // Step 2: Get material and surface properties
     const Material& mat = its.shape->getMaterial();
 
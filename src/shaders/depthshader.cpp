@@ -12,12 +12,18 @@ DepthShader::DepthShader(Vector3D hitColor_, double maxDist_, Vector3D bgColor_)
 { }
 
 Vector3D DepthShader::computeColor(const Ray &r, const std::vector<Shape*> &objList, const std::vector<LightSource*> &lsList) const
+{
+    PrimaryHit primary;
+    primary.trace(r, objList);
+    return computeColorFromHit(r, primary, objList, lsList);
+}
+
+Vector3D DepthShader::computeColorFromHit(const Ray &r, const PrimaryHit &primary, const std::vector<Shape*> &objList, const std::vector<LightSource*> &lsList) const
 {
     //if..
-    Intersection its;
-    if(Utils::getClosestIntersection(r, objList, its)){
+    if(primary.hit){
         Vector3D origin = r.o;
-        Vector3D destination = its.itsPoint;
+        Vector3D destination = primary.its.itsPoint;
         double distance = (destination - origin).length();
         double dist_n = distance / maxDist;
         dist_n = std::clamp(dist_n, 0.0, 1.0);
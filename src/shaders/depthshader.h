@@ -13,6 +13,10 @@ public:
     Vector3D computeColor(const Ray &r,
                              const std::vector<Shape*> &objList,
                              const std::vector<LightSource*> &lsList) const;
+    Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                 const std::vector<Shape*> &objList,
+                                 const std::vector<LightSource*> &lsList) const;
+    bool isDeterministic(const std::vector<LightSource*> &lsList) const { return true; }
 
 private:
     double maxDist;
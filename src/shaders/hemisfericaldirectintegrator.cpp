@@ -1,6 +1,8 @@
 #include "hemisfericaldirectintegrator.h"
 #include "../core/utils.h"
 #include "../core/hemisphericalsampler.h"
+#include "../core/sampler.h"
+#include "../core/statistics.h"
 #include <cmath>
 
 #ifndef M_PI
@@ -16,10 +18,22 @@ Vector3D HemisphericalDirectIntegrator::computeColor(const Ray &ray,
                                            const std::vector<LightSource*> &lsList) const
 {
     // Find closest intersection with scene geometry
-    Intersection its;
-    if (!Utils::getClosestIntersection(ray, objList, its))
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D HemisphericalDirectIntegrator::computeColorFromHit(const Ray &ray, const PrimaryHit &primary,
+                                                            const std::vector<Shape*> &objList,
+                                                            const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
         return bgColor;  // Ray escaped scene, return background color
 
+    STAT_PATH_VERTEX(0);
+
+    const Intersection& its = primary.its;
+
     // Setup local shading frame at intersection point
     const Vector3D x = its.itsPoint;           // Surface point x
     const Vector3D normal = its.normal.normalized(); // Surface normal n_x
@@ -34,12 +48,15 @@ Vector3D HemisphericalDirectIntegrator::computeColor(const Ray &ray,
     {
         
         HemisphericalSampler sampler;
+        Sampler& rng = Sampler::active();
         double pwj = 1.0 / (2.0 * M_PI);
         
         for (int i = 0; i < numSamples; i++)
         {
             // get a random direction from the hemisphere sampler
-            Vector3D wj = sampler.getSample(normal);
+            double u1, u2;
+            rng.get2D(SampleDimension::BSDF, (int)ray.depth, u1, u2, i, numSamples);
+            Vector3D wj = sampler.getSample(normal, u1, u2);
             
             // shadow ray from x in direction wj to find what's there
             Ray shadowRay(x, wj);
@@ -11,6 +11,9 @@ public:
     virtual Vector3D computeColor(const Ray &r,
                                  const std::vector<Shape*> &objList,
                                  const std::vector<LightSource*> &lsList) const;
+    virtual Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                         const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList) const;
 
 private:
     int numSamples;
@@ -14,7 +14,7 @@ Vector3D IntersectionShader::computeColor(const Ray &r, const std::vector<Shape*
     //(FILL..)
         
     //if..
-    if (Utils::hasIntersection(r, objList)) {
+    if (Utils::isOccluded(r, objList)) {
         return Vector3D(1.0, 0.0, 0.0);
     };
      
@@ -22,3 +22,8 @@ Vector3D IntersectionShader::computeColor(const Ray &r, const std::vector<Shape*
 
     return bgColor;
 }
+
+Vector3D IntersectionShader::computeColorFromHit(const Ray &r, const PrimaryHit &primary, const std::vector<Shape*> &objList, const std::vector<LightSource*> &lsList) const
+{
+    return primary.hit ? Vector3D(1.0, 0.0, 0.0) : bgColor;
+}
@@ -0,0 +1,203 @@
+#include "lighttracingintegrator.h"
+#include "core/hemisphericalsampler.h"
+#include "core/sampler.h"
+#include "core/intersection.h"
+#include "core/utils.h"
+#include "core/statistics.h"
+#include "core/vector3d.h"
+#include "shapes/shape.h"
+#include "lightsources/lightsource.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+LightTracingIntegrator::LightTracingIntegrator(Vector3D bgColor_, int maxDepth_,
+                                               const PerspectiveCamera &camera_, Film &film_):
+    Shader(bgColor_), maxDepth(maxDepth_), camera(camera_), film(film_)
+{ }
+
+Vector3D LightTracingIntegrator::computeColor(const Ray &ray,
+                                              const std::vector<Shape*> &objList,
+                                              const std::vector<LightSource*> &lsList) const
+{
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D LightTracingIntegrator::computeColorFromHit(const Ray &ray, const PrimaryHit &primary,
+                                                     const std::vector<Shape*> &objList,
+                                                     const std::vector<LightSource*> &lsList) const
+{
+    // One light path per camera sample: raytrace() normalizes the splats
+    // by the number of samples traced
+    traceLightPath(objList, lsList);
+
+    if (!primary.hit)
+        return bgColor;
+
+    // Emitters seen directly, and everything seen through a specular surface
+    const Intersection& its = primary.its;
+    const Material& mat = its.shape->getMaterial();
+    Vector3D L = mat.getEmissiveRadiance();
+    if (Utils::isSpecular(mat) && maxDepth > 0)
+    {
+        Vector3D wi, weight;
+        if (Utils::sampleSpecular(its.normal.normalized(), (-ray.d).normalized(), mat, wi, weight))
+            L += weight * tracePath(Ray(its.itsPoint, wi, 1), objList, lsList);
+    }
+    return L;
+}
+
+void LightTracingIntegrator::traceLightPath(const std::vector<Shape*> &objList,
+                                            const std::vector<LightSource*> &lsList) const
+{
+    const int numLights = (int)lsList.size();
+    if (numLights == 0)
+        return;
+
+    // The light path takes the sampler dimensions after those of the
+    // longest camera path
+    Sampler& rng = Sampler::active();
+    const int dimension = maxDepth + 2;
+
+    int lightIndex = std::min((int)(rng.get1D(SampleDimension::RussianRoulette, dimension) * numLights),
+                              numLights - 1);
+    const LightSource* light = lsList[lightIndex];
+    if (light->getArea() <= 0.0)
+        return;
+
+    // Uniform point on the light, cosine-weighted direction:
+    // Le * cos / (pdfPos * pdfDir), with pdfDir = cos / pi
+    double u, v;
+    rng.get2D(SampleDimension::Light, dimension, u, v);
+    Vector3D y = light->generatePoint(u, v);
+    rng.get2D(SampleDimension::BSDF, dimension, u, v);
+    HemisphericalSampler hemisphere;
+    Vector3D wi = hemisphere.getCosineSample(light->getNormal(), u, v);
+    double pdfPos = 1.0 / (numLights * light->getArea());
+    Vector3D beta = light->getIntensity() * (M_PI / pdfPos);
+
+    const Vector3D cameraPosition = camera.getPosition();
+    const Vector3D cameraForward = camera.getForward();
+    const double imagePlaneArea = camera.imagePlaneArea();
+
+    Ray ray(y, wi, 0);
+    for (int depth = 1; depth <= maxDepth; depth++)
+    {
+        Intersection its;
+        if (!Utils::getClosestIntersection(ray, objList, its))
+            return;
+
+        const Material& mat = its.shape->getMaterial();
+        const Vector3D x = its.itsPoint;
+        Vector3D n = its.normal.normalized();
+        const Vector3D wo = (-ray.d).normalized();
+        STAT_PATH_VERTEX(depth);
+
+        if (Utils::isSpecular(mat))
+        {
+            Vector3D weight;
+            if (!Utils::sampleSpecular(n, wo, mat, wi, weight))
+                return;
+            beta = beta * weight;
+            ray = Ray(x, wi, depth);
+            continue;
+        }
+
+        // Connection to the camera, splatted at the projection of x. The
+        // importance of the camera over the density of the connection is
+        // 1 / (A cos^3 d^2), A being the image plane area at distance 1
+        double rasterX, rasterY;
+        if (camera.worldToRaster(x, rasterX, rasterY))
+        {
+            Vector3D toCamera = cameraPosition - x;
+            double distance2 = toCamera.lengthSq();
+            double distance = std::sqrt(distance2);
+            Vector3D w = toCamera / distance;
+            double cosCamera = -dot(cameraForward, w);
+            if (dot(n, w) * dot(n, wo) > 0.0 && cosCamera > 0.0)
+            {
+                Ray shadowRay(x, w);
+                shadowRay.maxT = distance - Epsilon;
+                if (!Utils::isOccluded(shadowRay, objList))
+                {
+                    Vector3D L = beta * mat.getReflectance(n, wo, w)
+                               * (std::abs(dot(n, w)) / (imagePlaneArea * cosCamera * cosCamera * cosCamera * distance2));
+                    film.addSplat(rasterX, rasterY, L);
+                }
+            }
+        }
+
+        if (depth == maxDepth)
+            return;
+
+        // Cosine-weighted bounce: the weight f * cos / pdf is f * pi
+        if (dot(n, wo) < 0.0)
+            n = -n;
+        double u1, u2;
+        rng.get2D(SampleDimension::BSDF, dimension + depth, u1, u2);
+        wi = hemisphere.getCosineSample(n, u1, u2);
+        beta = beta * mat.getReflectance(n, wo, wi) * M_PI;
+        ray = Ray(x, wi, depth);
+    }
+}
+
+Vector3D LightTracingIntegrator::tracePath(Ray ray, const std::vector<Shape*> &objList,
+                                           const std::vector<LightSource*> &lsList) const
+{
+    HemisphericalSampler hemisphere;
+    Sampler& rng = Sampler::active();
+
+    // Emission is counted after specular bounces only: after a diffuse
+    // one it is part of the direct light estimate
+    Vector3D L(0.0);
+    Vector3D beta(1.0);
+    bool countEmission = true;
+    while (true)
+    {
+        Intersection its;
+        if (!Utils::getClosestIntersection(ray, objList, its))
+            break;
+
+        const Material& mat = its.shape->getMaterial();
+        const Vector3D x = its.itsPoint;
+        Vector3D n = its.normal.normalized();
+        const Vector3D wo = (-ray.d).normalized();
+        const int depth = (int)ray.depth;
+        STAT_PATH_VERTEX(depth);
+
+        if (countEmission)
+            L += beta * mat.getEmissiveRadiance();
+        if (depth >= maxDepth)
+            break;
+
+        Vector3D wi;
+        if (Utils::isSpecular(mat))
+        {
+            Vector3D weight;
+            if (!Utils::sampleSpecular(n, wo, mat, wi, weight))
+                break;
+            beta = beta * weight;
+            countEmission = true;
+        }
+        else
+        {
+            if (dot(n, wo) < 0.0)
+                n = -n;
+            L += beta * Utils::computeDirectRadiance(x, n, wo, mat, depth, objList, lsList);
+
+            double u1, u2;
+            rng.get2D(SampleDimension::BSDF, depth, u1, u2);
+            wi = hemisphere.getCosineSample(n, u1, u2);
+            beta = beta * mat.getReflectance(n, wo, wi) * M_PI;
+            countEmission = false;
+        }
+        ray = Ray(x, wi, depth + 1);
+    }
+    return L;
+}
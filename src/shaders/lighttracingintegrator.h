@@ -0,0 +1,50 @@
+#ifndef LIGHTTRACINGINTEGRATOR_H
+#define LIGHTTRACINGINTEGRATOR_H
+
+#include "shader.h"
+#include "../cameras/perspective.h"
+#include "../core/film.h"
+
+// Light (particle) tracing.
+//
+// Every sample traces one path from a point of an area light source and
+// connects each of its diffuse or glossy vertices to the camera; the
+// contribution is splatted into the film at the projection of the vertex,
+// and raytrace() merges the splats at the end of the render. Caustics,
+// which a camera path only finds by hitting the light through the
+// specular surfaces, are then as cheap as any other light.
+//
+// Light paths cannot reach the camera through a mirror or glass, nor
+// show the light sources themselves, so the camera-traced image (the
+// color returned for each camera ray) covers exactly those paths: the
+// emitters seen directly, and whatever is seen through a specular surface,
+// estimated with a path tracer with next event estimation.
+class LightTracingIntegrator : public Shader
+{
+public:
+    // film_ receives the splats; it must be the film rendered by raytrace()
+    LightTracingIntegrator(Vector3D bgColor_, int maxDepth_,
+                           const PerspectiveCamera &camera_, Film &film_);
+
+    virtual Vector3D computeColor(const Ray &r,
+                             const std::vector<Shape*> &objList,
+                             const std::vector<LightSource*> &lsList) const;
+    virtual Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                         const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList) const;
+
+private:
+    int maxDepth;
+    const PerspectiveCamera &camera;
+    Film &film;
+
+    // Traces one light path and splats its connections to the camera
+    void traceLightPath(const std::vector<Shape*> &objList,
+                        const std::vector<LightSource*> &lsList) const;
+
+    // Radiance along a camera path that went through a specular surface
+    Vector3D tracePath(Ray ray, const std::vector<Shape*> &objList,
+                       const std::vector<LightSource*> &lsList) const;
+};
+
+#endif // LIGHTTRACINGINTEGRATOR_H
@@ -1,32 +1,58 @@
 #include "nexteventestimatorintegration.h"
 #include "core/hemisphericalsampler.h"
+#include "core/sampler.h"
 #include "core/intersection.h"
 #include "core/utils.h"
+#include "core/statistics.h"
 #include "core/vector3d.h"
 #include "core/ray.h"
 #include "shapes/shape.h"
 #include "lightsources/lightsource.h"
+#include <algorithm>
 #include <cmath>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
-NextEventEstimatorIntegrator::NextEventEstimatorIntegrator(Vector3D bgColor_, int maxDepth_, int aoSamples_, float aoMaxDistance_):
-    Shader(bgColor_), maxDepth(maxDepth_), aoSamples(aoSamples_), aoMaxDistance(aoMaxDistance_)
-{ }
+// Neighboring first hits whose reservoirs are reused must face the same
+// way and lie close to the tangent plane (relative to their distance)
+static const double ReuseMinNormalCosine = 0.9;
+static const double ReuseMaxPlaneDistance = 0.1;
+
+// Largest double below 1, to keep rescaled random numbers in [0, 1)
+static const double OneMinusEpsilon = 0x1.fffffffffffffp-1;
+
+NextEventEstimatorIntegrator::NextEventEstimatorIntegrator(Vector3D bgColor_, int maxDepth_, int aoSamples_, float aoMaxDistance_,
+                                                           bool aoCache_):
+    Shader(bgColor_), maxDepth(maxDepth_), aoSamples(aoSamples_), aoMaxDistance(aoMaxDistance_),
+    resampleLights(false)
+{
+    if (aoCache_ && aoSamples > 0)
+        aoCache = std::make_unique<AmbientOcclusionCache>(AOCacheRadius * aoMaxDistance);
+}
 
 Vector3D NextEventEstimatorIntegrator::computeColor(const Ray &ray, 
                                                     const std::vector<Shape*> &objList, 
                                                     const std::vector<LightSource*> &lsList) const
 {
     // Find the closest intersection with the scene geometry
-    Intersection its;
-    if (!Utils::getClosestIntersection(ray, objList, its))
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D NextEventEstimatorIntegrator::computeColorFromHit(const Ray &ray,
+                                                           const PrimaryHit &primary,
+                                                           const std::vector<Shape*> &objList,
+                                                           const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
     {
         return bgColor;
     }
-    
+
+    const Intersection& its = primary.its;
     const Vector3D x = its.itsPoint;
     const Vector3D n = its.normal.normalized();
     const Vector3D wo = (-ray.d).normalized();  // Direction towards camera
@@ -41,7 +67,8 @@ Vector3D NextEventEstimatorIntegrator::computeColor(const Ray &ray,
     // Apply ambient occlusion if enabled (only for primary rays and non-emissive surfaces)
     if (aoSamples > 0 && ray.depth == 0 && !material.isEmissive())
     {
-        float aoFactor = computeAmbientOcclusion(x, n, objList);
+        float aoFactor = primary.aoFactor >= 0.0f ? primary.aoFactor
+                                                   : getAmbientOcclusion(x, n, objList);
         Lo = Lo * aoFactor;
     }
 
@@ -49,6 +76,23 @@ Vector3D NextEventEstimatorIntegrator::computeColor(const Ray &ray,
     return Lo;
 }
 
+void NextEventEstimatorIntegrator::preparePrimaryHit(const Ray &ray, PrimaryHit &primary,
+                                                     const std::vector<Shape*> &objList) const
+{
+    if (aoSamples > 0 && primary.hit && !primary.its.shape->getMaterial().isEmissive())
+        primary.aoFactor = getAmbientOcclusion(primary.its.itsPoint,
+                                               primary.its.normal.normalized(), objList);
+}
+
+float NextEventEstimatorIntegrator::getAmbientOcclusion(const Vector3D& x,
+                                                        const Vector3D& n,
+                                                        const std::vector<Shape*>& objList) const
+{
+    if (!aoCache)
+        return computeAmbientOcclusion(x, n, objList);
+    return aoCache->lookup(x, n, [&]() { return computeAmbientOcclusion(x, n, objList); });
+}
+
 // split reflected radiance into direct + indirect
 Vector3D NextEventEstimatorIntegrator::computeReflectedRadiance(const Vector3D& x,
                                                                 const Vector3D& n,
@@ -58,11 +102,13 @@ Vector3D NextEventEstimatorIntegrator::computeReflectedRadiance(const Vector3D&
                                                                 const std::vector<Shape*>& objList,
                                                                 const std::vector<LightSource*>& lsList) const
 {
+    STAT_PATH_VERTEX(depth);
+
     if (depth >= maxDepth)
         return Vector3D(0.0);
 
     // direct illumination
-    Vector3D L_dir = computeDirectRadiance(x, n, wo, mat, objList, lsList);
+    Vector3D L_dir = computeDirectRadiance(x, n, wo, mat, depth, objList, lsList);
 
     // indirect illumination
     Vector3D L_ind = computeIndirectRadiance(x, n, wo, mat, depth, objList, lsList);
@@ -76,34 +122,132 @@ Vector3D NextEventEstimatorIntegrator::computeDirectRadiance(const Vector3D& x,
                                                              const Vector3D& n,
                                                              const Vector3D& wo,
                                                              const Material& mat,
+                                                             int depth,
                                                              const std::vector<Shape*>& objList,
                                                              const std::vector<LightSource*>& lsList) const
 {
-    Vector3D L_dir(0.0);
+    if (resampleLights)
+        return computeResampledDirectRadiance(x, n, wo, mat, depth, objList, lsList);
+
+    // one random point on every light
+    return Utils::computeDirectRadiance(x, n, wo, mat, depth, objList, lsList);
+}
+
+// direct illumination via resampled importance sampling of the lights
+Vector3D NextEventEstimatorIntegrator::computeResampledDirectRadiance(const Vector3D& x,
+                                                                     const Vector3D& n,
+                                                                     const Vector3D& wo,
+                                                                     const Material& mat,
+                                                                     int depth,
+                                                                     const std::vector<Shape*>& objList,
+                                                                     const std::vector<LightSource*>& lsList) const
+{
+    Sampler& rng = Sampler::active();
+    const int numLights = (int)lsList.size();
+    if (numLights == 0)
+        return Vector3D(0.0);
 
-    // Loop over all lights
-    for (const LightSource* light : lsList)
+    // candidates: a uniformly chosen light and a uniform point on it,
+    // weighted by target / source density
+    const int numCandidates = std::max(reservoirSettings.candidates, 1);
+    const bool reuse = reservoirBuffer && depth == 0;
+    const int numNeighbors = reuse ? reservoirSettings.spatialNeighbors : 0;
+    const int numChoices = numCandidates + numNeighbors;
+    Reservoir reservoir;
+    for (int i = 0; i < numCandidates; i++)
     {
-        // sample one random point on the light
-        Vector3D y = light->generateRandomPoint();
-        double pdf = 1.0 / light->getArea();
+        double u, v;
+        rng.get2D(SampleDimension::Light, depth, u, v, i, numCandidates);
+        int lightIndex = std::min((int)(u * numLights), numLights - 1);
+        u = std::min(u * numLights - lightIndex, OneMinusEpsilon);
 
-        // compute direction from x to y
-        Vector3D wi = (y - x).normalized();
+        const LightSource* light = lsList[lightIndex];
+        LightSample candidate = { light->generatePoint(u, v), lightIndex };
+        double sourcePdf = 1.0 / (numLights * light->getArea());
 
-        // check visibility and compute contribution
-        if (computeVisibility(x, y, objList))
+        double targetPdf;
+        evaluateLightSample(x, n, wo, mat, candidate, lsList, targetPdf);
+        reservoir.update(candidate, targetPdf / sourcePdf, targetPdf, 1,
+                         rng.get1D(SampleDimension::Resampling, depth, i, numChoices));
+    }
+
+    if (reuse)
+    {
+        // publish the fresh candidates before mixing in those of the
+        // neighbors, so that reuse does not chain from pixel to pixel
+        size_t px = rng.getPixelX(), py = rng.getPixelY();
+        reservoirBuffer->store(px, py, x, n, reservoir);
+
+        // biased combination (Bitterli et al. 2020): the neighbors' samples
+        // are reweighted by the target at x, and their weights normalized
+        // by the total candidate count
+        for (int j = 0; j < numNeighbors; j++)
         {
-            Vector3D Le = light->getIntensity();
-            Vector3D fr = mat.getReflectance(n, wo, wi);
-            Vector3D G = computeGeometricTerm(x, y, n, light->getNormal());
+            double u, v;
+            rng.get2D(SampleDimension::ReuseNeighbor, depth, u, v, j, numNeighbors);
+            double radius = reservoirSettings.spatialRadius * std::sqrt(u);
+            long qx = std::lround(px + radius * std::cos(2.0 * M_PI * v));
+            long qy = std::lround(py + radius * std::sin(2.0 * M_PI * v));
+            if (qx < 0 || qy < 0 || (qx == (long)px && qy == (long)py))
+                continue;
+
+            Vector3D xq, nq;
+            LightSample neighborSample;
+            double neighborWeight;
+            int neighborCount;
+            if (!reservoirBuffer->load(qx, qy, xq, nq, neighborSample, neighborWeight, neighborCount)
+                || neighborSample.light < 0 || neighborSample.light >= numLights)
+                continue;
 
-            // Add contribution: Le * BRDF * G / pdf
-            L_dir += (Le * fr * G) / pdf;
+            Vector3D toNeighbor = xq - x;
+            if (dot(n, nq) < ReuseMinNormalCosine
+                || std::abs(dot(n, toNeighbor)) > ReuseMaxPlaneDistance * toNeighbor.length())
+                continue;
+
+            double targetPdf;
+            evaluateLightSample(x, n, wo, mat, neighborSample, lsList, targetPdf);
+            reservoir.update(neighborSample, targetPdf * neighborWeight * neighborCount, targetPdf,
+                             neighborCount,
+                             rng.get1D(SampleDimension::Resampling, depth, numCandidates + j, numChoices));
         }
     }
 
-    return L_dir;
+    // a single shadow ray, for the kept sample
+    double weight = reservoir.getWeight();
+    if (weight <= 0.0)
+        return Vector3D(0.0);
+
+    double targetPdf;
+    Vector3D f = evaluateLightSample(x, n, wo, mat, reservoir.sample, lsList, targetPdf);
+    if (!computeVisibility(x, reservoir.sample.position, objList))
+        return Vector3D(0.0);
+    return f * weight;
+}
+
+Vector3D NextEventEstimatorIntegrator::evaluateLightSample(const Vector3D& x,
+                                                          const Vector3D& n,
+                                                          const Vector3D& wo,
+                                                          const Material& mat,
+                                                          const LightSample& sample,
+                                                          const std::vector<LightSource*>& lsList,
+                                                          double& targetPdf) const
+{
+    targetPdf = 0.0;
+    const LightSource* light = lsList[sample.light];
+    Vector3D toLight = sample.position - x;
+    double distance2 = toLight.lengthSq();
+    if (distance2 <= 0.0)
+        return Vector3D(0.0);
+
+    Vector3D wi = toLight / std::sqrt(distance2);
+    double cosX = dot(n, wi);
+    double cosY = -dot(wi, light->getNormal());
+    if (cosX <= 0.0 || cosY <= 0.0)
+        return Vector3D(0.0);
+
+    Vector3D f = light->getIntensity() * mat.getReflectance(n, wo, wi) * (cosX * cosY / distance2);
+    targetPdf = std::max(0.0, (f.x + f.y + f.z) / 3.0);
+    return f;
 }
 
 // indirect illumination via hemisphere sampling
@@ -115,10 +259,26 @@ Vector3D NextEventEstimatorIntegrator::computeIndirectRadiance(const Vector3D& x
                                                                const std::vector<Shape*>& objList,
                                                                const std::vector<LightSource*>& lsList) const
 {
+    // Smooth diffuse interreflections come from the irradiance cache
+    if (irradianceCache && depth == 0 && mat.isLambertian())
+        return mat.getDiffuseReflectance() / M_PI * computeCachedIrradiance(x, n, depth, objList, lsList);
+
     // sample random hemisphere direction
     HemisphericalSampler sampler;
-    Vector3D wi = sampler.getSample(n);
-    double pdf = 1.0 / (2.0 * M_PI);
+    double u1, u2;
+    Sampler::active().get2D(SampleDimension::BSDF, depth, u1, u2);
+    Vector3D wi;
+    double pdf;
+    if (guide)
+    {
+        // guided sampling, which may pick directions below the surface
+        pdf = guide->sampleDirection(x, n, u1, u2, wi);
+    }
+    else
+    {
+        wi = sampler.getSample(n, u1, u2);
+        pdf = 1.0 / (2.0 * M_PI);
+    }
 
     // create new ray in sampled direction
     Ray newRay(x, wi, depth + 1);
@@ -127,7 +287,7 @@ Vector3D NextEventEstimatorIntegrator::computeIndirectRadiance(const Vector3D& x
     Vector3D L_ind(0.0);
 
     // check depth limit
-    if (depth < maxDepth)
+    if (depth < maxDepth && dot(n, wi) > 0.0)
     {
         // intersect scene
         Intersection its;
@@ -139,8 +299,22 @@ Vector3D NextEventEstimatorIntegrator::computeIndirectRadiance(const Vector3D& x
             const Material& yMaterial = its.shape->getMaterial();
 
 
-            Vector3D Lr = computeReflectedRadiance(y, ny, wo_next, yMaterial, 
-                                                   depth + 1, objList, lsList);
+            // past the termination depth, a filled cache entry ends the path
+            Vector3D Lr;
+            bool cacheable = radianceCache && yMaterial.isLambertian();
+            if (!cacheable || depth + 1 < radianceCache->getSettings().terminationDepth
+                || !radianceCache->lookup(y, ny, Lr))
+            {
+                Lr = computeReflectedRadiance(y, ny, wo_next, yMaterial,
+                                              depth + 1, objList, lsList);
+                if (cacheable)
+                    radianceCache->add(y, ny, Lr);
+            }
+
+            // the guide learns the radiance the bounce estimates: the
+            // light reflected at y, its emission being direct light
+            if (guide)
+                guide->record(x, wi, Lr, pdf);
 
             // compute BRDF and cosine term
             Vector3D fr = mat.getReflectance(n, wo, wi);
@@ -149,23 +323,95 @@ Vector3D NextEventEstimatorIntegrator::computeIndirectRadiance(const Vector3D& x
             // accumulate indirect contribution
             L_ind = Lr * fr * nx_dot_wi / pdf;
         }
+        else if (guide)
+        {
+            guide->record(x, wi, Vector3D(0.0), pdf);
+        }
     }
 
     return L_ind;
 }
 
-// compute geometric term G(x,y)
-Vector3D NextEventEstimatorIntegrator::computeGeometricTerm(const Vector3D& x, 
-                                                            const Vector3D& y,
-                                                            const Vector3D& nx, 
-                                                            const Vector3D& ny) const
+void NextEventEstimatorIntegrator::enableIrradianceCache(const IrradianceCacheSettings &settings)
+{
+    irradianceCache = std::make_unique<IrradianceCache>(settings);
+}
+
+void NextEventEstimatorIntegrator::enableReservoirSampling(const Film &film, const ReservoirSettings &settings)
+{
+    resampleLights = true;
+    reservoirSettings = settings;
+    if (settings.spatialNeighbors > 0)
+        reservoirBuffer = std::make_unique<ReservoirBuffer>(film.getWidth(), film.getHeight());
+    else
+        reservoirBuffer.reset();
+}
+
+void NextEventEstimatorIntegrator::preprocess(const std::vector<Shape*> &objList,
+                                              const std::vector<LightSource*> &lsList)
+{
+    if (reservoirBuffer)
+        reservoirBuffer->clear();
+}
+
+void NextEventEstimatorIntegrator::sceneChanged()
+{
+    if (aoCache)
+        aoCache->clear();
+    if (irradianceCache)
+        irradianceCache->clear();
+    if (radianceCache)
+        radianceCache->clear();
+    if (guide)
+        guide->reset();
+}
+
+void NextEventEstimatorIntegrator::enableRadianceCache(const RadianceCacheSettings &settings)
+{
+    radianceCache = std::make_unique<RadianceCache>(settings);
+}
+
+void NextEventEstimatorIntegrator::enablePathGuiding(const PathGuidingSettings &settings)
+{
+    guide = std::make_unique<SDTree>(settings);
+}
+
+int NextEventEstimatorIntegrator::getTrainingPasses() const
+{
+    return guide ? guide->getSettings().trainingPasses : 0;
+}
+
+void NextEventEstimatorIntegrator::endTrainingPass(int pass)
 {
-    Vector3D wi = (y - x).normalized();
-    double distance2 = (y - x).lengthSq();
-    double nx_dot_wi = dot(nx, wi);
-    double neg_wi_dot_ny = dot(-wi, ny);
-    double G = (nx_dot_wi * neg_wi_dot_ny) / distance2;
-    return Vector3D(G, G, G);
+    guide->endPass(pass);
+}
+
+Vector3D NextEventEstimatorIntegrator::computeCachedIrradiance(const Vector3D& x,
+                                                               const Vector3D& n,
+                                                               int depth,
+                                                               const std::vector<Shape*>& objList,
+                                                               const std::vector<LightSource*>& lsList) const
+{
+    Vector3D E;
+    if (irradianceCache->lookup(x, n, E))
+        return E;
+
+    // Same estimator as computeIndirectRadiance(), for every stratum of the record
+    return irradianceCache->addRecord(x, n, [&](const Vector3D& wi, double& distance)
+    {
+        Ray newRay(x, wi, depth + 1);
+        Intersection its;
+        if (!Utils::getClosestIntersection(newRay, objList, its))
+        {
+            distance = INFINITY;
+            return Vector3D(0.0);
+        }
+
+        distance = (its.itsPoint - x).length();
+        const Material& yMaterial = its.shape->getMaterial();
+        return computeReflectedRadiance(its.itsPoint, its.normal.normalized(), -wi, yMaterial,
+                                        depth + 1, objList, lsList);
+    });
 }
 
 // check visibility between x and y
@@ -177,7 +423,7 @@ bool NextEventEstimatorIntegrator::computeVisibility(const Vector3D& x,
     double distance = (y - x).length();
     Ray shadowRay(x, direction);
     shadowRay.maxT = distance - Epsilon;
-    return !Utils::hasIntersection(shadowRay, objList);
+    return !Utils::isOccluded(shadowRay, objList);
 }
 
 // compute ambient occlusion factor
@@ -186,27 +432,25 @@ float NextEventEstimatorIntegrator::computeAmbientOcclusion(const Vector3D& x,
                                                             const std::vector<Shape*>& objList) const
 {
     HemisphericalSampler sampler;
-    int blockedRays = 0;
+    Sampler& rng = Sampler::active();
     
     // Cast aoSamples rays in random hemisphere directions
+    std::vector<Ray> occlusionRays;
+    occlusionRays.reserve(aoSamples);
     for (int i = 0; i < aoSamples; i++)
     {
         // Get a random direction in the hemisphere around the normal
-        Vector3D wi = sampler.getSample(n);
-        
-        // Create occlusion test ray from surface point in direction wi
-        Ray occlusionRay(x, wi);
-        occlusionRay.minT = Epsilon;  // Avoid self-intersection
-        occlusionRay.maxT = aoMaxDistance;  // Only check within maxDistance
+        double u1, u2;
+        rng.get2D(SampleDimension::AmbientOcclusion, 0, u1, u2, i, aoSamples);
+        Vector3D wi = sampler.getSample(n, u1, u2);
         
-        // Check if ray hits something within maxDistance
-        Intersection occlusionHit;
-        if (Utils::getClosestIntersection(occlusionRay, objList, occlusionHit))
-        {
-            // Ray hit something within maxDistance -> it's occluded
-            blockedRays++;
-        }
+        // Occlusion test ray from surface point in direction wi, only
+        // checked within aoMaxDistance
+        occlusionRays.emplace_back(x, wi, 0, Epsilon, aoMaxDistance);
     }
+
+    // Count the rays that hit something within aoMaxDistance
+    int blockedRays = Utils::countOccluded(occlusionRays.data(), aoSamples, objList);
     
     // Compute AO factor
     float occlusionFactor = (float)blockedRays / (float)aoSamples;
@@ -2,20 +2,81 @@
 #define NEXTEVENTESTIMATORINTEGRATOR_H
 
 #include "shader.h"
+#include "../core/aocache.h"
+#include "../core/irradiancecache.h"
+#include "../core/radiancecache.h"
+#include "../core/reservoir.h"
+#include "../core/film.h"
+#include "../core/sdtree.h"
+
+#include <memory>
 
 class NextEventEstimatorIntegrator : public Shader
 {
 public:
-    NextEventEstimatorIntegrator(Vector3D bgColor_, int maxDepth_, int aoSamples_ = 0, float aoMaxDistance_ = 0.3f);
+    // With aoCache_, the ambient occlusion factors are shared between
+    // nearby points through a world-space cache
+    NextEventEstimatorIntegrator(Vector3D bgColor_, int maxDepth_, int aoSamples_ = 0, float aoMaxDistance_ = 0.3f,
+                                 bool aoCache_ = false);
 
     virtual Vector3D computeColor(const Ray &r,
                              const std::vector<Shape*> &objList,
                              const std::vector<LightSource*> &lsList) const;
+    virtual Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                         const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList) const;
+
+    // Caches the first-hit ambient occlusion factor
+    virtual void preparePrimaryHit(const Ray &r, PrimaryHit &primary,
+                                   const std::vector<Shape*> &objList) const;
+
+    // Irradiance caching mode: the indirect light at Lambertian first hits
+    // is interpolated from a Ward irradiance cache, filled lazily, instead
+    // of being estimated with a random bounce.
+    void enableIrradianceCache(const IrradianceCacheSettings &settings = IrradianceCacheSettings());
+
+    // Path guiding mode: the indirect bounces sample a mixture of the BSDF
+    // and the indirect radiance learned by an SD-tree over the training
+    // passes of raytrace().
+    void enablePathGuiding(const PathGuidingSettings &settings = PathGuidingSettings());
+
+    // Radiance caching mode: past terminationDepth bounces, paths end at
+    // the first diffuse vertex whose cell of the radiance cache is filled,
+    // reading its reflected radiance instead of tracing on. Every vertex
+    // traced in full adds its radiance to the cache.
+    void enableRadianceCache(const RadianceCacheSettings &settings = RadianceCacheSettings());
+
+    // Resampled direct lighting for scenes with many lights: instead of one
+    // shadow ray per light, settings.candidates light samples are
+    // weighted without visibility and a single one is kept, and traced,
+    // by resampled importance sampling. At first hits the reservoirs of
+    // neighboring pixels of film can be reused too (spatial reuse, biased).
+    // Since every pixel renders all its samples in a row, it only sees the
+    // last reservoir of each finished neighbor, so reuse pays off at low
+    // sample counts only
+    void enableReservoirSampling(const Film &film, const ReservoirSettings &settings = ReservoirSettings());
+
+    // Empties the reservoirs of the previous render
+    virtual void preprocess(const std::vector<Shape*> &objList,
+                            const std::vector<LightSource*> &lsList);
+
+    // Empties the caches of the enabled modes; path guiding learns again
+    virtual void sceneChanged();
+
+    virtual int getTrainingPasses() const;
+    virtual void endTrainingPass(int pass);
 
 private:
     int maxDepth;
     int aoSamples;        // Number of AO samples (0 = disabled)
     float aoMaxDistance;  // Maximum distance for AO occlusion testing
+    std::unique_ptr<AmbientOcclusionCache> aoCache; // Null when caching is disabled
+    std::unique_ptr<IrradianceCache> irradianceCache; // Null unless enabled
+    std::unique_ptr<SDTree> guide; // Null unless enabled
+    std::unique_ptr<RadianceCache> radianceCache; // Null unless enabled
+    bool resampleLights;
+    ReservoirSettings reservoirSettings;
+    std::unique_ptr<ReservoirBuffer> reservoirBuffer; // Null without spatial reuse
     
     Vector3D computeReflectedRadiance(const Vector3D& x,
                                      const Vector3D& n,
@@ -29,9 +90,29 @@ private:
                                   const Vector3D& n,
                                   const Vector3D& wo,
                                   const Material& mat,
+                                  int depth,
                                   const std::vector<Shape*>& objList,
                                   const std::vector<LightSource*>& lsList) const;
     
+    // Direct illumination from the light sample kept by a reservoir
+    Vector3D computeResampledDirectRadiance(const Vector3D& x,
+                                            const Vector3D& n,
+                                            const Vector3D& wo,
+                                            const Material& mat,
+                                            int depth,
+                                            const std::vector<Shape*>& objList,
+                                            const std::vector<LightSource*>& lsList) const;
+
+    // Unshadowed contribution Le * BRDF * G of a light sample, and the
+    // target density of the resampling (its luminance)
+    Vector3D evaluateLightSample(const Vector3D& x,
+                                 const Vector3D& n,
+                                 const Vector3D& wo,
+                                 const Material& mat,
+                                 const LightSample& sample,
+                                 const std::vector<LightSource*>& lsList,
+                                 double& targetPdf) const;
+
     Vector3D computeIndirectRadiance(const Vector3D& x,
                                     const Vector3D& n,
                                     const Vector3D& wo,
@@ -40,12 +121,21 @@ private:
                                     const std::vector<Shape*>& objList,
                                     const std::vector<LightSource*>& lsList) const;
     
-    Vector3D computeGeometricTerm(const Vector3D& x, const Vector3D& y,
-                                 const Vector3D& nx, const Vector3D& ny) const;
-    
+    // Indirect irradiance at x, interpolated from the irradiance cache or
+    // computed as a new record
+    Vector3D computeCachedIrradiance(const Vector3D& x,
+                                     const Vector3D& n,
+                                     int depth,
+                                     const std::vector<Shape*>& objList,
+                                     const std::vector<LightSource*>& lsList) const;
+
     bool computeVisibility(const Vector3D& x, const Vector3D& y,
                           const std::vector<Shape*>& objList) const;
     
+    // Ambient occlusion factor at x, from the cache when enabled
+    float getAmbientOcclusion(const Vector3D& x,
+                              const Vector3D& n,
+                              const std::vector<Shape*>& objList) const;
     float computeAmbientOcclusion(const Vector3D& x,
                                  const Vector3D& n,
                                  const std::vector<Shape*>& objList) const;
@@ -0,0 +1,313 @@
+#include "photonmappingintegrator.h"
+#include "core/hemisphericalsampler.h"
+#include "core/sampler.h"
+#include "core/intersection.h"
+#include "core/parallel.h"
+#include "core/utils.h"
+#include "core/statistics.h"
+#include "core/vector3d.h"
+#include "shapes/shape.h"
+#include "lightsources/lightsource.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Photon paths traced per parallel task. The paths of a task take the
+// samples of one Sobol sequence, so that their emission is stratified
+static const int PhotonBatchSize = 4096;
+
+// Slope of the cone filter of the caustic estimates (Jensen's k)
+static const double ConeFilterK = 1.1;
+
+PhotonMappingIntegrator::PhotonMappingIntegrator(Vector3D bgColor_, int maxDepth_,
+                                                 const PhotonMapSettings &settings_):
+    Shader(bgColor_), maxDepth(maxDepth_), settings(settings_)
+{ }
+
+void PhotonMappingIntegrator::preprocess(const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList)
+{
+    emitPhotons(settings.globalPhotons, false, globalMap, objList, lsList);
+    emitPhotons(settings.causticPhotons, true, causticMap, objList, lsList);
+    STAT_ADD(GlobalPhotons, globalMap.size());
+    STAT_ADD(CausticPhotons, causticMap.size());
+}
+
+void PhotonMappingIntegrator::emitPhotons(int numPaths, bool causticPass, PhotonMap &map,
+                                          const std::vector<Shape*> &objList,
+                                          const std::vector<LightSource*> &lsList) const
+{
+    // Flux of a one-sided diffuse emitter: Le * pi * area. Point lights
+    // have no area and emit no photons; only area lights are supported, as
+    // in the direct light estimate
+    std::vector<double> lightPower(lsList.size());
+    double totalPower = 0.0;
+    for (size_t l = 0; l < lsList.size(); l++)
+    {
+        Vector3D Le = lsList[l]->getIntensity();
+        lightPower[l] = (Le.x + Le.y + Le.z) / 3.0 * M_PI * lsList[l]->getArea();
+        totalPower += lightPower[l];
+    }
+
+    // Photon paths of every light, split in tasks of PhotonBatchSize paths
+    struct Batch
+    {
+        int light;
+        int index;
+        int numPaths;  // Paths of this batch
+        int lightPaths; // Paths of the whole light
+    };
+    std::vector<Batch> batches;
+    for (size_t l = 0; l < lsList.size() && totalPower > 0.0; l++)
+    {
+        int lightPaths = (int)std::lround(numPaths * lightPower[l] / totalPower);
+        for (int first = 0, b = 0; first < lightPaths; first += PhotonBatchSize, b++)
+            batches.push_back({ (int)l, b, std::min(PhotonBatchSize, lightPaths - first), lightPaths });
+    }
+
+    std::vector<Sampler*> samplers(numWorkerThreads());
+    samplers[0] = Sampler::create(SamplerType::Sobol, PhotonBatchSize);
+    for (size_t t = 1; t < samplers.size(); t++)
+        samplers[t] = samplers[0]->clone();
+
+    // Photons of every batch, concatenated in batch order below so that the
+    // map does not depend on the scheduling of the threads
+    std::vector<std::vector<Photon>> stored(batches.size());
+    parallelFor(batches.size(), [&](size_t b, int thread)
+    {
+        Sampler* sampler = samplers[thread];
+        Sampler::setActive(sampler);
+
+        const Batch &batch = batches[b];
+        const LightSource* light = lsList[batch.light];
+        Vector3D power = light->getIntensity() * (M_PI * light->getArea() / batch.lightPaths);
+        HemisphericalSampler hemisphere;
+        for (int i = 0; i < batch.numPaths; i++)
+        {
+            sampler->startPixelSample(batch.index, 2 * batch.light + (causticPass ? 1 : 0), i);
+
+            // Uniform point on the light, cosine-weighted direction: every
+            // photon carries the same power
+            double u, v;
+            sampler->get2D(SampleDimension::Light, 0, u, v);
+            Vector3D y = light->generatePoint(u, v);
+            sampler->get2D(SampleDimension::BSDF, 0, u, v);
+            Vector3D wi = hemisphere.getCosineSample(light->getNormal(), u, v);
+
+            tracePhoton(Ray(y, wi, 0), power, causticPass, stored[b], objList);
+        }
+    });
+
+    Sampler::setActive(nullptr);
+    for (Sampler* sampler : samplers)
+        delete sampler;
+
+    std::vector<Photon> photons;
+    size_t count = 0;
+    for (const std::vector<Photon> &batchPhotons : stored)
+        count += batchPhotons.size();
+    photons.reserve(count);
+    for (const std::vector<Photon> &batchPhotons : stored)
+        photons.insert(photons.end(), batchPhotons.begin(), batchPhotons.end());
+    map.build(photons);
+}
+
+void PhotonMappingIntegrator::tracePhoton(Ray ray, Vector3D power, bool causticPass,
+                                          std::vector<Photon> &stored,
+                                          const std::vector<Shape*> &objList) const
+{
+    HemisphericalSampler hemisphere;
+    Sampler& rng = Sampler::active();
+
+    for (int depth = 0; depth < maxDepth; depth++)
+    {
+        Intersection its;
+        if (!Utils::getClosestIntersection(ray, objList, its))
+            return;
+
+        const Material& mat = its.shape->getMaterial();
+        const Vector3D x = its.itsPoint;
+        Vector3D n = its.normal.normalized();
+        const Vector3D wo = (-ray.d).normalized();
+
+        if (Utils::isSpecular(mat))
+        {
+            Vector3D wi, weight;
+            if (!Utils::sampleSpecular(n, wo, mat, wi, weight))
+                return;
+            power = power * weight;
+            ray = Ray(x, wi, depth + 1);
+            continue;
+        }
+
+        // Caustic photons stop at the first diffuse surface, and are only
+        // stored when they went through a specular bounce before
+        if (causticPass)
+        {
+            if (depth > 0)
+                stored.push_back({ x, wo, power, 0 });
+            return;
+        }
+        stored.push_back({ x, wo, power, 0 });
+
+        // Diffuse bounce, cosine-weighted: the weight f * cos / pdf is f * pi
+        if (dot(n, wo) < 0.0)
+            n = -n;
+        double u1, u2;
+        rng.get2D(SampleDimension::BSDF, depth + 1, u1, u2);
+        Vector3D wi = hemisphere.getCosineSample(n, u1, u2);
+        Vector3D weight = mat.getReflectance(n, wo, wi) * M_PI;
+
+        // Russian roulette keeps the power of the surviving photons close
+        // to the power emitted
+        double survival = std::min(1.0, (double)std::max(weight.x, std::max(weight.y, weight.z)));
+        if (rng.get1D(SampleDimension::RussianRoulette, depth + 1) >= survival)
+            return;
+        power = power * weight / survival;
+        ray = Ray(x, wi, depth + 1);
+    }
+}
+
+Vector3D PhotonMappingIntegrator::computeColor(const Ray &ray,
+                                               const std::vector<Shape*> &objList,
+                                               const std::vector<LightSource*> &lsList) const
+{
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D PhotonMappingIntegrator::computeColorFromHit(const Ray &ray, const PrimaryHit &primary,
+                                                      const std::vector<Shape*> &objList,
+                                                      const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
+        return bgColor;
+    return shade(ray, primary.its, objList, lsList);
+}
+
+Vector3D PhotonMappingIntegrator::shade(const Ray &ray, const Intersection &its,
+                                        const std::vector<Shape*> &objList,
+                                        const std::vector<LightSource*> &lsList) const
+{
+    STAT_PATH_VERTEX((int)ray.depth);
+
+    const Vector3D x = its.itsPoint;
+    Vector3D n = its.normal.normalized();
+    const Vector3D wo = (-ray.d).normalized();
+    const Material& mat = its.shape->getMaterial();
+
+    // Emission is only reached by the camera and specular bounces: after a
+    // diffuse bounce it is part of the direct light estimate
+    Vector3D Lo = mat.getEmissiveRadiance();
+    if ((int)ray.depth >= maxDepth)
+        return Lo;
+
+    if (Utils::isSpecular(mat))
+    {
+        Vector3D wi, weight;
+        if (Utils::sampleSpecular(n, wo, mat, wi, weight))
+        {
+            Ray next(x, wi, ray.depth + 1);
+            Intersection nextIts;
+            if (Utils::getClosestIntersection(next, objList, nextIts))
+                Lo += weight * shade(next, nextIts, objList, lsList);
+            else
+                Lo += weight * bgColor;
+        }
+        return Lo;
+    }
+
+    if (dot(n, wo) < 0.0)
+        n = -n;
+    Lo += Utils::computeDirectRadiance(x, n, wo, mat, (int)ray.depth, objList, lsList);
+    Lo += estimateRadiance(causticMap, settings.causticNeighbors, settings.causticRadius, true,
+                           x, n, wo, mat);
+    Lo += computeGatheredRadiance(x, n, wo, mat, (int)ray.depth, objList);
+    return Lo;
+}
+
+Vector3D PhotonMappingIntegrator::computeGatheredRadiance(const Vector3D &x, const Vector3D &n,
+                                                          const Vector3D &wo, const Material &mat,
+                                                          int depth,
+                                                          const std::vector<Shape*> &objList) const
+{
+    HemisphericalSampler hemisphere;
+    double u1, u2;
+    Sampler::active().get2D(SampleDimension::BSDF, depth, u1, u2);
+    Vector3D wi = hemisphere.getCosineSample(n, u1, u2);
+    Vector3D throughput = mat.getReflectance(n, wo, wi) * M_PI;
+
+    // Follow the specular bounces up to the next diffuse point. The light
+    // sources they reach are not added: those paths are caustics at x
+    Ray ray(x, wi, depth + 1);
+    while ((int)ray.depth < maxDepth)
+    {
+        Intersection its;
+        if (!Utils::getClosestIntersection(ray, objList, its))
+            return Vector3D(0.0);
+
+        const Material& yMaterial = its.shape->getMaterial();
+        const Vector3D y = its.itsPoint;
+        Vector3D ny = its.normal.normalized();
+        const Vector3D wo_next = (-ray.d).normalized();
+
+        if (Utils::isSpecular(yMaterial))
+        {
+            Vector3D wj, weight;
+            if (!Utils::sampleSpecular(ny, wo_next, yMaterial, wj, weight))
+                return Vector3D(0.0);
+            throughput = throughput * weight;
+            ray = Ray(y, wj, ray.depth + 1);
+            continue;
+        }
+
+        // The global map holds all the light reflected at y (direct,
+        // caustic and indirect), but not its emission
+        if (dot(ny, wo_next) < 0.0)
+            ny = -ny;
+        return throughput * estimateRadiance(globalMap, settings.globalNeighbors, settings.globalRadius,
+                                             false, y, ny, wo_next, yMaterial);
+    }
+
+    return Vector3D(0.0);
+}
+
+Vector3D PhotonMappingIntegrator::estimateRadiance(const PhotonMap &map, int k, double maxRadius,
+                                                   bool coneFilter, const Vector3D &x,
+                                                   const Vector3D &n, const Vector3D &wo,
+                                                   const Material &mat) const
+{
+    static thread_local std::vector<NearestPhoton> nearest;
+    double r2 = map.findNearest(x, k, (float)(maxRadius * maxRadius), nearest);
+    if (nearest.empty())
+        return Vector3D(0.0);
+
+    // With fewer than k photons in reach, the density is that of the whole
+    // search disc: a handful of close photons must not make a firefly
+    if ((int)nearest.size() < k)
+        r2 = maxRadius * maxRadius;
+    double r = std::sqrt(r2);
+
+    Vector3D flux(0.0);
+    for (const NearestPhoton &np : nearest)
+    {
+        const Photon &photon = *np.photon;
+        // Photons that arrived from the other side belong to another surface
+        if (dot(n, photon.direction) <= 0.0)
+            continue;
+
+        double weight = coneFilter ? 1.0 - std::sqrt(np.distance2) / (ConeFilterK * r) : 1.0;
+        flux += mat.getReflectance(n, wo, photon.direction) * photon.power * weight;
+    }
+
+    // Radiance = reflected flux / disc area (normalized for the cone filter)
+    double area = M_PI * r2;
+    if (coneFilter)
+        area *= 1.0 - 2.0 / (3.0 * ConeFilterK);
+    return flux / area;
+}
@@ -0,0 +1,83 @@
+#ifndef PHOTONMAPPINGINTEGRATOR_H
+#define PHOTONMAPPINGINTEGRATOR_H
+
+#include "shader.h"
+#include "../core/photonmap.h"
+
+// Photon counts and density estimation options of the photon maps
+struct PhotonMapSettings
+{
+    PhotonMapSettings() :
+        globalPhotons(200000), causticPhotons(2000000),
+        globalNeighbors(100), causticNeighbors(60),
+        globalRadius(1.0), causticRadius(0.25)
+    { }
+
+    int globalPhotons;     // Photon paths emitted for the global map
+    int causticPhotons;    // Photon paths emitted for the caustic map
+    int globalNeighbors;   // k of the k-nearest-neighbor radiance estimates
+    int causticNeighbors;
+    double globalRadius;   // Largest search radius of the estimates (world units)
+    double causticRadius;
+};
+
+// Two-pass photon mapping (Jensen 2001).
+//
+// preprocess() emits photons from the area light sources, in parallel,
+// and stores them in two kd-trees:
+//   - the caustic map, with the photons that reached a diffuse surface
+//     through mirrors and transmissive objects only (L S+ D paths);
+//   - the global map, with every photon stored at a diffuse surface.
+// Camera paths follow the specular bounces up to the first diffuse (or
+// glossy) point, where the radiance is the sum of the direct light
+// (sampled on the light sources), the caustics (estimated from the
+// nearest caustic photons) and the indirect light, gathered with one
+// random bounce that reads the global map at the next diffuse point.
+class PhotonMappingIntegrator : public Shader
+{
+public:
+    PhotonMappingIntegrator(Vector3D bgColor_, int maxDepth_,
+                            const PhotonMapSettings &settings_ = PhotonMapSettings());
+
+    // Traces the photons and builds the photon maps
+    virtual void preprocess(const std::vector<Shape*> &objList,
+                            const std::vector<LightSource*> &lsList);
+
+    virtual Vector3D computeColor(const Ray &r,
+                             const std::vector<Shape*> &objList,
+                             const std::vector<LightSource*> &lsList) const;
+    virtual Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                         const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList) const;
+
+private:
+    int maxDepth;
+    PhotonMapSettings settings;
+    PhotonMap globalMap;
+    PhotonMap causticMap;
+
+    // Emits numPaths photon paths shared by the area light sources in
+    // proportion to their power. In the caustic pass only the photons that
+    // leave a specular surface are followed.
+    void emitPhotons(int numPaths, bool causticPass, PhotonMap &map,
+                     const std::vector<Shape*> &objList,
+                     const std::vector<LightSource*> &lsList) const;
+    void tracePhoton(Ray ray, Vector3D power, bool causticPass, std::vector<Photon> &stored,
+                     const std::vector<Shape*> &objList) const;
+
+    Vector3D shade(const Ray &ray, const Intersection &its,
+                   const std::vector<Shape*> &objList,
+                   const std::vector<LightSource*> &lsList) const;
+
+    // Final gather: one bounce to the next diffuse point, read from the global map
+    Vector3D computeGatheredRadiance(const Vector3D &x, const Vector3D &n, const Vector3D &wo,
+                                     const Material &mat, int depth,
+                                     const std::vector<Shape*> &objList) const;
+
+    // Reflected radiance at x from the k nearest photons of the map
+    Vector3D estimateRadiance(const PhotonMap &map, int k, double maxRadius, bool coneFilter,
+                              const Vector3D &x, const Vector3D &n, const Vector3D &wo,
+                              const Material &mat) const;
+};
+
+#endif // PHOTONMAPPINGINTEGRATOR_H
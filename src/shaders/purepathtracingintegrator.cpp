@@ -1,7 +1,9 @@
 #include "purepathtracingintegrator.h"
 #include "core/hemisphericalsampler.h"
+#include "core/sampler.h"
 #include "core/intersection.h"
 #include "core/utils.h"
+#include "core/statistics.h"
 #include "core/vector3d.h"
 #include "shapes/shape.h"
 
@@ -11,11 +13,22 @@ PurePathTracingIntegrator::PurePathTracingIntegrator(Vector3D bgColor_, int maxD
 Vector3D PurePathTracingIntegrator::computeColor(const Ray &ray, const std::vector<Shape*> &objList, const std::vector<LightSource*> &lsList) const
 {
     //Find the closest intersection with the scene geometry
-    Intersection its;
-    if (!Utils::getClosestIntersection(ray, objList, its))
+    PrimaryHit primary;
+    primary.trace(ray, objList);
+    return computeColorFromHit(ray, primary, objList, lsList);
+}
+
+Vector3D PurePathTracingIntegrator::computeColorFromHit(const Ray &ray, const PrimaryHit &primary,
+                                                        const std::vector<Shape*> &objList,
+                                                        const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
     {
         return bgColor;
     }
+
+    const Intersection& its = primary.its;
+    STAT_PATH_VERTEX((int)ray.depth);
     
     //properties of the intersection point
     const Vector3D x = its.itsPoint;
@@ -86,19 +99,55 @@ Vector3D PurePathTracingIntegrator::computeColor(const Ray &ray, const std::vect
     {
         // Monte Carlo hemisphere sampling for diffuse materials
         HemisphericalSampler sampler;
-        Vector3D wi = sampler.getSample(x_normal);
-        const double pdf = 1.0 / (2.0 * M_PI);
+        double u1, u2;
+        Sampler::active().get2D(SampleDimension::BSDF, (int)ray.depth, u1, u2);
+        Vector3D wi;
+        double pdf;
+        if (guide)
+        {
+            // Guided sampling, which may pick directions below the surface
+            pdf = guide->sampleDirection(x, x_normal, u1, u2, wi);
+        }
+        else
+        {
+            wi = sampler.getSample(x_normal, u1, u2);
+            pdf = 1.0 / (2.0 * M_PI);
+        }
 
-        // Trace ray in sampled direction
-        Ray newRay(x, wi, ray.depth + 1);
         double nx_dot_wi = dot(x_normal, wi);
-        
-        // Accumulate indirect illumination
-        Lo += computeColor(newRay, objList, lsList) * 
-              surfaceMaterial.getReflectance(x_normal, wo, wi) * 
-              nx_dot_wi / pdf;
+        if (nx_dot_wi > 0.0)
+        {
+            // Trace ray in sampled direction
+            Ray newRay(x, wi, ray.depth + 1);
+            Vector3D Li = computeColor(newRay, objList, lsList);
+            if (guide)
+                guide->record(x, wi, Li, pdf);
+
+            // Accumulate indirect illumination
+            Lo += Li * surfaceMaterial.getReflectance(x_normal, wo, wi) * nx_dot_wi / pdf;
+        }
     }
     
     return Lo;
 }
 
+void PurePathTracingIntegrator::enablePathGuiding(const PathGuidingSettings &settings)
+{
+    guide = std::make_unique<SDTree>(settings);
+}
+
+void PurePathTracingIntegrator::sceneChanged()
+{
+    if (guide)
+        guide->reset();
+}
+
+int PurePathTracingIntegrator::getTrainingPasses() const
+{
+    return guide ? guide->getSettings().trainingPasses : 0;
+}
+
+void PurePathTracingIntegrator::endTrainingPass(int pass)
+{
+    guide->endPass(pass);
+}
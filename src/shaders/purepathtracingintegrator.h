@@ -2,6 +2,9 @@
 #define PUREPATHTRACINGINTEGRATOR_H
 
 #include "shader.h"
+#include "../core/sdtree.h"
+
+#include <memory>
 
 class PurePathTracingIntegrator : public Shader
 {
@@ -11,9 +14,24 @@ public:
     virtual Vector3D computeColor(const Ray &r,
                                  const std::vector<Shape*> &objList,
                                  const std::vector<LightSource*> &lsList) const;
+    virtual Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                         const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList) const;
+
+    // Path guiding mode: diffuse bounces sample a mixture of the BSDF and
+    // the incident radiance learned by an SD-tree over the training passes
+    // of raytrace().
+    void enablePathGuiding(const PathGuidingSettings &settings = PathGuidingSettings());
+
+    // The guide learns again
+    virtual void sceneChanged();
+
+    virtual int getTrainingPasses() const;
+    virtual void endTrainingPass(int pass);
 
 private:
     int maxDepth;
+    std::unique_ptr<SDTree> guide; // Null unless enabled
 };
 
 #endif // PUREPATHTRACINGINTEGRATOR_H
@@ -5,3 +5,10 @@ Shader::Shader() : bgColor(Vector3D(0.0))
 
 Shader::Shader(Vector3D bgColor_) : bgColor(bgColor_)
 { }
+
+Vector3D Shader::computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                     const std::vector<Shape*> &objList,
+                                     const std::vector<LightSource*> &lsList) const
+{
+    return computeColor(r, objList, lsList);
+}
@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "core/ray.h"
+#include "core/gbuffer.h"
 #include "lightsources/pointlightsource.h"
 #include "lightsources/arealightsource.h"
 #include "shapes/shape.h"
@@ -13,11 +14,45 @@ class Shader
 public:
     Shader();
     Shader(Vector3D bgColor_);
+    virtual ~Shader() {}
+
+    // Called by raytrace() before rendering, for the precomputations that
+    // depend on the whole scene (e.g. photon maps)
+    virtual void preprocess(const std::vector<Shape*> &objList,
+                            const std::vector<LightSource*> &lsList) { }
+
+    // Called when the scene has moved since the last render (animations),
+    // so that the shader forgets what it cached about the old one. The
+    // caches of the shaders (ambient occlusion, irradiance and radiance
+    // caches, path guiding) hold only until then
+    virtual void sceneChanged() { }
 
     virtual Vector3D computeColor(const Ray &r,
                              const std::vector<Shape*> &objList,
                              const std::vector<LightSource*> &lsList) const = 0;
 
+    // Same as computeColor(), starting from the already traced first hit of
+    // the camera ray r. The default implementation traces r again.
+    virtual Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                         const std::vector<Shape*> &objList,
+                                         const std::vector<LightSource*> &lsList) const;
+
+    // Called once per G-buffer entry, so that the shader can cache the
+    // quantities of the first hit that do not change between samples
+    virtual void preparePrimaryHit(const Ray &r, PrimaryHit &primary,
+                                   const std::vector<Shape*> &objList) const { }
+
+    // True when computeColor() always returns the same value for the same
+    // ray, in which case tracing several samples through the pixel center
+    // is wasted work
+    virtual bool isDeterministic(const std::vector<LightSource*> &lsList) const { return false; }
+
+    // Shaders that learn from their own samples (e.g. path guiding) ask
+    // raytrace() for training passes of 1, 2, 4... samples per pixel before
+    // the final render; endTrainingPass() is called after each of them
+    virtual int getTrainingPasses() const { return 0; }
+    virtual void endTrainingPass(int pass) { }
+
     Vector3D bgColor;
 };
 
@@ -1,6 +1,10 @@
 #include "whittedintegrator.h"
 
 #include "../core/utils.h"
+#include "../core/sampler.h"
+#include "../core/statistics.h"
+
+#include <memory>
 
 WhittedIntegrator::WhittedIntegrator(Vector3D& bgColor, int maxDepth_, float ambientTerm_) :
     Shader(bgColor), maxDepth(maxDepth_), ambientTerm(ambientTerm_)
@@ -11,6 +15,23 @@ Vector3D WhittedIntegrator::computeColor(const Ray &r, const std::vector<Shape*>
     return computeColorRecursive(r, objList, lsList, /*depth=*/0);
 }
 
+Vector3D WhittedIntegrator::computeColorFromHit(const Ray &r, const PrimaryHit &primary, const std::vector<Shape*> &objList, const std::vector<LightSource*> &lsList) const
+{
+    if (!primary.hit)
+        return bgColor;
+    return shadeIntersection(r, primary.its, objList, lsList, /*depth=*/0);
+}
+
+bool WhittedIntegrator::isDeterministic(const std::vector<LightSource*> &lsList) const
+{
+    for (const LightSource* L : lsList)
+    {
+        if (L->getArea() > 0.0)
+            return false;
+    }
+    return true;
+}
+
 #include <algorithm>
 #include <cmath>
 
@@ -30,6 +51,18 @@ Vector3D WhittedIntegrator::computeColorRecursive(
     if (!Utils::getClosestIntersection(r, objList, its))
         return bgColor;  // Ray escaped scene, return background color
 
+    return shadeIntersection(r, its, objList, lsList, depth);
+}
+
+Vector3D WhittedIntegrator::shadeIntersection(
+    const Ray &r,
+    const Intersection &its,
+    const std::vector<Shape*> &objList,
+    const std::vector<LightSource*> &lsList,
+    int depth) const
+{
+    STAT_PATH_VERTEX(depth);
+
     // Step 2: Setup local shading frame at intersection point
     const Vector3D x  = its.itsPoint;           // Surface point x
     const Vector3D n  = its.normal.normalized(); // Surface normal n_x
@@ -48,10 +81,22 @@ Vector3D WhittedIntegrator::computeColorRecursive(
     // Step 4: Direct Illumination from Point Lights (only for diffuse/glossy materials)
     if (mat.hasDiffuseOrGlossy())
     {
-        for (const LightSource* L : lsList)  // Loop over nL light sources
+        const int numLights = (int)lsList.size();
+
+        // Shadow rays towards a sample of every light, all leaving x: they
+        // are traced together as a single batch
+        std::vector<Ray> shadowRays;
+        std::vector<Vector3D> incidentRadiance;
+        shadowRays.reserve(numLights);
+        incidentRadiance.reserve(numLights);
+        for (int lightIndex = 0; lightIndex < numLights; lightIndex++)  // Loop over nL light sources
         {
+            const LightSource* L = lsList[lightIndex];
+
             // Sample light position (for point lights: single position; area lights: random sample)
-            const Vector3D lightPos = L->generateRandomPoint();
+            double u, v;
+            Sampler::active().get2D(SampleDimension::Light, depth, u, v, lightIndex, numLights);
+            const Vector3D lightPos = L->generatePoint(u, v);
             Vector3D Li = L->getIntensity();
 
             // Compute incident direction ω_i^s: from shading point x to light position
@@ -62,18 +107,25 @@ Vector3D WhittedIntegrator::computeColorRecursive(
             wi /= dist;
 
             // Apply inverse-square falloff: intensity decreases with distance²
-            Li = Li / dist2;
+            incidentRadiance.push_back(Li / dist2);
+
+            // Offset by epsilon to avoid self-intersection, stop at light position
+            shadowRays.emplace_back(x, wi, 0, Epsilon, dist - Epsilon);
+        }
 
-            // V_s(x) = 1 if light s is visible from x, 0 otherwise
-            Ray shadowRay(x, wi);  // Offset by epsilon to avoid self-intersection
-            shadowRay.minT = Epsilon;
-            shadowRay.maxT = dist - Epsilon;  // Stop at light position
+        // V_s(x) = 1 if light s is visible from x, 0 otherwise
+        const int numShadowRays = (int)shadowRays.size();
+        std::unique_ptr<bool[]> blocked(new bool[numShadowRays]);
+        Utils::countOccluded(shadowRays.data(), numShadowRays, objList, blocked.get());
 
-            Intersection occ;
-            const bool blocked = Utils::getClosestIntersection(shadowRay, objList, occ);
-            if (blocked)
+        for (int s = 0; s < numShadowRays; s++)
+        {
+            if (blocked[s])
                 continue;  // V_s(x) = 0: light is occluded, skip this light source
 
+            const Vector3D &wi = shadowRays[s].d;
+            const Vector3D &Li = incidentRadiance[s];
+
             // V_s(x) = 1: light is visible, compute contribution
             
             // Evaluate BRDF: f_r(n_x, ω_i^s, ω_o) using Phong model
@@ -18,6 +18,12 @@ public:
     Vector3D computeColor(const Ray &r,
                           const std::vector<Shape*> &objList,
                           const std::vector<LightSource*> &lsList) const override;
+    Vector3D computeColorFromHit(const Ray &r, const PrimaryHit &primary,
+                                 const std::vector<Shape*> &objList,
+                                 const std::vector<LightSource*> &lsList) const override;
+
+    // Only point lights keep the shader free of random sampling
+    bool isDeterministic(const std::vector<LightSource*> &lsList) const override;
 
     Vector3D computeColorRecursive(const Ray &r,
                                    const std::vector<Shape*> &objList,
@@ -25,6 +31,12 @@ public:
                                    int depth) const;
 
 private:
+    // Radiance leaving the hit point its towards the origin of r
+    Vector3D shadeIntersection(const Ray &r, const Intersection &its,
+                               const std::vector<Shape*> &objList,
+                               const std::vector<LightSource*> &lsList,
+                               int depth) const;
+
     int   maxDepth;     // max recursion depth
     float ambientTerm;  // ambient contribution
 };
@@ -0,0 +1,287 @@
+#include "aggregate.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+#include "instance.h"
+#include "../core/parallel.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+// Cache files: this header, then the tree traced. The version changes
+// with the layout of any structure written raw
+static const uint64_t CacheMagic = 0x0031485642474341ull; // "ACGBVH1"
+static const uint32_t CacheVersion = 3;
+
+struct CacheHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t wide;
+    uint64_t key;
+    uint64_t checksum; // Of the tree bytes, so that damaged files are rebuilt
+    BVHBuildMetrics metrics;
+};
+
+// FNV-1a over 64-bit words: every step is a bijection of the hash, so any
+// one damaged word changes it
+static uint64_t checksumOf(const std::string &bytes)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= bytes.size(); i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    for (; i < bytes.size(); i++)
+        hash = (hash ^ (uint8_t)bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+Aggregate::Aggregate(const std::vector<Shape*> &shapes_, const BVHSettings &settings_,
+                     const std::string &cacheDirectory)
+    : Shape(Matrix4x4(), nullptr), settings(settings_), wide(settings_.width == 4)
+{
+    BVHPrimitiveBounds bounds;
+    bounds.resize(shapes_.size());
+    for (Shape *shape : shapes_)
+    {
+        Vector3D boundsMin, boundsMax;
+        if (!shape->getBounds(boundsMin, boundsMax))
+        {
+            unbounded.push_back(shape);
+            continue;
+        }
+        bounds.set(shapes.size(), boundsMin, boundsMax);
+        shapes.push_back(shape);
+    }
+    bounds.resize(shapes.size());
+
+    std::string cachePath;
+    uint64_t key = 0;
+    if (!cacheDirectory.empty())
+    {
+        key = BVH::contentHash(bounds, settings);
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+        cachePath = (std::filesystem::path(cacheDirectory) / name).string();
+        if (loadCache(cachePath, key))
+            return;
+    }
+
+    buildTree(bounds);
+    if (!cachePath.empty())
+        saveCache(cachePath, key);
+}
+
+void Aggregate::buildTree(const BVHPrimitiveBounds &bounds)
+{
+    bvh.build(bounds, settings);
+    metrics = bvh.getMetrics();
+    if (wide)
+    {
+        // Only the layout traced is kept
+        wideBvh.build(bvh, settings.compressed);
+        metrics.memoryBytes = wideBvh.getMemoryBytes();
+        bvh = BVH();
+    }
+}
+
+void Aggregate::moveShape(Shape *shape, const Matrix4x4 &t_)
+{
+    shape->setTransform(t_);
+    markMoved(shape);
+}
+
+void Aggregate::markMoved(const Shape *shape)
+{
+    if (primitiveOf.empty())
+        for (uint32_t i = 0; i < shapes.size(); i++)
+            primitiveOf[shapes[i]] = i;
+    auto primitive = primitiveOf.find(shape);
+    if (primitive != primitiveOf.end())
+        moved.push_back(primitive->second);
+}
+
+bool Aggregate::refit()
+{
+    if (moved.empty())
+        return false;
+    BVHBoundsFunction boundsOf = [&](uint32_t primitive, Vector3D &boundsMin, Vector3D &boundsMax)
+    {
+        shapes[primitive]->getBounds(boundsMin, boundsMax);
+    };
+    double degradation = wide ? wideBvh.refit(moved, boundsOf) : bvh.refit(moved, boundsOf);
+    moved.clear();
+    if (degradation <= settings.rebuildThreshold)
+        return false;
+
+    BVHPrimitiveBounds bounds;
+    bounds.resize(shapes.size());
+    parallelFor(shapes.size(), [&](size_t i, int)
+    {
+        Vector3D boundsMin, boundsMax;
+        shapes[i]->getBounds(boundsMin, boundsMax);
+        bounds.set(i, boundsMin, boundsMax);
+    });
+    buildTree(bounds);
+    return true;
+}
+
+bool Aggregate::refitInstances(const Shape *geometry)
+{
+    for (Shape *shape : shapes)
+    {
+        Instance *instance = dynamic_cast<Instance*>(shape);
+        if (instance == nullptr || instance->getGeometry() != geometry)
+            continue;
+        instance->updateBounds();
+        markMoved(instance);
+    }
+    return refit();
+}
+
+bool Aggregate::rayIntersect(const Ray &ray, Intersection &its) const
+{
+    bool hit = false;
+    for (const Shape *shape : unbounded)
+        hit |= shape->rayIntersect(ray, its);
+
+    hit |= traverse(ray, false, [&](uint32_t primitive)
+    {
+        return shapes[primitive]->rayIntersect(ray, its);
+    });
+    return hit;
+}
+
+bool Aggregate::rayIntersectP(const Ray &ray) const
+{
+    for (const Shape *shape : unbounded)
+        if (shape->rayIntersectP(ray))
+            return true;
+
+    return traverse(ray, true, [&](uint32_t primitive)
+    {
+        return shapes[primitive]->rayIntersectP(ray);
+    });
+}
+
+bool Aggregate::overlapsSphere(const Vector3D &center, double radius) const
+{
+    for (const Shape *shape : unbounded)
+        if (shape->overlapsSphere(center, radius))
+            return true;
+
+    // Distance from the center to the box of the tree
+    Vector3D boundsMin, boundsMax;
+    if (!treeBounds(boundsMin, boundsMax))
+        return false;
+    Vector3D nearest(std::clamp(center.x, boundsMin.x, boundsMax.x),
+                     std::clamp(center.y, boundsMin.y, boundsMax.y),
+                     std::clamp(center.z, boundsMin.z, boundsMax.z));
+    return (nearest - center).lengthSq() <= radius * radius;
+}
+
+bool Aggregate::getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const
+{
+    if (!unbounded.empty())
+        return false;
+    return treeBounds(boundsMin, boundsMax);
+}
+
+const BVHBuildMetrics& Aggregate::getMetrics() const
+{
+    return metrics;
+}
+
+bool Aggregate::treeBounds(Vector3D &boundsMin, Vector3D &boundsMax) const
+{
+    if (wide ? wideBvh.empty() : bvh.empty())
+        return false;
+    if (wide)
+        wideBvh.getBounds(boundsMin, boundsMax);
+    else
+        bvh.getBounds(boundsMin, boundsMax);
+    return true;
+}
+
+bool Aggregate::loadCache(const std::string &path, uint64_t key)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream in(path, std::ios::binary);
+    CacheHeader header;
+    if (!in || !in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+    if (header.magic != CacheMagic || header.version != CacheVersion || header.key != key ||
+        header.wide != (uint32_t)wide)
+        return false;
+    std::stringstream tree;
+    tree << in.rdbuf();
+    if (checksumOf(tree.str()) != header.checksum ||
+        !(wide ? wideBvh.load(tree, shapes.size()) : bvh.load(tree, shapes.size())))
+        return false;
+
+    metrics = header.metrics;
+    metrics.cached = true;
+    metrics.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+// Suffix of the files written aside, unique to the writer: runs saving the
+// same tree at once must not write into each other's file
+static std::string partialSuffix()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    unsigned long process = (unsigned long)getpid();
+#else
+    unsigned long process = 0;
+#endif
+    std::random_device device;
+    char suffix[64];
+    std::snprintf(suffix, sizeof(suffix), ".%lu.%08x%08x.partial", process, device(), device());
+    return suffix;
+}
+
+void Aggregate::saveCache(const std::string &path, uint64_t key) const
+{
+    // Written aside and renamed, so that no run reads a file being written
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    std::string partialPath = path + partialSuffix();
+    {
+        std::ostringstream tree;
+        if (wide)
+            wideBvh.save(tree);
+        else
+            bvh.save(tree);
+        std::string bytes = tree.str();
+        std::ofstream out(partialPath, std::ios::binary | std::ios::trunc);
+        CacheHeader header = { CacheMagic, CacheVersion, (uint32_t)wide, key, checksumOf(bytes), metrics };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(bytes.data(), bytes.size());
+        if (!out.flush())
+        {
+            std::cout << "Warning! Could not write the BVH cache file " << partialPath << std::endl;
+            out.close();
+            std::filesystem::remove(partialPath, error);
+            return;
+        }
+    }
+    std::filesystem::rename(partialPath, path, error);
+    if (error)
+    {
+        std::cout << "Warning! Could not write the BVH cache file " << path << std::endl;
+        std::filesystem::remove(partialPath, error);
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "shape.h"
+#include "../core/bvh.h"
+#include "../core/widebvh.h"
+
+// Group of shapes traced as one: the bounded shapes are held in a BVH
+// (four-wide unless BVHSettings::width is 2, compressed if
+// BVHSettings::compressed), the unbounded ones
+// (infinite planes) are tested one by one. Hits report the shape that was
+// hit, never the aggregate, so the aggregate can stand for the whole
+// object list of a scene. It has no material of its own and must not be
+// added to a Scene. The shapes are not owned.
+//
+// Given a cache directory, the tree is saved there after its build, in a
+// file named after BVH::contentHash() of the shapes' boxes and the
+// settings, and later aggregates of the same shapes load it instead of
+// building it again. The files are raw copies of the nodes: they only
+// suit the build of the program that wrote them. A file whose checksum
+// fails, or whose nodes do not index the shapes, is built over again.
+//
+// For animation, moveShape() moves shapes in place and refit() then
+// refits the tree around them, rebuilding it only once the refits have
+// let its SAH cost grow past BVHSettings::rebuildThreshold. Neither may
+// run while the aggregate is traced. Instances do not see a refit of the
+// geometry they share: refitInstances() on the aggregate that holds them
+// updates their boxes, one level of instancing at a time.
+class Aggregate : public Shape
+{
+public:
+    Aggregate() = delete;
+    Aggregate(const std::vector<Shape*> &shapes_, const BVHSettings &settings_ = BVHSettings(),
+              const std::string &cacheDirectory = "");
+
+    bool rayIntersect(const Ray &ray, Intersection &its) const;
+    bool rayIntersectP(const Ray &ray) const;
+    bool overlapsSphere(const Vector3D &center, double radius) const;
+    bool getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+
+    // Metrics of the build, with the memory of the layout traced
+    const BVHBuildMetrics& getMetrics() const;
+
+    // Gives shape, one of the aggregate's, the transform t_. The tree
+    // follows at the next refit()
+    void moveShape(Shape *shape, const Matrix4x4 &t_);
+    // Updates the tree to the shapes moved since the last call. Returns
+    // whether it had to rebuild it
+    bool refit();
+    // After a refit of geometry, updates the boxes of the aggregate's
+    // instances of it and refits the tree around them, with the shapes
+    // moved since the last refit. Returns whether it had to rebuild it
+    bool refitInstances(const Shape *geometry);
+
+private:
+    template <typename PrimitiveTest>
+    bool traverse(const Ray &ray, bool anyHit, PrimitiveTest test) const
+    {
+        return wide ? wideBvh.traverse(ray, anyHit, test) : bvh.traverse(ray, anyHit, test);
+    }
+
+    // Box of the bounded shapes, false if there are none
+    bool treeBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+
+    bool loadCache(const std::string &path, uint64_t key);
+    void saveCache(const std::string &path, uint64_t key) const;
+    void buildTree(const BVHPrimitiveBounds &bounds);
+    // Queues the primitive of shape, if bounded, for the next refit
+    void markMoved(const Shape *shape);
+
+    std::vector<Shape*> shapes;    // Indexed by the BVH primitives
+    std::vector<Shape*> unbounded;
+    BVHSettings settings;
+    BVH bvh;
+    WideBVH wideBvh;
+    bool wide;
+    BVHBuildMetrics metrics;
+
+    // Primitive of every bounded shape, indexed by the first move, and the
+    // primitives moved since the last refit
+    std::unordered_map<const Shape*, uint32_t> primitiveOf;
+    std::vector<uint32_t> moved;
+};
+
+#endif // AGGREGATE_H
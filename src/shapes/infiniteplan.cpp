@@ -1,11 +1,25 @@
 #include "infiniteplan.h"
 
+#include "../core/statistics.h"
+
 InfinitePlan::InfinitePlan(const Vector3D &p0_, const Vector3D &normal_,
          Material *mat_) :
     Shape(Matrix4x4(), mat_),
     p0World(p0_), nWorld(normal_.normalized())
 { }
 
+void InfinitePlan::setTransform(const Matrix4x4 &t_)
+{
+    // Moved by the change of transform, as the plan is given in world space
+    Matrix4x4 change = t_ * worldToObject;
+    Matrix4x4 changeInverse, normalChange;
+    change.inverse(changeInverse);
+    changeInverse.transpose(normalChange);
+    p0World = change.transformPoint(p0World);
+    nWorld = normalChange.transformVector(nWorld).normalized();
+    Shape::setTransform(t_);
+}
+
 Vector3D InfinitePlan::getNormalWorld() const
 {
     return nWorld;
@@ -13,6 +27,7 @@ Vector3D InfinitePlan::getNormalWorld() const
 
 bool InfinitePlan::rayIntersect(const Ray &rayWorld, Intersection &its) const
 {
+    STAT_INC(PlaneTests);
     // Compute the denominator of the tHit formula
     double denominator = dot(rayWorld.d, nWorld);
 
@@ -41,8 +56,14 @@ bool InfinitePlan::rayIntersect(const Ray &rayWorld, Intersection &its) const
     return true;
 }
 
+bool InfinitePlan::overlapsSphere(const Vector3D &center, double radius) const
+{
+    return std::abs(dot(center - p0World, nWorld)) <= radius;
+}
+
 bool InfinitePlan::rayIntersectP(const Ray &rayWorld) const
 {
+    STAT_INC(PlaneTests);
     // Compute the denominator of the tHit formula
     double denominator = dot(rayWorld.d, nWorld);
 
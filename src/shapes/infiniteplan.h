@@ -16,6 +16,8 @@ public:
     // Ray/plan intersection methods
     bool rayIntersect(const Ray &ray, Intersection &its) const;
     bool rayIntersectP(const Ray &rayWorld) const;
+    bool overlapsSphere(const Vector3D &center, double radius) const;
+    void setTransform(const Matrix4x4 &t_);
 
 
     // Convert triangle to String
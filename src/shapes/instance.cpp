@@ -0,0 +1,82 @@
+#include "instance.h"
+
+#include <algorithm>
+
+Instance::Instance(const Shape *geometry_, const Matrix4x4 &t_, Material *material_)
+    : Shape(t_, material_), geometry(geometry_)
+{
+    updateBounds();
+}
+
+void Instance::setTransform(const Matrix4x4 &t_)
+{
+    Shape::setTransform(t_);
+    updateBounds();
+}
+
+const Shape* Instance::getGeometry() const
+{
+    return geometry;
+}
+
+void Instance::updateBounds()
+{
+    // Box of the transformed corners of the geometry box
+    Vector3D localMin, localMax;
+    bounded = geometry->getBounds(localMin, localMax);
+    if (!bounded)
+        return;
+    worldMin = Vector3D(INFINITY);
+    worldMax = Vector3D(-INFINITY);
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vector3D p = objectToWorld.transformPoint(Vector3D((corner & 1) ? localMax.x : localMin.x,
+                                                           (corner & 2) ? localMax.y : localMin.y,
+                                                           (corner & 4) ? localMax.z : localMin.z));
+        worldMin = Vector3D(std::min(worldMin.x, p.x), std::min(worldMin.y, p.y), std::min(worldMin.z, p.z));
+        worldMax = Vector3D(std::max(worldMax.x, p.x), std::max(worldMax.y, p.y), std::max(worldMax.z, p.z));
+    }
+}
+
+bool Instance::rayIntersect(const Ray &ray, Intersection &its) const
+{
+    // The direction is not normalized in object space, so that distances
+    // along the ray stay the same in both spaces
+    Ray r = worldToObject.transformRay(ray);
+    if (!geometry->rayIntersect(r, its))
+        return false;
+    ray.maxT = r.maxT;
+
+    its.itsPoint = objectToWorld.transformPoint(its.itsPoint);
+    // Normals go through the transpose of the inverse
+    Matrix4x4 inverseTransposed;
+    worldToObject.transpose(inverseTransposed);
+    its.normal = inverseTransposed.transformVector(its.normal).normalized();
+    if (material != nullptr)
+        its.shape = this;
+    else if (its.shape->getId() == 0)
+        its.instanceId = id;
+    return true;
+}
+
+bool Instance::rayIntersectP(const Ray &ray) const
+{
+    return geometry->rayIntersectP(worldToObject.transformRay(ray));
+}
+
+bool Instance::overlapsSphere(const Vector3D &center, double radius) const
+{
+    if (!bounded)
+        return true;
+    Vector3D nearest(std::clamp(center.x, worldMin.x, worldMax.x),
+                     std::clamp(center.y, worldMin.y, worldMax.y),
+                     std::clamp(center.z, worldMin.z, worldMax.z));
+    return (nearest - center).lengthSq() <= radius * radius;
+}
+
+bool Instance::getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const
+{
+    boundsMin = worldMin;
+    boundsMax = worldMax;
+    return bounded;
+}
@@ -0,0 +1,44 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "shape.h"
+
+// Placement of shared geometry: the geometry is traced in its own space,
+// through the instance's object-to-world transform, so any number of
+// instances share one copy of it. The geometry is usually an Aggregate,
+// whose BVH then serves as the bottom level under the top-level
+// Aggregate of the instances. Without a material the hits report the
+// shapes of the geometry, with theirs, and the id of the instance in
+// Intersection::instanceId when those are not in the scene (so that
+// each placement keeps its own id). With one, they report the
+// instance, which overrides the material of the whole geometry; it must
+// not be emissive, as area lights need squares. The geometry is not
+// owned. Its box is read when the instance is placed: after a refit of
+// the geometry, see Aggregate::refitInstances().
+class Instance : public Shape
+{
+public:
+    Instance() = delete;
+    Instance(const Shape *geometry_, const Matrix4x4 &t_, Material *material_ = nullptr);
+
+    bool rayIntersect(const Ray &ray, Intersection &its) const;
+    bool rayIntersectP(const Ray &ray) const;
+    bool overlapsSphere(const Vector3D &center, double radius) const;
+    bool getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+    void setTransform(const Matrix4x4 &t_);
+
+    const Shape* getGeometry() const;
+    // Reads the box of the geometry again, once it has changed
+    void updateBounds();
+
+private:
+
+    const Shape *geometry;
+
+    // World-space box of the transformed geometry box, if it has one
+    bool bounded;
+    Vector3D worldMin;
+    Vector3D worldMax;
+};
+
+#endif // INSTANCE_H
@@ -5,9 +5,41 @@ Shape::Shape(const Matrix4x4 &t_, Material *material_)
     objectToWorld = t_;
     objectToWorld.inverse(worldToObject);
     material = material_;
+    id = 0;
+}
+
+void Shape::setTransform(const Matrix4x4 &t_)
+{
+    objectToWorld = t_;
+    objectToWorld.inverse(worldToObject);
+}
+
+bool Shape::overlapsSphere(const Vector3D &center, double radius) const
+{
+    return true;
+}
+
+bool Shape::getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const
+{
+    return false;
 }
 
 const Material& Shape::getMaterial() const
 {
     return *material;
 }
+
+bool Shape::hasMaterial() const
+{
+    return material != nullptr;
+}
+
+int Shape::getId() const
+{
+    return id;
+}
+
+void Shape::setId(int id_)
+{
+    id = id_;
+}
@@ -12,6 +12,7 @@ class Shape
 public:
     Shape() = delete;
     Shape(const Matrix4x4 &t_, Material *material_);
+    virtual ~Shape() {}
 
     // Pure virtual function makes this class Abstract class.
 
@@ -19,13 +20,34 @@ public:
     virtual bool rayIntersect(const Ray &ray, Intersection &its) const =0 ;
     virtual bool rayIntersectP(const Ray &ray) const = 0;
 
+    // Conservative test of whether the shape can touch the ball of the given
+    // center and radius, used to cull shapes out of reach of short rays
+    virtual bool overlapsSphere(const Vector3D &center, double radius) const;
+
+    // Moves the shape: its object-to-world transform becomes t_, and its
+    // world-space data follows. Shapes given in world space (squares,
+    // planes) move by the change from their current transform. An
+    // Aggregate ignores it: move its shapes with Aggregate::moveShape()
+    virtual void setTransform(const Matrix4x4 &t_);
+
+    // World-space axis-aligned bounding box, for acceleration structures.
+    // False for unbounded shapes (the default), which must be tested apart
+    virtual bool getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+
     // Return the material associated with the shape
     const Material& getMaterial() const;
+    // False for shapes that only report the hits of others (instances)
+    bool hasMaterial() const;
+
+    // Identifier of the shape in its scene (1-based, 0 = not in a scene)
+    int getId() const;
+    void setId(int id_);
 
 protected:
     Matrix4x4 objectToWorld;
     Matrix4x4 worldToObject;
     Material *material;
+    int id;
     //float area;
 };
 
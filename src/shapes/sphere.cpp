@@ -1,8 +1,30 @@
 #include "sphere.h"
 
+#include "../core/statistics.h"
+
+#include <algorithm>
+
 Sphere::Sphere(const double radius_, const Matrix4x4 &t_, Material *material_)
     : Shape(t_, material_), radius(radius_)
-{ }
+{
+    updateBoundingSphere();
+}
+
+void Sphere::setTransform(const Matrix4x4 &t_)
+{
+    Shape::setTransform(t_);
+    updateBoundingSphere();
+}
+
+void Sphere::updateBoundingSphere()
+{
+    // The largest axis scale bounds the radius
+    centerWorld = objectToWorld.transformPoint(Vector3D(0.0));
+    double scale = std::max({ objectToWorld.transformVector(Vector3D(1, 0, 0)).length(),
+                              objectToWorld.transformVector(Vector3D(0, 1, 0)).length(),
+                              objectToWorld.transformVector(Vector3D(0, 0, 1)).length() });
+    radiusWorld = radius * scale;
+}
 
 // Return the normal in world coordinates
 // Pre condition: the point passed as argument to this function is in
@@ -35,6 +57,7 @@ Vector3D Sphere::getNormalWorld(const Vector3D &pt_world) const
 // Chapter 3 PBRT, page 117
 bool Sphere::rayIntersect(const Ray &ray, Intersection &its) const
 {
+    STAT_INC(SphereTests);
     // Pass the ray to local coordinates
     //Ray r = worldToObject.applyTransform(ray);
     Ray r = worldToObject.transformRay(ray);
@@ -99,9 +122,32 @@ bool Sphere::rayIntersect(const Ray &ray, Intersection &its) const
     return true;
 }
 
+bool Sphere::overlapsSphere(const Vector3D &center, double radius_) const
+{
+    double reach = radiusWorld + radius_;
+    return (centerWorld - center).lengthSq() <= reach * reach;
+}
+
+bool Sphere::getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const
+{
+    // Box of the transformed corners of the local box
+    boundsMin = Vector3D(INFINITY);
+    boundsMax = Vector3D(-INFINITY);
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vector3D p = objectToWorld.transformPoint(Vector3D((corner & 1) ? radius : -radius,
+                                                           (corner & 2) ? radius : -radius,
+                                                           (corner & 4) ? radius : -radius));
+        boundsMin = Vector3D(std::min(boundsMin.x, p.x), std::min(boundsMin.y, p.y), std::min(boundsMin.z, p.z));
+        boundsMax = Vector3D(std::max(boundsMax.x, p.x), std::max(boundsMax.y, p.y), std::max(boundsMax.z, p.z));
+    }
+    return true;
+}
+
 // Chapter 3 PBRT, page 117
 bool Sphere::rayIntersectP(const Ray &ray) const
 {
+    STAT_INC(SphereTests);
     // Pass the ray to local coordinates
     Ray r = worldToObject.transformRay(ray);
 
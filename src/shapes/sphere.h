@@ -17,13 +17,22 @@ public:
 
     bool rayIntersect(const Ray &ray, Intersection &its) const;
     bool rayIntersectP(const Ray &ray) const;
+    bool overlapsSphere(const Vector3D &center, double radius) const;
+    bool getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+    void setTransform(const Matrix4x4 &t_);
     std::string toString() const;
 
 private:
+    void updateBoundingSphere();
+
     // The center of the sphere in local coordinates is assumed
     // to be (0, 0, 0). To pass to world coordinates just apply the
     // objectToWorld transformation contained in the mother class
     double radius;
+
+    // World-space bounding sphere, for overlapsSphere()
+    Vector3D centerWorld;
+    double radiusWorld;
 };
 
 std::ostream& operator<<(std::ostream &out, const Sphere &s);
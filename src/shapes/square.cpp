@@ -1,5 +1,9 @@
 #include "square.h"
 
+#include "../core/statistics.h"
+
+#include <algorithm>
+
 
 Square::Square(const Vector3D pos_, const Vector3D& v1_, const Vector3D& v2_, const Vector3D& normal_, Material *material_)
     : Shape(Matrix4x4(), material_), corner(pos_), v1(v1_), v2(v2_), normal(normal_)
@@ -18,6 +22,7 @@ Vector3D Square::getNormalWorld(const Vector3D &pt_world) const
 // Chapter 3 PBRT, page 117
 bool Square::rayIntersect(const Ray &ray, Intersection &its) const
 {
+    STAT_INC(SquareTests);
     //return false;  
      // Compute the denominator of the tHit formula
     double denominator = dot(ray.d, normal);
@@ -57,9 +62,50 @@ bool Square::rayIntersect(const Ray &ray, Intersection &its) const
     return true;
 }
 
+bool Square::overlapsSphere(const Vector3D &center, double radius) const
+{
+    // Bounding sphere of the parallelogram: centered on it, reaching its
+    // farthest corner
+    Vector3D middle = corner + (v1 + v2) * 0.5;
+    double halfDiagonal = std::max((v1 + v2).length(), (v1 - v2).length()) * 0.5;
+    double reach = halfDiagonal + radius;
+    return (middle - center).lengthSq() <= reach * reach;
+}
+
+bool Square::getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const
+{
+    const Vector3D corners[4] = { corner, corner + v1, corner + v2, corner + v1 + v2 };
+    boundsMin = Vector3D(INFINITY);
+    boundsMax = Vector3D(-INFINITY);
+    for (const Vector3D &p : corners)
+    {
+        boundsMin = Vector3D(std::min(boundsMin.x, p.x), std::min(boundsMin.y, p.y), std::min(boundsMin.z, p.z));
+        boundsMax = Vector3D(std::max(boundsMax.x, p.x), std::max(boundsMax.y, p.y), std::max(boundsMax.z, p.z));
+    }
+    return true;
+}
+
+void Square::setTransform(const Matrix4x4 &t_)
+{
+    // The corner and edges are in world space: they move by the change of
+    // transform, and the normal by the transpose of its inverse
+    Matrix4x4 change = t_ * worldToObject;
+    Matrix4x4 changeInverse, normalChange;
+    change.inverse(changeInverse);
+    changeInverse.transpose(normalChange);
+    corner = change.transformPoint(corner);
+    v1 = change.transformVector(v1);
+    v2 = change.transformVector(v2);
+    normal = normalChange.transformVector(normal).normalized();
+    Vector3D n = cross(v1, v2);
+    w = n / dot(n, n);
+    Shape::setTransform(t_);
+}
+
 // Chapter 3 PBRT, page 117
 bool Square::rayIntersectP(const Ray &ray) const
 {
+    STAT_INC(SquareTests);
     //return false;  
  // Compute the denominator of the tHit formula
     double denominator = dot(ray.d, normal);
@@ -17,6 +17,9 @@ public:
 
     bool rayIntersect(const Ray &ray, Intersection &its) const;
     bool rayIntersectP(const Ray &ray) const;
+    bool overlapsSphere(const Vector3D &center, double radius) const;
+    bool getBounds(Vector3D &boundsMin, Vector3D &boundsMax) const;
+    void setTransform(const Matrix4x4 &t_);
     std::string toString() const;
 
 